@@ -4,6 +4,9 @@
 #include "BackupConfig.h"
 #include "BackupDirectory.h"
 #include "BackupRepositoryLog.h"
+#include "BackupRunner.h"
+#include "Fanout.h"
+#include "ObjectIndex.h"
 #include <filesystem>
 #include <vector>
 
@@ -17,6 +20,13 @@ namespace krico::backup {
         static constexpr auto LOCK_FILE = "krico-backup.lock";
         static constexpr auto CONFIG_FILE = "config";
         static constexpr auto METADATA_SECTION = "metadata";
+        static constexpr auto DIGEST_VARIABLE = "digest";
+        static constexpr auto FANOUT_DEPTH_VARIABLE = "fanout-depth";
+        static constexpr auto FANOUT_WIDTH_VARIABLE = "fanout-width";
+        //! Set (to the target fanout) while relayout() moves objects
+        static constexpr auto RELAYOUT_VARIABLE = "relayout";
+        //! Summary files verify_log() queues before waiting for them
+        static constexpr size_t MAX_PENDING_SUMMARIES = 4096;
         static constexpr auto LOG_DIR = "log";
         static constexpr auto DIRECTORIES_DIR = "dirs";
         static constexpr auto HARDLINKS_DIR = "hlinks";
@@ -25,6 +35,20 @@ namespace krico::backup {
 
         static BackupRepository initialize(const std::filesystem::path &dir);
 
+        //!
+        //! Initialize a repository whose objects (files in hardLinksDir()) are named by their `digestAlgorithm` digest
+        //!
+        //! @param digestAlgorithm a Digest algorithm name (e.g. Digest::SHA256_ALGORITHM or Digest::BLAKE3_ALGORITHM)
+        //!
+        static BackupRepository initialize(const std::filesystem::path &dir, const std::string &digestAlgorithm);
+
+        //!
+        //! Same as above, with the objects laid out (and all their directories created) according to `fanout`
+        //!
+        static BackupRepository initialize(const std::filesystem::path &dir,
+                                           const std::string &digestAlgorithm,
+                                           const Fanout &fanout);
+
         //!
         //! User visible directory of this repository
         //!
@@ -57,6 +81,53 @@ namespace krico::backup {
         //!
         [[nodiscard]] BackupConfig &config();
 
+        //!
+        //! Digest algorithm of the objects in hardLinksDir(), chosen at initialize() (repositories that predate the
+        //! choice use Digest::SHA256_ALGORITHM)
+        //!
+        [[nodiscard]] std::string digestAlgorithm();
+
+        //!
+        //! Layout of the objects in hardLinksDir(), chosen at initialize() or relayout() (repositories that predate the
+        //! choice use Fanout::legacy())
+        //!
+        [[nodiscard]] Fanout fanout();
+
+        //!
+        //! Move every object of hardLinksDir() to the layout `fanout`, with renames only, and remove the directories
+        //! that are not part of it anymore.
+        //!
+        //! Directories are processed by `threads` threads, each submitting its renames in IoBatch(es).  The new layout is
+        //! recorded first, an interrupted relayout is finished by running it again (backups refuse to run until then).
+        //!
+        //! @return the number of objects moved
+        //!
+        size_t relayout(const Fanout &fanout, unsigned threads);
+
+        //!
+        //! Result of verify_log()
+        //!
+        struct log_verification_t {
+            //! Records hashed (packed and loose)
+            size_t numRecords_{0};
+            //! Records reached from HEAD following prev()
+            size_t numLinks_{0};
+            //! RunBackupRecord whose summary file was checked
+            size_t numSummaries_{0};
+            //! What is wrong (empty if nothing is)
+            std::vector<std::string> problems_{};
+        };
+
+        //!
+        //! Check that every record of the repositoryLog() hashes to its digest, that the prev() chain from HEAD (and the
+        //! chain of checkpoints) is intact, and that the summary file of every RunBackupRecord has its checksum.
+        //!
+        //! Records and summary files are hashed by `threads` threads.  The chain is followed by the calling thread,
+        //! at most MAX_PENDING_SUMMARIES summary files are queued at a time.  Nothing is written to the repository (loose
+        //! records are read where they are, not moved to the pack).
+        //!
+        [[nodiscard]] log_verification_t verify_log(unsigned threads);
+
         //!
         //! Release the lock of this repository, this repository should no longer be used once unlocked
         //!
@@ -77,8 +148,15 @@ namespace krico::backup {
 
         BackupSummary run_backup(const BackupDirectory &directory);
 
+        BackupSummary run_backup(const BackupDirectory &directory, const BackupRunner::options_t &options);
+
         [[nodiscard]] BackupRepositoryLog &repositoryLog();
 
+        //!
+        //! Index of the objects in hardLinksDir() (opened, or rebuilt, on first use)
+        //!
+        [[nodiscard]] ObjectIndex &objectIndex();
+
     private:
         const std::filesystem::path dir_;
         const std::filesystem::path metaDir_;
@@ -90,6 +168,7 @@ namespace krico::backup {
         bool directoriesLoaded_{false};
         std::vector<std::unique_ptr<BackupDirectory> > directories_{};
         std::unique_ptr<BackupRepositoryLog> repositoryLog_{nullptr};
+        std::unique_ptr<ObjectIndex> objectIndex_{nullptr};
 
         std::vector<std::unique_ptr<BackupDirectory> > &loadDirectories();
     };
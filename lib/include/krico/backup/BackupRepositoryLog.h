@@ -3,32 +3,105 @@
 #include "log_records.h"
 #include "Digest.h"
 #include "BackupSummary.h"
+#include "LogPack.h"
+#include "LogIndex.h"
 #include "gtest/gtest_prod.h"
 #include <filesystem>
+#include <functional>
 #include <ostream>
 #include <istream>
 #include <cassert>
+#include <optional>
+#include <limits>
 
 namespace krico::backup {
+    class ThreadPool; // fwd-decl
+
     //!
     //! Manages the log_entry chain
     //!
+    //! Records are appended to a LogPack.  Loose records (one file per record, as written before the pack existed) are
+    //! still read, and moved to the pack when they are.  Their files are only removed once the pack is synced (in
+    //! batches, by publishHead() or the destructor), so a crash cannot lose a record HEAD or a `prev` points to.
+    //!
     //! Not thread-safe, must be protected by BackupRepository lock
     //!
     class BackupRepositoryLog {
     public:
         static constexpr auto HEAD_FILE = "HEAD";
         static constexpr auto DIGEST_DIRS = 1;
+        //! A CheckpointRecord is put after this many records
+        static constexpr uint32_t CHECKPOINT_INTERVAL = 100;
+        //! Loose records moved to the pack before it is synced and their files removed
+        static constexpr size_t MIGRATE_BATCH = 256;
+
+        //!
+        //! Chains the records put while it is open and publishes HEAD once, when it is committed (or destroyed)
+        //! instead of once per record.  The records are synced to disk before HEAD is, so HEAD never points at a
+        //! record that a crash can lose.  A batch opened while another one is open leaves publishing to the outermost
+        //! one.
+        //!
+        class batch {
+        public:
+            explicit batch(BackupRepositoryLog &log);
+
+            //!
+            //! commit() (errors are logged), the records put in a failed batch are not lost
+            //!
+            ~batch();
+
+            batch(const batch &) = delete;
+
+            batch &operator=(const batch &) = delete;
+
+            //!
+            //! Publish HEAD if records were put since it last was (a no-op in a nested batch)
+            //!
+            void commit();
+
+        private:
+            BackupRepositoryLog &log_;
+        };
+
+        //!
+        //! Records to find with query(), every criteria that is set must match
+        //!
+        struct query_t {
+            //! BackupDirectoryId::str() of the AddDirectoryRecord and RunBackupRecord to find
+            std::optional<std::string> directoryId_{};
+            //! Records put at or after since_ ...
+            std::chrono::system_clock::time_point since_{std::chrono::system_clock::time_point::min()};
+            //! ... and before until_
+            std::chrono::system_clock::time_point until_{std::chrono::system_clock::time_point::max()};
+            std::optional<LogEntryType> type_{};
+            //! At most this many (the newest)
+            size_t limit_{std::numeric_limits<size_t>::max()};
+        };
 
         explicit BackupRepositoryLog(std::filesystem::path dir);
 
+        //!
+        //! Sync the pack and remove the files of the loose records moved to it (errors are logged)
+        //!
+        ~BackupRepositoryLog();
+
+        BackupRepositoryLog(const BackupRepositoryLog &) = delete;
+
+        BackupRepositoryLog &operator=(const BackupRepositoryLog &) = delete;
+
         [[nodiscard]] const Digest::result &head();
 
         //!
-        //! Produces a list of Digest::result that start with `hash`
+        //! Produces a list of Digest::result that start with `hash` (hex digits, a full hash or a prefix of one)
         //!
         [[nodiscard]] std::vector<Digest::result> findHash(const std::string &hash) const;
 
+        //!
+        //! @return the single record whose hash starts with `hash`
+        //! @throws krico::backup::exception if no record does, or more than one (listing them)
+        //!
+        [[nodiscard]] Digest::result resolveHash(const std::string &hash) const;
+
         //!
         //! Add an InitRecord to the BackupRepositoryLog.
         //!
@@ -46,6 +119,39 @@ namespace krico::backup {
         //!
         void putRunBackupRecord(const std::string &author, const BackupSummary &summary);
 
+        //!
+        //! Add a RunBackupRecord for each of `summaries` to the BackupRepositoryLog (in a single batch).
+        //!
+        void putRunBackupRecords(const std::string &author, const std::vector<BackupSummary> &summaries);
+
+        //!
+        //! Hash every stored record (packed and loose) with `pool` and call `problem` (one call at a time) for each
+        //! record whose content does not hash to its digest, and for each damaged frame or index entry of the pack
+        //!
+        //! @return number of records checked
+        //!
+        size_t verifyRecords(ThreadPool &pool,
+                             const std::function<void(const Digest::result &, const std::string &)> &problem);
+
+        //!
+        //! Scan of the LogIndex (brought up to date with head() first), no record is read unless it has to be checked
+        //! for query.directoryId_
+        //!
+        //! @return the records matching `query`, newest first
+        //!
+        [[nodiscard]] std::vector<Digest::result> query(const query_t &query);
+
+        //!
+        //! Counters of all the RunBackupRecord in the log, from the latest CheckpointRecord and the records after it
+        //!
+        [[nodiscard]] log_counters counters();
+
+        //!
+        //! Counters of the RunBackupRecord put since `since`, found walking the checkpoints (plus the records between
+        //! two of them) rather than the records.  lastRun_ is the latest run of the directory.
+        //!
+        [[nodiscard]] log_counters counters(std::chrono::system_clock::time_point since);
+
         //!
         //! Retrieve a given LogHeader **only valid** until the next call to getRecord(), getHeadRecord() or getPrev()
         //!
@@ -54,6 +160,18 @@ namespace krico::backup {
         //!
         [[nodiscard]] const LogHeader &getRecord(const Digest::result &digest);
 
+        //!
+        //! Read-only view of a given record **only valid** until the next call to getRecord(), getRecordView() or a
+        //! put (a packed record is read where it is mapped, without copying it)
+        //!
+        //! A loose record is moved to the pack unless `migrate` is false (nothing is written then, e.g. to verify the
+        //! repository)
+        //!
+        //! @return the record with the given Digest::result
+        //! @throws krico::backup::exception if the entry is not found or cannot be read
+        //!
+        [[nodiscard]] LogHeaderView getRecordView(const Digest::result &digest, bool migrate = true);
+
         //!
         //! @return getRecord(head())
         //!
@@ -69,16 +187,90 @@ namespace krico::backup {
         const std::filesystem::path headFile_;
         Digest::result head_;
         Digest digest_;
+        LogPack pack_;
+        LogIndex index_;
+        unsigned batches_{0};
+        bool headPending_{false};
+        //! Files of the loose records moved to the pack since it was last synced
+        std::vector<std::filesystem::path> migrated_{};
+
+        struct checkpoint_state {
+            bool loaded_{false};
+            //! Latest CheckpointRecord (Digest::SHA1_ZERO if there is none)
+            Digest::result last_{Digest::SHA1_ZERO};
+            //! Records up to last_
+            uint32_t numRecords_{0};
+            //! Records after last_
+            uint32_t since_{0};
+        } checkpoint_{};
 
         struct readers {
             LogHeader header_{};
             InitRecord init_{};
             AddDirectoryRecord add_{};
             RunBackupRecord run_{};
+            CheckpointRecord checkpoint_{};
         } readers_{};
 
         void putRecord(LogHeader &entry);
 
+        //!
+        //! Append `entry` to the pack and make it head_ (without publishing it)
+        //!
+        void appendRecord(const LogHeader &entry);
+
+        //!
+        //! Add the records after the last entry of index_ (the whole chain if it is not part of it) to index_
+        //!
+        void updateIndex();
+
+        //!
+        //! @return the LogIndex entry of the record `header` with `digest`
+        //!
+        [[nodiscard]] static LogIndex::entry_t indexEntry(const Digest::result &digest, const LogHeaderView &header);
+
+        //!
+        //! Find the latest CheckpointRecord (walking from head()) unless it is known already
+        //!
+        void loadCheckpoint();
+
+        //!
+        //! Put a CheckpointRecord of the records up to head()
+        //!
+        void putCheckpoint(std::string_view author);
+
+        //!
+        //! Counters of the RunBackupRecord put before `before`
+        //!
+        [[nodiscard]] log_counters countersBefore(std::chrono::system_clock::time_point before);
+
+        //!
+        //! Sync the pack and then atomically replace HEAD_FILE with head_
+        //!
+        void publishHead();
+
+        //!
+        //! @return the reader for records of `type` (the first byte of a record)
+        //!
+        [[nodiscard]] LogHeader &reader(int type);
+
+        //!
+        //! Read the loose record with `digest` and, if `migrate`, move it to the pack (its file is removed by
+        //! removeMigrated())
+        //!
+        [[nodiscard]] const LogHeader &getLooseRecord(const Digest::result &digest, bool migrate = true);
+
+        //!
+        //! Remove the files of the records in migrated_, the pack must have been synced since they were appended to it
+        //! (a failure is logged, the file is then read again but never appended twice)
+        //!
+        void removeMigrated();
+
         FRIEND_TEST(BackupRepositoryLogTest, putRecord);
+        FRIEND_TEST(BackupRepositoryLogTest, batch);
+        FRIEND_TEST(BackupRepositoryLogTest, checkpoint);
+        FRIEND_TEST(BackupRepositoryLogTest, query);
+        FRIEND_TEST(BackupRepositoryLogTest, readOnly);
+        FRIEND_TEST(BackupRepositoryLogTest, looseRecordSynced);
     };
 }
@@ -2,44 +2,475 @@
 
 #include "BackupDirectory.h"
 #include "BackupSummary.h"
+#include "BoundedQueue.h"
+#include "CountingResource.h"
 #include "Digest.h"
-#include "Directory.h"
+#include "Fanout.h"
+#include "IoBatch.h"
+#include "DirectoryScanner.h"
+#include "ObjectIndex.h"
+#include "StagedFile.h"
+#include "StatCache.h"
+#include "ThreadPool.h"
+#include "io.h"
 #include <chrono>
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory_resource>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
 namespace krico::backup {
     //!
     //! Run a Backup for a given BackupDirectory.
     //!
+    //! Files flow through a pipeline of stages connected by BoundedQueue(s):
+    //!
+    //!     scan (ThreadPool) -> hash -> [store] -> link
+    //!
+    //! Files whose digest already exists in hardLinksDir() (according to the ObjectIndex) skip the store stage.  Each stage
+    //! runs with its own number of threads, so reading/hashing, copying and linking overlap.
+    //!
+    //! The queue sizes cap the files in flight between the stages.  The results of a scanned directory (a dir_node, one
+    //! entry per name) stay buffered until the directories before it in traversal order have been merged, at most
+    //! options_t::maxBufferedDirs of them: beyond that the scan of a directory is parked until the merge catches up
+    //! (the directory the merge waits for is always scanned), so a slow file early in the tree holds back the scan
+    //! rather than letting memory grow with the size of the tree.
+    //!
     //! Not thread-safe, should be proteced by a BackupRepository lock
     //!
     class BackupRunner {
     public:
         static constexpr auto PREVIOUS_LINK = "previous";
         static constexpr auto CURRENT_LINK = "current";
-        static constexpr auto DIGEST_DIRS = 2;
+        //! Files at least this large are digested from a memory mapping in one go (BLAKE3 uses options_t::hashers threads)
+        static constexpr uintmax_t MAPPED_DIGEST_SIZE = 16 * 1024 * 1024;
+        //! Descriptors left to the repository, the merge front and the process when capping options_t::maxBufferedDirs
+        static constexpr size_t RESERVED_DESCRIPTORS = 64;
+        //! Size of the first block of the arena of each scanned directory (later blocks grow geometrically)
+        static constexpr size_t DIR_ARENA_SIZE = 4096;
+
+        struct options_t {
+            //!
+            //! Threads traversing the source directory (sub-directories are spread across them)
+            //!
+            unsigned scanners{1};
+            //!
+            //! Threads computing file digests
+            //!
+            unsigned hashers{1};
+            //!
+            //! Threads copying new files into hardLinksDir()
+            //!
+            unsigned copiers{1};
+            //!
+            //! Threads creating the hard links in the backup directory
+            //!
+            unsigned linkers{1};
+            //!
+            //! Capacity of each of the queues between the stages (files in flight, the scan is throttled by it)
+            //!
+            size_t queueSize{256};
+            //!
+            //! Scanned directories whose results wait to be merged before further scans are parked (at least 1, the
+            //! directories the merge waits for are scanned regardless, at most one per level of the tree beyond it).
+            //!
+            //! Each one keeps up to two descriptors open (its source and its destination), the cap is lowered to what
+            //! fits into RLIMIT_NOFILE besides the descriptors of the other stages.
+            //!
+            size_t maxBufferedDirs{1024};
+            //!
+            //! Hash new files while copying them (single read pass).
+            //!
+            //! Every file is streamed once into a StagedFile by the hash stage, which is then published in hardLinksDir()
+            //! or discarded if the digest already exists.  Halves the reads of first backups (and the stored object is
+            //! guaranteed to match its digest), but rewrites files that are already in hardLinksDir().
+            //!
+            bool hashWhileCopy{false};
+            //!
+            //! Ignore the StatCache and hash every file (the cache is still rebuilt from the computed digests), every
+            //! file counts as a miss
+            //!
+            bool rehash{false};
+            //!
+            //! Files smaller than this are read whole and hashed several at a time with MultiBufferSha256 (only in
+            //! SHA2-256 repositories, 0 disables)
+            //!
+            uintmax_t batchDigestSize{64 * 1024};
+            //!
+            //! Maximum number of hard links (and reads of small files) submitted to the file system at once
+            //!
+            unsigned ioDepth{IoBatch::DEFAULT_DEPTH};
+            //!
+            //! Submit those batches through io_uring when the kernel supports it (blocking calls otherwise)
+            //!
+            bool ioUring{true};
+            //!
+            //! Hard links per object before an overflow replica (<digest>.1, <digest>.2, ...) takes over, 0 relies on
+            //! the limit of the file system (EMLINK, e.g. 65000 on ext4)
+            //!
+            uint64_t maxLinks{0};
+        };
 
         explicit BackupRunner(const BackupDirectory &directory, const std::chrono::year_month_day &date = {});
 
+        BackupRunner(const BackupDirectory &directory,
+                     const std::chrono::year_month_day &date,
+                     const options_t &options);
+
+        ~BackupRunner();
+
         [[nodiscard]] BackupSummary run();
 
         [[nodiscard]] const std::filesystem::path &backupDir() const { return backupDir_; }
 
+        //!
+        //! @return most directories buffered at once by run() (scanned, not merged yet), see options_t::maxBufferedDirs
+        //!
+        [[nodiscard]] size_t peakBufferedDirs() const { return peakBufferedDirs_; }
+
     private:
+        struct dir_node; // fwd-decl
+
+        //!
+        //! An open directory of the destination (O_PATH on Linux), the anchor of the *at() calls creating its entries
+        //!
+        struct dir_fd {
+            const int fd_;
+
+            explicit dir_fd(const int fd) : fd_(fd) {
+            }
+
+            dir_fd(const dir_fd &) = delete;
+
+            dir_fd &operator=(const dir_fd &) = delete;
+
+            ~dir_fd();
+        };
+
+        //!
+        //! Outcome of backing up one entry of a directory, kept until it can be merged in traversal order
+        //!
+        struct entry_result {
+            enum class kind : uint8_t { directory, file, symlink };
+
+            kind kind_;
+            // Relative to the source (and backup) directory, allocated from the arena of the dir_node
+            std::pmr::string path_;
+            Digest::result digest_{};
+            // Files only, size and modification time of the source (for the manifest)
+            uint64_t size_{0};
+            int64_t mtimeNs_{0};
+            // True if the digest file was created by this run (as opposed to existing before)
+            bool created_{false};
+            // Files only, time spent hashing and copying it
+            std::chrono::nanoseconds time_{0};
+            std::filesystem::path target_{};
+            std::unique_ptr<dir_node> dir_{};
+        };
+
+        struct dir_node {
+            explicit dir_node(std::pmr::memory_resource *upstream) : arena_(DIR_ARENA_SIZE, upstream), entries_(&arena_) {
+            }
+
+            // Holds entries_ and their paths, released all at once when the node has been merged.  Only the scan of
+            // this directory allocates from it.
+            std::pmr::monotonic_buffer_resource arena_;
+            std::pmr::vector<entry_result> entries_;
+            // The directory in the backup, released once done (sub-directories hold on to it until they are created)
+            std::shared_ptr<const dir_fd> dest_{};
+            // Scan of this directory (1) plus its files still in the pipeline, done when it drops to zero
+            std::atomic<size_t> pending_{1};
+            bool done_{false};
+            // The scan of this directory while it waits for room (see schedule()), guarded by mergeMutex_
+            ThreadPool::task parked_{};
+            std::list<dir_node *>::iterator parkedAt_{};
+        };
+
+        struct merge_frame {
+            std::unique_ptr<dir_node> node_;
+            size_t next_{0};
+        };
+
+        //!
+        //! A file travelling through the pipeline stages
+        //!
+        struct file_job {
+            dir_node *node_;
+            entry_result *result_;
+            std::filesystem::path source_;
+            std::filesystem::path digestFile_{};
+            copy_method copyMethod_{copy_method::read_write};
+        };
+
+        //!
+        //! The copy of an object that new hard links go to, see replica()
+        //!
+        struct replica_t {
+            uint32_t index_{0};
+            // Hard links of the replica (only counted with options_t::maxLinks)
+            uint64_t links_{0};
+            bool counted_{false};
+        };
+
+        //!
+        //! A small file waiting in the hash stage for enough others to fill the lanes of MultiBufferSha256
+        //!
+        struct batched_file {
+            file_job job_;
+            StatCache::key_t key_;
+            std::string content_{};
+        };
+
         const BackupDirectory &directory_;
         const std::chrono::year_month_day date_;
         const std::filesystem::path backupDir_;
-        Digest digest_;
+        const options_t options_;
+        const std::string digestAlgorithm_;
+        // Layout of hardLinksDir() (commit() still creates missing directories, Fanout::legacy() ones are not pre-created)
+        const Fanout fanout_;
+        // Digest of every empty file, those are never opened
+        const Digest::result emptyDigest_;
+        std::once_flag emptyOnce_{};
+
+        ObjectIndex &objectIndex_;
+        // hardLinksDir(), hard links are made relative to it
+        std::unique_ptr<const dir_fd> hardLinksFd_{};
+        // How new objects are published in hardLinksDir() (StagedFile::probe())
+        StagedFile::method staging_{StagedFile::method::rename};
+        // Upstream of the dir_node arenas
+        CountingResource allocations_{};
+        std::unique_ptr<StatCache> statCache_{};
+
+        BoundedQueue<file_job> hashQueue_;
+        BoundedQueue<file_job> storeQueue_;
+        BoundedQueue<file_job> linkQueue_;
+
+        // First failure of a pipeline stage (all queues are aborted once it is set)
+        std::mutex errorMutex_{};
+        std::exception_ptr error_{};
+
+        // Guards commits to hardLinksDir() and createdDigests_
+        std::mutex storeMutex_{};
+        std::unordered_set<Digest::result> createdDigests_{};
+        std::array<uint32_t, COPY_METHOD_COUNT> numCopies_{};
+
+        // Guards the in-order merge of dir_node results into the BackupSummaryBuilder
+        std::mutex mergeMutex_{};
+        std::vector<merge_frame> mergeStack_{};
+        std::unordered_set<Digest::result> copiedDigests_{};
+        // Directories scanned (or being scanned) and not merged yet, capped by maxBufferedDirs_
+        size_t bufferedDirs_{0};
+        // options_t::maxBufferedDirs, lowered to fit into RLIMIT_NOFILE (see bufferedDirsLimit())
+        size_t maxBufferedDirs_{1};
+        size_t peakBufferedDirs_{0};
+        // Scans waiting for room in submission order, resumed by complete() through scanners_
+        std::list<dir_node *> parked_{};
+        ThreadPool *scanners_{nullptr};
+        // Sub-directory scans not finished (queued, parked or running), run() waits on scansChanged_ for them
+        size_t scansLeft_{0};
+        bool resumed_{false};
+        bool aborted_{false};
+        std::condition_variable scansChanged_{};
+
+        // Guards replicas_ and the creation of replicas (only objects that needed one, or that are close to
+        // options_t::maxLinks)
+        std::mutex replicaMutex_{};
+        std::unordered_map<Digest::result, replica_t> replicas_{};
+        std::atomic<bool> overflowed_{false};
+        // Links to objects not in replicas_ that were handed out but not submitted yet
+        std::atomic<uint64_t> untrackedLinks_{0};
+        uint32_t numReplicas_{0};
+
+        // Nanoseconds spent in each backup_phase (see phase_time) and bytes read by the hash stage
+        std::array<std::atomic<int64_t>, BACKUP_PHASE_COUNT> phaseWall_{};
+        std::array<std::atomic<int64_t>, BACKUP_PHASE_COUNT> phaseCpu_{};
+        std::atomic<uint64_t> bytesHashed_{0};
 
         [[nodiscard]] static std::filesystem::path determineBackupDir(const BackupDirectory &directory,
                                                                       const std::chrono::year_month_day &date);
 
-        void backup(BackupSummaryBuilder &builder, const Directory &dir);
+        //!
+        //! Scan stage: handle symlinks and feed files to the hash stage (node.dest_ must exist already)
+        //!
+        void scan(ThreadPool &pool,
+                  BackupSummaryBuilder &builder,
+                  dir_node &node,
+                  const std::shared_ptr<const DirectoryScanner> &dir,
+                  std::string_view relativeDir);
+
+        //!
+        //! @return options_t::maxBufferedDirs, lowered so that the descriptors of the buffered directories (two each)
+        //! fit into RLIMIT_NOFILE next to the ones the other stages of `options` keep open
+        //!
+        [[nodiscard]] static size_t bufferedDirsLimit(const options_t &options);
+
+        //!
+        //! Submit `task` (the scan of `node`) to `pool`, it is parked instead of run while options_t::maxBufferedDirs
+        //! directories wait to be merged, unless `node` is the one the merge waits for
+        //!
+        void schedule(ThreadPool &pool, dir_node &node, ThreadPool::task task);
+
+        //!
+        //! Submit the parked scan of `node` (counting it as buffered), needs mergeMutex_ held
+        //!
+        void resume(dir_node &node);
+
+        //!
+        //! Run the scan `task` of a sub-directory and count it as finished, even if it throws
+        //!
+        void scanned(const ThreadPool::task &task);
+
+        //!
+        //! Run a scan task, with the opening of its directories, and account its time to backup_phase::scan
+        //!
+        template<typename Task>
+        void timedScan(Task task);
+
+        //!
+        //! Recreate the symlink `name` of `dir` in `dest`
+        //!
+        void backup(entry_result &result, const DirectoryScanner &dir, const dir_fd &dest, std::string_view name) const;
+
+        //!
+        //! Create (if needed) and open the directory `name` of `parent`, whose path in the backup is `relativeDir`
+        //!
+        [[nodiscard]] std::shared_ptr<const dir_fd> mkdir(const dir_fd &parent,
+                                                          std::string_view name,
+                                                          std::string_view relativeDir) const;
+
+        //!
+        //! Open `dir` as an anchor for *at() calls
+        //!
+        [[nodiscard]] static int open_dir(int dirFd, const char *dir, bool follow, const std::filesystem::path &path);
+
+        //!
+        //! Hash stage: compute the digest and route the file to the store (new digest) or link stage
+        //!
+        //! With options_t::hashWhileCopy it also copies (and commits) the file itself and routes to the link stage.
+        //! Files found in the StatCache (and hardLinksDir()) go straight to the link stage without being opened.
+        //!
+        void hash(unsigned index);
+
+        //!
+        //! Hash (or route straight away) a single file, or add it to `batch` if it is small enough
+        //!
+        void hash(const Digest &md,
+                  const std::filesystem::path &copyFile,
+                  std::vector<batched_file> &batch,
+                  file_job &&job);
+
+        //!
+        //! Hash all files of `batch` together and route them, leaves `batch` empty
+        //!
+        void hash(IoBatch &io, std::vector<batched_file> &batch);
+
+        //!
+        //! Send `job` to the link stage if its digest is already in hardLinksDir(), otherwise to the store stage
+        //!
+        void route(file_job &&job);
+
+        //!
+        //! Store stage: copy new files into hardLinksDir()
+        //!
+        void store(unsigned index);
+
+        //!
+        //! Publish `staged` as job.digestFile_, or discard it if that digest was committed in the meantime
+        //!
+        void commit(file_job &job, StagedFile &staged);
+
+        //!
+        //! @return a temp file in hardLinksDir() unique per stage and thread (only used without O_TMPFILE)
+        //!
+        [[nodiscard]] std::filesystem::path tmpFile(const char *stage, unsigned index) const;
+
+        //!
+        //! Link stage: hard link the digest files into the backup directory, in batches of what is queued
+        //!
+        void link(BackupSummaryBuilder &builder);
+
+        //!
+        //! Hard link `job` to the replicas after `full` (which ran out of links) until one has room
+        //!
+        void relink(const file_job &job, uint32_t full);
+
+        //!
+        //! @return path of replica `index` of the object with `digest`, relative to hardLinksDir() (0 is the object)
+        //!
+        [[nodiscard]] std::string object(const Digest::result &digest, uint32_t index) const;
+
+        //!
+        //! With options_t::maxLinks, an object is only tracked in replicas_ once its links (stat) plus the links that
+        //! can be in flight reach the limit.  Links to the others are counted in `untracked` (and untrackedLinks_)
+        //! until they are submitted.
+        //!
+        //! @return index of the replica of `digest` new hard links go to (also accounts for one with options_t::maxLinks)
+        //!
+        uint32_t replica(const Digest::result &digest, uint64_t &untracked);
+
+        //!
+        //! Move the hard links of `digest` past replica `full`, which ran out of links
+        //!
+        //! @return index of the replica to use now
+        //!
+        uint32_t overflow(const Digest::result &digest, uint32_t full);
+
+        //!
+        //! Create replica `index` of `digest` (a clone of the object) unless it exists, needs replicaMutex_ held
+        //!
+        void replicate(const Digest::result &digest, uint32_t index);
+
+        //!
+        //! @return number of hard links of `object` (relative to hardLinksDir()), 0 if it does not exist
+        //!
+        [[nodiscard]] uint64_t links(const std::string &object) const;
+
+        //!
+        //! Start `count` threads running `stage` (their CPU time is accounted to `phase`), a failure aborts the whole
+        //! pipeline
+        //!
+        template<typename Stage>
+        void start(std::vector<std::thread> &threads, unsigned count, backup_phase phase, Stage stage);
+
+        //!
+        //! Add `wall` and `cpu` time to `phase` (thread-safe)
+        //!
+        void account(backup_phase phase, std::chrono::nanoseconds wall, std::chrono::nanoseconds cpu);
+
+        void fail(const std::exception_ptr &error);
+
+        //!
+        //! Account for one finished unit (scan or file) of `node` and merge what can be merged
+        //!
+        void complete(BackupSummaryBuilder &builder, dir_node &node);
+
+        //!
+        //! Feed finished dir_node results to `builder` in the same (depth-first, sorted) order a single threaded
+        //! traversal would, so the summary file and checksum do not depend on scheduling.
+        //!
+        //! Must be called with mergeMutex_ held.
+        //!
+        void merge(BackupSummaryBuilder &builder);
+
+        [[nodiscard]] Digest::result digest(const Digest &md, const std::filesystem::path &file) const;
 
-        void backup(BackupSummaryBuilder &builder, const File &file);
+        [[nodiscard]] static std::string read(const std::filesystem::path &file);
 
-        void backup(BackupSummaryBuilder &builder, const Symlink &symlink);
+        //!
+        //! Read the whole content of every file of `batch` using `io`
+        //!
+        static void read(IoBatch &io, std::vector<batched_file> &batch);
 
-        [[nodiscard]] Digest::result digest(const File &file) const;
+        //!
+        //! Copy `from` to `to` updating `md` with every block read
+        //!
+        //! @return digest of the content written to `to`
+        //!
+        [[nodiscard]] static Digest::result copy(const Digest &md, const std::filesystem::path &from, const StagedFile &to);
 
         void adjustSymlinks(BackupSummaryBuilder &builder) const;
     };
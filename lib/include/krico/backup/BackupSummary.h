@@ -3,16 +3,71 @@
 #include "Digest.h"
 #include "BackupDirectoryId.h"
 #include "TemporaryFile.h"
+#include "Manifest.h"
+#include "io.h"
 #include "gtest/gtest_prod.h"
 #include <filesystem>
 #include <chrono>
 #include <ostream>
 #include <istream>
 #include <fstream>
+#include <array>
+#include <string_view>
 
 namespace krico::backup {
     class BackupSummaryBuilder; // fwd-decl
 
+    //!
+    //! Stages of the BackupRunner pipeline
+    //!
+    enum class backup_phase : uint8_t {
+        //! Traversal of the source directory (and creation of the backup directories and symlinks)
+        scan,
+        //! Digests of the files (and, with BackupRunner::options_t::hashWhileCopy, the copies)
+        hash,
+        //! Copies of new files into hardLinksDir()
+        copy,
+        //! Hard links of the files into the backup directory
+        link,
+    };
+
+    static constexpr size_t BACKUP_PHASE_COUNT = static_cast<size_t>(backup_phase::link) + 1;
+
+    const char *to_string(backup_phase phase);
+
+    //!
+    //! Time spent by the threads of a backup_phase, added up across threads (so it can exceed the elapsed time)
+    //!
+    struct phase_time {
+        //! While busy with an entry (including waits on a full queue to the next phase)
+        std::chrono::nanoseconds wall_{0};
+        //! CPU time of the threads
+        std::chrono::nanoseconds cpu_{0};
+
+        bool operator==(const phase_time &) const = default;
+    };
+
+    //!
+    //! Performance counters of a backup run, persisted in its RunBackupRecord (all zero for records written before)
+    //!
+    struct backup_metrics {
+        std::array<phase_time, BACKUP_PHASE_COUNT> phases_{};
+        //! Read to compute digests (files found in the StatCache are not read)
+        uint64_t bytesHashed_{0};
+        //! Of the files copied into hardLinksDir()
+        uint64_t bytesCopied_{0};
+        //! Of the files hard linked to an object that existed already
+        uint64_t bytesDeduplicated_{0};
+        //! Size of the largest file
+        uint64_t largestFileSize_{0};
+        //! Time spent hashing and copying the largest file
+        std::chrono::nanoseconds largestFileTime_{0};
+
+        [[nodiscard]] const phase_time &phase(const backup_phase p) const { return phases_[static_cast<size_t>(p)]; }
+
+        bool operator==(const backup_metrics &) const = default;
+    };
+
     class BackupSummary {
     public:
         using ptr = std::unique_ptr<BackupSummary>;
@@ -31,7 +86,8 @@ namespace krico::backup {
                       uint32_t numSymlinks,
                       std::filesystem::path previousTarget,
                       std::filesystem::path currentTarget,
-                      const Digest::result &checksum);
+                      const Digest::result &checksum,
+                      const backup_metrics &metrics = {});
 
         [[nodiscard]] const BackupDirectoryId &directoryId() const { return directoryId_; }
         [[nodiscard]] const std::chrono::year_month_day &date() const { return date_; }
@@ -45,12 +101,68 @@ namespace krico::backup {
         [[nodiscard]] const std::filesystem::path &previousTarget() const { return previousTarget_; }
         [[nodiscard]] const std::filesystem::path &currentTarget() const { return currentTarget_; }
         [[nodiscard]] const Digest::result &checksum() const { return checksum_; }
+        [[nodiscard]] const backup_metrics &metrics() const { return metrics_; }
+
+        //!
+        //! @return true if this was built by the run that created it (BackupSummaryBuilder), only then are the
+        //! counters that are not in the log (numCopies(), numStatCacheHits(), ...) known
+        //!
+        [[nodiscard]] bool inProcess() const { return inProcess_; }
+
+        //!
+        //! @return number of objects stored in hardLinksDir() using `method` (only known to the run that created this)
+        //!
+        [[nodiscard]] uint32_t numCopies(copy_method method) const {
+            return numCopies_[static_cast<size_t>(method)];
+        }
+
+        //!
+        //! @return number of files whose digest was found in the StatCache (only known to the run that created this)
+        //!
+        [[nodiscard]] uint32_t numStatCacheHits() const { return numStatCacheHits_; }
+
+        //!
+        //! @return number of files that had to be hashed (only known to the run that created this)
+        //!
+        [[nodiscard]] uint32_t numStatCacheMisses() const { return numStatCacheMisses_; }
+
+        //!
+        //! @return number of heap allocations made by the directory arenas of the run (only known to the run that
+        //! created this)
+        //!
+        [[nodiscard]] uint64_t numAllocations() const { return numAllocations_; }
+
+        //!
+        //! @return bytes allocated by the directory arenas of the run (only known to the run that created this)
+        //!
+        [[nodiscard]] uint64_t numAllocatedBytes() const { return numAllocatedBytes_; }
+
+        //!
+        //! @return number of overflow replicas of objects that ran out of hard links (only known to the run that
+        //! created this)
+        //!
+        [[nodiscard]] uint32_t numReplicas() const { return numReplicas_; }
 
         //!
         //! Reconstruct the summary file for this BackupSummary given a `directoryMetaDir`
         //!
         [[nodiscard]] std::filesystem::path summaryFile(const std::filesystem::path &directoryMetaDir) const;
 
+        //!
+        //! Open the manifest (summary file) of this backup given a `directoryMetaDir`, throws if the summary file
+        //! predates the manifest
+        //!
+        [[nodiscard]] ManifestReader manifest(const std::filesystem::path &directoryMetaDir) const;
+
+        //!
+        //! @return the checksum of the entries of `manifest` (the checksum() of its backup unless it was altered)
+        //!
+        [[nodiscard]] static Digest::result compute_checksum(const ManifestReader &manifest);
+
+        //!
+        //! Equality of the persisted fields (numCopies(), the stat cache, allocation and replica counters are not part of
+        //! the log)
+        //!
         bool operator==(const BackupSummary &) const;
 
         bool operator!=(const BackupSummary &rhs) const { return !(*this == rhs); }
@@ -68,12 +180,45 @@ namespace krico::backup {
         std::filesystem::path previousTarget_;
         std::filesystem::path currentTarget_;
         Digest::result checksum_{};
+        backup_metrics metrics_{};
+        std::array<uint32_t, COPY_METHOD_COUNT> numCopies_{};
+        uint32_t numStatCacheHits_{0};
+        uint32_t numStatCacheMisses_{0};
+        uint64_t numAllocations_{0};
+        uint64_t numAllocatedBytes_{0};
+        uint32_t numReplicas_{0};
+        bool inProcess_{false};
+
+        //!
+        //! @return e.g. "clone=3 read_write=1" (only methods that were used) or "-"
+        //!
+        [[nodiscard]] std::string copyMethods() const;
+
+        //!
+        //! @return e.g. "wall=00:00:01.250000 cpu=00:00:00.980000" or "-" for a summary without metrics
+        //!
+        [[nodiscard]] std::string phaseTime(backup_phase phase) const;
+
+        //!
+        //! @return `bytes` or "-" for a summary without metrics
+        //!
+        [[nodiscard]] std::string metricBytes(uint64_t bytes) const;
+
+        //!
+        //! @return e.g. "size=1048576 time=00:00:00.015000" or "-" for a summary without metrics
+        //!
+        [[nodiscard]] std::string largestFile() const;
+
+        //!
+        //! Print the counters that are not in the log (only for an inProcess() summary)
+        //!
+        void printRunCounters(std::ostream &out) const;
 
         friend std::ostream &operator<<(std::ostream &out, const BackupSummary &summary) {
             using namespace std::chrono;
             static constexpr auto WIDTH = 2 * DigestLength::SHA1;
             const auto elapsed = duration_cast<nanoseconds>(summary.endTime_ - summary.startTime_);
-            return out
+            out
                    << "DirectoryId  : " << std::setw(WIDTH) << summary.directoryId_.str() << std::endl
                    << "Date         : " << std::setw(WIDTH) << summary.date_ << std::endl
                    << "BackupId     : " << std::setw(WIDTH) << summary.backupId_.string() << std::endl
@@ -85,7 +230,20 @@ namespace krico::backup {
                    << "Symlinks     : " << std::setw(WIDTH) << summary.numSymlinks_ << std::endl
                    << "Unliked bkp  : " << std::setw(WIDTH) << summary.previousTarget_.string() << std::endl
                    << "Previous bkp : " << std::setw(WIDTH) << summary.currentTarget_.string() << std::endl
-                   << "Checksum     : " << std::setw(WIDTH) << summary.checksum_.str() << std::endl
+                   << "Checksum     : " << std::setw(WIDTH) << summary.checksum_.str() << std::endl;
+            if (summary.inProcess_) summary.printRunCounters(out);
+            return out
+                   << "Scan         : " << std::setw(WIDTH) << summary.phaseTime(backup_phase::scan) << std::endl
+                   << "Hash         : " << std::setw(WIDTH) << summary.phaseTime(backup_phase::hash) << std::endl
+                   << "Copy         : " << std::setw(WIDTH) << summary.phaseTime(backup_phase::copy) << std::endl
+                   << "Link         : " << std::setw(WIDTH) << summary.phaseTime(backup_phase::link) << std::endl
+                   << "Hashed bytes : " << std::setw(WIDTH) << summary.metricBytes(summary.metrics_.bytesHashed_)
+                   << std::endl
+                   << "Copied bytes : " << std::setw(WIDTH) << summary.metricBytes(summary.metrics_.bytesCopied_)
+                   << std::endl
+                   << "Dedup bytes  : " << std::setw(WIDTH) << summary.metricBytes(summary.metrics_.bytesDeduplicated_)
+                   << std::endl
+                   << "Largest file : " << std::setw(WIDTH) << summary.largestFile() << std::endl
                    << "Elapsed      : " << std::setw(WIDTH) << std::format("{0:%T}", elapsed);
         }
     };
@@ -97,18 +255,61 @@ namespace krico::backup {
                              const std::chrono::year_month_day &date,
                              std::filesystem::path backupId);
 
-        void addDir(const std::filesystem::path &dir);
+        void addDir(std::string_view dir);
 
-        void addCopiedFile(const std::filesystem::path &file, const Digest::result &digest);
+        //!
+        //! Add a file whose object was created by this run, `size` and `mtimeNs` (of the source) go to the manifest
+        //!
+        void addCopiedFile(std::string_view file, const Digest::result &digest, uint64_t size = 0,
+                           int64_t mtimeNs = 0);
 
-        void addHardLinkedFile(const std::filesystem::path &file, const Digest::result &digest);
+        //!
+        //! Add a file linked to an existing object, `size` and `mtimeNs` (of the source) go to the manifest
+        //!
+        void addHardLinkedFile(std::string_view file, const Digest::result &digest, uint64_t size = 0,
+                               int64_t mtimeNs = 0);
 
-        void addSymlink(const std::filesystem::path &file, const std::filesystem::path &target);
+        void addSymlink(std::string_view file, const std::filesystem::path &target);
 
         void addPreviousSymlink(const std::filesystem::path &previousTarget);
 
         void addCurrentSymlink(const std::filesystem::path &currentTarget);
 
+        //!
+        //! Account for `count` objects stored in hardLinksDir() using `method`
+        //!
+        void addCopies(copy_method method, uint32_t count);
+
+        //!
+        //! Account for the StatCache `hits` and `misses` of the run
+        //!
+        void addStatCache(uint32_t hits, uint32_t misses);
+
+        //!
+        //! Account for `count` allocations of `bytes` in total made while running the backup
+        //!
+        void addAllocations(uint64_t count, uint64_t bytes);
+
+        //!
+        //! Account for `count` overflow replicas created in hardLinksDir()
+        //!
+        void addReplicas(uint32_t count);
+
+        //!
+        //! Account for `wall` and `cpu` time spent in `phase`
+        //!
+        void addPhase(backup_phase phase, std::chrono::nanoseconds wall, std::chrono::nanoseconds cpu);
+
+        //!
+        //! Account for `bytes` read to compute digests
+        //!
+        void addHashedBytes(uint64_t bytes);
+
+        //!
+        //! Account for the `time` spent hashing and copying a file of `size` bytes (only the largest is kept)
+        //!
+        void addFileTime(uint64_t size, std::chrono::nanoseconds time);
+
         [[nodiscard]] BackupSummary build();
 
     private:
@@ -117,7 +318,7 @@ namespace krico::backup {
         std::filesystem::path backupId_;
         std::filesystem::path summaryFile_;
         TemporaryFile tmpFile_;
-        std::ofstream out_;
+        ManifestWriter writer_;
         Digest digest_;
 
         std::chrono::system_clock::time_point startTime_;
@@ -129,6 +330,15 @@ namespace krico::backup {
         std::filesystem::path previousTarget_{};
         std::filesystem::path currentTarget_{};
         Digest::result checksum_{};
+        std::array<uint32_t, COPY_METHOD_COUNT> numCopies_{};
+        uint32_t numStatCacheHits_{0};
+        uint32_t numStatCacheMisses_{0};
+        uint64_t numAllocations_{0};
+        uint64_t numAllocatedBytes_{0};
+        uint32_t numReplicas_{0};
+        backup_metrics metrics_{};
+
+        void add(const manifest_entry &entry);
 
         friend class BackupSummary;
         FRIEND_TEST(BackupRepositoryLogTest, putRunBackupRecord);
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace krico::backup {
+    //!
+    //! BLAKE3 hash function (default hashing mode, 32 byte output).
+    //!
+    //! Full chunks are compressed several at a time using the widest SIMD implementation the CPU supports (AVX-512,
+    //! AVX2 or 128-bit vectors, which compile to SSE2 on x86 and NEON on ARM).  hash() additionally splits the tree of
+    //! a large input into sub-trees hashed by multiple threads.
+    //!
+    class Blake3 final {
+    public:
+        static constexpr size_t OUT_LEN = 32;
+        static constexpr size_t BLOCK_LEN = 64;
+        static constexpr size_t CHUNK_LEN = 1024;
+
+        Blake3();
+
+        void reset();
+
+        void update(const void *data, size_t len);
+
+        void finalize(uint8_t out[OUT_LEN]) const;
+
+        //!
+        //! Hash `len` bytes of `data` into `out` using up to `threads` threads
+        //!
+        static void hash(const void *data, size_t len, uint8_t out[OUT_LEN], unsigned threads = 1);
+
+        //!
+        //! @return name of the SIMD implementation in use (e.g. "avx2")
+        //!
+        [[nodiscard]] static const char *implementation();
+
+        //!
+        //! Use the SIMD implementation `name` (one of implementations()) from now on, for tests and benchmarks
+        //!
+        static void implementation(const std::string &name);
+
+        //!
+        //! @return names of the SIMD implementations the CPU supports, the one used by default first ("portable", one
+        //! chunk at a time, is always last)
+        //!
+        [[nodiscard]] static std::vector<const char *> implementations();
+
+        //!
+        //! @return number of chunks compressed in parallel by implementation()
+        //!
+        [[nodiscard]] static size_t lanes();
+
+    private:
+        static constexpr size_t MAX_DEPTH = 54; // 2^54 chunks * 1KiB = 2^64 bytes
+
+        struct chunk_state {
+            uint32_t cv_[8];
+            uint64_t counter_;
+            uint8_t block_[BLOCK_LEN];
+            uint8_t blockLen_;
+            uint8_t blocksCompressed_;
+
+            [[nodiscard]] size_t len() const { return BLOCK_LEN * blocksCompressed_ + blockLen_; }
+        };
+
+        struct output_t {
+            uint32_t cv_[8];
+            uint8_t block_[BLOCK_LEN];
+            uint8_t blockLen_;
+            uint64_t counter_;
+            uint8_t flags_;
+
+            void chaining_value(uint32_t cv[8]) const;
+
+            void root(uint8_t out[OUT_LEN]) const;
+        };
+
+        chunk_state chunk_{};
+        uint32_t cvStack_[MAX_DEPTH][8]{};
+        uint8_t cvStackLen_{0};
+
+        explicit Blake3(uint64_t chunkCounter);
+
+        void start_chunk(uint64_t chunkCounter);
+
+        void update_chunk(const uint8_t *data, size_t len);
+
+        [[nodiscard]] output_t chunk_output() const;
+
+        //!
+        //! Push the chaining value of a complete sub-tree of 2^`level` chunks, `totalChunks` includes it
+        //!
+        void push_cv(const uint32_t cv[8], unsigned level, uint64_t totalChunks);
+
+        //!
+        //! Chaining value of everything hashed so far (which must be a complete sub-tree)
+        //!
+        void subtree_cv(uint32_t cv[8]) const;
+    };
+}
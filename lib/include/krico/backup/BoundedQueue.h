@@ -0,0 +1,104 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <optional>
+
+namespace krico::backup {
+    //!
+    //! A multi-producer multi-consumer FIFO with a fixed capacity.
+    //!
+    //! push() blocks while the queue is full (backpressure) and pop() blocks while it is empty.  Once close() is called
+    //! no more elements are accepted and pop() drains what is left, abort() additionally drops what is left.
+    //!
+    template<typename T>
+    class BoundedQueue final {
+    public:
+        explicit BoundedQueue(const size_t capacity): capacity_(capacity == 0 ? 1 : capacity) {
+        }
+
+        BoundedQueue(const BoundedQueue &) = delete;
+
+        BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+        [[nodiscard]] size_t capacity() const { return capacity_; }
+
+        //!
+        //! Append `v`, waiting for room if the queue is full
+        //!
+        //! @return false if the queue was closed (or aborted) and `v` was not added
+        //!
+        bool push(T v) {
+            std::unique_lock lock{mutex_};
+            notFull_.wait(lock, [this] { return closed_ || elements_.size() < capacity_; });
+            if (closed_) return false;
+            elements_.emplace_back(std::move(v));
+            lock.unlock();
+            notEmpty_.notify_one();
+            return true;
+        }
+
+        //!
+        //! Remove the oldest element, waiting for one if the queue is empty
+        //!
+        //! @return the element or std::nullopt if the queue is closed and drained
+        //!
+        std::optional<T> pop() {
+            std::unique_lock lock{mutex_};
+            notEmpty_.wait(lock, [this] { return closed_ || !elements_.empty(); });
+            if (elements_.empty()) return std::nullopt;
+            std::optional<T> ret{std::move(elements_.front())};
+            elements_.pop_front();
+            lock.unlock();
+            notFull_.notify_one();
+            return ret;
+        }
+
+        //!
+        //! Remove the oldest element if there is one (never waits)
+        //!
+        std::optional<T> try_pop() {
+            std::unique_lock lock{mutex_};
+            if (elements_.empty()) return std::nullopt;
+            std::optional<T> ret{std::move(elements_.front())};
+            elements_.pop_front();
+            lock.unlock();
+            notFull_.notify_one();
+            return ret;
+        }
+
+        //!
+        //! Stop accepting elements, consumers still get the remaining ones
+        //!
+        void close() {
+            do {
+                std::lock_guard lock{mutex_};
+                closed_ = true;
+            } while (false);
+            notFull_.notify_all();
+            notEmpty_.notify_all();
+        }
+
+        //!
+        //! Stop accepting elements and drop the remaining ones (used to unblock everybody on failures)
+        //!
+        void abort() {
+            do {
+                std::lock_guard lock{mutex_};
+                closed_ = true;
+                elements_.clear();
+            } while (false);
+            notFull_.notify_all();
+            notEmpty_.notify_all();
+        }
+
+    private:
+        const size_t capacity_;
+        std::mutex mutex_{};
+        std::condition_variable notFull_{};
+        std::condition_variable notEmpty_{};
+        std::deque<T> elements_{};
+        bool closed_{false};
+    };
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory_resource>
+
+namespace krico::backup {
+    //!
+    //! A std::pmr::memory_resource that forwards to an upstream resource and counts the allocations going through it.
+    //!
+    //! Used as the upstream of arenas, so the number of real (heap) allocations they make is visible.  Thread-safe as
+    //! long as the upstream resource is.
+    //!
+    class CountingResource final : public std::pmr::memory_resource {
+    public:
+        explicit CountingResource(std::pmr::memory_resource *upstream = std::pmr::new_delete_resource())
+            : upstream_(upstream) {
+        }
+
+        //!
+        //! @return number of allocations made so far
+        //!
+        [[nodiscard]] uint64_t allocations() const { return allocations_.load(std::memory_order_relaxed); }
+
+        //!
+        //! @return total number of bytes allocated so far (not reduced by deallocations)
+        //!
+        [[nodiscard]] uint64_t bytes() const { return bytes_.load(std::memory_order_relaxed); }
+
+    private:
+        std::pmr::memory_resource *upstream_;
+        std::atomic<uint64_t> allocations_{0};
+        std::atomic<uint64_t> bytes_{0};
+
+        void *do_allocate(const size_t bytes, const size_t alignment) override {
+            void *p = upstream_->allocate(bytes, alignment);
+            allocations_.fetch_add(1, std::memory_order_relaxed);
+            bytes_.fetch_add(bytes, std::memory_order_relaxed);
+            return p;
+        }
+
+        void do_deallocate(void *p, const size_t bytes, const size_t alignment) override {
+            upstream_->deallocate(p, bytes, alignment);
+        }
+
+        [[nodiscard]] bool do_is_equal(const memory_resource &other) const noexcept override {
+            return this == &other;
+        }
+    };
+}
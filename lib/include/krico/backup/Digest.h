@@ -2,6 +2,10 @@
 
 #include <openssl/evp.h>
 #include <string>
+#include <cstring>
+#include <functional>
+#include <algorithm>
+#include <memory>
 #include <__filesystem/filesystem_error.h>
 
 //!
@@ -13,15 +17,26 @@ namespace krico::backup {
         static constexpr unsigned int SHA1 = 20;
         static constexpr unsigned int SHA256 = 32;
         static constexpr unsigned int MD5 = 16;
+        static constexpr unsigned int BLAKE3 = 32;
     }
 
+    class Blake3; // fwd-decl
+
     class Digest {
     public:
+        static constexpr auto SHA1_ALGORITHM = "SHA-1";
+        static constexpr auto SHA256_ALGORITHM = "SHA2-256";
+        static constexpr auto MD5_ALGORITHM = "MD5";
+        //! Not an OpenSSL algorithm, implemented by krico::backup::Blake3
+        static constexpr auto BLAKE3_ALGORITHM = "BLAKE3";
+
         //!
         //! Construct a new Digest.
         //!
         //! It is more convenient to use one of the static methods such as Digest::sha256() and Digest::md5()
         //!
+        //! @param algorithm an OpenSSL algorithm name or BLAKE3_ALGORITHM
+        //!
         explicit Digest(const std::string &algorithm, const std::string &properties = "");
 
         Digest(const Digest &) = delete;
@@ -45,6 +60,11 @@ namespace krico::backup {
         //!
         [[nodiscard]] static Digest md5();
 
+        //!
+        //! Create a new Digest with blake3 implementation
+        //!
+        [[nodiscard]] static Digest blake3();
+
         void reset() const;
 
         void update(const void *data, size_t len) const;
@@ -95,6 +115,13 @@ namespace krico::backup {
         //!
         [[nodiscard]] result digest() const;
 
+        //!
+        //! Reset and compute the digest of `len` bytes of `data` in one go.
+        //!
+        //! BLAKE3 hashes parts of the tree of a large input on up to `threads` threads, other algorithms ignore it.
+        //!
+        [[nodiscard]] result digest(const void *data, size_t len, unsigned threads = 1) const;
+
         //!
         //! Compute the zero result (aka: result of digest-length wiht all zeroes)
         //!
@@ -103,6 +130,7 @@ namespace krico::backup {
     private:
         EVP_MD *digest_{nullptr};
         EVP_MD_CTX *context_{nullptr};
+        std::unique_ptr<Blake3> blake3_{};
     };
 
     //!
@@ -120,3 +148,13 @@ namespace krico::backup {
     //!
     std::string md5_sum(const std::string &str);
 }
+
+template<>
+struct std::hash<krico::backup::Digest::result> {
+    size_t operator()(const krico::backup::Digest::result &r) const noexcept {
+        // Digests are uniformly distributed, the leading bytes are as good a hash as any
+        size_t h{r.len_};
+        std::memcpy(&h, r.md_, std::min<size_t>(sizeof(h), r.len_));
+        return h;
+    }
+};
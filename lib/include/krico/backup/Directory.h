@@ -1,7 +1,10 @@
 #pragma once
 
+#include "CountingResource.h"
+#include "DirectoryScanner.h"
 #include <filesystem>
-#include <vector>
+#include <memory>
+#include <memory_resource>
 
 namespace krico::backup {
     class Directory; // fwd-decl
@@ -64,7 +67,7 @@ namespace krico::backup {
             iterator &operator=(const iterator &rhs);
 
             iterator &operator++() {
-                ++it_;
+                ++index_;
                 return *this;
             }
 
@@ -74,18 +77,29 @@ namespace krico::backup {
                 return retval;
             }
 
-            bool operator==(const iterator &other) const { return it_ == other.it_ && directory_ == other.directory_; }
+            bool operator==(const iterator &other) const {
+                return index_ == other.index_ && directory_ == other.directory_;
+            }
             bool operator!=(const iterator &other) const { return !(*this == other); }
 
             reference operator*();
 
         private:
             const Directory *directory_{nullptr};
-            std::vector<std::filesystem::directory_entry>::const_iterator it_;
+            size_t index_;
+            // Allocated from arena_ (the arena of directory_), destroyed when moving on to the next entry.  The
+            // iterator shares the arena so it can release current_ even if it outlives directory_.
+            std::shared_ptr<std::pmr::unsynchronized_pool_resource> arena_{};
             directory_entry *current_{nullptr};
+            size_t currentSize_{0};
+            size_t currentAlignment_{0};
+
+            explicit iterator(const Directory &directory, size_t index);
+
+            template<typename T, typename... Args>
+            void emplace(Args &&... args);
 
-            explicit iterator(const Directory &directory,
-                              std::vector<std::filesystem::directory_entry>::const_iterator it);
+            void release();
 
             friend class Directory;
         };
@@ -100,12 +114,24 @@ namespace krico::backup {
 
         [[nodiscard]] const Directory &as_directory() const override { return *this; }
 
+        //!
+        //! @return the number of entries in this directory
+        //!
+        [[nodiscard]] size_t size() const { return entries_->size(); }
+
         [[nodiscard]] iterator begin() const;
 
         [[nodiscard]] iterator end() const;
 
+        //!
+        //! @return the upstream of all Directory arenas, counts the heap allocations made by traversals
+        //!
+        [[nodiscard]] static const CountingResource &allocations();
+
     private:
-        std::vector<std::filesystem::directory_entry> entries_{};
+        std::shared_ptr<const DirectoryScanner> entries_;
+        // Entries handed out by iterators are recycled through this pool, released with the Directory
+        std::shared_ptr<std::pmr::unsynchronized_pool_resource> arena_;
 
         friend class File;
         friend class Symlink;
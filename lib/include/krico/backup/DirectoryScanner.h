@@ -0,0 +1,125 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+namespace krico::backup {
+    //!
+    //! The entries of one directory, read through an open directory descriptor.
+    //!
+    //! On Linux the entries are read with getdents64 in large batches, elsewhere with readdir.  Names are packed into a
+    //! single buffer and sorted by raw bytes, so a directory costs one allocation for the names plus 8 bytes per entry
+    //! and no per-entry path.  Entry types come from d_type, with a fstatat(AT_SYMLINK_NOFOLLOW) only when the file
+    //! system doesn't fill it in.  Sub-directories are opened relative to the parent descriptor (openat).
+    //!
+    class DirectoryScanner final {
+    public:
+        enum class entry_type : uint8_t { file, directory, symlink, other };
+
+        //!
+        //! A view of one entry, valid as long as the DirectoryScanner
+        //!
+        struct entry_view {
+            //! The file name (null terminated)
+            std::string_view name_;
+            entry_type type_;
+
+            [[nodiscard]] bool is_file() const { return type_ == entry_type::file; }
+            [[nodiscard]] bool is_directory() const { return type_ == entry_type::directory; }
+            [[nodiscard]] bool is_symlink() const { return type_ == entry_type::symlink; }
+        };
+
+        class iterator {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = entry_view;
+            using difference_type = std::ptrdiff_t;
+            using pointer = void;
+            using reference = entry_view;
+
+            iterator() = default;
+
+            iterator &operator++() {
+                ++index_;
+                return *this;
+            }
+
+            iterator operator++(int) {
+                const iterator retval = *this;
+                ++index_;
+                return retval;
+            }
+
+            bool operator==(const iterator &other) const = default;
+
+            reference operator*() const { return (*scanner_)[index_]; }
+
+        private:
+            const DirectoryScanner *scanner_{nullptr};
+            size_t index_{0};
+
+            iterator(const DirectoryScanner &scanner, const size_t index) : scanner_(&scanner), index_(index) {
+            }
+
+            friend class DirectoryScanner;
+        };
+
+        //!
+        //! Open and read `dir`
+        //!
+        explicit DirectoryScanner(const std::filesystem::path &dir);
+
+        //!
+        //! Open and read the sub-directory `name` of `parent` (relative to the descriptor of `parent`)
+        //!
+        DirectoryScanner(const DirectoryScanner &parent, std::string_view name);
+
+        ~DirectoryScanner();
+
+        DirectoryScanner(const DirectoryScanner &) = delete;
+
+        DirectoryScanner &operator=(const DirectoryScanner &) = delete;
+
+        [[nodiscard]] const std::filesystem::path &path() const { return path_; }
+
+        [[nodiscard]] size_t size() const { return entries_.size(); }
+
+        [[nodiscard]] entry_view operator[](const size_t index) const {
+            const auto &[offset, len, type] = entries_[index];
+            return {.name_ = {names_.data() + offset, len}, .type_ = type};
+        }
+
+        [[nodiscard]] iterator begin() const { return {*this, 0}; }
+
+        [[nodiscard]] iterator end() const { return {*this, entries_.size()}; }
+
+        //!
+        //! @return the target of the symlink `name` (readlinkat)
+        //!
+        [[nodiscard]] std::filesystem::path read_symlink(std::string_view name) const;
+
+        //!
+        //! @return true if `name` is, or is a symlink that resolves to, a directory (false for dangling links)
+        //!
+        [[nodiscard]] bool is_directory(std::string_view name) const;
+
+    private:
+        struct entry_t {
+            uint32_t offset_;
+            uint16_t len_;
+            entry_type type_;
+        };
+
+        std::filesystem::path path_;
+        int fd_{-1};
+        std::string names_{};
+        std::vector<entry_t> entries_{};
+
+        void read();
+
+        void add(const char *name, unsigned char type);
+    };
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "Digest.h"
+#include "IoBatch.h"
+#include <filesystem>
+#include <string>
+#include <cstdint>
+
+namespace krico::backup {
+    //!
+    //! Layout of the objects in BackupRepository::hardLinksDir(): `depth_` levels of directories, each named by the next
+    //! `width_` hex digits of the digest, and the object file named by the remaining digits (e.g. depth 2 and width 2
+    //! store digest 1294ae... as 12/94/ae...).
+    //!
+    //! Chosen at BackupRepository::initialize(), which also creates all the directories, so committing an object never
+    //! has to check for (or create) its directory.  Small repositories want few directories, large ones enough of them
+    //! to keep each directory small.
+    //!
+    struct Fanout {
+        static constexpr uint8_t MAX_DEPTH = 4;
+        static constexpr uint8_t MAX_WIDTH = 4;
+        //! Limit of depth_ * width_, at most 16^4 leaf directories are created
+        static constexpr uint8_t MAX_DIGITS = 4;
+
+        uint8_t depth_;
+        uint8_t width_;
+
+        //!
+        //! Layout of new repositories (256 directories)
+        //!
+        static constexpr Fanout standard() { return {.depth_ = 1, .width_ = 2}; }
+
+        //!
+        //! Layout of repositories that predate the configuration (not pre-created)
+        //!
+        static constexpr Fanout legacy() { return {.depth_ = 2, .width_ = 2}; }
+
+        //!
+        //! @throws krico::backup::exception if depth_ or width_ are out of range
+        //!
+        void validate() const;
+
+        //!
+        //! @return number of directories in the last level
+        //!
+        [[nodiscard]] size_t directories() const { return size_t{1} << 4 * depth_ * width_; }
+
+        //!
+        //! @return path of the object with `digest`, relative to hardLinksDir()
+        //!
+        [[nodiscard]] std::string path(const Digest::result &digest) const;
+
+        //!
+        //! @return true if `relative` (to hardLinksDir()) is one of the directories of this layout
+        //!
+        [[nodiscard]] bool is_directory(const std::filesystem::path &relative) const;
+
+        //!
+        //! Create all the directories of this layout below `dir` (existing ones are kept)
+        //!
+        void create(const std::filesystem::path &dir, unsigned ioDepth = IoBatch::DEFAULT_DEPTH) const;
+
+        [[nodiscard]] std::string str() const;
+
+        constexpr bool operator==(const Fanout &rhs) const = default;
+    };
+}
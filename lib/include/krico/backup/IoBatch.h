@@ -0,0 +1,132 @@
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+namespace krico::backup {
+    //!
+    //! A batch of file system operations submitted together.
+    //!
+    //! On Linux the operations go through an io_uring (set up with raw syscalls), so a whole batch is in flight at
+    //! once and slow devices see a deep queue instead of one blocking call at a time.  Where io_uring is not available
+    //! (other platforms, old kernels, seccomp filters) or an operation is not supported by the kernel, the operation
+    //! runs as the equivalent blocking call.
+    //!
+    //! Operations of one submit() run concurrently and in no particular order, dependent operations (e.g. read() after
+    //! open()) need separate submissions.  Not thread-safe, use one IoBatch per thread.
+    //!
+    class IoBatch final {
+    public:
+        static constexpr unsigned DEFAULT_DEPTH = 64;
+
+        enum class backend : uint8_t { io_uring, blocking };
+
+        //!
+        //! @param depth maximum number of operations in flight at once
+        //! @param useUring false forces the blocking backend
+        //!
+        explicit IoBatch(unsigned depth = DEFAULT_DEPTH, bool useUring = true);
+
+        ~IoBatch();
+
+        IoBatch(const IoBatch &) = delete;
+
+        IoBatch &operator=(const IoBatch &) = delete;
+
+        [[nodiscard]] backend get_backend() const { return uring_ ? backend::io_uring : backend::blocking; }
+
+        //!
+        //! @return number of operations queued for the next submit()
+        //!
+        [[nodiscard]] size_t size() const { return ops_.size(); }
+
+        //!
+        //! Queue an lstat() of `file` into `st`
+        //!
+        //! @return index of the result in the span returned by submit() (same for all the methods below)
+        //!
+        size_t stat(const std::filesystem::path &file, struct stat &st);
+
+        //!
+        //! Queue an open(), the result is the new file descriptor
+        //!
+        size_t open(const std::filesystem::path &file, int flags, mode_t mode = 0);
+
+        //!
+        //! Queue a pread() of up to `len` bytes, the result is the number of bytes read
+        //!
+        size_t read(int fd, void *buffer, size_t len, uint64_t offset = 0);
+
+        size_t close(int fd);
+
+        //!
+        //! Queue the creation of hard link `link` to `target`
+        //!
+        size_t link(const std::filesystem::path &target, const std::filesystem::path &link) {
+            return this->link(AT_FDCWD, target, AT_FDCWD, link);
+        }
+
+        //!
+        //! Queue a linkat(), relative paths are resolved from the directory descriptors (as with all the *at() calls)
+        //!
+        size_t link(int targetDirFd, const std::filesystem::path &target, int linkDirFd, const std::filesystem::path &link);
+
+        size_t mkdir(const std::filesystem::path &dir, const mode_t mode = 0777) { return mkdir(AT_FDCWD, dir, mode); }
+
+        size_t mkdir(int dirFd, const std::filesystem::path &dir, mode_t mode = 0777);
+
+        size_t rename(const std::filesystem::path &from, const std::filesystem::path &to);
+
+        //!
+        //! Run all queued operations and wait for them to finish
+        //!
+        //! @return the result of each operation (>= 0 on success, -errno on failure), valid until the next submit()
+        //!
+        std::span<const int> submit();
+
+        //!
+        //! @return true if io_uring can be set up by this process
+        //!
+        [[nodiscard]] static bool uring_available();
+
+    private:
+        enum class op_kind : uint8_t { stat, open, read, close, link, mkdir, rename };
+
+        struct op_t {
+            op_kind kind_;
+            std::string path_{};
+            std::string path2_{};
+            // Directories relative path_ and path2_ are resolved from
+            int dirFd_{AT_FDCWD};
+            int dirFd2_{AT_FDCWD};
+            int fd_{-1};
+            int flags_{0};
+            mode_t mode_{0};
+            void *buffer_{nullptr};
+            size_t len_{0};
+            uint64_t offset_{0};
+            struct stat *stat_{nullptr};
+        };
+
+        struct uring; // fwd-decl, only defined on Linux
+
+        std::unique_ptr<uring> uring_;
+        std::vector<op_t> ops_{};
+        std::vector<int> results_{};
+
+        size_t add(op_t &&op);
+
+        //!
+        //! @return result of running `op` with a blocking call
+        //!
+        static int execute(const op_t &op);
+    };
+
+    [[nodiscard]] const char *to_string(IoBatch::backend backend);
+}
@@ -8,6 +8,7 @@ namespace krico::backup {
         Initialized = 1,
         AddDirectory = 2,
         RunBackup = 3,
+        Checkpoint = 4,
     };
 
     inline std::ostream &operator<<(std::ostream &out, const LogEntryType &type) {
@@ -21,6 +22,8 @@ namespace krico::backup {
                 return out << "add";
             case LogEntryType::RunBackup:
                 return out << "run";
+            case LogEntryType::Checkpoint:
+                return out << "ckpt";
             default:
                 return out << "UNKN";
         }
@@ -0,0 +1,172 @@
+#pragma once
+
+#include "Digest.h"
+#include "MappedFile.h"
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+
+namespace krico::backup {
+    class ThreadPool; // fwd-decl
+
+    //!
+    //! Append-only storage of the records of a BackupRepositoryLog, so reading the log costs no system calls per record.
+    //!
+    //! The pack file (log/records.pack) is a header followed by frames, each one the length and digest of a record and
+    //! the record itself.  The index file (log/records.index) is a header followed by the digest, length and offset of
+    //! every record, sorted by digest.  Both are memory-mapped, a record is looked up with a binary search of the index.
+    //!
+    //! Records appended since the index was written are found by scanning the end of the pack when it is opened (a
+    //! crash can leave a partial frame there, it is ignored).  Once there are INDEX_INTERVAL of them, the index is
+    //! written again.  Like the ObjectIndex, the index is a cache: it is rebuilt from the pack if it is missing.
+    //!
+    //! Opening and reading a pack never writes, so the log of a read-only repository can be read.  The pack is only
+    //! created (or its partial frame truncated) and the index rewritten by the first append().
+    //!
+    //! Not thread-safe, must be protected by BackupRepository lock
+    //!
+    class LogPack final {
+    public:
+        static constexpr auto PACK_FILE = "records.pack";
+        static constexpr auto INDEX_FILE = "records.index";
+        static constexpr uint32_t PACK_MAGIC = 0x504c424b; // "KBLP"
+        static constexpr uint32_t INDEX_MAGIC = 0x494c424b; // "KBLI"
+        static constexpr uint32_t VERSION = 1;
+        static constexpr size_t INDEX_INTERVAL = 64;
+        //! Default bytes of records hashed by each task of verify()
+        static constexpr size_t VERIFY_CHUNK = 1024 * 1024;
+
+        explicit LogPack(const std::filesystem::path &dir);
+
+        ~LogPack();
+
+        LogPack(const LogPack &) = delete;
+
+        LogPack &operator=(const LogPack &) = delete;
+
+        //!
+        //! @return true if the record with `digest` is in the pack
+        //!
+        [[nodiscard]] bool contains(const Digest::result &digest) const;
+
+        //!
+        //! @return the record with `digest` (**only valid** until the next call to find() or append()) or an empty view
+        //! if it is not in the pack
+        //!
+        [[nodiscard]] std::string_view find(const Digest::result &digest);
+
+        //!
+        //! Append the record `data` with `digest` (a record that is already in the pack is not appended again)
+        //!
+        void append(const Digest::result &digest, const char *data, size_t len);
+
+        //!
+        //! Flush the records appended so far to disk (fdatasync)
+        //!
+        void sync();
+
+        //!
+        //! @return true if nothing was appended since the last sync()
+        //!
+        [[nodiscard]] bool synced() const { return synced_; }
+
+        //!
+        //! Binary search of the index (plus a scan of the records appended since it was written)
+        //!
+        //! @return digests of the records starting with the hex digits `prefix` (in no particular order, all of them
+        //! for an empty prefix, none if it is not hex)
+        //!
+        [[nodiscard]] std::vector<Digest::result> find_prefix(std::string_view prefix) const;
+
+        //!
+        //! Hash every record of the pack with `pool` and call `problem` (one call at a time) with the digest of each
+        //! record whose content does not hash to it, each task hashing about `chunk` bytes of records
+        //!
+        //! Frames are bounds checked first: the walk stops at a truncated or corrupt frame (reported with the digest of
+        //! the frame, zero if its header is cut) and every index entry is checked against the frame it locates.
+        //!
+        //! @return number of records checked
+        //!
+        size_t verify(ThreadPool &pool, const std::function<void(const Digest::result &, const std::string &)> &problem,
+                      size_t chunk = VERIFY_CHUNK);
+
+        //!
+        //! @return digests of all the records in the pack (in no particular order)
+        //!
+        [[nodiscard]] std::vector<Digest::result> digests() const;
+
+        //!
+        //! @return number of records in the pack
+        //!
+        [[nodiscard]] size_t size() const { return count_ + tail_.size(); }
+
+    private:
+        struct pack_header_t {
+            uint32_t magic_;
+            uint32_t version_;
+        };
+
+        struct frame_t {
+            uint32_t length_;
+            uint8_t digest_[DigestLength::SHA1];
+        };
+
+        struct index_header_t {
+            uint32_t magic_;
+            uint32_t version_;
+            uint64_t count_;
+            // Size of the pack covered by the index
+            uint64_t packSize_;
+        };
+
+        struct index_entry_t {
+            uint8_t digest_[DigestLength::SHA1];
+            uint32_t length_;
+            uint64_t offset_;
+        };
+
+        struct location_t {
+            uint64_t offset_;
+            uint32_t length_;
+        };
+
+        const std::filesystem::path packFile_;
+        const std::filesystem::path indexFile_;
+        // Only open once something is appended, see writable()
+        int pack_{-1};
+        uint64_t packSize_{0};
+        bool synced_{true};
+        MappedFile packMapped_{};
+        MappedFile indexMapped_{};
+        const index_entry_t *entries_{nullptr};
+        size_t count_{0};
+        uint64_t indexedSize_{0};
+        std::unordered_map<Digest::result, location_t> tail_{};
+
+        //!
+        //! Map indexFile_, returns false if it is not a valid index (of this pack)
+        //!
+        bool map();
+
+        //!
+        //! Add the frames after indexedSize_ to tail_, truncating a partial frame at the end
+        //!
+        void scan();
+
+        [[nodiscard]] const index_entry_t *indexed(const Digest::result &digest) const;
+
+        //!
+        //! Open pack_ for appending (once), creating the pack or truncating a partial frame at its end
+        //!
+        void writable();
+
+        //!
+        //! Write the index and tail_ as the new index file and remap it
+        //!
+        void save();
+    };
+}
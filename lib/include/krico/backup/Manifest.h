@@ -0,0 +1,228 @@
+#pragma once
+
+#include "Digest.h"
+#include "MappedFile.h"
+#include <filesystem>
+#include <fstream>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+namespace krico::backup {
+    //!
+    //! One entry of a manifest (views are valid while the writer call, or the reader iterator, lasts)
+    //!
+    struct manifest_entry {
+        enum class kind : uint8_t { directory = 'D', copied = 'C', hard_linked = 'H', symlink = 'L' };
+
+        kind kind_;
+        //! Relative to the backup directory, "." is the backup directory itself
+        std::string_view path_;
+        //! Files only
+        Digest::result digest_{};
+        //! Files only
+        uint64_t size_{0};
+        //! Files only, modification time in nanoseconds since the epoch
+        int64_t mtimeNs_{0};
+        //! Symlinks only
+        std::string_view target_{};
+    };
+
+    //!
+    //! Compare paths component by component, which is the order a depth first traversal (of directories sorted by
+    //! name) emits them in, e.g. "a" < "a/b" < "a.txt".  "." (the root) is less than any other path.
+    //!
+    //! @return <0, 0 or >0 as `lhs` is less than, equal to or greater than `rhs`
+    //!
+    [[nodiscard]] int compare_paths(std::string_view lhs, std::string_view rhs);
+
+    //!
+    //! Binary manifest of a backup, the `.summary` file of a BackupSummary (version 1).
+    //!
+    //!     header   magic "KBSM", version
+    //!     blocks   entries in traversal order, each path front-coded against the previous one, every BLOCK_ENTRIES
+    //!              entries a block starts over with a complete path
+    //!     index    offset of every block (u64)
+    //!     trailer  offset of the index, number of blocks and entries, digest length, checksum of the backup, magic
+    //!
+    //! An entry is a kind tag, varint shared prefix length, varint suffix length and the suffix, then for files the
+    //! raw digest, varint size and 8 byte mtime, for symlinks a varint target length and the target.  Fixed width
+    //! fields are in native byte order (as the other binary files of the repository).
+    //!
+    //! Entries are collected in large buffers, so writing a manifest costs one write() per BUFFER_SIZE bytes.
+    //!
+    class ManifestWriter final {
+    public:
+        static constexpr uint32_t MAGIC = 0x4d53424b; // "KBSM"
+        static constexpr uint32_t VERSION = 1;
+        static constexpr size_t BLOCK_ENTRIES = 64;
+        static constexpr size_t BUFFER_SIZE = 1024 * 1024;
+
+        explicit ManifestWriter(const std::filesystem::path &file);
+
+        ManifestWriter(const ManifestWriter &) = delete;
+
+        ManifestWriter &operator=(const ManifestWriter &) = delete;
+
+        //!
+        //! Append `entry`, entries must be added in traversal order (see compare_paths())
+        //!
+        void add(const manifest_entry &entry);
+
+        //!
+        //! Write the index and trailer and close the file
+        //!
+        void finish(const Digest::result &checksum);
+
+        [[nodiscard]] uint64_t size() const { return entries_; }
+
+    private:
+        struct header_t {
+            uint32_t magic_;
+            uint32_t version_;
+        };
+
+        struct trailer_t {
+            uint64_t indexOffset_;
+            uint64_t blocks_;
+            uint64_t entries_;
+            uint32_t digestLength_;
+            uint32_t checksumLength_;
+            uint8_t checksum_[EVP_MAX_MD_SIZE];
+            uint32_t reserved_;
+            uint32_t magic_;
+        };
+
+        const std::filesystem::path file_;
+        std::ofstream out_;
+        std::string buffer_{};
+        // Bytes written to out_ so far
+        uint64_t offset_{0};
+        uint64_t entries_{0};
+        std::vector<uint64_t> blocks_{};
+        std::string previous_{};
+        uint32_t digestLength_{0};
+
+        void flush();
+
+        friend class ManifestReader;
+    };
+
+    //!
+    //! Reads a manifest written by ManifestWriter from a memory mapping, sequentially or looking up paths (and the
+    //! subtrees below them) in O(log n)
+    //!
+    class ManifestReader final {
+    public:
+        //!
+        //! Map `file`, throws if it is not a (valid) manifest
+        //!
+        explicit ManifestReader(const std::filesystem::path &file);
+
+        //!
+        //! @return true if `file` starts like a manifest (summary files before version 1 are text)
+        //!
+        [[nodiscard]] static bool is_manifest(const std::filesystem::path &file);
+
+        [[nodiscard]] uint64_t size() const { return entries_; }
+
+        [[nodiscard]] const Digest::result &checksum() const { return checksum_; }
+
+        class iterator {
+        public:
+            using iterator_category = std::input_iterator_tag;
+            using value_type = manifest_entry;
+            using difference_type = std::ptrdiff_t;
+            using pointer = void;
+            using reference = manifest_entry;
+
+            iterator() = default;
+
+            [[nodiscard]] manifest_entry operator*() const;
+
+            iterator &operator++();
+
+            bool operator==(const iterator &rhs) const { return index_ == rhs.index_; }
+
+        private:
+            const ManifestReader *reader_{nullptr};
+            uint64_t index_{0};
+            // Next entry to decode
+            const uint8_t *next_{nullptr};
+            std::string path_{};
+            manifest_entry entry_{};
+
+            iterator(const ManifestReader *reader, uint64_t index, const uint8_t *next);
+
+            void decode();
+
+            friend class ManifestReader;
+        };
+
+        //!
+        //! Entries from `begin_` up to (not including) `end_`
+        //!
+        struct range {
+            iterator begin_;
+            iterator end_;
+
+            [[nodiscard]] iterator begin() const { return begin_; }
+
+            [[nodiscard]] iterator end() const { return end_; }
+
+            [[nodiscard]] bool empty() const { return begin_ == end_; }
+        };
+
+        [[nodiscard]] iterator begin() const;
+
+        [[nodiscard]] iterator end() const;
+
+        //!
+        //! Binary search of the block index, then a scan of at most one block
+        //!
+        //! @return the first entry not less than `path` (see compare_paths()) or end()
+        //!
+        [[nodiscard]] iterator lower_bound(std::string_view path) const;
+
+        //!
+        //! @return the entry of `path` or end()
+        //!
+        [[nodiscard]] iterator find(std::string_view path) const;
+
+        //!
+        //! @return `dir` and every entry below it (all entries for "."), empty if there is no `dir`
+        //!
+        [[nodiscard]] range subtree(std::string_view dir) const;
+
+    private:
+        const std::filesystem::path file_;
+        MappedFile mapped_;
+        const uint8_t *index_{nullptr};
+        // End of the entries (start of the index)
+        const uint8_t *entriesEnd_{nullptr};
+        uint64_t blocks_{0};
+        uint64_t entries_{0};
+        uint32_t digestLength_{0};
+        Digest::result checksum_{};
+
+        [[nodiscard]] const uint8_t *block(uint64_t block) const;
+
+        //!
+        //! @return the path of the first entry of `block`, which is never front-coded
+        //!
+        [[nodiscard]] std::string_view first_path(uint64_t block) const;
+    };
+
+    //!
+    //! Print `entry` as a line of print_manifest() (without the newline)
+    //!
+    std::ostream &operator<<(std::ostream &out, const manifest_entry &entry);
+
+    //!
+    //! Print the manifest `file` as text, one "D <dir>", "C <digest> <file>", "H <digest> <file>" or
+    //! "L <link>\t<target>" line per entry and a final "S <checksum>" (summary files before version 1 are that text)
+    //!
+    void print_manifest(const std::filesystem::path &file, std::ostream &out);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <filesystem>
+#include <cstdint>
+
+namespace krico::backup {
+    //!
+    //! A read-only, shared memory mapping of a whole file.  Unmapped when the object goes away.
+    //!
+    class MappedFile final {
+    public:
+        //!
+        //! An empty mapping (data() is nullptr and size() is 0)
+        //!
+        MappedFile() = default;
+
+        //!
+        //! Map `file` (an empty file results in an empty mapping), throws in case of errors
+        //!
+        explicit MappedFile(const std::filesystem::path &file);
+
+        ~MappedFile();
+
+        MappedFile(const MappedFile &) = delete;
+
+        MappedFile &operator=(const MappedFile &) = delete;
+
+        MappedFile(MappedFile &&) noexcept;
+
+        MappedFile &operator=(MappedFile &&) noexcept;
+
+        [[nodiscard]] const uint8_t *data() const { return data_; }
+
+        [[nodiscard]] size_t size() const { return size_; }
+
+        [[nodiscard]] bool empty() const { return size_ == 0; }
+
+    private:
+        const uint8_t *data_{nullptr};
+        size_t size_{0};
+    };
+}
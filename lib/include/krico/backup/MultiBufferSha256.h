@@ -0,0 +1,36 @@
+#pragma once
+
+#include "Digest.h"
+#include <cstddef>
+
+namespace krico::backup {
+    //!
+    //! SHA-256 of several independent buffers at once (multi-buffer hashing).
+    //!
+    //! Each lane of a SIMD vector runs the compression function of a different buffer, 16 lanes with AVX-512, 8 with AVX2
+    //! and 4 otherwise (SSE2 on x86, NEON on ARM).  Meant for batches of small files where the per-message overhead of
+    //! Digest (reset, update and final through OpenSSL) dominates.  Results are identical to Digest::sha256().
+    //!
+    class MultiBufferSha256 final {
+    public:
+        struct buffer_t {
+            const void *data_;
+            size_t len_;
+        };
+
+        //!
+        //! Compute the SHA-256 of each of the `n` `buffers` into the corresponding `results`
+        //!
+        static void digest(const buffer_t *buffers, size_t n, Digest::result *results);
+
+        //!
+        //! @return number of buffers hashed at once by implementation()
+        //!
+        [[nodiscard]] static size_t lanes();
+
+        //!
+        //! @return name of the SIMD implementation in use (e.g. "avx2")
+        //!
+        [[nodiscard]] static const char *implementation();
+    };
+}
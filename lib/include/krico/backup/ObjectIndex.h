@@ -0,0 +1,128 @@
+#pragma once
+
+#include "Digest.h"
+#include "MappedFile.h"
+#include <filesystem>
+#include <functional>
+#include <shared_mutex>
+#include <unordered_set>
+
+namespace krico::backup {
+    //!
+    //! Index of the digests of all the objects in BackupRepository::hardLinksDir(), so looking up whether an object
+    //! exists costs no system calls.
+    //!
+    //! The index file (metaDir()/objects.index) is a header followed by the sorted digests, it is memory-mapped and
+    //! looked up with a binary search.  Inserts go to an in-memory set and are appended to a journal
+    //! (metaDir()/objects.journal) that is replayed when the index is opened.  save() merges both into a new index file
+    //! (renamed over the old one) and truncates the journal.
+    //!
+    //! The index is a cache of hardLinksDir(): an object missing from it is copied again and discarded on commit (then
+    //! inserted), rebuild() re-creates it from a scan of hardLinksDir() (it is also rebuilt if the index file is missing
+    //! or was written for another digest length).
+    //!
+    //! contains() and insert() are thread-safe.
+    //!
+    class ObjectIndex final {
+    public:
+        static constexpr auto INDEX_FILE = "objects.index";
+        static constexpr auto JOURNAL_FILE = "objects.journal";
+        static constexpr uint32_t MAGIC = 0x4b424f49; // "KBOI"
+        static constexpr uint32_t VERSION = 1;
+
+        //!
+        //! @param digestLength length of the digests of the repository (see BackupRepository::digestAlgorithm())
+        //!
+        ObjectIndex(const std::filesystem::path &metaDir,
+                    std::filesystem::path hardLinksDir,
+                    uint32_t digestLength = DigestLength::SHA256);
+
+        ~ObjectIndex();
+
+        ObjectIndex(const ObjectIndex &) = delete;
+
+        ObjectIndex &operator=(const ObjectIndex &) = delete;
+
+        //!
+        //! @return true if an object with `digest` was indexed
+        //!
+        [[nodiscard]] bool contains(const Digest::result &digest) const;
+
+        //!
+        //! Index an object (that was just committed to hardLinksDir())
+        //!
+        void insert(const Digest::result &digest);
+
+        //!
+        //! Write the journaled inserts into the index file
+        //!
+        void save();
+
+        //!
+        //! Re-create the index from a scan of hardLinksDir()
+        //!
+        //! The fanout directories are visited in order and only the digests of one directory are sorted at a time, so
+        //! memory does not grow with the number of objects (unless the layout is not one the order holds for, e.g. an
+        //! interrupted relayout, then all the digests are sorted at once).
+        //!
+        //! @return the number of objects indexed
+        //!
+        size_t rebuild();
+
+        //!
+        //! @return number of indexed objects
+        //!
+        [[nodiscard]] size_t size() const;
+
+        [[nodiscard]] uint32_t digestLength() const { return digestLength_; }
+
+    private:
+        struct header_t {
+            uint32_t magic_;
+            uint32_t version_;
+            uint32_t digestLength_;
+            uint32_t reserved_;
+            uint64_t count_;
+        };
+
+        const std::filesystem::path indexFile_;
+        const std::filesystem::path journalFile_;
+        const std::filesystem::path hardLinksDir_;
+        const uint32_t digestLength_;
+        mutable std::shared_mutex mutex_{};
+        MappedFile mapped_{};
+        const uint8_t *entries_{nullptr};
+        size_t count_{0};
+        std::unordered_set<Digest::result> added_{};
+        int journal_{-1};
+
+        //!
+        //! Map indexFile_, returns false if it is not a valid index
+        //!
+        bool map();
+
+        [[nodiscard]] bool indexed(const uint8_t *md) const;
+
+        [[nodiscard]] bool less(const Digest::result &lhs, const Digest::result &rhs) const;
+
+        //!
+        //! @return the digest named by the path of `file` relative to hardLinksDir_, false if it is not an object
+        //!
+        [[nodiscard]] bool parse(const std::filesystem::path &file, Digest::result &digest) const;
+
+        //!
+        //! Scan `dir` (below hardLinksDir_) in order, passing each digest to `add`
+        //!
+        //! @return false if a digest was out of order (`add` was not called with it)
+        //!
+        bool scan(const std::filesystem::path &dir, const std::function<bool(const Digest::result &)> &add) const;
+
+        //!
+        //! Write the digests `produce` passes to its argument (sorted) as the new index file, remap it and truncate the
+        //! journal
+        //!
+        //! @return false (and nothing changes) if `produce` returns false
+        //!
+        bool write(const std::function<bool(const std::function<void(const Digest::result &)> &)> &produce);
+    };
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <cstdint>
+
+namespace krico::backup {
+    //!
+    //! A new file that only gets its final name once it is completely written.
+    //!
+    //! On Linux the data goes into an anonymous open(O_TMPFILE) file of the directory, published with a single linkat()
+    //! (AT_EMPTY_PATH, or through /proc/self/fd when that needs privileges the process lacks).  The file has no name
+    //! until then, so an interrupted run leaves nothing behind to clean up.  Where O_TMPFILE is not supported (file
+    //! systems, platforms) a named temp file is written and renamed into place instead.
+    //!
+    class StagedFile final {
+    public:
+        //!
+        //! How a staged file becomes visible under its final name
+        //!
+        enum class method : uint8_t {
+            //! linkat(fd, "", ..., AT_EMPTY_PATH)
+            empty_path,
+            //! linkat(AT_FDCWD, "/proc/self/fd/<fd>", ..., AT_SYMLINK_FOLLOW)
+            proc_fd,
+            //! Named temp file and rename()
+            rename,
+        };
+
+        enum class outcome : uint8_t {
+            published,
+            //! Nothing was published, the name already exists
+            exists,
+            //! Nothing was published, the parent directory of the name does not exist
+            no_directory,
+        };
+
+        //!
+        //! @return the cheapest method that works in `dirFd`, found by publishing (and removing) a probe file
+        //!
+        [[nodiscard]] static method probe(int dirFd, const std::filesystem::path &dir);
+
+        //!
+        //! @param dirFd directory the file is staged in (and published names are relative to)
+        //! @param m usually the result of probe()
+        //! @param tmpFile the named temp file (in `dirFd`) used by method::rename, replaced if left over
+        //!
+        StagedFile(int dirFd, method m, const std::filesystem::path &tmpFile);
+
+        //!
+        //! Discards the file unless it was published
+        //!
+        ~StagedFile();
+
+        StagedFile(const StagedFile &) = delete;
+
+        StagedFile &operator=(const StagedFile &) = delete;
+
+        //!
+        //! @return descriptor to write the data to (opened write-only)
+        //!
+        [[nodiscard]] int fd() const { return fd_; }
+
+        //!
+        //! @return the temp file, or just the directory of an anonymous file (for messages)
+        //!
+        [[nodiscard]] const std::filesystem::path &path() const { return path_; }
+
+        [[nodiscard]] method get_method() const { return method_; }
+
+        void write(const void *data, size_t len) const;
+
+        //!
+        //! Give the file the name `name` (relative to `dirFd`), never replaces an existing file
+        //!
+        //! @param target full path of `name` (for messages)
+        //! @return published or why not, throws on other errors
+        //!
+        outcome publish(const char *name, const std::filesystem::path &target);
+
+    private:
+        const int dirFd_;
+        const method method_;
+        const std::filesystem::path path_;
+        // Name of the temp file (method::rename) relative to dirFd_
+        const std::string tmpName_;
+        int fd_{-1};
+        bool published_{false};
+    };
+
+    [[nodiscard]] const char *to_string(StagedFile::method method);
+}
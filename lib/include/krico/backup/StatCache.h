@@ -0,0 +1,119 @@
+#pragma once
+
+#include "Digest.h"
+#include "MappedFile.h"
+#include <filesystem>
+#include <mutex>
+#include <atomic>
+#include <vector>
+#include <chrono>
+#include <type_traits>
+
+namespace krico::backup {
+    //!
+    //! Persistent cache of file digests keyed by (dev, ino, size, mtime, ctime), one per BackupDirectory.
+    //!
+    //! The cache file (metaDir()/stat.cache) is a header followed by fixed size entries sorted by (dev, ino), it is
+    //! memory-mapped and looked up with a binary search.  Entries found or added during a run make up the next
+    //! generation of the cache which save() writes to a temp file and renames over the old one, so entries of files that
+    //! are gone are dropped and an interrupted run leaves the previous cache intact.
+    //!
+    //! find() and put() are thread-safe.
+    //!
+    class StatCache final {
+    public:
+        static constexpr auto CACHE_FILE = "stat.cache";
+        static constexpr uint32_t MAGIC = 0x4b425343; // "KBSC"
+        static constexpr uint32_t VERSION = 1;
+        //! Digests longer than this are not cached
+        static constexpr uint32_t MAX_DIGEST_LENGTH = 32;
+
+        struct key_t {
+            uint64_t dev_{0};
+            uint64_t ino_{0};
+            uint64_t size_{0};
+            int64_t mtime_ns_{0};
+            int64_t ctime_ns_{0};
+
+            bool operator==(const key_t &) const = default;
+        };
+
+        //!
+        //! Open (map) the cache of the BackupDirectory with `metaDir`, a missing or invalid cache file is an empty cache
+        //!
+        explicit StatCache(const std::filesystem::path &metaDir);
+
+        StatCache(const StatCache &) = delete;
+
+        StatCache &operator=(const StatCache &) = delete;
+
+        //!
+        //! lstat `file` into `key` (throws in case of errors)
+        //!
+        static void stat(const std::filesystem::path &file, key_t &key);
+
+        //!
+        //! Look up the digest of `key`, counts a hit or a miss
+        //!
+        //! @return true and sets `digest` if the cache has an entry matching all fields of `key`
+        //!
+        bool find(const key_t &key, Digest::result &digest);
+
+        //!
+        //! Record the `digest` of a file with `key` (the key must have been taken *before* the file was read).
+        //!
+        //! Files changed since the cache was opened are ignored, their timestamps could still change without notice.
+        //!
+        void put(const key_t &key, const Digest::result &digest);
+
+        //!
+        //! Count a miss for a file that is hashed without being looked up (e.g. BackupRunner::options_t::rehash)
+        //!
+        void miss() { ++misses_; }
+
+        //!
+        //! Atomically replace the cache file with the entries found or put since the cache was opened
+        //!
+        void save();
+
+        [[nodiscard]] const std::filesystem::path &file() const { return file_; }
+
+        //!
+        //! @return number of entries in the mapped cache file
+        //!
+        [[nodiscard]] size_t size() const { return count_; }
+
+        [[nodiscard]] uint32_t hits() const { return hits_; }
+
+        [[nodiscard]] uint32_t misses() const { return misses_; }
+
+    private:
+        struct header_t {
+            uint32_t magic_;
+            uint32_t version_;
+            uint64_t count_;
+        };
+
+        struct entry_t {
+            key_t key_;
+            uint32_t len_;
+            uint8_t md_[MAX_DIGEST_LENGTH];
+            // Always 0, makes the padding explicit so the file never carries uninitialized bytes
+            uint32_t reserved_;
+        };
+
+        // Written to disk as is
+        static_assert(std::has_unique_object_representations_v<key_t>);
+        static_assert(std::has_unique_object_representations_v<entry_t>);
+
+        const std::filesystem::path file_;
+        const int64_t openTime_ns_;
+        MappedFile mapped_{};
+        const entry_t *entries_{nullptr};
+        size_t count_{0};
+        std::mutex mutex_{};
+        std::vector<entry_t> next_{};
+        std::atomic<uint32_t> hits_{0};
+        std::atomic<uint32_t> misses_{0};
+    };
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <functional>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+namespace krico::backup {
+    //!
+    //! A fixed size pool of worker threads with one task deque per worker.
+    //!
+    //! Tasks submitted from a worker thread are pushed to that worker's own deque and popped LIFO (depth first),
+    //! idle workers steal FIFO from the other deques (breadth first).  This keeps recursive work (e.g. directory
+    //! traversal) local to a worker while still spreading large sub-trees across all workers.
+    //!
+    class ThreadPool final {
+    public:
+        using task = std::function<void()>;
+
+        //!
+        //! Start a pool with `threads` workers (at least one)
+        //!
+        explicit ThreadPool(unsigned threads);
+
+        ThreadPool(const ThreadPool &) = delete;
+
+        ThreadPool &operator=(const ThreadPool &) = delete;
+
+        ~ThreadPool();
+
+        [[nodiscard]] unsigned size() const { return static_cast<unsigned>(queues_.size()); }
+
+        //!
+        //! Schedule `t` to be executed by one of the workers (safe to call from within a task)
+        //!
+        void submit(task t);
+
+        //!
+        //! Wait until all submitted tasks (including tasks submitted by tasks) have completed.
+        //!
+        //! If a task threw, remaining tasks are discarded and the first exception is re-thrown here.
+        //!
+        void wait();
+
+        //!
+        //! @return the index [0, size()) of the calling worker thread (only valid from within a task)
+        //!
+        [[nodiscard]] static unsigned worker();
+
+    private:
+        struct worker_queue {
+            std::mutex mutex_{};
+            std::deque<task> tasks_{};
+        };
+
+        std::vector<std::unique_ptr<worker_queue> > queues_{};
+        std::vector<std::thread> threads_{};
+        std::mutex mutex_{};
+        std::condition_variable workAvailable_{};
+        std::condition_variable allDone_{};
+        std::atomic<size_t> queued_{0};
+        std::atomic<size_t> pending_{0};
+        std::atomic<unsigned> nextQueue_{0};
+        std::atomic<bool> failed_{false};
+        bool stop_{false};
+        std::exception_ptr error_{};
+
+        void run(unsigned index);
+
+        bool pop(unsigned index, task &t);
+
+        void execute(task &t);
+    };
+}
@@ -155,6 +155,37 @@
 })
 
 namespace krico::backup {
+    //!
+    //! How copy_file() transferred the data
+    //!
+    enum class copy_method : uint8_t {
+        //! Reflink (ioctl FICLONE), the copy shares the extents of the source until either is modified
+        clone,
+        //! copy_file_range(2), in-kernel copy (may be offloaded to the filesystem/storage)
+        copy_file_range,
+        //! sendfile(2), in-kernel copy through the page cache
+        sendfile,
+        //! read(2)/write(2) through a user-space buffer
+        read_write,
+    };
+
+    static constexpr size_t COPY_METHOD_COUNT = static_cast<size_t>(copy_method::read_write) + 1;
+
+    const char *to_string(copy_method method);
+
+    //!
+    //! Copy the data and permissions of `from` into `to` (created or truncated) using the cheapest method available:
+    //! FICLONE, then copy_file_range, then sendfile and finally read/write (on non-Linux systems only the latter).
+    //!
+    //! @return the method that was used, throws in case of errors
+    //!
+    copy_method copy_file_data(const std::filesystem::path &from, const std::filesystem::path &to);
+
+    //!
+    //! Same as above, but copies into the already open (empty) file `toFd`, `to` is only used in messages
+    //!
+    copy_method copy_file_data(const std::filesystem::path &from, int toFd, const std::filesystem::path &to);
+
     //!
     //! @return true if path is a lexical sub-path of base (e.g. /a/b is sub_path of /a and /a/b is NOT of /b)
     //!
@@ -3,12 +3,436 @@
 #include "BackupSummary.h"
 #include "records.h"
 #include "LogEntryType.h"
+#include <array>
 #include <vector>
+#include <map>
+#include <ranges>
+#include <string_view>
 
 namespace krico::backup {
+    class RunBackupRecordView; // fwd-decl
+
+    //!
+    //! Cumulative counters of the RunBackupRecord of a directory
+    //!
+    struct directory_counters {
+        uint32_t runs_{0};
+        uint64_t directories_{0};
+        uint64_t copiedFiles_{0};
+        uint64_t hardLinkedFiles_{0};
+        uint64_t symlinks_{0};
+        //! endTime() of the latest run
+        std::chrono::system_clock::time_point lastRun_{};
+        //! backup_metrics byte counters (runs counted by a version 0 CheckpointRecord have none)
+        uint64_t bytesCopied_{0};
+        uint64_t bytesDeduplicated_{0};
+        uint64_t bytesHashed_{0};
+
+        directory_counters &operator+=(const RunBackupRecordView &run);
+
+        directory_counters &operator+=(const directory_counters &rhs);
+
+        //!
+        //! Remove the counters of `rhs` (the same directory at an earlier point of the log), lastRun_ is kept
+        //!
+        directory_counters &operator-=(const directory_counters &rhs);
+
+        friend bool operator==(const directory_counters &, const directory_counters &) = default;
+    };
+
+    //!
+    //! directory_counters by BackupDirectoryId::str()
+    //!
+    using log_counters = std::map<std::string, directory_counters, std::less<> >;
+
+    //!
+    //! The byte counters of every directory of a log_counters (in its order): bytesCopied_, bytesDeduplicated_ and
+    //! bytesHashed_
+    //!
+    using log_byte_counters = std::vector<std::array<uint64_t, 3> >;
+
+    //!
+    //! @return the byte counters of `counters`
+    //!
+    log_byte_counters byte_counters(const log_counters &counters);
+
+    //!
+    //! Set the byte counters of `counters` to `bytes` (ignored unless there is one entry per directory)
+    //!
+    void set_byte_counters(log_counters &counters, const log_byte_counters &bytes);
+}
+
+namespace krico::backup::records {
+    //!
+    //! A dynamic_int count followed by the directory id and counters of each directory
+    //!
+    template<>
+    struct codec<log_counters> {
+        using entry_schema = schema<std::string_view, uint32_t, uint64_t, uint64_t, uint64_t, uint64_t,
+            std::chrono::system_clock::time_point>;
+
+        [[nodiscard]] static log_counters get(const uint8_t *buf) {
+            log_counters ret{};
+            const uint32_t count = codec<dynamic_int>::get(buf);
+            const uint8_t *entry = buf + codec<dynamic_int>::length(buf);
+            for (uint32_t i = 0; i < count; ++i) {
+                const view<entry_schema> v{entry};
+                ret.emplace(v.get<0>(), directory_counters{
+                                .runs_ = v.get<1>(),
+                                .directories_ = v.get<2>(),
+                                .copiedFiles_ = v.get<3>(),
+                                .hardLinkedFiles_ = v.get<4>(),
+                                .symlinks_ = v.get<5>(),
+                                .lastRun_ = v.get<6>()
+                            });
+                entry += v.length();
+            }
+            return ret;
+        }
+
+        static void set(uint8_t *buf, const log_counters &v) {
+            codec<dynamic_int>::set(buf, static_cast<uint32_t>(v.size()));
+            uint8_t *entry = buf + codec<dynamic_int>::length(buf);
+            for (const auto &[id, counters]: v) {
+                codec<std::string_view>::set(entry, id);
+                entry += codec<std::string_view>::length(entry);
+                codec<uint32_t>::set(entry, counters.runs_);
+                entry += codec<uint32_t>::width;
+                for (const auto n: {
+                         counters.directories_, counters.copiedFiles_, counters.hardLinkedFiles_, counters.symlinks_
+                     }) {
+                    codec<uint64_t>::set(entry, n);
+                    entry += codec<uint64_t>::width;
+                }
+                codec<std::chrono::system_clock::time_point>::set(entry, counters.lastRun_);
+                entry += codec<std::chrono::system_clock::time_point>::width;
+            }
+        }
+
+        [[nodiscard]] static size_t length(const uint8_t *buf) {
+            const uint32_t count = codec<dynamic_int>::get(buf);
+            size_t len = codec<dynamic_int>::length(buf);
+            for (uint32_t i = 0; i < count; ++i) {
+                len += entry_schema::length(buf + len);
+            }
+            return len;
+        }
+
+        //!
+        //! @return length() if the counters fit into the `len` bytes at `buf` (never reads beyond them), or more than
+        //! `len` if they do not
+        //!
+        [[nodiscard]] static size_t length(const uint8_t *buf, const size_t len) {
+            if (len == 0 || codec<dynamic_int>::length(buf) > len) return len + 1;
+            const uint32_t count = codec<dynamic_int>::get(buf);
+            size_t offset = codec<dynamic_int>::length(buf);
+            for (uint32_t i = 0; i < count; ++i) {
+                if (!entry_schema::fits(buf + offset, len - offset)) return len + 1;
+                offset += entry_schema::length(buf + offset);
+            }
+            return offset;
+        }
+
+        //!
+        //! @return upper bound of length() once `v` is set
+        //!
+        [[nodiscard]] static size_t max_length(const log_counters &v) {
+            size_t len = 4;
+            for (const auto &id: v | std::views::keys) {
+                len += 4 + id.size() + codec<uint32_t>::width + 4 * codec<uint64_t>::width
+                        + codec<std::chrono::system_clock::time_point>::width;
+            }
+            return len;
+        }
+    };
+}
+
+namespace krico::backup::records {
+    //!
+    //! A dynamic_int count followed by the counters of each directory, each one a uint64_t
+    //!
+    template<>
+    struct codec<log_byte_counters> {
+        static constexpr size_t entry_width = std::tuple_size_v<log_byte_counters::value_type> * codec<uint64_t>::width;
+
+        [[nodiscard]] static log_byte_counters get(const uint8_t *buf) {
+            log_byte_counters ret(codec<dynamic_int>::get(buf));
+            const uint8_t *entry = buf + codec<dynamic_int>::length(buf);
+            for (auto &counters: ret) {
+                for (auto &n: counters) {
+                    n = codec<uint64_t>::get(entry);
+                    entry += codec<uint64_t>::width;
+                }
+            }
+            return ret;
+        }
+
+        static void set(uint8_t *buf, const log_byte_counters &v) {
+            codec<dynamic_int>::set(buf, static_cast<uint32_t>(v.size()));
+            uint8_t *entry = buf + codec<dynamic_int>::length(buf);
+            for (const auto &counters: v) {
+                for (const auto n: counters) {
+                    codec<uint64_t>::set(entry, n);
+                    entry += codec<uint64_t>::width;
+                }
+            }
+        }
+
+        [[nodiscard]] static size_t length(const uint8_t *buf) {
+            return codec<dynamic_int>::length(buf) + codec<dynamic_int>::get(buf) * entry_width;
+        }
+
+        //!
+        //! @return length() if the counters fit into the `len` bytes at `buf` (never reads beyond them), or more than
+        //! `len` if they do not
+        //!
+        [[nodiscard]] static size_t length(const uint8_t *buf, const size_t len) {
+            if (len == 0 || codec<dynamic_int>::length(buf) > len) return len + 1;
+            return length(buf);
+        }
+
+        //!
+        //! @return upper bound of length() once `v` is set
+        //!
+        [[nodiscard]] static size_t max_length(const log_byte_counters &v) {
+            return 4 + v.size() * entry_width;
+        }
+    };
+}
+
+namespace krico::backup::records {
+    //!
+    //! The wall and CPU time of every backup_phase followed by the byte counters and the time of the largest file,
+    //! each one a uint64_t (times in nanoseconds)
+    //!
+    template<>
+    struct codec<backup_metrics> {
+        static constexpr size_t width = (2 * BACKUP_PHASE_COUNT + 5) * codec<uint64_t>::width;
+
+        [[nodiscard]] static backup_metrics get(const uint8_t *buf) {
+            using std::chrono::nanoseconds;
+            backup_metrics ret{};
+            for (auto &[wall, cpu]: ret.phases_) {
+                wall = nanoseconds{codec<uint64_t>::get(buf)};
+                cpu = nanoseconds{codec<uint64_t>::get(buf + codec<uint64_t>::width)};
+                buf += 2 * codec<uint64_t>::width;
+            }
+            for (auto *n: {&ret.bytesHashed_, &ret.bytesCopied_, &ret.bytesDeduplicated_, &ret.largestFileSize_}) {
+                *n = codec<uint64_t>::get(buf);
+                buf += codec<uint64_t>::width;
+            }
+            ret.largestFileTime_ = nanoseconds{codec<uint64_t>::get(buf)};
+            return ret;
+        }
+
+        static void set(uint8_t *buf, const backup_metrics &v) {
+            for (const auto &[wall, cpu]: v.phases_) {
+                codec<uint64_t>::set(buf, wall.count());
+                codec<uint64_t>::set(buf + codec<uint64_t>::width, cpu.count());
+                buf += 2 * codec<uint64_t>::width;
+            }
+            for (const auto n: {v.bytesHashed_, v.bytesCopied_, v.bytesDeduplicated_, v.largestFileSize_}) {
+                codec<uint64_t>::set(buf, n);
+                buf += codec<uint64_t>::width;
+            }
+            codec<uint64_t>::set(buf, v.largestFileTime_.count());
+        }
+
+        [[nodiscard]] static size_t length(const uint8_t *) {
+            return width;
+        }
+    };
+}
+
+namespace krico::backup {
+    //!
+    //! Read-only view of a log record of `Schema`, reading the fields where the record is stored.  Only valid as long
+    //! as that storage is.
+    //!
+    //! `Schema` is the only description of the layout: the LogHeader classes encode their records through it (plus the
+    //! version_schema of the latest version) and read them back through the view.
+    //!
+    template<typename Schema>
+    class basic_record_view {
+    public:
+        using schema = Schema;
+
+        basic_record_view() = default;
+
+        explicit basic_record_view(const std::string_view record)
+            : record_(record), fields_(reinterpret_cast<const uint8_t *>(record.data())) {
+        }
+
+        [[nodiscard]] LogEntryType type() const { return fields_.template get<0>(); }
+        [[nodiscard]] Digest::result prev() const { return fields_.template get<1>(); }
+        [[nodiscard]] std::chrono::system_clock::time_point ts() const { return fields_.template get<2>(); }
+        [[nodiscard]] std::string_view author() const { return fields_.template get<3>(); }
+
+        //!
+        //! @return the bytes of the record
+        //!
+        [[nodiscard]] std::string_view record() const { return record_; }
+
+        //!
+        //! @return true if all the fields of `Schema` fit into the record
+        //!
+        [[nodiscard]] bool valid() const {
+            return Schema::fits(reinterpret_cast<const uint8_t *>(record_.data()), record_.size());
+        }
+
+    protected:
+        std::string_view record_{};
+        records::view<Schema> fields_{};
+    };
+
+    using log_header_schema = records::schema<LogEntryType,
+        records::digest_result<DigestLength::SHA1>,
+        std::chrono::system_clock::time_point,
+        std::string_view>;
+
+    //!
+    //! View of any log record (just the LogHeader fields)
+    //!
+    using LogHeaderView = basic_record_view<log_header_schema>;
+
+    class InitRecordView : public basic_record_view<log_header_schema> {
+    public:
+        static constexpr auto log_entry_type = LogEntryType::Initialized;
+
+        using basic_record_view::basic_record_view;
+    };
+
+    class AddDirectoryRecordView : public basic_record_view<log_header_schema::extend<
+                std::string_view,
+                std::filesystem::path> > {
+    public:
+        static constexpr auto log_entry_type = LogEntryType::AddDirectory;
+
+        using basic_record_view::basic_record_view;
+
+        [[nodiscard]] std::string_view directoryId() const { return fields_.get<4>(); }
+        [[nodiscard]] std::string_view sourceDir() const { return fields_.get<5, std::string_view>(); }
+    };
+
+    class RunBackupRecordView : public basic_record_view<log_header_schema::extend<
+                BackupDirectoryId,
+                std::chrono::year_month_day,
+                std::filesystem::path,
+                std::chrono::system_clock::time_point,
+                std::chrono::system_clock::time_point,
+                uint32_t,
+                uint32_t,
+                uint32_t,
+                uint32_t,
+                std::filesystem::path,
+                std::filesystem::path,
+                records::digest_result<DigestLength::SHA1> > > {
+    public:
+        static constexpr auto log_entry_type = LogEntryType::RunBackup;
+        //! What version 1 appends (the version and the backup_metrics)
+        using version_schema = records::schema<uint8_t, backup_metrics>;
+
+        using basic_record_view::basic_record_view;
+
+        [[nodiscard]] std::string_view directoryId() const { return fields_.get<4, std::string_view>(); }
+        [[nodiscard]] std::chrono::year_month_day date() const { return fields_.get<5>(); }
+        [[nodiscard]] std::string_view backupId() const { return fields_.get<6, std::string_view>(); }
+        [[nodiscard]] std::chrono::system_clock::time_point startTime() const { return fields_.get<7>(); }
+        [[nodiscard]] std::chrono::system_clock::time_point endTime() const { return fields_.get<8>(); }
+        [[nodiscard]] uint32_t numDirectories() const { return fields_.get<9>(); }
+        [[nodiscard]] uint32_t numCopiedFiles() const { return fields_.get<10>(); }
+        [[nodiscard]] uint32_t numHardLinkedFiles() const { return fields_.get<11>(); }
+        [[nodiscard]] uint32_t numSymlinks() const { return fields_.get<12>(); }
+        [[nodiscard]] std::string_view previousTarget() const { return fields_.get<13, std::string_view>(); }
+        [[nodiscard]] std::string_view currentTarget() const { return fields_.get<14, std::string_view>(); }
+        [[nodiscard]] Digest::result checksum() const { return fields_.get<15>(); }
+
+        //!
+        //! @return version of the record (0 if it ends with the checksum), see RunBackupRecord
+        //!
+        [[nodiscard]] uint8_t version() const {
+            const auto end = schema::length(fields_.data());
+            return record_.size() > end ? records::codec<uint8_t>::get(fields_.data() + end) : 0;
+        }
+
+        //!
+        //! @return metrics of the run (all zero for a version 0 record or if they do not fit into the record)
+        //!
+        [[nodiscard]] backup_metrics metrics() const {
+            const auto end = schema::length(fields_.data());
+            if (version() < 1 || !version_schema::fits(fields_.data() + end, record_.size() - end)) return {};
+            return records::view<version_schema>{fields_.data() + end}.get<1>();
+        }
+
+        //!
+        //! @return a BackupSummary of this record (allocates, prefer the getters when they are enough)
+        //!
+        [[nodiscard]] BackupSummary summary() const;
+    };
+
+    class CheckpointRecordView : public basic_record_view<log_header_schema::extend<
+                records::digest_result<DigestLength::SHA1>,
+                uint32_t,
+                log_counters> > {
+    public:
+        static constexpr auto log_entry_type = LogEntryType::Checkpoint;
+        //! What version 1 appends (the version and the log_byte_counters)
+        using version_schema = records::schema<uint8_t, log_byte_counters>;
+
+        using basic_record_view::basic_record_view;
+
+        [[nodiscard]] Digest::result previousCheckpoint() const { return fields_.get<4>(); }
+        [[nodiscard]] uint32_t numRecords() const { return fields_.get<5>(); }
+
+        //!
+        //! @return version of the record (0 if it ends with the counters), see CheckpointRecord
+        //!
+        [[nodiscard]] uint8_t version() const {
+            const auto end = schema::length(fields_.data());
+            return record_.size() > end ? records::codec<uint8_t>::get(fields_.data() + end) : 0;
+        }
+
+        //!
+        //! @return the counters (without byte counters for a version 0 record or if they do not fit into the record)
+        //!
+        [[nodiscard]] log_counters counters() const {
+            auto ret = fields_.get<6>();
+            const auto end = schema::length(fields_.data());
+            if (version() >= 1 && version_schema::fits(fields_.data() + end, record_.size() - end)) {
+                set_byte_counters(ret, records::view<version_schema>{fields_.data() + end}.get<1>());
+            }
+            return ret;
+        }
+    };
+
+    //!
+    //! @throws krico::backup::exception for a record of `type` whose fields do not fit into its `length` bytes
+    //!
+    [[noreturn]] void throw_corrupt_record(LogEntryType type, size_t length);
+
+    //!
+    //! @return `header` as a view of a T record
+    //! @throws krico::backup::exception if the fields of T do not fit into the record
+    //!
+    template<typename T>
+    T log_record_cast(const LogHeaderView &header) {
+        assert(header.type() == T::log_entry_type); // Dev mistake...
+        T ret{header.record()};
+        if (!ret.valid()) throw_corrupt_record(header.type(), header.record().size());
+        return ret;
+    }
+}
+
+namespace krico::backup {
+    //!
+    //! A log record that owns its bytes: built (encoded through the schema of its view) to be put in the log, or read
+    //! back from it.  The fields are read through the view of the record, so its layout is only described by that
+    //! schema.
+    //!
     class LogHeader {
     public:
-        static constexpr size_t DEFAULT_BUFFER_SIZE = 8192;
+        //! Loose records (one file per record, before the log pack) were never longer than this
+        static constexpr size_t MAX_LOOSE_LENGTH = 8192;
 
         LogHeader();
 
@@ -16,24 +440,42 @@ namespace krico::backup {
                   const Digest::result &prev,
                   const std::string_view &author);
 
-        [[nodiscard]] LogEntryType type() const { return type_.get(); }
-        [[nodiscard]] Digest::result prev() const { return prev_.get(); }
-        [[nodiscard]] std::chrono::system_clock::time_point ts() const { return ts_.get(); }
-        [[nodiscard]] std::string_view author() const { return author_.get(); }
+        [[nodiscard]] LogEntryType type() const { return view().type(); }
+        [[nodiscard]] Digest::result prev() const { return view().prev(); }
+        [[nodiscard]] std::chrono::system_clock::time_point ts() const { return view().ts(); }
+        [[nodiscard]] std::string_view author() const { return view().author(); }
+
+        [[nodiscard]] LogHeaderView view() const { return LogHeaderView{record()}; }
 
-        void parse_offsets() const;
+        //!
+        //! @return the bytes of the record
+        //!
+        [[nodiscard]] std::string_view record() const { return {buffer_.const_cptr(), length_}; }
 
-        [[nodiscard]] size_t end_offset() const { return fields_.back()->end_offset(); }
+        [[nodiscard]] size_t end_offset() const { return length_; }
 
         [[nodiscard]] const records::buffer &buffer() const { return buffer_; }
 
+        //!
+        //! Replace this record with a copy of `record` (e.g. read from the log)
+        //!
+        void assign(std::string_view record);
+
     protected:
         records::buffer buffer_{};
-        std::vector<records::field_offset *> fields_{};
-        records::field<LogEntryType> type_;
-        records::field<records::digest_result<DigestLength::SHA1> > prev_;
-        records::field<std::chrono::system_clock::time_point> ts_;
-        records::field<std::string_view> author_;
+        size_t length_{0};
+
+        //!
+        //! Encode `values` (one per field of `Schema`, in its order) as this record
+        //!
+        template<typename Schema, typename... Values>
+        void write(const Values &... values) {
+            reserve(Schema::max_length(values...));
+            length_ = Schema::write(buffer_.ptr(), values...);
+        }
+
+    private:
+        void reserve(size_t length);
     };
 
     class InitRecord : public LogHeader {
@@ -43,6 +485,8 @@ namespace krico::backup {
         InitRecord();
 
         InitRecord(const Digest::result &prev, const std::string_view &author);
+
+        [[nodiscard]] InitRecordView view() const { return InitRecordView{record()}; }
     };
 
     class AddDirectoryRecord : public LogHeader {
@@ -56,19 +500,21 @@ namespace krico::backup {
                            const std::string_view &directoryId,
                            const std::filesystem::path &sourceDir);
 
-        [[nodiscard]] std::string_view directoryId() const { return directoryId_.get(); }
-        [[nodiscard]] std::filesystem::path sourceDir() const { return sourceDir_.get(); }
-
-    private:
-        records::field<std::string_view> directoryId_;
-        records::field<std::filesystem::path> sourceDir_;
+        [[nodiscard]] AddDirectoryRecordView view() const { return AddDirectoryRecordView{record()}; }
 
-        void add_fields();
+        [[nodiscard]] std::string_view directoryId() const { return view().directoryId(); }
+        [[nodiscard]] std::filesystem::path sourceDir() const { return view().sourceDir(); }
     };
 
+    //!
+    //! Version 0 records end with the checksum, later versions append a version byte and their fields after it (a
+    //! reader of version N ignores what comes after the fields of N)
+    //!
     class RunBackupRecord : public LogHeader {
     public:
         static constexpr auto log_entry_type = LogEntryType::RunBackup;
+        //! Version 1 adds the backup_metrics
+        static constexpr uint8_t VERSION = 1;
 
         RunBackupRecord();
 
@@ -76,23 +522,63 @@ namespace krico::backup {
                         const std::string_view &author,
                         const BackupSummary &summary);
 
-        [[nodiscard]] BackupSummary summary() const;
+        [[nodiscard]] RunBackupRecordView view() const { return RunBackupRecordView{record()}; }
 
-    private:
-        records::field<BackupDirectoryId> directoryId_;
-        records::field<std::chrono::year_month_day> date_;
-        records::field<std::filesystem::path> backupId_;
-        records::field<std::chrono::system_clock::time_point> startTime_;
-        records::field<std::chrono::system_clock::time_point> endTime_;
-        records::field<uint32_t> numDirectories_;
-        records::field<uint32_t> numCopiedFiles_;
-        records::field<uint32_t> numHardLinkedFiles_;
-        records::field<uint32_t> numSymlinks_;
-        records::field<std::filesystem::path> previousTarget_;
-        records::field<std::filesystem::path> currentTarget_;
-        records::field<records::digest_result<DigestLength::SHA1> > checksum_;
-
-        void add_fields();
+        [[nodiscard]] BackupSummary summary() const { return view().summary(); }
+
+        //!
+        //! @return version of the record (0 if it ends with the checksum)
+        //!
+        [[nodiscard]] uint8_t version() const { return view().version(); }
+
+        //!
+        //! @return metrics of the run (all zero for a version 0 record)
+        //!
+        [[nodiscard]] backup_metrics metrics() const { return view().metrics(); }
+    };
+
+    //!
+    //! Written every BackupRepositoryLog::CHECKPOINT_INTERVAL records with the counters of all the RunBackupRecord
+    //! up to it, so aggregates of the log only need the records after the latest checkpoint
+    //!
+    //! Version 0 records end with the counters, later versions append a version byte and their fields after it (same
+    //! as RunBackupRecord)
+    //!
+    class CheckpointRecord : public LogHeader {
+    public:
+        static constexpr auto log_entry_type = LogEntryType::Checkpoint;
+        //! Version 1 adds the byte counters (log_byte_counters)
+        static constexpr uint8_t VERSION = 1;
+
+        CheckpointRecord();
+
+        CheckpointRecord(const Digest::result &prev,
+                         const std::string_view &author,
+                         const Digest::result &previousCheckpoint,
+                         uint32_t numRecords,
+                         const log_counters &counters);
+
+        [[nodiscard]] CheckpointRecordView view() const { return CheckpointRecordView{record()}; }
+
+        //!
+        //! @return the checkpoint before this one (Digest::SHA1_ZERO for the first)
+        //!
+        [[nodiscard]] Digest::result previousCheckpoint() const { return view().previousCheckpoint(); }
+
+        //!
+        //! @return number of records (not counting checkpoints) up to this checkpoint
+        //!
+        [[nodiscard]] uint32_t numRecords() const { return view().numRecords(); }
+
+        //!
+        //! @return version of the record (0 if it ends with the counters)
+        //!
+        [[nodiscard]] uint8_t version() const { return view().version(); }
+
+        //!
+        //! @return the counters (without byte counters for a version 0 record)
+        //!
+        [[nodiscard]] log_counters counters() const { return view().counters(); }
     };
 
     template<typename T>
@@ -1,7 +1,13 @@
 #pragma once
 
+#include <chrono>
 #include <string>
 
 namespace krico::backup {
     std::string get_username();
+
+    //!
+    //! @return CPU time consumed by the calling thread (0 if the clock is not available)
+    //!
+    std::chrono::nanoseconds thread_cpu_time();
 }
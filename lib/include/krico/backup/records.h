@@ -4,6 +4,8 @@
 #include "Digest.h"
 #include "BackupDirectoryId.h"
 #include <cstdint>
+#include <concepts>
+#include <tuple>
 #include <string_view>
 #include <cassert>
 #include <filesystem>
@@ -38,6 +40,8 @@ namespace krico::backup::records {
             return reinterpret_cast<const char *>(const_ptr(offset));
         }
 
+        [[nodiscard]] size_t capacity() const { return len_; }
+
         void resize(size_t capacity);
 
     private:
@@ -48,21 +52,16 @@ namespace krico::backup::records {
     template<typename T>
     struct codec;
 
-    struct field_offset {
-        virtual ~field_offset() = default;
-
-        virtual void offset(size_t offset) = 0;
-
-        [[nodiscard]] virtual size_t end_offset() const = 0;
-    };
-
+    //!
+    //! A single field of `T` at an offset of a buffer
+    //!
     template<typename T>
-    class field final : public field_offset {
+    class field {
     public:
         explicit field(buffer &buffer): buffer_(buffer) {
         }
 
-        void offset(const size_t offset) override {
+        void offset(const size_t offset) {
             offset_ = offset;
         }
 
@@ -74,7 +73,7 @@ namespace krico::backup::records {
             codec<T>::set(buffer_.ptr(offset_), v);
         }
 
-        [[nodiscard]] size_t end_offset() const override {
+        [[nodiscard]] size_t end_offset() const {
             return offset_ + codec<T>::length(buffer_.ptr(offset_));
         }
 
@@ -85,6 +84,8 @@ namespace krico::backup::records {
 
     template<>
     struct codec<uint8_t> {
+        static constexpr size_t width = 1;
+
         [[nodiscard]] static uint8_t get(const uint8_t *buf) {
             return *buf;
         }
@@ -100,6 +101,8 @@ namespace krico::backup::records {
 
     template<>
     struct codec<uint16_t> {
+        static constexpr size_t width = 2;
+
         [[nodiscard]] static uint16_t get(const uint8_t *buf) {
             return get_le<uint16_t>(buf);
         }
@@ -115,6 +118,8 @@ namespace krico::backup::records {
 
     template<>
     struct codec<uint32_t> {
+        static constexpr size_t width = 4;
+
         [[nodiscard]] static uint32_t get(const uint8_t *buf) {
             return get_le<uint32_t>(buf);
         }
@@ -130,6 +135,8 @@ namespace krico::backup::records {
 
     template<>
     struct codec<uint64_t> {
+        static constexpr size_t width = 8;
+
         [[nodiscard]] static uint64_t get(const uint8_t *buf) {
             return get_le<uint64_t>(buf);
         }
@@ -157,6 +164,7 @@ namespace krico::backup::records {
     template<unsigned int DigestLength>
     struct codec<digest_result<DigestLength> > {
         static constexpr unsigned int digest_length = digest_result<DigestLength>::digest_length;
+        static constexpr size_t width = digest_length;
 
         [[nodiscard]] static digest_result<DigestLength> get(const uint8_t *buf) {
             Digest::result ret{.len_ = digest_length};
@@ -260,6 +268,13 @@ namespace krico::backup::records {
             const auto lenLen = codec<dynamic_int>::length(buf);
             return lenLen + len;
         }
+
+        //!
+        //! @return upper bound of length() once `v` is set
+        //!
+        [[nodiscard]] static size_t max_length(const std::string_view &v) {
+            return 4 + v.length();
+        }
     };
 
     template<>
@@ -275,6 +290,10 @@ namespace krico::backup::records {
         [[nodiscard]] static size_t length(const uint8_t *buf) {
             return codec<std::string_view>::length(buf);
         }
+
+        [[nodiscard]] static size_t max_length(const std::filesystem::path &v) {
+            return codec<std::string_view>::max_length(v.string());
+        }
     };
 
     template<>
@@ -290,12 +309,18 @@ namespace krico::backup::records {
         [[nodiscard]] static size_t length(const uint8_t *buf) {
             return codec<std::string_view>::length(buf);
         }
+
+        [[nodiscard]] static size_t max_length(const BackupDirectoryId &v) {
+            return codec<std::string_view>::max_length(v.str());
+        }
     };
 
     template<typename T> requires std::is_enum_v<T>
     struct codec<T> {
         static_assert(std::is_same_v<std::underlying_type_t<T>, uint8_t>, "only uint8_t enums supported");
 
+        static constexpr size_t width = 1;
+
         [[nodiscard]] static T get(const uint8_t *buf) {
             return static_cast<T>(*buf);
         }
@@ -311,6 +336,8 @@ namespace krico::backup::records {
 
     template<>
     struct codec<std::chrono::year_month_day> {
+        static constexpr size_t width = codec<uint32_t>::width;
+
         [[nodiscard]] static std::chrono::year_month_day get(const uint8_t *buf) {
             using namespace std::chrono;
 
@@ -342,6 +369,8 @@ namespace krico::backup::records {
 
     template<>
     struct codec<std::chrono::system_clock::time_point> {
+        static constexpr size_t width = codec<uint64_t>::width;
+
         [[nodiscard]] static std::chrono::system_clock::time_point get(const uint8_t *buf) {
             using namespace std::chrono;
 
@@ -360,4 +389,166 @@ namespace krico::backup::records {
             return codec<uint64_t>::length(buf);
         }
     };
+
+    //!
+    //! Types whose codec has a fixed `width` (the others are prefixed with their length as a dynamic_int)
+    //!
+    template<typename T>
+    concept fixed_width = requires { { codec<T>::width } -> std::convertible_to<size_t>; };
+
+    //!
+    //! Compile-time description of a record: the types of its fields in the order they are stored.
+    //!
+    //! The offsets of the leading fixed width fields are constants, the ones after the first variable width field are
+    //! found by walking the fields in between (only as far as the field that is read).
+    //!
+    template<typename... Fields>
+    struct schema {
+        static constexpr size_t size = sizeof...(Fields);
+
+        template<size_t I>
+        using type = std::tuple_element_t<I, std::tuple<Fields...> >;
+
+        //!
+        //! This schema followed by `More` fields (e.g. a record type extending LogHeader)
+        //!
+        template<typename... More>
+        using extend = schema<Fields..., More...>;
+
+        //!
+        //! `Base` followed by the fields of this schema (e.g. what a later version of a record appends)
+        //!
+        template<typename Base>
+        using after = typename Base::template extend<Fields...>;
+
+        //!
+        //! Number of leading fixed width fields
+        //!
+        static constexpr size_t fixed_prefix = [] {
+            constexpr bool fixed[] = {fixed_width<Fields>..., false};
+            size_t n = 0;
+            while (fixed[n]) ++n;
+            return n;
+        }();
+
+        //!
+        //! Offset of field `I` in the record at `buf`, a constant for the fixed prefix
+        //!
+        template<size_t I> requires (I <= size)
+        [[nodiscard]] static size_t offset(const uint8_t *buf) {
+            if constexpr (I <= fixed_prefix) {
+                return fixed_offset<I>();
+            } else {
+                const size_t previous = offset<I - 1>(buf);
+                return previous + codec<type<I - 1> >::length(buf + previous);
+            }
+        }
+
+        //!
+        //! @return length of the record at `buf` (the end of its last field)
+        //!
+        [[nodiscard]] static size_t length(const uint8_t *buf) { return offset<size>(buf); }
+
+        //!
+        //! @return true if all the fields fit into the `len` bytes at `buf` (never reads beyond them)
+        //!
+        [[nodiscard]] static bool fits(const uint8_t *buf, const size_t len) {
+            size_t offset = 0;
+            return (fits<Fields>(buf, len, offset) && ...);
+        }
+
+        //!
+        //! @return upper bound of the length of a record of `values` (one per field, in order)
+        //!
+        template<typename... Values> requires (sizeof...(Values) == size)
+        [[nodiscard]] static size_t max_length(const Values &... values) {
+            return (field_max_length<Fields>(values) + ... + 0);
+        }
+
+        //!
+        //! Encode `values` (one per field, in order) as a record at `buf`, which holds at least max_length(values...)
+        //! bytes
+        //!
+        //! @return length of the record
+        //!
+        template<typename... Values> requires (sizeof...(Values) == size)
+        static size_t write(uint8_t *buf, const Values &... values) {
+            size_t offset = 0;
+            (write_field<Fields>(buf, values, offset), ...);
+            return offset;
+        }
+
+    private:
+        template<typename T, typename V>
+        static size_t field_max_length(const V &v) {
+            if constexpr (fixed_width<T>) return codec<T>::width;
+            else return codec<T>::max_length(v);
+        }
+
+        template<typename T, typename V>
+        static void write_field(uint8_t *buf, const V &v, size_t &offset) {
+            codec<T>::set(buf + offset, v);
+            offset += codec<T>::length(buf + offset);
+        }
+
+        template<size_t I>
+        static constexpr size_t fixed_offset() {
+            constexpr size_t widths[] = {width_of<Fields>()..., 0};
+            size_t offset = 0;
+            for (size_t i = 0; i < I; ++i) offset += widths[i];
+            return offset;
+        }
+
+        template<typename T>
+        static constexpr size_t width_of() {
+            if constexpr (fixed_width<T>) return codec<T>::width;
+            else return 0;
+        }
+
+        template<typename T>
+        static bool fits(const uint8_t *buf, const size_t len, size_t &offset) {
+            const size_t remaining = len - offset;
+            size_t length;
+            if constexpr (fixed_width<T>) {
+                length = codec<T>::width;
+            } else if constexpr (requires { codec<T>::length(buf, remaining); }) {
+                // A codec that checks its own bounds (e.g. repeated fields)
+                length = codec<T>::length(buf + offset, remaining);
+            } else {
+                if (remaining == 0 || codec<dynamic_int>::length(buf + offset) > remaining) return false;
+                length = codec<T>::length(buf + offset);
+            }
+            if (length > remaining) return false;
+            offset += length;
+            return true;
+        }
+    };
+
+    //!
+    //! Reads the fields of a record of `Schema` where it is stored (e.g. a memory mapping), no copy is made and
+    //! nothing is allocated except by the codec of the field that is read
+    //!
+    template<typename Schema>
+    class view {
+    public:
+        view() = default;
+
+        explicit view(const uint8_t *data) : data_(data) {
+        }
+
+        //!
+        //! @return field `I` decoded as its type in `Schema`, or as `As` (e.g. a path as a std::string_view)
+        //!
+        template<size_t I, typename As = typename Schema::template type<I> >
+        [[nodiscard]] As get() const {
+            return codec<As>::get(data_ + Schema::template offset<I>(data_));
+        }
+
+        [[nodiscard]] size_t length() const { return Schema::length(data_); }
+
+        [[nodiscard]] const uint8_t *data() const { return data_; }
+
+    private:
+        const uint8_t *data_{nullptr};
+    };
 }
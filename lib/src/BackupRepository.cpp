@@ -4,7 +4,15 @@
 #include "krico/backup/io.h"
 #include "krico/backup/os.h"
 #include "krico/backup/BackupRunner.h"
+#include "krico/backup/DirectoryScanner.h"
+#include "krico/backup/ThreadPool.h"
 #include <spdlog/spdlog.h>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <functional>
+#include <fstream>
+#include <mutex>
 
 
 using namespace krico::backup;
@@ -16,6 +24,17 @@ namespace fs = std::filesystem;
 } while(false)
 
 namespace {
+    bool is_hex(const std::string_view s) {
+        return std::ranges::all_of(s, [](const unsigned char c) { return std::isxdigit(c); });
+    }
+
+    //! Nothing (the object itself) or .<index>
+    bool is_replica_suffix(const std::string_view suffix) {
+        return suffix.empty() || (suffix.size() > 1 && std::ranges::all_of(suffix.substr(1), [](const unsigned char c) {
+            return std::isdigit(c);
+        }));
+    }
+
     FileLock acquire_lock(const fs::path &dir, const fs::path &metaDir) {
         const fs::file_status status = STATUS(metaDir);
         if (status.type() != std::filesystem::file_type::directory) {
@@ -39,6 +58,21 @@ BackupRepository::BackupRepository(const std::filesystem::path &dir)
 }
 
 BackupRepository BackupRepository::initialize(const std::filesystem::path &dir) {
+    return initialize(dir, Digest::SHA256_ALGORITHM);
+}
+
+BackupRepository BackupRepository::initialize(const std::filesystem::path &dir, const std::string &digestAlgorithm) {
+    return initialize(dir, digestAlgorithm, Fanout::standard());
+}
+
+BackupRepository BackupRepository::initialize(const std::filesystem::path &dir,
+                                              const std::string &digestAlgorithm,
+                                              const Fanout &fanout) {
+    fanout.validate();
+    do {
+        // Fail early on unknown algorithms
+        const Digest digest{digestAlgorithm};
+    } while (false);
     fs::file_status status = STATUS(dir);
     if (status.type() != std::filesystem::file_type::directory) {
         THROW_EXCEPTION("Directory '" + dir.string() +"' doesn't exist");
@@ -59,7 +93,11 @@ BackupRepository BackupRepository::initialize(const std::filesystem::path &dir)
     if (!exists(repo.hardLinksDir())) {
         MKDIR(repo.hardLinksDir());
     }
+    fanout.create(repo.hardLinksDir());
     repo.config().set(METADATA_SECTION, "", "init-ts", std::format("{}", system_clock::now()));
+    repo.config().set(METADATA_SECTION, "", DIGEST_VARIABLE, digestAlgorithm);
+    repo.config().set(METADATA_SECTION, "", FANOUT_DEPTH_VARIABLE, std::to_string(fanout.depth_));
+    repo.config().set(METADATA_SECTION, "", FANOUT_WIDTH_VARIABLE, std::to_string(fanout.width_));
     repo.repositoryLog().putInitRecord(get_username());
     return repo;
 }
@@ -69,6 +107,117 @@ BackupConfig &BackupRepository::config() {
     return config_;
 }
 
+std::string BackupRepository::digestAlgorithm() {
+    return config().get(METADATA_SECTION, DIGEST_VARIABLE).value_or(Digest::SHA256_ALGORITHM);
+}
+
+Fanout BackupRepository::fanout() {
+    const auto depth = config().get(METADATA_SECTION, FANOUT_DEPTH_VARIABLE);
+    const auto width = config().get(METADATA_SECTION, FANOUT_WIDTH_VARIABLE);
+    if (!depth || !width) {
+        return Fanout::legacy();
+    }
+    try {
+        const Fanout fanout{
+            .depth_ = static_cast<uint8_t>(std::stoul(*depth)),
+            .width_ = static_cast<uint8_t>(std::stoul(*width))
+        };
+        fanout.validate();
+        return fanout;
+    } catch (const std::logic_error &) {
+        THROW_EXCEPTION("Invalid fanout in '" + config().file().string() + "' (depth=" + *depth + ", width=" + *width + ")");
+    }
+}
+
+size_t BackupRepository::relayout(const Fanout &fanout, const unsigned threads) {
+    fanout.validate();
+    const Fanout current = this->fanout();
+    const bool resume = !config().get(METADATA_SECTION, RELAYOUT_VARIABLE).value_or("").empty();
+    if (current == fanout && !resume) {
+        spdlog::info("Objects already laid out with {}", fanout.str());
+        return 0;
+    }
+    // Recorded first, so new objects (and a resumed relayout) already go to the new layout
+    config().set(METADATA_SECTION, "", RELAYOUT_VARIABLE, fanout.str());
+    config().set(METADATA_SECTION, "", FANOUT_DEPTH_VARIABLE, std::to_string(fanout.depth_));
+    config().set(METADATA_SECTION, "", FANOUT_WIDTH_VARIABLE, std::to_string(fanout.width_));
+    fanout.create(hardLinksDir_);
+
+    std::atomic<size_t> moved{0};
+    // One per worker, created by its first task and reused for every directory it moves
+    std::vector<std::unique_ptr<IoBatch> > batches(std::max(threads, 1u));
+    ThreadPool pool{threads};
+    std::function<void(const std::shared_ptr<const DirectoryScanner> &)> move;
+    move = [&](const std::shared_ptr<const DirectoryScanner> &dir) {
+        const fs::path relative = dir->path().lexically_relative(hardLinksDir_);
+        auto &batch = batches[ThreadPool::worker()];
+        if (!batch) batch = std::make_unique<IoBatch>();
+        IoBatch &io = *batch;
+        std::vector<std::pair<fs::path, fs::path> > renames{};
+        auto submit = [&] {
+            const auto results = io.submit();
+            for (size_t i = 0; i < results.size(); ++i) {
+                if (results[i] < 0) {
+                    THROW_ERROR_CODE("Failed to move '" + renames[i].first.string()
+                                     + "' to '" + renames[i].second.string() + "'",
+                                     std::make_error_code(static_cast<std::errc>(-results[i])));
+                }
+            }
+            moved += results.size();
+            renames.clear();
+        };
+        for (const auto &entry: *dir) {
+            if (entry.is_directory()) {
+                pool.submit([dir, name = std::string{entry.name_}, &move] {
+                    move(std::make_shared<const DirectoryScanner>(*dir, name));
+                });
+                continue;
+            }
+            if (!entry.is_file()) continue;
+            // The object path is the hex digest with directory separators in it, replicas add a .<index> suffix
+            const auto dot = entry.name_.find('.');
+            const std::string_view suffix = dot == std::string_view::npos ? "" : entry.name_.substr(dot);
+            std::string hex{};
+            for (const auto &part: relative / entry.name_.substr(0, dot)) {
+                if (part != ".") hex += part.string();
+            }
+            Digest::result digest{};
+            if (hex.size() % 2 != 0 || hex.size() > 2 * EVP_MAX_MD_SIZE || !is_hex(hex) || !is_replica_suffix(suffix)) {
+                // Temp files or something that is not ours
+                spdlog::debug("Not moving '{}'", (dir->path() / entry.name_).string());
+                continue;
+            }
+            Digest::result::parse(digest, hex);
+            const fs::path from = dir->path() / entry.name_;
+            const fs::path to = hardLinksDir_ / (fanout.path(digest) + std::string{suffix});
+            if (from == to) continue;
+            io.rename(from, to);
+            renames.emplace_back(from, to);
+            if (io.size() == IoBatch::DEFAULT_DEPTH) submit();
+        }
+        submit();
+    };
+    pool.submit([&] { move(std::make_shared<const DirectoryScanner>(hardLinksDir_)); });
+    pool.wait();
+
+    // Deepest first, parents only get empty once their children are gone
+    std::vector<fs::path> obsolete{};
+    for (const auto &entry: fs::recursive_directory_iterator{hardLinksDir_}) {
+        if (entry.is_directory() && !fanout.is_directory(entry.path().lexically_relative(hardLinksDir_))) {
+            obsolete.push_back(entry.path());
+        }
+    }
+    std::ranges::sort(obsolete, std::greater{});
+    for (const auto &dir: obsolete) {
+        if (std::error_code ec; !fs::remove(dir, ec)) {
+            spdlog::warn("Not removing '{}' [ec={}]: {}", dir.string(), ec.value(), ec.message());
+        }
+    }
+    config().set(METADATA_SECTION, "", RELAYOUT_VARIABLE, "");
+    spdlog::info("Relayout from {} to {} moved {} objects", current.str(), fanout.str(), moved.load());
+    return moved;
+}
+
 void BackupRepository::unlock() {
     ASSERT_LOCKED();
     lock_.unlock();
@@ -149,12 +298,135 @@ const BackupDirectory *BackupRepository::get_directory(const BackupDirectoryId &
 }
 
 BackupSummary BackupRepository::run_backup(const BackupDirectory &directory) {
-    BackupRunner runner{directory};
+    return run_backup(directory, BackupRunner::options_t{});
+}
+
+BackupSummary BackupRepository::run_backup(const BackupDirectory &directory, const BackupRunner::options_t &options) {
+    if (const auto relayout = config().get(METADATA_SECTION, RELAYOUT_VARIABLE); relayout && !relayout->empty()) {
+        THROW_EXCEPTION("Relayout to " + *relayout + " was interrupted, run it again before backing up");
+    }
+    BackupRunner runner{directory, {}, options};
     auto s = runner.run();
     repositoryLog().putRunBackupRecord(get_username(), s);
     return s;
 }
 
+BackupRepository::log_verification_t BackupRepository::verify_log(const unsigned threads) {
+    log_verification_t ret{};
+    std::mutex mutex{};
+    const auto problem = [&](std::string what) {
+        std::lock_guard lock{mutex};
+        spdlog::debug("Log verification: {}", what);
+        ret.problems_.emplace_back(std::move(what));
+    };
+    auto &log = repositoryLog();
+    std::atomic<size_t> summaries{0};
+    const auto verify_summary = [&](const Digest::result &record, const fs::path &file, const Digest::result &checksum) {
+        try {
+            if (!exists(file)) {
+                problem("Record " + record.str() + ": summary file '" + file.string() + "' not found");
+                return;
+            }
+            Digest::result stored{};
+            if (ManifestReader::is_manifest(file)) {
+                const ManifestReader manifest{file};
+                stored = manifest.checksum();
+                if (BackupSummary::compute_checksum(manifest) != stored) {
+                    problem("Record " + record.str() + ": entries of '" + file.string() + "' do not match its checksum");
+                }
+            } else {
+                // Text summary written before the manifest, the checksum is on the last line
+                std::ifstream in{file};
+                for (std::string line; std::getline(in, line);) {
+                    if (line.starts_with("S ")) Digest::result::parse(stored, line.substr(2));
+                }
+            }
+            if (stored != checksum) {
+                problem("Record " + record.str() + ": checksum " + checksum.str() + " but '" + file.string()
+                        + "' has " + stored.str());
+            }
+            ++summaries;
+        } catch (const std::exception &e) {
+            problem("Record " + record.str() + ": failed to read '" + file.string() + "': " + e.what());
+        }
+    };
+
+    // After everything its tasks capture, so its workers are joined before any of it is destroyed
+    ThreadPool pool{threads};
+    ret.numRecords_ = log.verifyRecords(pool, [&](const Digest::result &digest, const std::string &what) {
+        problem("Record " + digest.str() + ": " + what);
+    });
+
+    // Bounded: more links than records means a cycle
+    Digest::result checkpoint{};
+    size_t pending = 0;
+    for (auto prev = log.head(); !prev.is_zero();) {
+        if (ret.numLinks_ > ret.numRecords_) {
+            problem("Record " + prev.str() + ": the chain has a cycle");
+            break;
+        }
+        LogHeaderView header{};
+        try {
+            // Read-only, a loose record (maybe one that failed its hash check) is not moved to the pack
+            header = log.getRecordView(prev, false);
+        } catch (const std::exception &e) {
+            problem("Record " + prev.str() + ": chain broken, " + e.what());
+            break;
+        }
+        ++ret.numLinks_;
+        if (!header.valid()) {
+            problem("Record " + prev.str() + ": truncated");
+            break;
+        }
+        switch (header.type()) {
+            case RunBackupRecordView::log_entry_type: {
+                const RunBackupRecordView run{header.record()};
+                if (!run.valid()) {
+                    problem("Record " + prev.str() + ": truncated backup run");
+                    break;
+                }
+                const auto summary = run.summary();
+                const auto *directory = get_directory(summary.directoryId());
+                if (!directory) {
+                    problem("Record " + prev.str() + ": backup directory '" + summary.directoryId().str() +
+                            "' not found");
+                    break;
+                }
+                pool.submit([&verify_summary, record = prev, file = summary.summaryFile(directory->metaDir()),
+                            checksum = summary.checksum()] {
+                    verify_summary(record, file, checksum);
+                });
+                if (++pending == MAX_PENDING_SUMMARIES) {
+                    pool.wait();
+                    pending = 0;
+                }
+            }
+            break;
+            case CheckpointRecordView::log_entry_type: {
+                const CheckpointRecordView view{header.record()};
+                if (!view.valid()) {
+                    problem("Record " + prev.str() + ": truncated checkpoint");
+                    break;
+                }
+                if (checkpoint.len_ != 0 && checkpoint != prev) {
+                    problem("Record " + prev.str() + ": checkpoint chain broken (expected " + checkpoint.str() + ")");
+                }
+                checkpoint = view.previousCheckpoint();
+            }
+            break;
+            default:
+                break;
+        }
+        prev = header.prev();
+    }
+    if (checkpoint.len_ != 0 && !checkpoint.is_zero()) {
+        problem("Record " + checkpoint.str() + ": checkpoint not in the chain");
+    }
+    pool.wait();
+    ret.numSummaries_ = summaries;
+    return ret;
+}
+
 std::vector<std::unique_ptr<BackupDirectory> > &BackupRepository::loadDirectories() {
     if (directoriesLoaded_) return directories_;
 
@@ -178,3 +450,12 @@ BackupRepositoryLog &BackupRepository::repositoryLog() {
     }
     return *repositoryLog_;
 }
+
+ObjectIndex &BackupRepository::objectIndex() {
+    ASSERT_LOCKED();
+    if (!objectIndex_) {
+        const auto digestLength = Digest{digestAlgorithm()}.zero().len_;
+        objectIndex_ = std::make_unique<ObjectIndex>(metaDir(), hardLinksDir(), digestLength);
+    }
+    return *objectIndex_;
+}
@@ -2,11 +2,19 @@
 #include "krico/backup/exception.h"
 #include "krico/backup/io.h"
 #include "krico/backup/TemporaryFile.h"
+#include "krico/backup/ThreadPool.h"
 #include "spdlog/spdlog.h"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <ranges>
+#include <cctype>
 #include <fstream>
 #include <cstring>
 #include <chrono>
 #include <utility>
+#include <fcntl.h>
+#include <unistd.h>
 
 
 using namespace krico::backup;
@@ -17,7 +25,19 @@ BackupRepositoryLog::BackupRepositoryLog(std::filesystem::path dir)
     : dir_(std::move(dir)),
       headFile_(dir_ / HEAD_FILE),
       head_{},
-      digest_(Digest::sha1()) {
+      digest_(Digest::sha1()),
+      pack_(dir_),
+      index_(dir_) {
+}
+
+BackupRepositoryLog::~BackupRepositoryLog() {
+    if (migrated_.empty()) return;
+    try {
+        pack_.sync();
+        removeMigrated();
+    } catch (const std::exception &e) {
+        spdlog::warn("Failed to sync the log records moved to the pack, keeping their loose files: {}", e.what());
+    }
 }
 
 void BackupRepositoryLog::putInitRecord(const std::string &author) {
@@ -37,62 +57,345 @@ void BackupRepositoryLog::putRunBackupRecord(const std::string &author, const Ba
     putRecord(entry);
 }
 
+void BackupRepositoryLog::putRunBackupRecords(const std::string &author, const std::vector<BackupSummary> &summaries) {
+    batch batch{*this};
+    for (const auto &summary: summaries) {
+        putRunBackupRecord(author, summary);
+    }
+    batch.commit();
+}
+
 void BackupRepositoryLog::putRecord(LogHeader &entry) {
+    appendRecord(entry);
+    if (entry.type() != CheckpointRecord::log_entry_type && ++checkpoint_.since_ >= CHECKPOINT_INTERVAL) {
+        putCheckpoint(entry.author());
+    }
+    if (batches_ == 0) {
+        publishHead();
+    }
+}
+
+void BackupRepositoryLog::appendRecord(const LogHeader &entry) {
+    loadCheckpoint();
     digest_.reset();
-    const size_t len = entry.end_offset();
-    digest_.update(entry.buffer().ptr(), len);
+    const auto bytes = entry.record();
+    digest_.update(bytes.data(), bytes.size());
     const auto r = digest_.digest();
-    const fs::path file{dir_ / r.path(DIGEST_DIRS)};
-    if (const fs::path dir{file.parent_path()}; !is_directory(dir)) {
-        MKDIRS(dir);
+    pack_.append(r, bytes.data(), bytes.size());
+    // Otherwise updateIndex() adds it (and the records missing before it) on the next query
+    if (index_.last() == entry.prev()) {
+        index_.append(indexEntry(r, entry.view()));
+    }
+    head_ = r;
+    headPending_ = true;
+}
+
+size_t BackupRepositoryLog::verifyRecords(ThreadPool &pool,
+                                          const std::function<void(const Digest::result &, const std::string &)> &
+                                          problem) {
+    const size_t packed = pack_.verify(pool, problem);
+
+    // Loose records that were not moved to the pack yet, a task per directory
+    std::mutex mutex{};
+    std::atomic<size_t> loose{0};
+    for (const auto &dirEntry: fs::directory_iterator{dir_}) {
+        if (!dirEntry.is_directory()) continue;
+        pool.submit([&, dir = dirEntry.path()] {
+            const auto md = Digest::sha1();
+            const std::string prefix{dir.filename().string()};
+            for (const auto &fileEntry: fs::directory_iterator{dir}) {
+                if (!fileEntry.is_regular_file()) continue;
+                const std::string hex{prefix + fileEntry.path().filename().string()};
+                if (hex.size() != 2 * DigestLength::SHA1 || !std::ranges::all_of(hex, [](const unsigned char c) {
+                    return std::isxdigit(c);
+                })) {
+                    continue;
+                }
+                Digest::result digest{};
+                Digest::result::parse(digest, hex);
+                std::ifstream in{fileEntry.path(), std::ios::binary};
+                const std::string data{std::istreambuf_iterator{in}, std::istreambuf_iterator<char>{}};
+                ++loose;
+                if (!in || md.digest(data.data(), data.size()) != digest) {
+                    std::lock_guard lock{mutex};
+                    problem(digest, "loose record '" + fileEntry.path().string() + "' does not hash to its name");
+                }
+            }
+        });
+    }
+    pool.wait();
+    return packed + loose;
+}
+
+std::vector<Digest::result> BackupRepositoryLog::query(const query_t &query) {
+    updateIndex();
+    const auto directory = query.directoryId_ ? LogIndex::directory_hash(*query.directoryId_) : 0;
+    const auto since = LogIndex::timestamp(query.since_);
+    const auto until = LogIndex::timestamp(query.until_);
+    std::vector<Digest::result> ret{};
+    // Newest first, the entries are in the order the records were put
+    for (const auto &entry: std::ranges::reverse_view(index_.entries())) {
+        if (ret.size() >= query.limit_) break;
+        if (query.type_ && entry.type_ != *query.type_) continue;
+        if (entry.ts_ < since || entry.ts_ >= until) continue;
+        if (query.directoryId_) {
+            if (entry.directory_ != directory) continue;
+            // A hash collision is possible
+            const auto header = getRecordView(entry.digest());
+            const auto id = header.type() == AddDirectoryRecordView::log_entry_type
+                                ? log_record_cast<AddDirectoryRecordView>(header).directoryId()
+                                : log_record_cast<RunBackupRecordView>(header).directoryId();
+            if (id != *query.directoryId_) continue;
+        }
+        ret.push_back(entry.digest());
+    }
+    return ret;
+}
+
+void BackupRepositoryLog::updateIndex() {
+    const auto last = index_.last();
+    if (last == head()) return;
+    std::vector<LogIndex::entry_t> missing{};
+    auto prev = head();
+    for (; !prev.is_zero() && prev != last;) {
+        const auto header = getRecordView(prev);
+        missing.push_back(indexEntry(prev, header));
+        prev = header.prev();
+    }
+    if (prev != last) {
+        spdlog::info("Rebuilding log query index [records={}]", missing.size());
+        index_.clear();
+    }
+    std::ranges::reverse(missing);
+    index_.append(missing);
+}
+
+LogIndex::entry_t BackupRepositoryLog::indexEntry(const Digest::result &digest, const LogHeaderView &header) {
+    LogIndex::entry_t ret{
+        .ts_ = LogIndex::timestamp(header.ts()), .directory_ = 0, .digest_ = {}, .type_ = header.type(),
+        .reserved_ = {}
+    };
+    std::memcpy(ret.digest_, digest.md_, DigestLength::SHA1);
+    switch (header.type()) {
+        case AddDirectoryRecordView::log_entry_type:
+            ret.directory_ = LogIndex::directory_hash(log_record_cast<AddDirectoryRecordView>(header).directoryId());
+            break;
+        case RunBackupRecordView::log_entry_type:
+            ret.directory_ = LogIndex::directory_hash(log_record_cast<RunBackupRecordView>(header).directoryId());
+            break;
+        default:
+            break;
     }
-    if (std::ofstream out{file}; !(out && out.write(entry.buffer().const_cptr(), static_cast<std::streamsize>(len)))) {
-        THROW_EXCEPTION("Failed to write LogEntry to '" + file.string() + "'");
+    return ret;
+}
+
+void BackupRepositoryLog::loadCheckpoint() {
+    if (checkpoint_.loaded_) return;
+    // Only the first time, a log written before checkpoints is walked to the start
+    for (auto prev = head(); !prev.is_zero();) {
+        const auto header = getRecordView(prev);
+        if (header.type() == CheckpointRecordView::log_entry_type) {
+            checkpoint_.last_ = prev;
+            checkpoint_.numRecords_ = log_record_cast<CheckpointRecordView>(header).numRecords();
+            break;
+        }
+        ++checkpoint_.since_;
+        prev = header.prev();
+    }
+    checkpoint_.loaded_ = true;
+}
+
+void BackupRepositoryLog::putCheckpoint(const std::string_view author) {
+    const auto numRecords = checkpoint_.numRecords_ + checkpoint_.since_;
+    const CheckpointRecord checkpoint{head(), author, checkpoint_.last_, numRecords, counters()};
+    appendRecord(checkpoint);
+    checkpoint_.last_ = head_;
+    checkpoint_.numRecords_ = numRecords;
+    checkpoint_.since_ = 0;
+    spdlog::debug("Put log checkpoint [hash={}][records={}]", head_.str(), numRecords);
+}
+
+log_counters BackupRepositoryLog::counters() {
+    return countersBefore(system_clock::time_point::max());
+}
+
+log_counters BackupRepositoryLog::counters(const system_clock::time_point since) {
+    auto ret = counters();
+    for (const auto &[id, before]: countersBefore(since)) {
+        if (const auto it = ret.find(id); it != ret.end()) {
+            it->second -= before;
+            if (it->second.runs_ == 0) ret.erase(it);
+        }
+    }
+    return ret;
+}
+
+log_counters BackupRepositoryLog::countersBefore(const system_clock::time_point before) {
+    loadCheckpoint();
+    // Skip the checkpoints (and the records they cover) put since `before`
+    Digest::result from = head();
+    for (auto checkpoint = checkpoint_.last_; !checkpoint.is_zero();) {
+        const auto view = log_record_cast<CheckpointRecordView>(getRecordView(checkpoint));
+        if (view.ts() < before) break;
+        from = view.prev();
+        checkpoint = view.previousCheckpoint();
+    }
+    log_counters ret{};
+    for (auto prev = from; !prev.is_zero();) {
+        const auto header = getRecordView(prev);
+        if (header.type() == CheckpointRecordView::log_entry_type) {
+            for (const auto &[id, counters]: log_record_cast<CheckpointRecordView>(header).counters()) {
+                ret[id] += counters;
+            }
+            break;
+        }
+        if (header.type() == RunBackupRecordView::log_entry_type && header.ts() < before) {
+            const auto run = log_record_cast<RunBackupRecordView>(header);
+            ret[std::string{run.directoryId()}] += run;
+        }
+        prev = header.prev();
     }
+    return ret;
+}
+
+void BackupRepositoryLog::publishHead() {
+    // The records first, HEAD must never point at a record that is not on disk
+    pack_.sync();
+    removeMigrated();
 
     const TemporaryFile tmp(headFile_.parent_path(), HEAD_FILE);
-    if (std::ofstream out{tmp.file()}; !(out && out << r.str())) {
-        THROW_EXCEPTION("Failed to write LogEntry hash to '" + tmp.file().string() + "'");
+    const auto hex = head_.str();
+    const int fd = open(tmp.file().c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC);
+    if (fd == -1) {
+        THROW_ERRNO("Failed to open '" + tmp.file().string() + "'");
+    }
+    const bool written = ::write(fd, hex.data(), hex.size()) == static_cast<ssize_t>(hex.size()) && fsync(fd) == 0;
+    const int error = errno;
+    close(fd);
+    if (!written) {
+        THROW_ERROR_CODE("Failed to write LogEntry hash to '" + tmp.file().string() + "'",
+                         std::make_error_code(static_cast<std::errc>(error)));
     }
 
     // Try to be atomic
     RENAME_FILE(tmp.file(), headFile_);
-    head_ = r;
+    if (const int dir = open(dir_.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC); dir != -1) {
+        if (fsync(dir)) {
+            spdlog::warn("Failed to sync '{}': {}", dir_.string(), std::strerror(errno));
+        }
+        close(dir);
+    }
+    headPending_ = false;
+}
+
+BackupRepositoryLog::batch::batch(BackupRepositoryLog &log) : log_(log) {
+    ++log_.batches_;
+}
+
+BackupRepositoryLog::batch::~batch() {
+    // Only the outermost batch publishes
+    if (--log_.batches_ > 0 || !log_.headPending_) return;
+    try {
+        log_.publishHead();
+    } catch (const std::exception &e) {
+        spdlog::error("Failed to publish log HEAD '{}': {}", log_.head_.str(), e.what());
+    }
+}
+
+void BackupRepositoryLog::batch::commit() {
+    if (log_.batches_ == 1 && log_.headPending_) {
+        log_.publishHead();
+    }
 }
 
 const LogHeader &BackupRepositoryLog::getRecord(const Digest::result &digest) {
+    const auto packed = pack_.find(digest);
+    if (packed.empty()) {
+        return getLooseRecord(digest);
+    }
+    auto &record = reader(static_cast<unsigned char>(packed.front()));
+    record.assign(packed);
+    return record;
+}
+
+LogHeaderView BackupRepositoryLog::getRecordView(const Digest::result &digest, const bool migrate) {
+    if (const auto packed = pack_.find(digest); !packed.empty()) {
+        return LogHeaderView{packed};
+    }
+    const auto &record = getLooseRecord(digest, migrate);
+    if (!migrate) return record.view();
+    if (const auto packed = pack_.find(digest); !packed.empty()) {
+        return LogHeaderView{packed};
+    }
+    // Not migrated, view the copy in the reader
+    return record.view();
+}
+
+LogHeader &BackupRepositoryLog::reader(const int type) {
+    switch (static_cast<LogEntryType>(type)) {
+        case InitRecord::log_entry_type:
+            return readers_.init_;
+        case AddDirectoryRecord::log_entry_type:
+            return readers_.add_;
+        case RunBackupRecord::log_entry_type:
+            return readers_.run_;
+        case CheckpointRecord::log_entry_type:
+            return readers_.checkpoint_;
+        default:
+            spdlog::warn("Unknown LogHeader: {}", std::to_string(type));
+            return readers_.header_;
+    }
+}
+
+const LogHeader &BackupRepositoryLog::getLooseRecord(const Digest::result &digest, const bool migrate) {
     const fs::path file{dir_ / digest.path(DIGEST_DIRS)};
-    auto length = FILE_SIZE(file);
     if (std::ifstream in{file}; in) {
+        const auto length = FILE_SIZE(file);
         const auto entryType = in.peek();
         if (entryType == std::ifstream::traits_type::eof()) {
             THROW_EXCEPTION("LogHeader '" + digest.str() + "' corrupt (missing type)! File '" + file.string() + "'");
         }
-        LogHeader *record;
-        switch (static_cast<LogEntryType>(entryType)) {
-            case InitRecord::log_entry_type:
-                record = &readers_.init_;
-                break;
-            case AddDirectoryRecord::log_entry_type:
-                record = &readers_.add_;
-                break;
-            case RunBackupRecord::log_entry_type:
-                record = &readers_.run_;
-                break;
-            default:
-                spdlog::warn("Unknown LogHeader: {}", std::to_string(entryType));
-                record = &readers_.header_;
-                break;
-        }
-        if (!in.read(record->buffer().cptr(), static_cast<std::streamsize>(length))) {
+        if (length > LogHeader::MAX_LOOSE_LENGTH) {
+            THROW_EXCEPTION("LogHeader '" + digest.str() + "' corrupt (length " + std::to_string(length) + ")! File '"
+                + file.string() + "'");
+        }
+        std::string bytes(length, '\0');
+        if (!in.read(bytes.data(), static_cast<std::streamsize>(length))) {
             THROW_EXCEPTION("Failed to read LogHeader '" + digest.str() + "'! File '" + file.string() + "'");
         }
-        record->parse_offsets();
-        return *record;
+        auto &record = reader(entryType);
+        record.assign(bytes);
+        if (!migrate) return record;
+        // Migrate, a failure (e.g. a read-only repository) only means it is read from the loose file again next time.
+        // The file goes once the pack is synced, HEAD or a later `prev` may point at the record.
+        try {
+            pack_.append(digest, bytes.data(), bytes.size());
+            migrated_.push_back(file);
+            if (migrated_.size() >= MIGRATE_BATCH) {
+                pack_.sync();
+                removeMigrated();
+            }
+        } catch (const std::exception &e) {
+            spdlog::warn("Failed to move loose log record '{}' to the pack: {}", file.string(), e.what());
+        }
+        return record;
     }
     THROW_EXCEPTION("LogHeader '" + digest.str() + "' not found! File '" + file.string() + "'");
 }
 
+void BackupRepositoryLog::removeMigrated() {
+    assert(pack_.synced()); // Dev mistake...
+    for (const auto &file: migrated_) {
+        std::error_code ec{};
+        if (fs::remove(file, ec)) {
+            spdlog::debug("Moved loose log record to the pack [file={}]", file.string());
+        } else if (ec) {
+            spdlog::warn("Failed to remove loose log record '{}' (moved to the pack): {}", file.string(), ec.message());
+        }
+    }
+    migrated_.clear();
+}
+
 const Digest::result &BackupRepositoryLog::head() {
     if (head_.len_ == 0) {
         if (exists(headFile_)) {
@@ -113,9 +416,19 @@ std::vector<Digest::result> BackupRepositoryLog::findHash(const std::string &has
     // Just in case someone decided to change this... remind them they need to fix the logic ;)
     static_assert(DIGEST_DIRS == 1, "This method only DIGEST_DIRS == 1");
 
-    if (hash.size() == DigestLength::SHA1) {
+    std::string hex{hash};
+    std::ranges::transform(hex, hex.begin(), [](const unsigned char c) { return std::tolower(c); });
+    if (hex.size() > 2 * DigestLength::SHA1 || !std::ranges::all_of(hex, [](const unsigned char c) {
+        return std::isxdigit(c);
+    })) {
+        return {};
+    }
+
+    auto hashes_ = pack_.find_prefix(hex);
+    if (hex.size() == 2 * DigestLength::SHA1) {
+        if (!hashes_.empty()) return hashes_;
         Digest::result digest{};
-        Digest::result::parse(digest, hash);
+        Digest::result::parse(digest, hex);
         const fs::path file{dir_ / digest.path(DIGEST_DIRS)};
         const auto status = STATUS(file);
         if (status.type() == fs::file_type::regular) {
@@ -124,21 +437,46 @@ std::vector<Digest::result> BackupRepositoryLog::findHash(const std::string &has
         return {};
     }
 
-    std::vector<Digest::result> hashes_{};
-
-    const std::string hashPrefix{hash.size() > 2 ? hash.substr(0, 2) : hash};
-    for (const auto &dirEntry: fs::directory_iterator{dir_}) {
-        if (!dirEntry.is_directory()) continue;
-        const std::string prefix{dirEntry.path().filename().string()};
-        if (!prefix.starts_with(hashPrefix)) continue;
-        for (const auto &fileEntry: fs::directory_iterator{dirEntry.path()}) {
+    // Loose records that were not moved to the pack yet
+    const auto findLoose = [&](const fs::path &dir) {
+        const std::string prefix{dir.filename().string()};
+        for (const auto &fileEntry: fs::directory_iterator{dir}) {
             if (!fileEntry.is_regular_file()) continue;
             const std::string fileHash{prefix + fileEntry.path().filename().string()};
-            if (fileHash.starts_with(hash)) {
-                Digest::result::parse(hashes_.emplace_back(), fileHash);
+            if (fileHash.size() == 2 * DigestLength::SHA1 && fileHash.starts_with(hex)) {
+                Digest::result digest{};
+                Digest::result::parse(digest, fileHash);
+                // Unless it was moved to the pack and could not be removed
+                if (!pack_.contains(digest)) hashes_.push_back(digest);
+            }
+        }
+    };
+    if (hex.size() >= 2) {
+        if (const fs::path dir{dir_ / hex.substr(0, 2)}; is_directory(dir)) {
+            findLoose(dir);
+        }
+    } else {
+        for (const auto &dirEntry: fs::directory_iterator{dir_}) {
+            if (dirEntry.is_directory() && dirEntry.path().filename().string().starts_with(hex)) {
+                findLoose(dirEntry.path());
             }
         }
     }
 
     return hashes_;
 }
+
+Digest::result BackupRepositoryLog::resolveHash(const std::string &hash) const {
+    const auto found = findHash(hash);
+    if (found.empty()) {
+        THROW_EXCEPTION("No hash found matching '" + hash + "'");
+    }
+    if (found.size() != 1) {
+        std::string hashes{};
+        for (const auto &h: found) {
+            hashes += "\n" + h.str();
+        }
+        THROW_EXCEPTION("More than one hash found matching '" + hash + "'" + hashes);
+    }
+    return found.front();
+}
@@ -2,8 +2,17 @@
 #include "krico/backup/BackupRepository.h"
 #include "krico/backup/exception.h"
 #include "krico/backup/io.h"
+#include "krico/backup/IoBatch.h"
+#include "krico/backup/MappedFile.h"
+#include "krico/backup/MultiBufferSha256.h"
+#include "krico/backup/os.h"
 #include <spdlog/spdlog.h>
 #include <fstream>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 
 #include "krico/backup/BackupSummary.h"
 
@@ -11,16 +20,37 @@ using namespace krico::backup;
 using namespace std::chrono;
 namespace fs = std::filesystem;
 
+namespace {
+    Digest::result empty_digest(const std::string &algorithm) {
+        const Digest md{algorithm};
+        md.reset();
+        return md.digest();
+    }
+}
+
 BackupRunner::BackupRunner(const BackupDirectory &directory, const year_month_day &date)
+    : BackupRunner(directory, date, options_t{}) {
+}
+
+BackupRunner::BackupRunner(const BackupDirectory &directory, const year_month_day &date, const options_t &options)
     : directory_(directory),
       date_(date.ok() ? date : year_month_day{floor<days>(system_clock::now())}),
       backupDir_(determineBackupDir(directory_, date_)),
-      digest_(Digest::sha256()) {
+      options_(options),
+      digestAlgorithm_(directory_.repository().digestAlgorithm()),
+      fanout_(directory_.repository().fanout()),
+      emptyDigest_(empty_digest(digestAlgorithm_)),
+      objectIndex_(directory_.repository().objectIndex()),
+      hashQueue_(options_.queueSize),
+      storeQueue_(options_.queueSize),
+      linkQueue_(options_.queueSize) {
     if (!is_directory(directory_.sourceDir())) {
         THROW_EXCEPTION("Invalid source directory '" + directory_.sourceDir().string() + "'");
     }
 }
 
+BackupRunner::~BackupRunner() = default;
+
 BackupSummary BackupRunner::run() {
     if (exists(backupDir_)) {
         THROW_EXCEPTION("Backup directory already exists '" + backupDir_.string() + "'");
@@ -33,8 +63,78 @@ BackupSummary BackupRunner::run() {
         date_,
         backupDir_.lexically_relative(directory_.metaDir())
     };
-    const Directory source{directory_.sourceDir()};
-    backup(builder, source);
+    builder.addDir(".");
+    auto root = std::make_unique<dir_node>(&allocations_);
+    auto &rootNode = *root;
+    rootNode.dest_ = std::make_shared<const dir_fd>(open_dir(AT_FDCWD, backupDir_.c_str(), true, backupDir_));
+    mergeStack_.emplace_back(std::move(root));
+    const fs::path &hardLinksDir = directory_.repository().hardLinksDir();
+    hardLinksFd_ = std::make_unique<const dir_fd>(open_dir(AT_FDCWD, hardLinksDir.c_str(), true, hardLinksDir));
+    staging_ = StagedFile::probe(hardLinksFd_->fd_, hardLinksDir);
+    spdlog::debug("New objects are published by {}", to_string(staging_));
+
+    statCache_ = std::make_unique<StatCache>(directory_.metaDir());
+
+    std::vector<std::thread> hashers, storers, linkers;
+    start(hashers, options_.hashers, backup_phase::hash, [this](const unsigned index) { hash(index); });
+    if (!options_.hashWhileCopy) {
+        start(storers, options_.copiers, backup_phase::copy, [this](const unsigned index) { store(index); });
+    }
+    start(linkers, options_.linkers, backup_phase::link, [this, &builder] { link(builder); });
+    do {
+        ThreadPool scanners{options_.scanners};
+        do {
+            std::lock_guard lock{mergeMutex_};
+            scanners_ = &scanners;
+            bufferedDirs_ = peakBufferedDirs_ = 1;
+            maxBufferedDirs_ = bufferedDirsLimit(options_);
+        } while (false);
+        scanners.submit([&] {
+            timedScan([&] {
+                scan(scanners, builder, rootNode, std::make_shared<const DirectoryScanner>(directory_.sourceDir()), {});
+            });
+        });
+        try {
+            // The pool runs out of work while scans are parked, they come back once the merge makes room
+            for (bool done = false; !done;) {
+                scanners.wait();
+                std::unique_lock lock{mergeMutex_};
+                scansChanged_.wait(lock, [this] { return scansLeft_ == 0 || resumed_ || aborted_; });
+                done = scansLeft_ == 0 || aborted_;
+                resumed_ = false;
+            }
+        } catch (...) {
+            fail(std::current_exception());
+        }
+        std::lock_guard lock{mergeMutex_};
+        scanners_ = nullptr;
+    } while (false);
+    // Shut down stage by stage, so every queue is drained before the next one closes
+    hashQueue_.close();
+    for (auto &t: hashers) t.join();
+    storeQueue_.close();
+    for (auto &t: storers) t.join();
+    linkQueue_.close();
+    for (auto &t: linkers) t.join();
+    if (error_) {
+        std::rethrow_exception(error_);
+    }
+    if (!mergeStack_.empty()) {
+        THROW_EXCEPTION("Incomplete backup of '" + directory_.sourceDir().string() + "'");
+    }
+    for (size_t i = 0; i < numCopies_.size(); ++i) {
+        builder.addCopies(static_cast<copy_method>(i), numCopies_[i]);
+    }
+    objectIndex_.save();
+    statCache_->save();
+    builder.addStatCache(statCache_->hits(), statCache_->misses());
+    builder.addAllocations(allocations_.allocations(), allocations_.bytes());
+    builder.addReplicas(numReplicas_);
+    for (size_t i = 0; i < BACKUP_PHASE_COUNT; ++i) {
+        builder.addPhase(static_cast<backup_phase>(i), nanoseconds{phaseWall_[i].load()},
+                         nanoseconds{phaseCpu_[i].load()});
+    }
+    builder.addHashedBytes(bytesHashed_);
     adjustSymlinks(builder);
     return builder.build();
 }
@@ -49,79 +149,691 @@ std::filesystem::path BackupRunner::determineBackupDir(const BackupDirectory &di
     THROW_EXCEPTION("Too many backups for " + std::format("{0:%Y-%m-%d}", date) + " (max 1000)");
 }
 
-void BackupRunner::backup(BackupSummaryBuilder &builder, const Directory &dir) /* NOLINT(*-no-recursion) */ {
-    builder.addDir(dir.relative_path());
-    if (const fs::path toDir = backupDir_ / dir.relative_path(); exists(toDir)) {
-        if (!is_directory(toDir)) {
-            THROW_EXCEPTION("Expected dir but got file '" + toDir.string() + "'");
+void BackupRunner::scan(ThreadPool &pool,
+                        BackupSummaryBuilder &builder,
+                        dir_node &node,
+                        const std::shared_ptr<const DirectoryScanner> &dir,
+                        const std::string_view relativeDir) {
+    // Jobs point into entries_, it must never reallocate
+    node.entries_.reserve(dir->size());
+    const auto path = [&node, relativeDir](const std::string_view name) {
+        std::pmr::string ret{&node.arena_};
+        if (!relativeDir.empty()) {
+            ret.reserve(relativeDir.size() + 1 + name.size());
+            ret.append(relativeDir).append(1, '/');
         }
-    } else {
-        MKDIR(toDir);
-    }
-    for (const auto &entry: dir) {
+        ret.append(name);
+        return ret;
+    };
+    for (const auto entry: *dir) {
         if (entry.is_directory()) {
-            backup(builder, entry.as_directory());
+            auto &result = node.entries_.emplace_back(entry_result{
+                .kind_ = entry_result::kind::directory, .path_ = path(entry.name_)
+            });
+            result.dir_ = std::make_unique<dir_node>(&allocations_);
+            // Hand the sub-directory over to the pool, an idle worker will steal it.  Source and destination are opened
+            // relative to `dir` and `dest`, which stay open until then (as does `node`, which holds the path).
+            schedule(pool, *result.dir_, [this, &pool, &builder, &child = *result.dir_, dir, dest = node.dest_,
+                         name = entry.name_, relative = std::string_view{result.path_}] {
+                timedScan([&] {
+                    child.dest_ = mkdir(*dest, name, relative);
+                    scan(pool, builder, child, std::make_shared<const DirectoryScanner>(*dir, name), relative);
+                });
+            });
         } else if (entry.is_file()) {
-            backup(builder, entry.as_file());
+            auto &result = node.entries_.emplace_back(entry_result{
+                .kind_ = entry_result::kind::file, .path_ = path(entry.name_)
+            });
+            ++node.pending_;
+            if (!hashQueue_.push(file_job{
+                .node_ = &node, .result_ = &result, .source_ = directory_.sourceDir() / std::string_view{result.path_}
+            })) {
+                THROW_EXCEPTION("Backup aborted while scanning '" + dir->path().string() + "'");
+            }
         } else if (entry.is_symlink()) {
-            backup(builder, entry.as_symlink());
+            auto &result = node.entries_.emplace_back(entry_result{
+                .kind_ = entry_result::kind::symlink, .path_ = path(entry.name_)
+            });
+            backup(result, *dir, *node.dest_, entry.name_);
         } else {
-            THROW_NOT_IMPLEMENTED("Entry type not supported");
+            THROW_NOT_IMPLEMENTED("Entry type not supported '" + (dir->path() / entry.name_).string() + "'");
         }
     }
+    complete(builder, node);
 }
 
-void BackupRunner::backup(BackupSummaryBuilder &builder, const File &file) {
-    const fs::path toFile = backupDir_ / file.relative_path();
-    const auto digestResult = digest(file);
-    const fs::path digestFile = directory_.repository().hardLinksDir() / digestResult.path(DIGEST_DIRS);
+size_t BackupRunner::bufferedDirsLimit(const options_t &options) {
+    const size_t ret = std::max<size_t>(1, options.maxBufferedDirs);
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) || limit.rlim_cur == RLIM_INFINITY) return ret;
+    // Sources being read (a batch of small files per hasher), staged objects, io_uring rings, plus what the
+    // repository, the merge front and the process itself keep open
+    const size_t reserved = RESERVED_DESCRIPTORS
+                            + options.hashers * (options.ioDepth + MultiBufferSha256::lanes() + 4)
+                            + options.copiers * 4 + options.linkers * 2;
+    const size_t fits = limit.rlim_cur > reserved + 2 ? (limit.rlim_cur - reserved) / 2 : 1;
+    if (fits < ret) {
+        spdlog::debug("Buffered directories capped by the open files limit [maxBufferedDirs={}][limit={}][cap={}]",
+                      ret, limit.rlim_cur, fits);
+        return fits;
+    }
+    return ret;
+}
 
-    if (exists(digestFile)) {
-        builder.addHardLinkedFile(file.relative_path(), digestResult);
-    } else {
-        builder.addCopiedFile(file.relative_path(), digestResult);
+void BackupRunner::schedule(ThreadPool &pool, dir_node &node, ThreadPool::task task) {
+    do {
+        std::lock_guard lock{mergeMutex_};
+        ++scansLeft_;
+    } while (false);
+    pool.submit([this, &node, task = std::move(task)]() mutable {
+        do {
+            std::lock_guard lock{mergeMutex_};
+            if (aborted_) return;
+            // The front of the merge is never parked, otherwise nothing would ever make room
+            if (bufferedDirs_ >= maxBufferedDirs_
+                && mergeStack_.back().node_.get() != &node) {
+                node.parked_ = std::move(task);
+                node.parkedAt_ = parked_.insert(parked_.end(), &node);
+                return;
+            }
+            peakBufferedDirs_ = std::max(peakBufferedDirs_, ++bufferedDirs_);
+        } while (false);
+        scanned(task);
+    });
+}
+
+void BackupRunner::resume(dir_node &node) {
+    parked_.erase(node.parkedAt_);
+    peakBufferedDirs_ = std::max(peakBufferedDirs_, ++bufferedDirs_);
+    scanners_->submit([this, task = std::exchange(node.parked_, nullptr)] { scanned(task); });
+    resumed_ = true;
+    scansChanged_.notify_all();
+}
+
+void BackupRunner::scanned(const ThreadPool::task &task) {
+    const auto finished = [this] {
+        std::lock_guard lock{mergeMutex_};
+        --scansLeft_;
+        scansChanged_.notify_all();
+    };
+    try {
+        task();
+    } catch (...) {
+        // The pool drops the tasks still queued, run() must not wait for them
+        fail(std::current_exception());
+        finished();
+        throw;
+    }
+    finished();
+}
+
+template<typename Task>
+void BackupRunner::timedScan(Task task) {
+    const auto started = steady_clock::now();
+    const auto cpu = thread_cpu_time();
+    task();
+    account(backup_phase::scan, steady_clock::now() - started, thread_cpu_time() - cpu);
+}
+
+void BackupRunner::backup(entry_result &result,
+                          const DirectoryScanner &dir,
+                          const dir_fd &dest,
+                          const std::string_view name) const {
+    const fs::path &sourceDir = directory_.sourceDir();
+    const std::string_view path{result.path_};
+    const fs::path target = lexically_relative_symlink_target(sourceDir / path, dir.read_symlink(name), sourceDir);
+    result.target_ = target;
+    // Names from a DirectoryScanner are null terminated
+    if (symlinkat(target.c_str(), dest.fd_, name.data())) {
+        THROW_ERRNO("Failed to create symlink '" + target.string() + "' -> '" + (backupDir_ / path).string() + "'");
+    }
+}
+
+std::shared_ptr<const BackupRunner::dir_fd> BackupRunner::mkdir(const dir_fd &parent,
+                                                                const std::string_view name,
+                                                                const std::string_view relativeDir) const {
+    if (mkdirat(parent.fd_, name.data(), 0777)) {
+        const int error = errno;
+        struct stat st{};
+        if (error != EEXIST || fstatat(parent.fd_, name.data(), &st, AT_SYMLINK_NOFOLLOW) || !S_ISDIR(st.st_mode)) {
+            const fs::path toDir = backupDir_ / relativeDir;
+            if (error == EEXIST) {
+                THROW_EXCEPTION("Expected dir but got file '" + toDir.string() + "'");
+            }
+            THROW_ERROR_CODE("Failed to create directory '" + toDir.string() + "'",
+                             std::make_error_code(static_cast<std::errc>(error)));
+        }
+    }
+    return std::make_shared<const dir_fd>(open_dir(parent.fd_, name.data(), false, backupDir_ / relativeDir));
+}
+
+int BackupRunner::open_dir(const int dirFd, const char *dir, const bool follow, const fs::path &path) {
+#ifdef O_PATH
+    constexpr int flags = O_PATH | O_DIRECTORY | O_CLOEXEC;
+#else
+    constexpr int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+#endif
+    const int fd = openat(dirFd, dir, follow ? flags : flags | O_NOFOLLOW);
+    if (fd == -1) {
+        THROW_ERRNO("Failed to open directory '" + path.string() + "'");
+    }
+    return fd;
+}
 
-        if (const fs::path digestDir = digestFile.parent_path(); !is_directory(digestDir)) {
-            MKDIRS(digestDir);
+BackupRunner::dir_fd::~dir_fd() {
+    if (close(fd_)) {
+        auto ec = std::make_error_code(static_cast<std::errc>(errno));
+        spdlog::error("Failed to close [fd={}][ec={}]: {}", fd_, ec.value(), ec.message());
+    }
+}
+
+void BackupRunner::hash(const unsigned index) {
+    const Digest md{digestAlgorithm_};
+    const fs::path copyFile = options_.hashWhileCopy ? tmpFile("copy", index) : fs::path{};
+    std::vector<batched_file> batch{};
+    IoBatch io{options_.ioDepth, options_.ioUring};
+    while (auto job = hashQueue_.pop()) {
+        const auto started = steady_clock::now();
+        hash(md, copyFile, batch, std::move(*job));
+        // Fill the batch with files that are already queued, waiting for more would stall the pipeline
+        while (!batch.empty() && batch.size() < MultiBufferSha256::lanes()) {
+            auto next = hashQueue_.try_pop();
+            if (!next) break;
+            hash(md, copyFile, batch, std::move(*next));
+        }
+        if (!batch.empty()) {
+            hash(io, batch);
         }
-        // Write to a temp file and "commit" with a rename
-        const fs::path tmpDigestFile = {digestFile.parent_path() / (digestFile.filename().string() + ".tmp")};
-        COPY_FILE(file.absolute_path(), tmpDigestFile);
-        RENAME_FILE(tmpDigestFile, digestFile);
+        account(backup_phase::hash, steady_clock::now() - started, nanoseconds{0});
+    }
+}
+
+void BackupRunner::hash(const Digest &md, const fs::path &copyFile, std::vector<batched_file> &batch, file_job &&job) {
+    const fs::path &hardLinksDir = directory_.repository().hardLinksDir();
+    const auto started = steady_clock::now();
+    auto &result = *job.result_;
+    StatCache::key_t key{};
+    // Stat before reading, a change while reading leaves a key that will not match the next time
+    StatCache::stat(job.source_, key);
+    result.size_ = key.size_;
+    result.mtimeNs_ = key.mtime_ns_;
+    if (key.size_ == 0) {
+        // Every empty file is the same object, no need to open (let alone hash) it
+        result.digest_ = emptyDigest_;
+        job.digestFile_ = hardLinksDir / fanout_.path(result.digest_);
+        if (!objectIndex_.contains(result.digest_)) {
+            std::call_once(emptyOnce_, [this, &job] {
+                StagedFile staged{hardLinksFd_->fd_, staging_, tmpFile("empty", 0)};
+                // Same as copy(), the object carries the permissions of the first source it was copied from
+                if (fchmod(staged.fd(), static_cast<mode_t>(fs::status(job.source_).permissions()))) {
+                    THROW_ERRNO("Failed to set permissions of '" + staged.path().string() + "'");
+                }
+                commit(job, staged);
+            });
+        }
+        do {
+            std::lock_guard lock{storeMutex_};
+            result.created_ = createdDigests_.contains(result.digest_);
+        } while (false);
+        linkQueue_.push(std::move(job));
+        return;
+    }
+    if (options_.rehash) {
+        statCache_->miss();
+    } else if (statCache_->find(key, result.digest_)) {
+        job.digestFile_ = hardLinksDir / fanout_.path(result.digest_);
+        if (objectIndex_.contains(result.digest_)) {
+            do {
+                std::lock_guard lock{storeMutex_};
+                result.created_ = createdDigests_.contains(result.digest_);
+            } while (false);
+            linkQueue_.push(std::move(job));
+            return;
+        }
+        spdlog::debug("Digest of cached file is gone [file={}][digest={}]",
+                      job.source_.string(), result.digest_.str());
+    }
+    if (options_.hashWhileCopy) {
+        StagedFile staged{hardLinksFd_->fd_, staging_, copyFile};
+        result.digest_ = copy(md, job.source_, staged);
+        bytesHashed_.fetch_add(key.size_, std::memory_order_relaxed);
+        statCache_->put(key, result.digest_);
+        job.digestFile_ = hardLinksDir / fanout_.path(result.digest_);
+        commit(job, staged);
+        result.time_ = steady_clock::now() - started;
+        linkQueue_.push(std::move(job));
+        return;
+    }
+    if (key.size_ < options_.batchDigestSize && digestAlgorithm_ == Digest::SHA256_ALGORITHM) {
+        batch.push_back({.job_ = std::move(job), .key_ = key});
+        return;
     }
-    CREATE_HARD_LINK(digestFile, toFile);
+    result.digest_ = digest(md, job.source_);
+    bytesHashed_.fetch_add(key.size_, std::memory_order_relaxed);
+    statCache_->put(key, result.digest_);
+    result.time_ = steady_clock::now() - started;
+    route(std::move(job));
 }
 
-void BackupRunner::backup(BackupSummaryBuilder &builder, const Symlink &symlink) {
-    const fs::path link = backupDir_ / symlink.relative_path();
-    const fs::path &target = symlink.relative_target();
-    builder.addSymlink(symlink.relative_path(), target);
-    if (symlink.is_target_dir()) {
-        CREATE_DIRECTORY_SYMLINK(target, link);
+void BackupRunner::hash(IoBatch &io, std::vector<batched_file> &batch) {
+    const auto started = steady_clock::now();
+    read(io, batch);
+    std::vector<MultiBufferSha256::buffer_t> buffers{};
+    buffers.reserve(batch.size());
+    uint64_t bytes = 0;
+    for (const auto &file: batch) {
+        buffers.push_back({.data_ = file.content_.data(), .len_ = file.content_.size()});
+        bytes += file.content_.size();
+    }
+    std::vector<Digest::result> digests(batch.size());
+    MultiBufferSha256::digest(buffers.data(), buffers.size(), digests.data());
+    bytesHashed_.fetch_add(bytes, std::memory_order_relaxed);
+    // The files were hashed together, each one gets its share
+    const auto time = (steady_clock::now() - started) / batch.size();
+    for (size_t i = 0; i < batch.size(); ++i) {
+        auto &[job, key, _] = batch[i];
+        job.result_->digest_ = digests[i];
+        job.result_->time_ = time;
+        statCache_->put(key, digests[i]);
+        route(std::move(job));
+    }
+    batch.clear();
+}
+
+void BackupRunner::route(file_job &&job) {
+    auto &result = *job.result_;
+    job.digestFile_ = directory_.repository().hardLinksDir() / fanout_.path(result.digest_);
+    if (objectIndex_.contains(result.digest_)) {
+        do {
+            std::lock_guard lock{storeMutex_};
+            result.created_ = createdDigests_.contains(result.digest_);
+        } while (false);
+        linkQueue_.push(std::move(job));
     } else {
-        CREATE_SYMLINK(target, link);
+        storeQueue_.push(std::move(job));
     }
 }
 
-Digest::result BackupRunner::digest(const File &file) const {
+void BackupRunner::store(const unsigned index) {
+    const fs::path storeFile = tmpFile("store", index);
+    if (exists(storeFile)) {
+        // Left over by an interrupted run
+        REMOVE(storeFile);
+    }
+    while (auto job = storeQueue_.pop()) {
+        const auto started = steady_clock::now();
+        StagedFile staged{hardLinksFd_->fd_, staging_, storeFile};
+        job->copyMethod_ = copy_file_data(job->source_, staged.fd(), staged.path());
+        commit(*job, staged);
+        const nanoseconds elapsed = steady_clock::now() - started;
+        job->result_->time_ += elapsed;
+        linkQueue_.push(std::move(*job));
+        account(backup_phase::copy, elapsed, nanoseconds{0});
+    }
+}
+
+void BackupRunner::commit(file_job &job, StagedFile &staged) {
+    auto &result = *job.result_;
+    const fs::path &digestFile = job.digestFile_;
+    const std::string name = fanout_.path(result.digest_);
+    std::lock_guard lock{storeMutex_};
+    auto outcome = staged.publish(name.c_str(), digestFile);
+    if (outcome == StagedFile::outcome::no_directory) {
+        MKDIRS(digestFile.parent_path());
+        outcome = staged.publish(name.c_str(), digestFile);
+    }
+    switch (outcome) {
+        case StagedFile::outcome::published:
+            objectIndex_.insert(result.digest_);
+            createdDigests_.insert(result.digest_);
+            ++numCopies_[static_cast<size_t>(job.copyMethod_)];
+            result.created_ = true;
+            break;
+        case StagedFile::outcome::exists:
+            // Same content was committed in the meantime (or before this run, but missing from the index)
+            objectIndex_.insert(result.digest_);
+            result.created_ = createdDigests_.contains(result.digest_);
+            break;
+        case StagedFile::outcome::no_directory:
+            THROW_EXCEPTION("Directory vanished while committing '" + digestFile.string() + "'");
+    }
+}
+
+fs::path BackupRunner::tmpFile(const char *stage, const unsigned index) const {
+    return directory_.repository().hardLinksDir() / std::format("{}.{}.tmp", stage, index);
+}
+
+void BackupRunner::link(BackupSummaryBuilder &builder) {
+    IoBatch io{options_.ioDepth, options_.ioUring};
+    std::vector<file_job> jobs{};
+    std::vector<uint32_t> replicas{};
+    uint64_t untracked = 0;
+    while (auto job = linkQueue_.pop()) {
+        const auto started = steady_clock::now();
+        jobs.emplace_back(std::move(*job));
+        // Link what is already queued in one batch, waiting for more would stall the pipeline
+        while (jobs.size() < std::max(1u, options_.ioDepth)) {
+            auto next = linkQueue_.try_pop();
+            if (!next) break;
+            jobs.emplace_back(std::move(*next));
+        }
+        for (const auto &j: jobs) {
+            // Both sides resolve from open directories: <fanout>/<digest> below hardLinksDir() and the file name
+            const std::string_view path{j.result_->path_};
+            const uint32_t index = replicas.emplace_back(replica(j.result_->digest_, untracked));
+            io.link(hardLinksFd_->fd_, object(j.result_->digest_, index),
+                    j.node_->dest_->fd_, path.substr(path.rfind('/') + 1));
+        }
+        const auto results = io.submit();
+        untrackedLinks_ -= std::exchange(untracked, 0);
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            if (results[i] == -EMLINK) {
+                relink(jobs[i], replicas[i]);
+            } else if (results[i] < 0) {
+                const fs::path toFile = backupDir_ / std::string_view{jobs[i].result_->path_};
+                THROW_ERROR_CODE("Failed to create hard link '" + jobs[i].digestFile_.string() + "' -> '" +
+                                 toFile.string() + "'", std::make_error_code(static_cast<std::errc>(-results[i])));
+            }
+            complete(builder, *jobs[i].node_);
+        }
+        jobs.clear();
+        replicas.clear();
+        account(backup_phase::link, steady_clock::now() - started, nanoseconds{0});
+    }
+}
+
+void BackupRunner::relink(const file_job &job, uint32_t full) {
+    const auto &digest = job.result_->digest_;
+    const std::string_view path{job.result_->path_};
+    const std::string name{path.substr(path.rfind('/') + 1)};
+    for (;;) {
+        const uint32_t index = overflow(digest, full);
+        if (linkat(hardLinksFd_->fd_, object(digest, index).c_str(), job.node_->dest_->fd_, name.c_str(), 0) == 0) {
+            return;
+        }
+        if (errno != EMLINK) {
+            THROW_ERRNO("Failed to create hard link '" + (directory_.repository().hardLinksDir() /
+                object(digest, index)).string() + "' -> '" + (backupDir_ / path).string() + "'");
+        }
+        full = index;
+    }
+}
+
+std::string BackupRunner::object(const Digest::result &digest, const uint32_t index) const {
+    std::string object = fanout_.path(digest);
+    if (index > 0) {
+        object += '.';
+        object += std::to_string(index);
+    }
+    return object;
+}
+
+uint32_t BackupRunner::replica(const Digest::result &digest, uint64_t &untracked) {
+    if (options_.maxLinks == 0) {
+        // Only objects that ran out of links have replicas, nothing to look up before the first one does
+        if (!overflowed_.load(std::memory_order_acquire)) return 0;
+        std::lock_guard lock{replicaMutex_};
+        const auto found = replicas_.find(digest);
+        return found == replicas_.end() ? 0 : found->second.index_;
+    }
+    std::lock_guard lock{replicaMutex_};
+    auto found = replicas_.find(digest);
+    if (found == replicas_.end()) {
+        // Objects far from the limit are not tracked, the links in flight (not counted by stat yet) cannot take them
+        // past it
+        const uint64_t links = this->links(object(digest, 0));
+        const uint64_t inFlight = uint64_t{std::max(1u, options_.linkers)} * std::max(1u, options_.ioDepth);
+        if (links + inFlight < options_.maxLinks) {
+            ++untracked;
+            ++untrackedLinks_;
+            return 0;
+        }
+        // Some of the untracked links in flight may be to this object
+        found = replicas_.emplace(digest, replica_t{
+                                      .index_ = 0, .links_ = links + untrackedLinks_.load(), .counted_ = true
+                                  }).first;
+    }
+    auto &replica = found->second;
+    if (!replica.counted_) {
+        replica.links_ = links(object(digest, replica.index_));
+        replica.counted_ = true;
+    }
+    while (replica.links_ >= options_.maxLinks) {
+        replicate(digest, ++replica.index_);
+        replica.links_ = links(object(digest, replica.index_));
+    }
+    ++replica.links_;
+    return replica.index_;
+}
+
+uint32_t BackupRunner::overflow(const Digest::result &digest, const uint32_t full) {
+    std::lock_guard lock{replicaMutex_};
+    auto &replica = replicas_[digest];
+    overflowed_.store(true, std::memory_order_release);
+    if (replica.index_ <= full) {
+        // Replicas left by earlier runs may be full too, the caller comes back for the next one
+        replica.index_ = full + 1;
+        replicate(digest, replica.index_);
+        replica.links_ = links(object(digest, replica.index_));
+        replica.counted_ = true;
+    }
+    ++replica.links_;
+    return replica.index_;
+}
+
+void BackupRunner::replicate(const Digest::result &digest, const uint32_t index) {
+    const std::string name = object(digest, index);
+    if (struct stat st{}; fstatat(hardLinksFd_->fd_, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        return;
+    }
+    const fs::path &hardLinksDir = directory_.repository().hardLinksDir();
+    StagedFile staged{hardLinksFd_->fd_, staging_, tmpFile("replica", 0)};
+    copy_file_data(hardLinksDir / object(digest, 0), staged.fd(), staged.path());
+    if (staged.publish(name.c_str(), hardLinksDir / name) != StagedFile::outcome::published) {
+        THROW_EXCEPTION("Failed to publish replica '" + (hardLinksDir / name).string() + "'");
+    }
+    ++numReplicas_;
+    spdlog::info("Object ran out of hard links, created replica '{}'", (hardLinksDir / name).string());
+}
+
+uint64_t BackupRunner::links(const std::string &object) const {
+    struct stat st{};
+    if (fstatat(hardLinksFd_->fd_, object.c_str(), &st, AT_SYMLINK_NOFOLLOW)) {
+        if (errno == ENOENT) return 0;
+        THROW_ERRNO("Failed to stat '" + (directory_.repository().hardLinksDir() / object).string() + "'");
+    }
+    return st.st_nlink;
+}
+
+template<typename Stage>
+void BackupRunner::start(std::vector<std::thread> &threads, const unsigned count, const backup_phase phase,
+                         Stage stage) {
+    const unsigned n = std::max(1u, count);
+    threads.reserve(n);
+    for (unsigned i = 0; i < n; ++i) {
+        threads.emplace_back([this, phase, stage, i] {
+            // Waits on the queues cost no CPU, the thread is only ever busy with its stage
+            const auto cpu = thread_cpu_time();
+            try {
+                if constexpr (std::is_invocable_v<Stage, unsigned>) {
+                    stage(i);
+                } else {
+                    stage();
+                }
+            } catch (...) {
+                fail(std::current_exception());
+            }
+            account(phase, nanoseconds{0}, thread_cpu_time() - cpu);
+        });
+    }
+}
+
+void BackupRunner::account(const backup_phase phase, const nanoseconds wall, const nanoseconds cpu) {
+    phaseWall_[static_cast<size_t>(phase)].fetch_add(wall.count(), std::memory_order_relaxed);
+    phaseCpu_[static_cast<size_t>(phase)].fetch_add(cpu.count(), std::memory_order_relaxed);
+}
+
+void BackupRunner::fail(const std::exception_ptr &error) {
+    do {
+        std::lock_guard lock{errorMutex_};
+        if (!error_) error_ = error;
+    } while (false);
+    hashQueue_.abort();
+    storeQueue_.abort();
+    linkQueue_.abort();
+    do {
+        std::lock_guard lock{mergeMutex_};
+        aborted_ = true;
+        for (auto *node: parked_) node->parked_ = nullptr;
+        parked_.clear();
+    } while (false);
+    scansChanged_.notify_all();
+}
+
+void BackupRunner::complete(BackupSummaryBuilder &builder, dir_node &node) {
+    if (--node.pending_ != 0) return;
+    node.dest_.reset();
+    std::lock_guard lock{mergeMutex_};
+    node.done_ = true;
+    merge(builder);
+    // Room made by the merge goes to the scans parked first
+    while (!parked_.empty() && bufferedDirs_ < maxBufferedDirs_) {
+        resume(*parked_.front());
+    }
+}
+
+void BackupRunner::merge(BackupSummaryBuilder &builder) {
+    while (!mergeStack_.empty()) {
+        auto &frame = mergeStack_.back();
+        if (!frame.node_->done_) return;
+        std::unique_ptr<dir_node> child{};
+        while (!child && frame.next_ < frame.node_->entries_.size()) {
+            auto &entry = frame.node_->entries_[frame.next_++];
+            switch (entry.kind_) {
+                case entry_result::kind::directory:
+                    builder.addDir(entry.path_);
+                    child = std::move(entry.dir_);
+                    break;
+                case entry_result::kind::file:
+                    builder.addFileTime(entry.size_, entry.time_);
+                    // The first file (in traversal order) of a digest created by this run counts as the copy
+                    if (entry.created_ && copiedDigests_.insert(entry.digest_).second) {
+                        builder.addCopiedFile(entry.path_, entry.digest_, entry.size_, entry.mtimeNs_);
+                    } else {
+                        builder.addHardLinkedFile(entry.path_, entry.digest_, entry.size_, entry.mtimeNs_);
+                    }
+                    break;
+                case entry_result::kind::symlink:
+                    builder.addSymlink(entry.path_, entry.target_);
+                    break;
+            }
+        }
+        // Careful, `frame` is invalidated by both
+        if (child) {
+            // The merge waits for it now, whatever the room
+            if (child->parked_) resume(*child);
+            mergeStack_.emplace_back(std::move(child));
+        } else {
+            mergeStack_.pop_back();
+            --bufferedDirs_;
+        }
+    }
+}
+
+Digest::result BackupRunner::digest(const Digest &md, const fs::path &file) const {
+    if (FILE_SIZE(file) >= MAPPED_DIGEST_SIZE) {
+        const MappedFile mapped{file};
+        return md.digest(mapped.data(), mapped.size(), options_.hashers);
+    }
     constexpr std::streamsize buffer_size = 8192;
-    digest_.reset();
+    md.reset();
     char buffer[buffer_size];
-    std::ifstream in{file.absolute_path(), std::ios::binary};
+    std::ifstream in{file, std::ios::binary};
     if (!in) {
-        THROW_EXCEPTION("Failed to read '" + file.absolute_path().string() + "'");
+        THROW_EXCEPTION("Failed to read '" + file.string() + "'");
     }
     while (in.read(buffer, buffer_size)) {
-        digest_.update(buffer, buffer_size);
+        md.update(buffer, buffer_size);
     }
     if (in.bad()) {
-        THROW_EXCEPTION("I/O error reading '" + file.absolute_path().string() + "'");
+        THROW_EXCEPTION("I/O error reading '" + file.string() + "'");
     }
     if (in.eof()) {
-        digest_.update(buffer, in.gcount());
-        return digest_.digest();
+        md.update(buffer, in.gcount());
+        return md.digest();
+    }
+    THROW_EXCEPTION("Problem reading '" + file.string() + "'");
+}
+
+std::string BackupRunner::read(const fs::path &file) {
+    std::ifstream in{file, std::ios::binary};
+    if (!in) {
+        THROW_EXCEPTION("Failed to read '" + file.string() + "'");
+    }
+    std::string content{std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+    if (in.bad()) {
+        THROW_EXCEPTION("I/O error reading '" + file.string() + "'");
+    }
+    return content;
+}
+
+void BackupRunner::read(IoBatch &io, std::vector<batched_file> &batch) {
+    // Open, read and close all the files with one submission each, so they are all in flight at once
+    for (const auto &file: batch) {
+        io.open(file.job_.source_, O_RDONLY | O_CLOEXEC);
+    }
+    const auto opened = io.submit();
+    const std::vector<int> fds{opened.begin(), opened.end()};
+    // Only the files that opened are read, so the reads have their own submission indexes
+    std::vector<size_t> reads(batch.size(), 0);
+    for (size_t i = 0; i < batch.size(); ++i) {
+        if (fds[i] < 0) continue;
+        auto &file = batch[i];
+        // One byte more than the size seen by stat() reveals files that grew in the meantime
+        file.content_.resize(file.key_.size_ + 1);
+        reads[i] = io.read(fds[i], file.content_.data(), file.content_.size());
+    }
+    const auto results = io.submit();
+    const std::vector<int> lengths{results.begin(), results.end()};
+    for (const int fd: fds) {
+        if (fd >= 0) io.close(fd);
+    }
+    io.submit();
+    for (size_t i = 0; i < batch.size(); ++i) {
+        auto &file = batch[i];
+        const int length = fds[i] < 0 ? fds[i] : lengths[reads[i]];
+        if (length < 0) {
+            THROW_ERROR_CODE("Failed to read '" + file.job_.source_.string() + "'",
+                             std::make_error_code(static_cast<std::errc>(-length)));
+        }
+        if (static_cast<size_t>(length) < file.content_.size()) {
+            file.content_.resize(length);
+        } else {
+            file.content_ = read(file.job_.source_);
+        }
+    }
+}
+
+Digest::result BackupRunner::copy(const Digest &md, const fs::path &from, const StagedFile &to) {
+    constexpr std::streamsize buffer_size = 128 * 1024;
+    md.reset();
+    std::ifstream in{from, std::ios::binary};
+    if (!in) {
+        THROW_EXCEPTION("Failed to read '" + from.string() + "'");
+    }
+    const auto buffer = std::make_unique<char[]>(buffer_size);
+    while (in.read(buffer.get(), buffer_size) || in.gcount() > 0) {
+        md.update(buffer.get(), in.gcount());
+        to.write(buffer.get(), in.gcount());
+    }
+    if (in.bad() || !in.eof()) {
+        THROW_EXCEPTION("I/O error reading '" + from.string() + "'");
+    }
+    // Same as copy_file, the object carries the permissions of the first source it was copied from
+    if (fchmod(to.fd(), static_cast<mode_t>(fs::status(from).permissions()))) {
+        THROW_ERRNO("Failed to set permissions of '" + to.path().string() + "'");
     }
-    THROW_EXCEPTION("Problem reading '" + file.absolute_path().string() + "'");
+    return md.digest();
 }
 
 void BackupRunner::adjustSymlinks(BackupSummaryBuilder &builder) const {
@@ -11,6 +11,20 @@ using namespace krico::backup;
 using namespace std::chrono;
 namespace fs = std::filesystem;
 
+const char *krico::backup::to_string(const backup_phase phase) {
+    switch (phase) {
+        case backup_phase::scan:
+            return "scan";
+        case backup_phase::hash:
+            return "hash";
+        case backup_phase::copy:
+            return "copy";
+        case backup_phase::link:
+            return "link";
+    }
+    return "unknown";
+}
+
 BackupSummaryBuilder::BackupSummaryBuilder(const fs::path &metaDir,
                                            BackupDirectoryId directoryId,
                                            const year_month_day &date,
@@ -21,46 +35,71 @@ BackupSummaryBuilder::BackupSummaryBuilder(const fs::path &metaDir,
       summaryFile_(
           metaDir / backupId_.parent_path() / (backupId_.filename().string() + BackupSummary::SUMMARY_FILE_SUFFIX)),
       tmpFile_(summaryFile_.parent_path(), summaryFile_.filename().string()),
-      out_(tmpFile_.file()),
+      writer_(tmpFile_.file()),
       digest_(Digest::sha1()),
       startTime_(system_clock::now()) {
 }
 
-void BackupSummaryBuilder::addDir(const std::filesystem::path &dir) {
-    ++numDirectories_;
-    const auto s = dir.string();
-
-    digest_.update(Digest::SHA1_ZERO.md_, Digest::SHA1_ZERO.len_);
-    digest_.update(s.c_str(), s.length());
+namespace {
+    //!
+    //! Add `entry` to the checksum of a backup, which covers the manifest entries in the order they are added
+    //!
+    void update_checksum(const Digest &digest, const manifest_entry &entry) {
+        switch (entry.kind_) {
+            case manifest_entry::kind::directory:
+                digest.update(Digest::SHA1_ZERO.md_, Digest::SHA1_ZERO.len_);
+                digest.update(entry.path_.data(), entry.path_.length());
+                break;
+            case manifest_entry::kind::copied:
+            case manifest_entry::kind::hard_linked:
+                digest.update(entry.digest_.md_, entry.digest_.len_);
+                digest.update(entry.path_.data(), entry.path_.length());
+                break;
+            case manifest_entry::kind::symlink:
+                digest.update(entry.path_.data(), entry.path_.length());
+                digest.update(entry.target_.data(), entry.target_.length());
+                break;
+        }
+    }
+}
 
-    out_ << "D " << s << std::endl;
+void BackupSummaryBuilder::addDir(const std::string_view dir) {
+    ++numDirectories_;
+    add({.kind_ = manifest_entry::kind::directory, .path_ = dir});
 }
 
-void BackupSummaryBuilder::addCopiedFile(const std::filesystem::path &file, const Digest::result &digest) {
+void BackupSummaryBuilder::addCopiedFile(const std::string_view file,
+                                         const Digest::result &digest,
+                                         const uint64_t size,
+                                         const int64_t mtimeNs) {
     ++numCopiedFiles_;
-    const auto s = file.string();
-    digest_.update(digest.md_, digest.len_);
-    digest_.update(s.c_str(), s.length());
-
-    out_ << "C " << digest.str() << " " << file.string() << std::endl;
+    metrics_.bytesCopied_ += size;
+    add({
+        .kind_ = manifest_entry::kind::copied, .path_ = file, .digest_ = digest, .size_ = size, .mtimeNs_ = mtimeNs
+    });
 }
 
-void BackupSummaryBuilder::addHardLinkedFile(const std::filesystem::path &file, const Digest::result &digest) {
+void BackupSummaryBuilder::addHardLinkedFile(const std::string_view file,
+                                             const Digest::result &digest,
+                                             const uint64_t size,
+                                             const int64_t mtimeNs) {
     ++numHardLinkedFiles_;
-    const auto s = file.string();
-    digest_.update(digest.md_, digest.len_);
-    digest_.update(s.c_str(), s.length());
-
-    out_ << "H " << digest.str() << " " << file.string() << std::endl;
+    metrics_.bytesDeduplicated_ += size;
+    add({
+        .kind_ = manifest_entry::kind::hard_linked, .path_ = file, .digest_ = digest, .size_ = size,
+        .mtimeNs_ = mtimeNs
+    });
 }
 
-void BackupSummaryBuilder::addSymlink(const std::filesystem::path &file, const std::filesystem::path &target) {
+void BackupSummaryBuilder::addSymlink(const std::string_view file, const std::filesystem::path &target) {
     ++numSymlinks_;
-    const auto l = file.string();
     const auto t = target.string();
-    digest_.update(l.c_str(), l.length());
-    digest_.update(t.c_str(), t.length());
-    out_ << "L " << l << "\t" << t << std::endl;
+    add({.kind_ = manifest_entry::kind::symlink, .path_ = file, .target_ = t});
+}
+
+void BackupSummaryBuilder::add(const manifest_entry &entry) {
+    update_checksum(digest_, entry);
+    writer_.add(entry);
 }
 
 void BackupSummaryBuilder::addPreviousSymlink(const std::filesystem::path &previousTarget) {
@@ -71,12 +110,45 @@ void BackupSummaryBuilder::addCurrentSymlink(const std::filesystem::path &curren
     currentTarget_ = currentTarget;
 }
 
+void BackupSummaryBuilder::addCopies(const copy_method method, const uint32_t count) {
+    numCopies_[static_cast<size_t>(method)] += count;
+}
+
+void BackupSummaryBuilder::addStatCache(const uint32_t hits, const uint32_t misses) {
+    numStatCacheHits_ += hits;
+    numStatCacheMisses_ += misses;
+}
+
+void BackupSummaryBuilder::addAllocations(const uint64_t count, const uint64_t bytes) {
+    numAllocations_ += count;
+    numAllocatedBytes_ += bytes;
+}
+
+void BackupSummaryBuilder::addReplicas(const uint32_t count) {
+    numReplicas_ += count;
+}
+
+void BackupSummaryBuilder::addPhase(const backup_phase phase, const nanoseconds wall, const nanoseconds cpu) {
+    auto &time = metrics_.phases_[static_cast<size_t>(phase)];
+    time.wall_ += wall;
+    time.cpu_ += cpu;
+}
+
+void BackupSummaryBuilder::addHashedBytes(const uint64_t bytes) {
+    metrics_.bytesHashed_ += bytes;
+}
+
+void BackupSummaryBuilder::addFileTime(const uint64_t size, const nanoseconds time) {
+    if (size > metrics_.largestFileSize_ || (size == metrics_.largestFileSize_ && time > metrics_.largestFileTime_)) {
+        metrics_.largestFileSize_ = size;
+        metrics_.largestFileTime_ = time;
+    }
+}
+
 BackupSummary BackupSummaryBuilder::build() {
     endTime_ = system_clock::now();
     checksum_ = digest_.digest();
-    // Write the final digest
-    out_ << "S " << checksum_.str() << std::endl;
-    out_.close();
+    writer_.finish(checksum_);
     RENAME_FILE(tmpFile_.file(), summaryFile_);
     return BackupSummary{*this};
 }
@@ -93,7 +165,15 @@ BackupSummary::BackupSummary(const BackupSummaryBuilder &builder)
       numSymlinks_(builder.numSymlinks_),
       previousTarget_(builder.previousTarget_),
       currentTarget_(builder.currentTarget_),
-      checksum_(builder.checksum_) {
+      checksum_(builder.checksum_),
+      metrics_(builder.metrics_),
+      numCopies_(builder.numCopies_),
+      numStatCacheHits_(builder.numStatCacheHits_),
+      numStatCacheMisses_(builder.numStatCacheMisses_),
+      numAllocations_(builder.numAllocations_),
+      numAllocatedBytes_(builder.numAllocatedBytes_),
+      numReplicas_(builder.numReplicas_),
+      inProcess_(true) {
 }
 
 BackupSummary::BackupSummary(BackupDirectoryId directoryId,
@@ -107,7 +187,8 @@ BackupSummary::BackupSummary(BackupDirectoryId directoryId,
                              const uint32_t numSymlinks,
                              std::filesystem::path previousTarget,
                              std::filesystem::path currentTarget,
-                             const Digest::result &checksum)
+                             const Digest::result &checksum,
+                             const backup_metrics &metrics)
     : directoryId_(std::move(directoryId)),
       date_(date),
       backupId_(std::move(backupId)),
@@ -119,13 +200,62 @@ BackupSummary::BackupSummary(BackupDirectoryId directoryId,
       numSymlinks_(numSymlinks),
       previousTarget_(std::move(previousTarget)),
       currentTarget_(std::move(currentTarget)),
-      checksum_(checksum) {
+      checksum_(checksum),
+      metrics_(metrics) {
 }
 
 std::filesystem::path BackupSummary::summaryFile(const std::filesystem::path &directoryMetaDir) const {
     return directoryMetaDir / backupId_.parent_path() / (backupId_.filename().string() + SUMMARY_FILE_SUFFIX);
 }
 
+ManifestReader BackupSummary::manifest(const std::filesystem::path &directoryMetaDir) const {
+    return ManifestReader{summaryFile(directoryMetaDir)};
+}
+
+Digest::result BackupSummary::compute_checksum(const ManifestReader &manifest) {
+    const auto digest = Digest::sha1();
+    for (const auto &entry: manifest) {
+        update_checksum(digest, entry);
+    }
+    return digest.digest();
+}
+
+std::string BackupSummary::copyMethods() const {
+    std::string ret{};
+    for (size_t i = 0; i < numCopies_.size(); ++i) {
+        if (numCopies_[i] == 0) continue;
+        if (!ret.empty()) ret += ' ';
+        ret += std::format("{}={}", to_string(static_cast<copy_method>(i)), numCopies_[i]);
+    }
+    return ret.empty() ? "-" : ret;
+}
+
+void BackupSummary::printRunCounters(std::ostream &out) const {
+    static constexpr auto WIDTH = 2 * DigestLength::SHA1;
+    out << "Copy methods : " << std::setw(WIDTH) << copyMethods() << std::endl
+        << "Stat cache   : " << std::setw(WIDTH) << std::format("hits={} misses={}", numStatCacheHits_,
+                                                                numStatCacheMisses_) << std::endl
+        << "Allocations  : " << std::setw(WIDTH) << std::format("count={} bytes={}", numAllocations_,
+                                                                numAllocatedBytes_) << std::endl
+        << "Replicas     : " << std::setw(WIDTH) << numReplicas_ << std::endl;
+}
+
+std::string BackupSummary::phaseTime(const backup_phase phase) const {
+    if (metrics_ == backup_metrics{}) return "-";
+    const auto &[wall, cpu] = metrics_.phase(phase);
+    return std::format("wall={0:%T} cpu={1:%T}", duration_cast<microseconds>(wall), duration_cast<microseconds>(cpu));
+}
+
+std::string BackupSummary::metricBytes(const uint64_t bytes) const {
+    return metrics_ == backup_metrics{} ? "-" : std::to_string(bytes);
+}
+
+std::string BackupSummary::largestFile() const {
+    if (metrics_ == backup_metrics{}) return "-";
+    return std::format("size={} time={:%T}", metrics_.largestFileSize_,
+                       duration_cast<microseconds>(metrics_.largestFileTime_));
+}
+
 bool BackupSummary::operator==(const BackupSummary &rhs) const {
     if (this == &rhs) return true;
 
@@ -140,5 +270,6 @@ bool BackupSummary::operator==(const BackupSummary &rhs) const {
            && numSymlinks_ == rhs.numSymlinks_
            && previousTarget_ == rhs.previousTarget_
            && currentTarget_ == rhs.currentTarget_
-           && checksum_ == rhs.checksum_;
+           && checksum_ == rhs.checksum_
+           && metrics_ == rhs.metrics_;
 }
@@ -0,0 +1,409 @@
+#include "krico/backup/Blake3.h"
+#include "krico/backup/exception.h"
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+using namespace krico::backup;
+
+namespace {
+    constexpr uint32_t IV[8] = {
+        0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+    };
+
+    enum : uint8_t {
+        CHUNK_START = 1 << 0,
+        CHUNK_END = 1 << 1,
+        PARENT = 1 << 2,
+        ROOT = 1 << 3,
+    };
+
+    constexpr size_t ROUNDS = 7;
+
+    //!
+    //! Message word order of every round (the permutation applied 0..6 times)
+    //!
+    constexpr auto SCHEDULE = [] {
+        constexpr uint8_t PERMUTATION[16] = {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8};
+        std::array<std::array<uint8_t, 16>, ROUNDS> schedule{};
+        for (uint8_t i = 0; i < 16; ++i) schedule[0][i] = i;
+        for (size_t r = 1; r < ROUNDS; ++r) {
+            for (size_t i = 0; i < 16; ++i) schedule[r][i] = schedule[r - 1][PERMUTATION[i]];
+        }
+        return schedule;
+    }();
+
+    inline uint32_t load32(const uint8_t *p) {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        if constexpr (std::endian::native == std::endian::big) v = __builtin_bswap32(v);
+        return v;
+    }
+
+    inline void store32(uint8_t *p, uint32_t v) {
+        if constexpr (std::endian::native == std::endian::big) v = __builtin_bswap32(v);
+        std::memcpy(p, &v, sizeof(v));
+    }
+
+    // Works for both uint32_t and vectors of uint32_t.  Vectors are only passed by reference: passing or returning
+    // them by value from a function that is not compiled for their instruction set changes the ABI (-Wpsabi).
+    template<typename V>
+    [[gnu::always_inline]] inline void rotr(V &x, const int n) {
+        x = (x >> n) | (x << (32 - n));
+    }
+
+    template<typename V>
+    [[gnu::always_inline]] inline void g(V *v, const int a, const int b, const int c, const int d, const V &x,
+                                         const V &y) {
+        v[a] = v[a] + v[b] + x;
+        v[d] ^= v[a];
+        rotr(v[d], 16);
+        v[c] = v[c] + v[d];
+        v[b] ^= v[c];
+        rotr(v[b], 12);
+        v[a] = v[a] + v[b] + y;
+        v[d] ^= v[a];
+        rotr(v[d], 8);
+        v[c] = v[c] + v[d];
+        v[b] ^= v[c];
+        rotr(v[b], 7);
+    }
+
+    template<typename V>
+    [[gnu::always_inline]] inline void rounds(V v[16], const V m[16]) {
+        for (const auto &s: SCHEDULE) {
+            g(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+            g(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+            g(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+            g(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+            g(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+            g(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+            g(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+            g(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+        }
+    }
+
+    //!
+    //! Compress one block, `out` receives the first 8 words of the output (the chaining value)
+    //!
+    void compress(const uint32_t cv[8], const uint8_t block[Blake3::BLOCK_LEN], const uint8_t blockLen,
+                  const uint64_t counter, const uint8_t flags, uint32_t out[8]) {
+        uint32_t m[16];
+        for (size_t i = 0; i < 16; ++i) m[i] = load32(block + 4 * i);
+        uint32_t v[16] = {
+            cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+            IV[0], IV[1], IV[2], IV[3],
+            static_cast<uint32_t>(counter), static_cast<uint32_t>(counter >> 32), blockLen, flags
+        };
+        rounds(v, m);
+        for (size_t i = 0; i < 8; ++i) out[i] = v[i] ^ v[i + 8];
+    }
+
+    void parent_cv(const uint32_t left[8], const uint32_t right[8], const uint8_t flags, uint32_t out[8]) {
+        uint8_t block[Blake3::BLOCK_LEN];
+        for (size_t i = 0; i < 8; ++i) {
+            store32(block + 4 * i, left[i]);
+            store32(block + 32 + 4 * i, right[i]);
+        }
+        compress(IV, block, Blake3::BLOCK_LEN, 0, PARENT | flags, out);
+    }
+
+    template<size_t L>
+    struct vec {
+        typedef uint32_t type __attribute__((vector_size(4 * L)));
+    };
+
+    using hash_chunks_fn = void (*)(const uint8_t *const *inputs, size_t n, uint64_t counter, uint8_t *out);
+
+    //!
+    //! Compress `n` (<= L) whole chunks at once, chunk `i` has counter `counter + i` and its chaining value goes to
+    //! `out + 32 * i`.  Each lane of the vectors works on one chunk.
+    //!
+    template<size_t L>
+    [[gnu::always_inline]] inline void hash_chunks(const uint8_t *const *inputs, const size_t n, const uint64_t counter,
+                                                   uint8_t *out) {
+        using V = typename vec<L>::type;
+        V cv[8];
+        for (size_t i = 0; i < 8; ++i) cv[i] = V{} + IV[i];
+        V counterLow{}, counterHigh{};
+        for (size_t j = 0; j < L; ++j) {
+            counterLow[j] = static_cast<uint32_t>(counter + j);
+            counterHigh[j] = static_cast<uint32_t>((counter + j) >> 32);
+        }
+        for (size_t b = 0; b < Blake3::CHUNK_LEN / Blake3::BLOCK_LEN; ++b) {
+            // Transpose: word w of every lane's block goes into m[w]
+            alignas(64) uint32_t words[16][L];
+            for (size_t j = 0; j < L; ++j) {
+                // Unused lanes just repeat the first chunk
+                const uint8_t *block = inputs[j < n ? j : 0] + b * Blake3::BLOCK_LEN;
+                for (size_t w = 0; w < 16; ++w) words[w][j] = load32(block + 4 * w);
+            }
+            V m[16];
+            std::memcpy(m, words, sizeof(m));
+            const uint8_t flags = (b == 0 ? CHUNK_START : 0) | (b == Blake3::CHUNK_LEN / Blake3::BLOCK_LEN - 1
+                                                                    ? CHUNK_END
+                                                                    : 0);
+            V v[16] = {
+                cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+                V{} + IV[0], V{} + IV[1], V{} + IV[2], V{} + IV[3],
+                counterLow, counterHigh, V{} + static_cast<uint32_t>(Blake3::BLOCK_LEN), V{} + flags
+            };
+            rounds(v, m);
+            for (size_t i = 0; i < 8; ++i) cv[i] = v[i] ^ v[i + 8];
+        }
+        for (size_t j = 0; j < n; ++j) {
+            for (size_t i = 0; i < 8; ++i) store32(out + 32 * j + 4 * i, cv[i][j]);
+        }
+    }
+
+    void hash_chunks_portable(const uint8_t *const *inputs, const size_t n, const uint64_t counter, uint8_t *out) {
+        hash_chunks<1>(inputs, n, counter, out);
+    }
+
+    void hash_chunks_128(const uint8_t *const *inputs, const size_t n, const uint64_t counter, uint8_t *out) {
+        hash_chunks<4>(inputs, n, counter, out);
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    __attribute__((target("avx2")))
+    void hash_chunks_avx2(const uint8_t *const *inputs, const size_t n, const uint64_t counter, uint8_t *out) {
+        hash_chunks<8>(inputs, n, counter, out);
+    }
+
+    __attribute__((target("avx512f")))
+    void hash_chunks_avx512(const uint8_t *const *inputs, const size_t n, const uint64_t counter, uint8_t *out) {
+        hash_chunks<16>(inputs, n, counter, out);
+    }
+#endif
+
+    struct simd_t {
+        const char *name_;
+        size_t lanes_;
+        hash_chunks_fn hashChunks_;
+        bool (*supported_)();
+    };
+
+    //!
+    //! All the implementations, the widest first
+    //!
+    constexpr simd_t SIMD[] = {
+#if defined(__x86_64__) || defined(__i386__)
+        {"avx512", 16, hash_chunks_avx512, [] { return __builtin_cpu_supports("avx512f") != 0; }},
+        {"avx2", 8, hash_chunks_avx2, [] { return __builtin_cpu_supports("avx2") != 0; }},
+        {"sse2", 4, hash_chunks_128, [] { return true; }},
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+        {"neon", 4, hash_chunks_128, [] { return true; }},
+#else
+        {"simd128", 4, hash_chunks_128, [] { return true; }},
+#endif
+        {"portable", 1, hash_chunks_portable, [] { return true; }},
+    };
+
+    std::atomic<const simd_t *> &selected() {
+        // The last one is always supported
+        static std::atomic<const simd_t *> selected{
+            std::ranges::find_if(SIMD, [](const simd_t &s) { return s.supported_(); })
+        };
+        return selected;
+    }
+
+    const simd_t &simd() {
+        return *selected().load(std::memory_order_relaxed);
+    }
+}
+
+Blake3::Blake3() : Blake3(0) {
+}
+
+Blake3::Blake3(const uint64_t chunkCounter) {
+    start_chunk(chunkCounter);
+}
+
+void Blake3::reset() {
+    cvStackLen_ = 0;
+    start_chunk(0);
+}
+
+void Blake3::update(const void *data, size_t len) {
+    auto input = static_cast<const uint8_t *>(data);
+    const auto &impl = simd();
+    const size_t lanes = impl.lanes_;
+    const auto hashChunks = impl.hashChunks_;
+    while (len > 0) {
+        if (chunk_.len() == CHUNK_LEN) {
+            // More input is coming, so this chunk is not the root
+            uint32_t cv[8];
+            chunk_output().chaining_value(cv);
+            const uint64_t total = chunk_.counter_ + 1;
+            push_cv(cv, 0, total);
+            start_chunk(total);
+        }
+        if (chunk_.len() == 0 && len > 2 * CHUNK_LEN) {
+            // Whole chunks that are not the last one, compress them in parallel
+            const size_t n = std::min(lanes, (len - 1) / CHUNK_LEN);
+            const uint8_t *inputs[16];
+            uint8_t cvs[16 * OUT_LEN];
+            for (size_t i = 0; i < n; ++i) inputs[i] = input + i * CHUNK_LEN;
+            hashChunks(inputs, n, chunk_.counter_, cvs);
+            for (size_t i = 0; i < n; ++i) {
+                uint32_t cv[8];
+                for (size_t w = 0; w < 8; ++w) cv[w] = load32(cvs + OUT_LEN * i + 4 * w);
+                push_cv(cv, 0, chunk_.counter_ + i + 1);
+            }
+            start_chunk(chunk_.counter_ + n);
+            input += n * CHUNK_LEN;
+            len -= n * CHUNK_LEN;
+            continue;
+        }
+        const size_t take = std::min(CHUNK_LEN - chunk_.len(), len);
+        update_chunk(input, take);
+        input += take;
+        len -= take;
+    }
+}
+
+void Blake3::finalize(uint8_t out[OUT_LEN]) const {
+    // Merge the right edge of the tree, the last merge is the root
+    output_t output = chunk_output();
+    for (size_t i = cvStackLen_; i > 0; --i) {
+        uint32_t right[8];
+        output.chaining_value(right);
+        output_t parent{.cv_ = {}, .block_ = {}, .blockLen_ = BLOCK_LEN, .counter_ = 0, .flags_ = PARENT};
+        std::memcpy(parent.cv_, IV, sizeof(IV));
+        for (size_t w = 0; w < 8; ++w) {
+            store32(parent.block_ + 4 * w, cvStack_[i - 1][w]);
+            store32(parent.block_ + 32 + 4 * w, right[w]);
+        }
+        output = parent;
+    }
+    output.root(out);
+}
+
+void Blake3::hash(const void *data, const size_t len, uint8_t out[OUT_LEN], const unsigned threads) {
+    const auto input = static_cast<const uint8_t *>(data);
+    Blake3 hasher{};
+    // Whole chunks before the last one (which may be partial and must go through the regular path)
+    const uint64_t chunks = len == 0 ? 0 : (len - 1) / CHUNK_LEN;
+    // Aim for a few sub-trees per thread so threads finishing early can pick up more
+    const uint64_t target = chunks / (4 * std::max(1u, threads));
+    const uint64_t subtreeChunks = std::max<uint64_t>(std::bit_floor(std::max<uint64_t>(target, 1)), 2 * lanes());
+    const uint64_t subtrees = threads > 1 ? chunks / subtreeChunks : 0;
+    if (subtrees < 2) {
+        hasher.update(data, len);
+        hasher.finalize(out);
+        return;
+    }
+    std::vector<std::array<uint32_t, 8> > cvs(subtrees);
+    std::atomic<uint64_t> next{0};
+    auto work = [&] {
+        for (uint64_t i = next++; i < subtrees; i = next++) {
+            Blake3 subtree{i * subtreeChunks};
+            subtree.update(input + i * subtreeChunks * CHUNK_LEN, subtreeChunks * CHUNK_LEN);
+            subtree.subtree_cv(cvs[i].data());
+        }
+    };
+    std::vector<std::thread> workers{};
+    for (unsigned t = 1; t < std::min<uint64_t>(threads, subtrees); ++t) workers.emplace_back(work);
+    work();
+    for (auto &t: workers) t.join();
+
+    const auto level = static_cast<unsigned>(std::countr_zero(subtreeChunks));
+    for (uint64_t i = 0; i < subtrees; ++i) {
+        hasher.push_cv(cvs[i].data(), level, (i + 1) * subtreeChunks);
+    }
+    const uint64_t done = subtrees * subtreeChunks;
+    hasher.start_chunk(done);
+    hasher.update(input + done * CHUNK_LEN, len - done * CHUNK_LEN);
+    hasher.finalize(out);
+}
+
+const char *Blake3::implementation() {
+    return simd().name_;
+}
+
+void Blake3::implementation(const std::string &name) {
+    const auto it = std::ranges::find_if(SIMD, [&name](const simd_t &s) { return name == s.name_; });
+    if (it == std::end(SIMD) || !it->supported_()) {
+        THROW_EXCEPTION("BLAKE3 implementation '" + name + "' is not available");
+    }
+    selected().store(it, std::memory_order_relaxed);
+}
+
+std::vector<const char *> Blake3::implementations() {
+    std::vector<const char *> ret{};
+    for (const auto &s: SIMD) {
+        if (s.supported_()) ret.push_back(s.name_);
+    }
+    return ret;
+}
+
+size_t Blake3::lanes() {
+    return simd().lanes_;
+}
+
+void Blake3::start_chunk(const uint64_t chunkCounter) {
+    std::memcpy(chunk_.cv_, IV, sizeof(IV));
+    chunk_.counter_ = chunkCounter;
+    chunk_.blockLen_ = 0;
+    chunk_.blocksCompressed_ = 0;
+}
+
+void Blake3::update_chunk(const uint8_t *data, size_t len) {
+    while (len > 0) {
+        if (chunk_.blockLen_ == BLOCK_LEN) {
+            compress(chunk_.cv_, chunk_.block_, BLOCK_LEN, chunk_.counter_,
+                     chunk_.blocksCompressed_ == 0 ? CHUNK_START : 0, chunk_.cv_);
+            ++chunk_.blocksCompressed_;
+            chunk_.blockLen_ = 0;
+        }
+        const size_t take = std::min(BLOCK_LEN - chunk_.blockLen_, len);
+        std::memcpy(chunk_.block_ + chunk_.blockLen_, data, take);
+        chunk_.blockLen_ += take;
+        data += take;
+        len -= take;
+    }
+}
+
+Blake3::output_t Blake3::chunk_output() const {
+    output_t output{
+        .cv_ = {}, .block_ = {}, .blockLen_ = chunk_.blockLen_, .counter_ = chunk_.counter_,
+        .flags_ = static_cast<uint8_t>((chunk_.blocksCompressed_ == 0 ? CHUNK_START : 0) | CHUNK_END)
+    };
+    std::memcpy(output.cv_, chunk_.cv_, sizeof(output.cv_));
+    // Blocks are zero padded
+    std::memcpy(output.block_, chunk_.block_, chunk_.blockLen_);
+    return output;
+}
+
+void Blake3::push_cv(const uint32_t cv[8], const unsigned level, const uint64_t totalChunks) {
+    // Every trailing zero (above `level`) of the total number of chunks completes a sub-tree, whose left child is
+    // on top of the stack
+    uint32_t merged[8];
+    std::memcpy(merged, cv, sizeof(merged));
+    for (uint64_t total = totalChunks >> level; (total & 1) == 0; total >>= 1) {
+        parent_cv(cvStack_[--cvStackLen_], merged, 0, merged);
+    }
+    std::memcpy(cvStack_[cvStackLen_++], merged, sizeof(merged));
+}
+
+void Blake3::subtree_cv(uint32_t cv[8]) const {
+    chunk_output().chaining_value(cv);
+    for (size_t i = cvStackLen_; i > 0; --i) {
+        parent_cv(cvStack_[i - 1], cv, 0, cv);
+    }
+}
+
+void Blake3::output_t::chaining_value(uint32_t cv[8]) const {
+    compress(cv_, block_, blockLen_, counter_, flags_, cv);
+}
+
+void Blake3::output_t::root(uint8_t out[OUT_LEN]) const {
+    uint32_t words[8];
+    compress(cv_, block_, blockLen_, 0, flags_ | ROOT, words);
+    for (size_t i = 0; i < 8; ++i) store32(out + 4 * i, words[i]);
+}
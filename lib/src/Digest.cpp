@@ -1,4 +1,5 @@
 #include "krico/backup/Digest.h"
+#include "krico/backup/Blake3.h"
 #include "krico/backup/exception.h"
 #include <spdlog/spdlog.h>
 #include <openssl/err.h>
@@ -48,9 +49,13 @@ namespace {
     };
 }
 
-Digest::Digest(const std::string &algorithm, const std::string &properties)
-    : digest_(EVP_MD_fetch(nullptr, algorithm.c_str(), properties.c_str())),
-      context_(EVP_MD_CTX_new()) {
+Digest::Digest(const std::string &algorithm, const std::string &properties) {
+    if (algorithm == BLAKE3_ALGORITHM) {
+        blake3_ = std::make_unique<Blake3>();
+        return;
+    }
+    digest_ = EVP_MD_fetch(nullptr, algorithm.c_str(), properties.c_str());
+    context_ = EVP_MD_CTX_new();
     if (!digest_) {
         if (context_) {
             EVP_MD_CTX_free(context_);
@@ -84,27 +89,36 @@ Digest::~Digest() {
 }
 
 Digest Digest::sha1() {
-    constexpr auto ALGORITHM = "SHA-1";
-    return Digest{ALGORITHM};
+    return Digest{SHA1_ALGORITHM};
 }
 
 Digest Digest::sha256() {
-    constexpr auto ALGORITHM = "SHA2-256";
-    return Digest{ALGORITHM};
+    return Digest{SHA256_ALGORITHM};
 }
 
 Digest Digest::md5() {
-    constexpr auto ALGORITHM = "MD5";
-    return Digest{ALGORITHM};
+    return Digest{MD5_ALGORITHM};
+}
+
+Digest Digest::blake3() {
+    return Digest{BLAKE3_ALGORITHM};
 }
 
 void Digest::reset() const {
+    if (blake3_) {
+        blake3_->reset();
+        return;
+    }
     if (!EVP_DigestInit_ex(context_, digest_, nullptr)) {
         THROW(openssl_error, "DigestInit");
     }
 }
 
 void Digest::update(const void *data, const size_t len) const {
+    if (blake3_) {
+        blake3_->update(data, len);
+        return;
+    }
     if (!EVP_DigestUpdate(context_, data, len)) {
         THROW(openssl_error, "DigestUpdate");
     }
@@ -112,15 +126,32 @@ void Digest::update(const void *data, const size_t len) const {
 
 Digest::result Digest::digest() const {
     result r{};
+    if (blake3_) {
+        blake3_->finalize(r.md_);
+        r.len_ = DigestLength::BLAKE3;
+        return r;
+    }
     if (!EVP_DigestFinal_ex(context_, r.md_, &r.len_)) {
         THROW(openssl_error, "DigestFinal");
     }
     return r;
 }
 
+Digest::result Digest::digest(const void *data, const size_t len, const unsigned threads) const {
+    if (blake3_) {
+        result r{};
+        Blake3::hash(data, len, r.md_, threads);
+        r.len_ = DigestLength::BLAKE3;
+        return r;
+    }
+    reset();
+    update(data, len);
+    return digest();
+}
+
 Digest::result Digest::zero() const {
     result r{};
-    r.len_ = EVP_MD_get_size(digest_);
+    r.len_ = blake3_ ? DigestLength::BLAKE3 : EVP_MD_get_size(digest_);
     return r;
 }
 
@@ -6,6 +6,13 @@
 using namespace krico::backup;
 namespace fs = std::filesystem;
 
+namespace {
+    CountingResource &upstream() {
+        static CountingResource resource{};
+        return resource;
+    }
+}
+
 directory_entry::directory_entry(const std::filesystem::path &base, const std::filesystem::path &path)
     : basePath_(absolute(base)), absolutePath_(absolute(path)),
       relativePath_(absolutePath_.lexically_proximate(basePath_)) {
@@ -28,39 +35,61 @@ const Symlink &directory_entry::as_symlink() const {
 }
 
 Directory::iterator::~iterator() {
-    delete current_;
-    current_ = nullptr;
+    release();
 }
 
-Directory::iterator::iterator(const iterator &rhs) : directory_(rhs.directory_), it_(rhs.it_) {
+Directory::iterator::iterator(const iterator &rhs) : directory_(rhs.directory_), index_(rhs.index_) {
 }
 
 Directory::iterator &Directory::iterator::operator=(const iterator &rhs) {
     if (this == &rhs) return *this;
+    // The current entry belongs to the arena this iterator was on, rhs's is not shared, this one creates its own when
+    // dereferenced
+    release();
     directory_ = rhs.directory_;
-    it_ = rhs.it_;
-    delete current_;
-    current_ = rhs.current_;
+    index_ = rhs.index_;
     return *this;
 }
 
+template<typename T, typename... Args>
+void Directory::iterator::emplace(Args &&... args) {
+    release();
+    if (arena_ != directory_->arena_) arena_ = directory_->arena_;
+    void *p = arena_->allocate(sizeof(T), alignof(T));
+    try {
+        current_ = new(p) T(std::forward<Args>(args)...);
+    } catch (...) {
+        arena_->deallocate(p, sizeof(T), alignof(T));
+        throw;
+    }
+    currentSize_ = sizeof(T);
+    currentAlignment_ = alignof(T);
+}
+
+void Directory::iterator::release() {
+    if (!current_) return;
+    current_->~directory_entry();
+    arena_->deallocate(current_, currentSize_, currentAlignment_);
+    current_ = nullptr;
+}
+
 const std::filesystem::path &directory_entry::relative_path() const {
     return relativePath_;
 }
 
 Directory::iterator::reference Directory::iterator::operator*() {
-    const auto &entry = *it_;
-    if (current_ && current_->absolute_path() == entry.path()) {
+    const auto entry = (*directory_->entries_)[index_];
+    const fs::path path = directory_->absolutePath_ / entry.name_;
+    if (current_ && current_->absolute_path() == path) {
         return *current_;
     }
 
-    delete current_;
     if (entry.is_symlink()) {
-        current_ = new Symlink(*directory_, entry.path(), entry.is_directory());
-    } else if (entry.is_regular_file()) {
-        current_ = new File(*directory_, entry.path());
+        emplace<Symlink>(*directory_, path, directory_->entries_->is_directory(entry.name_));
+    } else if (entry.is_file()) {
+        emplace<File>(*directory_, path);
     } else if (entry.is_directory()) {
-        current_ = new Directory(*directory_, entry.path());
+        emplace<Directory>(*directory_, path);
     } else {
         // TODO: handle this
         THROW_EXCEPTION("Entry is neither a file nor a directory");
@@ -68,19 +97,14 @@ Directory::iterator::reference Directory::iterator::operator*() {
     return *current_;
 }
 
-Directory::iterator::iterator(const Directory &directory,
-                              const std::vector<std::filesystem::directory_entry>::const_iterator it)
-    : directory_(&directory), it_(it) {
+Directory::iterator::iterator(const Directory &directory, const size_t index)
+    : directory_(&directory), index_(index) {
 }
 
 Directory::Directory(const std::filesystem::path &base, const std::filesystem::path &path)
-    : directory_entry(base, path) {
-    for (auto const &entry: std::filesystem::directory_iterator{absolutePath_}) {
-        entries_.emplace_back(entry);
-    }
-    // Why does clion think this is broken :(
-    // std::ranges::sort(entries_, [](auto &e1, auto &e2) { return e1.path() < e2.path(); });
-    std::sort(entries_.begin(), entries_.end(), [](auto &e1, auto &e2) { return e1.path() < e2.path(); });
+    : directory_entry(base, path),
+      entries_(std::make_shared<const DirectoryScanner>(absolutePath_)),
+      arena_(std::make_shared<std::pmr::unsynchronized_pool_resource>(&upstream())) {
 }
 
 Directory::Directory(const fs::path &dir) : Directory(dir, dir) {
@@ -91,11 +115,15 @@ Directory::Directory(const Directory &parent, const std::filesystem::path &dir)
 }
 
 Directory::iterator Directory::begin() const {
-    return iterator(*this, entries_.begin());
+    return iterator(*this, 0);
 }
 
 Directory::iterator Directory::end() const {
-    return iterator(*this, entries_.end());
+    return iterator(*this, entries_->size());
+}
+
+const CountingResource &Directory::allocations() {
+    return upstream();
 }
 
 File::File(const Directory &parent, const std::filesystem::path &file)
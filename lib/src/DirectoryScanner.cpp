@@ -0,0 +1,158 @@
+#include "krico/backup/DirectoryScanner.h"
+#include "krico/backup/exception.h"
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+using namespace krico::backup;
+namespace fs = std::filesystem;
+
+namespace {
+    constexpr int OPEN_FLAGS = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+
+    DirectoryScanner::entry_type to_entry_type(const mode_t mode) {
+        if (S_ISREG(mode)) return DirectoryScanner::entry_type::file;
+        if (S_ISDIR(mode)) return DirectoryScanner::entry_type::directory;
+        if (S_ISLNK(mode)) return DirectoryScanner::entry_type::symlink;
+        return DirectoryScanner::entry_type::other;
+    }
+
+#ifdef __linux__
+    //! Layout of the records returned by getdents64 (glibc has no wrapper before 2.30)
+    struct linux_dirent64 {
+        ino64_t d_ino;
+        off64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[];
+    };
+#endif
+}
+
+DirectoryScanner::DirectoryScanner(const fs::path &dir)
+    : path_(dir),
+      fd_(open(dir.c_str(), OPEN_FLAGS)) {
+    if (fd_ == -1) {
+        THROW_ERRNO("Failed to open directory '" + path_.string() + "'");
+    }
+    read();
+}
+
+DirectoryScanner::DirectoryScanner(const DirectoryScanner &parent, const std::string_view name)
+    : path_(parent.path_ / name),
+      // A sub-directory replaced by a symlink since it was read must not be followed
+      fd_(openat(parent.fd_, name.data(), OPEN_FLAGS | O_NOFOLLOW)) {
+    if (fd_ == -1) {
+        THROW_ERRNO("Failed to open directory '" + path_.string() + "'");
+    }
+    read();
+}
+
+DirectoryScanner::~DirectoryScanner() {
+    if (fd_ != -1 && close(fd_)) {
+        auto ec = std::make_error_code(static_cast<std::errc>(errno));
+        spdlog::error("Failed to close '{}' [ec={}]: {}", path_.string(), ec.value(), ec.message());
+    }
+}
+
+void DirectoryScanner::read() {
+#ifdef __linux__
+    alignas(linux_dirent64) char buffer[64 * 1024];
+    for (;;) {
+        const long n = syscall(SYS_getdents64, fd_, buffer, sizeof(buffer));
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            THROW_ERRNO("Failed to read directory '" + path_.string() + "'");
+        }
+        if (n == 0) break;
+        for (long pos = 0; pos < n;) {
+            const auto *dirent = reinterpret_cast<const linux_dirent64 *>(buffer + pos);
+            add(dirent->d_name, dirent->d_type);
+            pos += dirent->d_reclen;
+        }
+    }
+#else
+    // readdir() owns (and closes) its descriptor, give it a duplicate so fd_ stays usable for the *at() calls
+    const int fd = dup(fd_);
+    if (fd == -1) {
+        THROW_ERRNO("Failed to dup directory '" + path_.string() + "'");
+    }
+    DIR *dir = fdopendir(fd);
+    if (!dir) {
+        const auto ec = std::make_error_code(static_cast<std::errc>(errno));
+        close(fd);
+        THROW_ERROR_CODE("Failed to open directory '" + path_.string() + "'", ec);
+    }
+    errno = 0;
+    while (const dirent *entry = readdir(dir)) {
+        add(entry->d_name, entry->d_type);
+        errno = 0;
+    }
+    const int error = errno;
+    closedir(dir);
+    if (error) {
+        THROW_ERROR_CODE("Failed to read directory '" + path_.string() + "'",
+                         std::make_error_code(static_cast<std::errc>(error)));
+    }
+#endif
+    std::ranges::sort(entries_, [this](const entry_t &lhs, const entry_t &rhs) {
+        return std::string_view{names_.data() + lhs.offset_, lhs.len_} <
+               std::string_view{names_.data() + rhs.offset_, rhs.len_};
+    });
+}
+
+void DirectoryScanner::add(const char *name, const unsigned char type) {
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) return;
+    entry_type entryType;
+    switch (type) {
+        case DT_REG:
+            entryType = entry_type::file;
+            break;
+        case DT_DIR:
+            entryType = entry_type::directory;
+            break;
+        case DT_LNK:
+            entryType = entry_type::symlink;
+            break;
+        case DT_UNKNOWN: {
+            // Not every file system fills d_type in
+            struct stat st{};
+            if (fstatat(fd_, name, &st, AT_SYMLINK_NOFOLLOW)) {
+                THROW_ERRNO("Failed to stat '" + (path_ / name).string() + "'");
+            }
+            entryType = to_entry_type(st.st_mode);
+            break;
+        }
+        default:
+            entryType = entry_type::other;
+    }
+    const size_t len = std::strlen(name);
+    entries_.push_back({
+        .offset_ = static_cast<uint32_t>(names_.size()),
+        .len_ = static_cast<uint16_t>(len),
+        .type_ = entryType
+    });
+    // Keep the terminator, so names can be passed to the *at() calls as they are
+    names_.append(name, len + 1);
+}
+
+fs::path DirectoryScanner::read_symlink(const std::string_view name) const {
+    char target[PATH_MAX];
+    const auto len = readlinkat(fd_, name.data(), target, sizeof(target));
+    if (len == -1) {
+        THROW_ERRNO("Failed to read symlink '" + (path_ / name).string() + "'");
+    }
+    return fs::path{std::string_view{target, static_cast<size_t>(len)}};
+}
+
+bool DirectoryScanner::is_directory(const std::string_view name) const {
+    struct stat st{};
+    return fstatat(fd_, name.data(), &st, 0) == 0 && S_ISDIR(st.st_mode);
+}
@@ -0,0 +1,92 @@
+#include "krico/backup/Fanout.h"
+#include "krico/backup/exception.h"
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <cctype>
+
+using namespace krico::backup;
+namespace fs = std::filesystem;
+
+namespace {
+    constexpr char HEX[] = "0123456789abcdef";
+
+    void submit(IoBatch &io, const std::vector<std::string> &dirs, const fs::path &dir) {
+        const auto results = io.submit();
+        for (size_t i = 0; i < results.size(); ++i) {
+            if (results[i] < 0 && results[i] != -EEXIST) {
+                THROW_ERROR_CODE("Failed to create '" + (dir / dirs[i]).string() + "'",
+                                 std::make_error_code(static_cast<std::errc>(-results[i])));
+            }
+        }
+    }
+}
+
+void Fanout::validate() const {
+    if (depth_ > MAX_DEPTH || width_ < 1 || width_ > MAX_WIDTH || depth_ * width_ > MAX_DIGITS) {
+        THROW_EXCEPTION("Invalid fanout " + str() + " (depth <= " + std::to_string(MAX_DEPTH)
+            + ", 1 <= width <= " + std::to_string(MAX_WIDTH)
+            + ", depth * width <= " + std::to_string(MAX_DIGITS) + ")");
+    }
+}
+
+std::string Fanout::path(const Digest::result &digest) const {
+    std::string ret{};
+    ret.reserve(2 * digest.len_ + depth_);
+    const size_t dirDigits = depth_ * width_;
+    for (size_t i = 0; i < 2 * digest.len_; ++i) {
+        const uint8_t byte = digest.md_[i / 2];
+        ret.push_back(HEX[i % 2 == 0 ? byte >> 4 : byte & 0x0f]);
+        if (i + 1 <= dirDigits && (i + 1) % width_ == 0) {
+            ret.push_back(fs::path::preferred_separator);
+        }
+    }
+    return ret;
+}
+
+bool Fanout::is_directory(const fs::path &relative) const {
+    size_t level = 0;
+    for (const auto &part: relative) {
+        const auto &name = part.native();
+        if (++level > depth_ || name.size() != width_ || !std::ranges::all_of(name, [](const unsigned char c) {
+            return std::isdigit(c) || (c >= 'a' && c <= 'f');
+        })) {
+            return false;
+        }
+    }
+    return level > 0;
+}
+
+void Fanout::create(const fs::path &dir, const unsigned ioDepth) const {
+    IoBatch io{ioDepth};
+    std::vector<std::string> dirs{};
+    std::vector<std::string> parents{""};
+    for (uint8_t level = 0; level < depth_; ++level) {
+        // A level only once its parents exist
+        std::vector<std::string> created{};
+        created.reserve(parents.size() << 4 * width_);
+        for (const auto &parent: parents) {
+            for (size_t n = 0; n < size_t{1} << 4 * width_; ++n) {
+                std::string name = parent;
+                for (int digit = width_ - 1; digit >= 0; --digit) {
+                    name.push_back(HEX[n >> 4 * digit & 0x0f]);
+                }
+                io.mkdir(dir / name);
+                dirs.push_back(name);
+                name.push_back(fs::path::preferred_separator);
+                created.push_back(std::move(name));
+                if (io.size() == ioDepth) {
+                    submit(io, dirs, dir);
+                    dirs.clear();
+                }
+            }
+        }
+        submit(io, dirs, dir);
+        dirs.clear();
+        parents = std::move(created);
+    }
+    spdlog::debug("Created fanout [dir={}][fanout={}][directories={}]", dir.string(), str(), directories());
+}
+
+std::string Fanout::str() const {
+    return "depth=" + std::to_string(depth_) + ",width=" + std::to_string(width_);
+}
@@ -0,0 +1,382 @@
+#include "krico/backup/IoBatch.h"
+#include "krico/backup/exception.h"
+#include <spdlog/spdlog.h>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#endif
+
+using namespace krico::backup;
+using namespace krico;
+namespace fs = std::filesystem;
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#define KRICO_IO_URING 1
+
+namespace {
+    template<typename T>
+    T load_acquire(T *p) {
+        return std::atomic_ref<T>{*p}.load(std::memory_order_acquire);
+    }
+
+    template<typename T>
+    void store_release(T *p, T v) {
+        std::atomic_ref<T>{*p}.store(v, std::memory_order_release);
+    }
+
+    void to_stat(const struct statx &stx, struct stat &st) {
+        st = {};
+        st.st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+        st.st_ino = stx.stx_ino;
+        st.st_mode = stx.stx_mode;
+        st.st_nlink = stx.stx_nlink;
+        st.st_uid = stx.stx_uid;
+        st.st_gid = stx.stx_gid;
+        st.st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+        st.st_size = static_cast<off_t>(stx.stx_size);
+        st.st_blksize = stx.stx_blksize;
+        st.st_blocks = static_cast<blkcnt_t>(stx.stx_blocks);
+        st.st_atim = {.tv_sec = stx.stx_atime.tv_sec, .tv_nsec = stx.stx_atime.tv_nsec};
+        st.st_mtim = {.tv_sec = stx.stx_mtime.tv_sec, .tv_nsec = stx.stx_mtime.tv_nsec};
+        st.st_ctim = {.tv_sec = stx.stx_ctime.tv_sec, .tv_nsec = stx.stx_ctime.tv_nsec};
+    }
+}
+
+//!
+//! An io_uring with its submission and completion rings mapped
+//!
+struct IoBatch::uring {
+    int fd_{-1};
+    unsigned entries_{0};
+    void *sqRing_{MAP_FAILED};
+    size_t sqRingSize_{0};
+    void *cqRing_{MAP_FAILED};
+    size_t cqRingSize_{0};
+    io_uring_sqe *sqes_{static_cast<io_uring_sqe *>(MAP_FAILED)};
+    size_t sqesSize_{0};
+    unsigned *sqTail_{nullptr};
+    unsigned sqMask_{0};
+    unsigned *sqArray_{nullptr};
+    unsigned *cqHead_{nullptr};
+    unsigned *cqTail_{nullptr};
+    unsigned cqMask_{0};
+    io_uring_cqe *cqes_{nullptr};
+    bool supported_[IORING_OP_LAST]{};
+    // Completion buffers of the stat operations in flight
+    std::vector<struct statx> statx_{};
+
+    //!
+    //! @return a ring for `depth` operations, nullptr if io_uring can't be used
+    //!
+    static std::unique_ptr<uring> create(unsigned depth);
+
+    ~uring() {
+        if (sqes_ != MAP_FAILED) munmap(sqes_, sqesSize_);
+        if (cqRing_ != MAP_FAILED && cqRing_ != sqRing_) munmap(cqRing_, cqRingSize_);
+        if (sqRing_ != MAP_FAILED) munmap(sqRing_, sqRingSize_);
+        if (fd_ != -1) ::close(fd_);
+    }
+
+    [[nodiscard]] bool supports(const op_kind kind) const {
+        const auto opcode = to_opcode(kind);
+        return opcode < IORING_OP_LAST && supported_[opcode];
+    }
+
+    //!
+    //! Run ops[first, first + count) (count <= entries_), all of them must be supported
+    //!
+    void run(const std::vector<op_t> &ops, size_t first, size_t count, std::vector<int> &results);
+
+    static uint8_t to_opcode(op_kind kind);
+
+    void prepare(io_uring_sqe &sqe, const op_t &op, size_t index);
+};
+
+std::unique_ptr<IoBatch::uring> IoBatch::uring::create(const unsigned depth) {
+    auto ring = std::make_unique<uring>();
+    io_uring_params params{};
+    ring->fd_ = static_cast<int>(syscall(__NR_io_uring_setup, depth, &params));
+    if (ring->fd_ == -1) {
+        spdlog::debug("io_uring not available [errno={}]: {}", errno, std::strerror(errno));
+        return nullptr;
+    }
+    ring->entries_ = params.sq_entries;
+    ring->sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sqRingSize_ = ring->cqRingSize_ = std::max(ring->sqRingSize_, ring->cqRingSize_);
+    }
+    ring->sqRing_ = mmap(nullptr, ring->sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd_, IORING_OFF_SQ_RING);
+    if (ring->sqRing_ == MAP_FAILED) return nullptr;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cqRing_ = ring->sqRing_;
+    } else {
+        ring->cqRing_ = mmap(nullptr, ring->cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd_, IORING_OFF_CQ_RING);
+        if (ring->cqRing_ == MAP_FAILED) return nullptr;
+    }
+    ring->sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+    ring->sqes_ = static_cast<io_uring_sqe *>(mmap(nullptr, ring->sqesSize_, PROT_READ | PROT_WRITE,
+                                                   MAP_SHARED | MAP_POPULATE, ring->fd_, IORING_OFF_SQES));
+    if (ring->sqes_ == MAP_FAILED) return nullptr;
+
+    auto *sq = static_cast<uint8_t *>(ring->sqRing_);
+    ring->sqTail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+    ring->sqMask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    ring->sqArray_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    auto *cq = static_cast<uint8_t *>(ring->cqRing_);
+    ring->cqHead_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+    ring->cqTail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+    ring->cqMask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    ring->cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+    // Which operations does this kernel know (unknown ones run as blocking calls)
+    constexpr unsigned probeOps = 256;
+    std::vector<uint8_t> buffer(sizeof(io_uring_probe) + probeOps * sizeof(io_uring_probe_op));
+    auto *probe = reinterpret_cast<io_uring_probe *>(buffer.data());
+    if (syscall(__NR_io_uring_register, ring->fd_, IORING_REGISTER_PROBE, probe, probeOps) == 0) {
+        for (unsigned i = 0; i < probe->ops_len; ++i) {
+            if (probe->ops[i].op < IORING_OP_LAST) {
+                ring->supported_[probe->ops[i].op] = probe->ops[i].flags & IO_URING_OP_SUPPORTED;
+            }
+        }
+    }
+    return ring;
+}
+
+uint8_t IoBatch::uring::to_opcode(const op_kind kind) {
+    switch (kind) {
+        case op_kind::stat:
+            return IORING_OP_STATX;
+        case op_kind::open:
+            return IORING_OP_OPENAT;
+        case op_kind::read:
+            return IORING_OP_READ;
+        case op_kind::close:
+            return IORING_OP_CLOSE;
+        case op_kind::link:
+            return IORING_OP_LINKAT;
+        case op_kind::mkdir:
+            return IORING_OP_MKDIRAT;
+        case op_kind::rename:
+            return IORING_OP_RENAMEAT;
+    }
+    return IORING_OP_LAST;
+}
+
+void IoBatch::uring::prepare(io_uring_sqe &sqe, const op_t &op, const size_t index) {
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = to_opcode(op.kind_);
+    sqe.user_data = index;
+    sqe.fd = op.dirFd_;
+    switch (op.kind_) {
+        case op_kind::stat:
+            sqe.addr = reinterpret_cast<uintptr_t>(op.path_.c_str());
+            sqe.len = STATX_BASIC_STATS;
+            sqe.off = reinterpret_cast<uintptr_t>(&statx_[index]);
+            sqe.statx_flags = AT_SYMLINK_NOFOLLOW;
+            break;
+        case op_kind::open:
+            sqe.addr = reinterpret_cast<uintptr_t>(op.path_.c_str());
+            sqe.len = op.mode_;
+            sqe.open_flags = static_cast<uint32_t>(op.flags_);
+            break;
+        case op_kind::read:
+            sqe.fd = op.fd_;
+            sqe.addr = reinterpret_cast<uintptr_t>(op.buffer_);
+            sqe.len = static_cast<uint32_t>(op.len_);
+            sqe.off = op.offset_;
+            break;
+        case op_kind::close:
+            sqe.fd = op.fd_;
+            break;
+        case op_kind::link:
+        case op_kind::rename:
+            sqe.addr = reinterpret_cast<uintptr_t>(op.path_.c_str());
+            sqe.len = static_cast<uint32_t>(op.dirFd2_);
+            sqe.addr2 = reinterpret_cast<uintptr_t>(op.path2_.c_str());
+            break;
+        case op_kind::mkdir:
+            sqe.addr = reinterpret_cast<uintptr_t>(op.path_.c_str());
+            sqe.len = op.mode_;
+            break;
+    }
+}
+
+void IoBatch::uring::run(const std::vector<op_t> &ops, const size_t first, const size_t count,
+                         std::vector<int> &results) {
+    statx_.resize(ops.size());
+    unsigned tail = *sqTail_;
+    for (size_t i = first; i < first + count; ++i) {
+        const unsigned slot = tail & sqMask_;
+        prepare(sqes_[slot], ops[i], i);
+        sqArray_[slot] = slot;
+        ++tail;
+    }
+    store_release(sqTail_, tail);
+
+    auto toSubmit = static_cast<unsigned>(count);
+    size_t completed = 0;
+    while (completed < count) {
+        // Submit what is left and wait for everything in flight
+        const auto wait = static_cast<unsigned>(count - completed);
+        const auto n = syscall(__NR_io_uring_enter, fd_, toSubmit, wait, IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (n == -1) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+            THROW_ERRNO("io_uring_enter failed");
+        }
+        toSubmit -= static_cast<unsigned>(n);
+        unsigned head = *cqHead_;
+        for (const unsigned cqTail = load_acquire(cqTail_); head != cqTail; ++head) {
+            const io_uring_cqe &cqe = cqes_[head & cqMask_];
+            const auto index = static_cast<size_t>(cqe.user_data);
+            results[index] = cqe.res;
+            if (const auto &op = ops[index]; op.kind_ == op_kind::stat && cqe.res == 0) {
+                to_stat(statx_[index], *op.stat_);
+            }
+            ++completed;
+        }
+        store_release(cqHead_, head);
+    }
+}
+#endif
+
+IoBatch::IoBatch(const unsigned depth, const bool useUring) {
+#ifdef KRICO_IO_URING
+    if (useUring) {
+        uring_ = uring::create(std::max(1u, depth));
+    }
+#endif
+}
+
+IoBatch::~IoBatch() = default;
+
+size_t IoBatch::add(op_t &&op) {
+    ops_.emplace_back(std::move(op));
+    return ops_.size() - 1;
+}
+
+size_t IoBatch::stat(const fs::path &file, struct stat &st) {
+    return add({.kind_ = op_kind::stat, .path_ = file.string(), .stat_ = &st});
+}
+
+size_t IoBatch::open(const fs::path &file, const int flags, const mode_t mode) {
+    return add({.kind_ = op_kind::open, .path_ = file.string(), .flags_ = flags, .mode_ = mode});
+}
+
+size_t IoBatch::read(const int fd, void *buffer, const size_t len, const uint64_t offset) {
+    return add({.kind_ = op_kind::read, .fd_ = fd, .buffer_ = buffer, .len_ = len, .offset_ = offset});
+}
+
+size_t IoBatch::close(const int fd) {
+    return add({.kind_ = op_kind::close, .fd_ = fd});
+}
+
+size_t IoBatch::link(const int targetDirFd, const fs::path &target, const int linkDirFd, const fs::path &link) {
+    return add({
+        .kind_ = op_kind::link, .path_ = target.string(), .path2_ = link.string(),
+        .dirFd_ = targetDirFd, .dirFd2_ = linkDirFd
+    });
+}
+
+size_t IoBatch::mkdir(const int dirFd, const fs::path &dir, const mode_t mode) {
+    return add({.kind_ = op_kind::mkdir, .path_ = dir.string(), .dirFd_ = dirFd, .mode_ = mode});
+}
+
+size_t IoBatch::rename(const fs::path &from, const fs::path &to) {
+    return add({.kind_ = op_kind::rename, .path_ = from.string(), .path2_ = to.string()});
+}
+
+std::span<const int> IoBatch::submit() {
+    results_.assign(ops_.size(), 0);
+#ifdef KRICO_IO_URING
+    if (uring_) {
+        // Operations the kernel doesn't support run as blocking calls, the rest goes to the ring in batches
+        std::vector<op_t> supported{};
+        std::vector<size_t> indexes{};
+        for (size_t i = 0; i < ops_.size(); ++i) {
+            if (uring_->supports(ops_[i].kind_)) {
+                indexes.push_back(i);
+            } else {
+                results_[i] = execute(ops_[i]);
+            }
+        }
+        if (indexes.size() == ops_.size()) {
+            for (size_t first = 0; first < ops_.size(); first += uring_->entries_) {
+                uring_->run(ops_, first, std::min<size_t>(uring_->entries_, ops_.size() - first), results_);
+            }
+        } else if (!indexes.empty()) {
+            for (const size_t i: indexes) supported.push_back(ops_[i]);
+            std::vector<int> results(supported.size());
+            for (size_t first = 0; first < supported.size(); first += uring_->entries_) {
+                uring_->run(supported, first, std::min<size_t>(uring_->entries_, supported.size() - first), results);
+            }
+            for (size_t i = 0; i < indexes.size(); ++i) results_[indexes[i]] = results[i];
+        }
+        ops_.clear();
+        return results_;
+    }
+#endif
+    for (size_t i = 0; i < ops_.size(); ++i) {
+        results_[i] = execute(ops_[i]);
+    }
+    ops_.clear();
+    return results_;
+}
+
+int IoBatch::execute(const op_t &op) {
+    long ret = 0;
+    switch (op.kind_) {
+        case op_kind::stat:
+            ret = fstatat(op.dirFd_, op.path_.c_str(), op.stat_, AT_SYMLINK_NOFOLLOW);
+            break;
+        case op_kind::open:
+            ret = openat(op.dirFd_, op.path_.c_str(), op.flags_, op.mode_);
+            break;
+        case op_kind::read:
+            do {
+                ret = pread(op.fd_, op.buffer_, op.len_, static_cast<off_t>(op.offset_));
+            } while (ret == -1 && errno == EINTR);
+            break;
+        case op_kind::close:
+            ret = ::close(op.fd_);
+            break;
+        case op_kind::link:
+            ret = linkat(op.dirFd_, op.path_.c_str(), op.dirFd2_, op.path2_.c_str(), 0);
+            break;
+        case op_kind::mkdir:
+            ret = mkdirat(op.dirFd_, op.path_.c_str(), op.mode_);
+            break;
+        case op_kind::rename:
+            ret = renameat(op.dirFd_, op.path_.c_str(), op.dirFd2_, op.path2_.c_str());
+            break;
+    }
+    return ret == -1 ? -errno : static_cast<int>(ret);
+}
+
+bool IoBatch::uring_available() {
+#ifdef KRICO_IO_URING
+    static const bool available = uring::create(1) != nullptr;
+    return available;
+#else
+    return false;
+#endif
+}
+
+const char *backup::to_string(const IoBatch::backend backend) {
+    switch (backend) {
+        case IoBatch::backend::io_uring:
+            return "io_uring";
+        case IoBatch::backend::blocking:
+            return "blocking";
+    }
+    return "unknown";
+}
@@ -0,0 +1,184 @@
+#include "krico/backup/LogIndex.h"
+#include "krico/backup/exception.h"
+#include <spdlog/spdlog.h>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace krico::backup;
+namespace fs = std::filesystem;
+
+namespace {
+    constexpr uint64_t FNV_OFFSET = 0xcbf29ce484222325ULL;
+    constexpr uint64_t FNV_PRIME = 0x100000001b3ULL;
+}
+
+int64_t LogIndex::timestamp(const std::chrono::system_clock::time_point ts) {
+    using namespace std::chrono;
+    // The duration of system_clock may be coarser than nanoseconds (e.g. microseconds with libc++)
+    constexpr auto max = duration_cast<system_clock::duration>(nanoseconds::max());
+    constexpr auto min = duration_cast<system_clock::duration>(nanoseconds::min());
+    const auto since = ts.time_since_epoch();
+    if (since >= max) return nanoseconds::max().count();
+    if (since <= min) return nanoseconds::min().count();
+    return duration_cast<nanoseconds>(since).count();
+}
+
+Digest::result LogIndex::entry_t::digest() const {
+    Digest::result ret{.md_ = {}, .len_ = DigestLength::SHA1};
+    std::memcpy(ret.md_, digest_, DigestLength::SHA1);
+    return ret;
+}
+
+LogIndex::LogIndex(const fs::path &dir) : indexFile_(dir / INDEX_FILE) {
+}
+
+LogIndex::~LogIndex() {
+    if (fd_ != -1 && close(fd_)) {
+        auto ec = std::make_error_code(static_cast<std::errc>(errno));
+        spdlog::error("Failed to close [fd={}][ec={}]: {}", fd_, ec.value(), ec.message());
+    }
+}
+
+std::span<const LogIndex::entry_t> LogIndex::entries() {
+    load();
+    if (inMemory_) return memory_;
+    if (size_ == 0) return {};
+    if (mapped_.size() < size_) {
+        mapped_ = MappedFile{indexFile_};
+        if (mapped_.size() < size_) {
+            THROW_EXCEPTION("Log query index '" + indexFile_.string() + "' shorter than expected (" +
+                std::to_string(mapped_.size()) + " < " + std::to_string(size_) + ")");
+        }
+    }
+    // The mapping is page aligned and the header a multiple of 8 bytes
+    const auto *entries = reinterpret_cast<const entry_t *>(mapped_.data() + sizeof(header_t));
+    return {entries, (size_ - sizeof(header_t)) / sizeof(entry_t)};
+}
+
+Digest::result LogIndex::last() {
+    load();
+    return last_;
+}
+
+void LogIndex::append(const std::span<const entry_t> entries) {
+    if (entries.empty()) return;
+    load();
+    if (!writable()) {
+        memory_.insert(memory_.end(), entries.begin(), entries.end());
+    } else {
+        const auto len = entries.size_bytes();
+        if (const ssize_t written = ::write(fd_, entries.data(), len); written != static_cast<ssize_t>(len)) {
+            const int error = written == -1 ? errno : EIO;
+            truncate(size_);
+            THROW_ERROR_CODE("Failed to append to '" + indexFile_.string() + "'",
+                             std::make_error_code(static_cast<std::errc>(error)));
+        }
+        size_ += len;
+    }
+    last_ = entries.back().digest();
+}
+
+void LogIndex::clear() {
+    load();
+    if (!writable()) {
+        memory_.clear();
+    } else {
+        truncate(0);
+        writeHeader();
+    }
+    last_ = Digest::SHA1_ZERO;
+}
+
+uint64_t LogIndex::directory_hash(const std::string_view id) {
+    uint64_t hash = FNV_OFFSET;
+    for (const auto c: id) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= FNV_PRIME;
+    }
+    return hash ? hash : 1;
+}
+
+void LogIndex::load() {
+    if (loaded_) return;
+    loaded_ = true;
+    const int fd = open(indexFile_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno == ENOENT) return;
+        THROW_ERRNO("Failed to open '" + indexFile_.string() + "'");
+    }
+    struct stat st{};
+    header_t header{};
+    const bool failed = fstat(fd, &st) || (st.st_size >= static_cast<off_t>(sizeof(header))
+                                           && pread(fd, &header, sizeof(header), 0) != sizeof(header));
+    const int error = errno;
+    close(fd);
+    if (failed) {
+        THROW_ERROR_CODE("Failed to read '" + indexFile_.string() + "'",
+                         std::make_error_code(static_cast<std::errc>(error)));
+    }
+    const uint64_t fileSize = st.st_size;
+    if (fileSize < sizeof(header) || header.magic_ != MAGIC || header.version_ != VERSION) {
+        if (fileSize != 0) {
+            spdlog::warn("Invalid log query index, rebuilding [file={}][size={}][magic={:x}][version={}]",
+                         indexFile_.string(), fileSize, header.magic_, header.version_);
+        }
+        return;
+    }
+    // A partial entry (a crash in the middle of an append) is dropped by the next writable()
+    size_ = fileSize - (fileSize - sizeof(header)) % sizeof(entry_t);
+    if (size_ != fileSize) {
+        spdlog::warn("Ignoring partial log query index entry [file={}][size={}]", indexFile_.string(), fileSize);
+    }
+    if (const auto all = entries(); !all.empty()) {
+        last_ = all.back().digest();
+    }
+}
+
+bool LogIndex::writable() {
+    if (fd_ != -1) return true;
+    if (inMemory_) return false;
+    fd_ = open(indexFile_.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd_ == -1) {
+        if (errno != EACCES && errno != EPERM && errno != EROFS) {
+            THROW_ERRNO("Failed to open '" + indexFile_.string() + "'");
+        }
+        spdlog::info("Log query index not writable, keeping it in memory [file={}]", indexFile_.string());
+        const auto all = entries();
+        memory_.assign(all.begin(), all.end());
+        mapped_ = MappedFile{};
+        inMemory_ = true;
+        return false;
+    }
+    struct stat st{};
+    if (fstat(fd_, &st)) {
+        THROW_ERRNO("Failed to stat '" + indexFile_.string() + "'");
+    }
+    if (size_ == 0) {
+        truncate(0);
+        writeHeader();
+    } else if (static_cast<uint64_t>(st.st_size) != size_) {
+        truncate(size_);
+    }
+    return true;
+}
+
+void LogIndex::writeHeader() {
+    constexpr header_t header{.magic_ = MAGIC, .version_ = VERSION};
+    if (::write(fd_, &header, sizeof(header)) != sizeof(header)) {
+        THROW_ERRNO("Failed to write '" + indexFile_.string() + "'");
+    }
+    size_ = sizeof(header);
+}
+
+void LogIndex::truncate(const uint64_t size) {
+    if (ftruncate(fd_, static_cast<off_t>(size))) {
+        THROW_ERRNO("Failed to truncate '" + indexFile_.string() + "'");
+    }
+    size_ = size;
+    if (mapped_.size() > size) {
+        // Pages beyond the end of the file can no longer be read
+        mapped_ = MappedFile{};
+    }
+}
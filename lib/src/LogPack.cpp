@@ -0,0 +1,373 @@
+#include "krico/backup/LogPack.h"
+#include "krico/backup/TemporaryFile.h"
+#include "krico/backup/exception.h"
+#include "krico/backup/io.h"
+#include "krico/backup/ThreadPool.h"
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <ranges>
+#include <fstream>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+using namespace krico::backup;
+namespace fs = std::filesystem;
+
+namespace {
+    int nibble(const char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+}
+
+LogPack::LogPack(const fs::path &dir)
+    : packFile_(dir / PACK_FILE),
+      indexFile_(dir / INDEX_FILE) {
+    // Reading only maps the files, so the log can be read without write access to the repository
+    if (!exists(packFile_)) {
+        spdlog::debug("No log pack yet [file={}]", packFile_.string());
+        return;
+    }
+    packMapped_ = MappedFile{packFile_};
+    packSize_ = packMapped_.size();
+    if (packSize_ == 0) {
+        // Created, but the header was never written
+        return;
+    }
+    pack_header_t header{};
+    if (packSize_ < sizeof(header)) {
+        THROW_EXCEPTION("Invalid log pack '" + packFile_.string() + "' (size=" + std::to_string(packSize_) + ")");
+    }
+    std::memcpy(&header, packMapped_.data(), sizeof(header));
+    if (header.magic_ != PACK_MAGIC || header.version_ != VERSION) {
+        THROW_EXCEPTION("Invalid log pack '" + packFile_.string() + "' (magic=" + std::to_string(header.magic_)
+            + ", version=" + std::to_string(header.version_) + ")");
+    }
+    if (!exists(indexFile_) || !map()) {
+        indexedSize_ = sizeof(pack_header_t);
+    }
+    scan();
+    spdlog::debug("Opened log pack [file={}][records={}][unindexed={}]", packFile_.string(), size(), tail_.size());
+}
+
+LogPack::~LogPack() {
+    if (pack_ != -1 && close(pack_)) {
+        auto ec = std::make_error_code(static_cast<std::errc>(errno));
+        spdlog::error("Failed to close [fd={}][ec={}]: {}", pack_, ec.value(), ec.message());
+    }
+}
+
+bool LogPack::contains(const Digest::result &digest) const {
+    if (digest.len_ != DigestLength::SHA1) return false;
+    return indexed(digest) || tail_.contains(digest);
+}
+
+std::string_view LogPack::find(const Digest::result &digest) {
+    if (digest.len_ != DigestLength::SHA1) return {};
+    location_t location{};
+    if (const auto *entry = indexed(digest)) {
+        location = {.offset_ = entry->offset_, .length_ = entry->length_};
+    } else if (const auto it = tail_.find(digest); it != tail_.end()) {
+        location = it->second;
+    } else {
+        return {};
+    }
+    if (location.offset_ + location.length_ > packMapped_.size()) {
+        // Appended since the pack was mapped
+        packMapped_ = MappedFile{packFile_};
+        if (location.offset_ + location.length_ > packMapped_.size()) {
+            THROW_EXCEPTION("Log record '" + digest.str() + "' beyond the end of '" + packFile_.string() + "'");
+        }
+    }
+    return {reinterpret_cast<const char *>(packMapped_.data() + location.offset_), location.length_};
+}
+
+void LogPack::append(const Digest::result &digest, const char *data, const size_t len) {
+    if (digest.len_ != DigestLength::SHA1) {
+        THROW_EXCEPTION("Cannot append log record '" + digest.str() + "' (digest length " +
+            std::to_string(digest.len_) + " != " + std::to_string(DigestLength::SHA1) + ")");
+    }
+    if (contains(digest)) return;
+    writable();
+    frame_t frame{.length_ = static_cast<uint32_t>(len), .digest_ = {}};
+    std::memcpy(frame.digest_, digest.md_, sizeof(frame.digest_));
+    iovec iov[] = {
+        {.iov_base = &frame, .iov_len = sizeof(frame)},
+        {.iov_base = const_cast<char *>(data), .iov_len = len}
+    };
+    // One O_APPEND write per record, a crash leaves at most a partial frame at the end (truncated on open)
+    if (const ssize_t written = writev(pack_, iov, 2); written != static_cast<ssize_t>(sizeof(frame) + len)) {
+        const int error = written == -1 ? errno : EIO;
+        if (ftruncate(pack_, static_cast<off_t>(packSize_))) {
+            spdlog::error("Failed to truncate '{}' to {} bytes", packFile_.string(), packSize_);
+        }
+        THROW_ERROR_CODE("Failed to append log record '" + digest.str() + "' to '" + packFile_.string() + "'",
+                         std::make_error_code(static_cast<std::errc>(error)));
+    }
+    tail_.emplace(digest, location_t{.offset_ = packSize_ + sizeof(frame), .length_ = frame.length_});
+    packSize_ += sizeof(frame) + len;
+    synced_ = false;
+    if (tail_.size() >= INDEX_INTERVAL) {
+        save();
+    }
+}
+
+void LogPack::sync() {
+    if (pack_ != -1 && fdatasync(pack_)) {
+        THROW_ERRNO("Failed to sync '" + packFile_.string() + "'");
+    }
+    synced_ = true;
+}
+
+std::vector<Digest::result> LogPack::find_prefix(const std::string_view prefix) const {
+    if (prefix.size() > 2 * DigestLength::SHA1) return {};
+    // The smallest digest starting with prefix
+    uint8_t low[DigestLength::SHA1]{};
+    for (size_t i = 0; i < prefix.size(); ++i) {
+        const int n = nibble(prefix[i]);
+        if (n < 0) return {};
+        low[i / 2] |= i % 2 ? n : n << 4;
+    }
+    const size_t bytes = prefix.size() / 2;
+    const auto matches = [&](const uint8_t *md) {
+        return std::memcmp(md, low, bytes) == 0 && (prefix.size() % 2 == 0 || (md[bytes] & 0xf0) == low[bytes]);
+    };
+    std::vector<Digest::result> ret{};
+    const auto add = [&ret](const uint8_t *md) {
+        auto &digest = ret.emplace_back(Digest::result{.md_ = {}, .len_ = DigestLength::SHA1});
+        std::memcpy(digest.md_, md, DigestLength::SHA1);
+    };
+    size_t lo = 0, hi = count_;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (std::memcmp(entries_[mid].digest_, low, DigestLength::SHA1) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    for (size_t i = lo; i < count_ && matches(entries_[i].digest_); ++i) {
+        add(entries_[i].digest_);
+    }
+    for (const auto &digest: tail_ | std::views::keys) {
+        if (matches(digest.md_)) add(digest.md_);
+    }
+    return ret;
+}
+
+size_t LogPack::verify(ThreadPool &pool,
+                       const std::function<void(const Digest::result &, const std::string &)> &problem,
+                       const size_t chunk) {
+    if (packSize_ == 0) return 0;
+    if (packMapped_.size() < packSize_) {
+        packMapped_ = MappedFile{packFile_};
+    }
+    const uint8_t *data = packMapped_.data();
+    std::mutex mutex{};
+    std::atomic<size_t> count{0};
+    const auto report = [&](const uint8_t *md, const std::string &what) {
+        Digest::result digest{.md_ = {}, .len_ = DigestLength::SHA1};
+        if (md) std::memcpy(digest.md_, md, DigestLength::SHA1);
+        std::lock_guard lock{mutex};
+        problem(digest, what);
+    };
+    const auto hash = [&, data](const uint64_t from, const uint64_t to) {
+        const auto md = Digest::sha1();
+        frame_t frame{};
+        size_t n = 0;
+        for (uint64_t offset = from; offset < to; offset += sizeof(frame) + frame.length_, ++n) {
+            std::memcpy(&frame, data + offset, sizeof(frame));
+            const auto digest = md.digest(data + offset + sizeof(frame), frame.length_);
+            if (std::memcmp(digest.md_, frame.digest_, DigestLength::SHA1) != 0) {
+                report(frame.digest_, "packed record does not hash to its digest");
+            }
+        }
+        count += n;
+    };
+    // Only the frames after indexedSize_ were checked when the pack was opened (scan()), a damaged length in the
+    // indexed part would point anywhere, so every frame is bounds checked before a task hashes it
+    std::vector<uint64_t> offsets{};
+    offsets.reserve(size());
+    uint64_t offset = sizeof(pack_header_t);
+    uint64_t from = offset;
+    frame_t frame{};
+    while (offset < packSize_) {
+        if (packSize_ - offset < sizeof(frame)) {
+            report(nullptr, "truncated frame at offset " + std::to_string(offset) + " of '" + packFile_.string()
+                            + "' (size=" + std::to_string(packSize_) + ")");
+            break;
+        }
+        std::memcpy(&frame, data + offset, sizeof(frame));
+        if (frame.length_ > packSize_ - offset - sizeof(frame)) {
+            report(frame.digest_, "corrupt frame at offset " + std::to_string(offset) + " of '" + packFile_.string()
+                                  + "' (length=" + std::to_string(frame.length_) + ", size="
+                                  + std::to_string(packSize_) + ")");
+            break;
+        }
+        offsets.push_back(offset + sizeof(frame));
+        offset += sizeof(frame) + frame.length_;
+        if (offset - from >= chunk || offset >= packSize_) {
+            pool.submit([&hash, from, offset] { hash(from, offset); });
+            from = offset;
+        }
+    }
+    if (from != offset) {
+        // The frames before the one that stopped the walk
+        pool.submit([&hash, from, offset] { hash(from, offset); });
+    }
+
+    // Every index entry must locate a frame with its digest and length
+    for (size_t i = 0; i < count_; ++i) {
+        const auto &entry = entries_[i];
+        if (!std::ranges::binary_search(offsets, entry.offset_)) {
+            report(entry.digest_, "index entry (offset=" + std::to_string(entry.offset_) + ", length="
+                                  + std::to_string(entry.length_) + ") is not a record of '" + packFile_.string() + "'");
+            continue;
+        }
+        std::memcpy(&frame, data + entry.offset_ - sizeof(frame), sizeof(frame));
+        if (frame.length_ != entry.length_ || std::memcmp(frame.digest_, entry.digest_, DigestLength::SHA1) != 0) {
+            report(entry.digest_, "index entry (offset=" + std::to_string(entry.offset_) + ", length="
+                                  + std::to_string(entry.length_) + ") does not match its frame in '"
+                                  + packFile_.string() + "'");
+        }
+    }
+    pool.wait();
+    return count;
+}
+
+std::vector<Digest::result> LogPack::digests() const {
+    std::vector<Digest::result> ret{};
+    ret.reserve(size());
+    for (size_t i = 0; i < count_; ++i) {
+        auto &digest = ret.emplace_back(Digest::result{.md_ = {}, .len_ = DigestLength::SHA1});
+        std::memcpy(digest.md_, entries_[i].digest_, DigestLength::SHA1);
+    }
+    for (const auto &digest: tail_ | std::views::keys) {
+        ret.push_back(digest);
+    }
+    return ret;
+}
+
+bool LogPack::map() {
+    entries_ = nullptr;
+    count_ = 0;
+    indexMapped_ = MappedFile{indexFile_};
+    index_header_t header{};
+    if (indexMapped_.size() < sizeof(header)) {
+        spdlog::warn("Invalid log index [file={}][size={}]", indexFile_.string(), indexMapped_.size());
+        return false;
+    }
+    std::memcpy(&header, indexMapped_.data(), sizeof(header));
+    if (header.magic_ != INDEX_MAGIC || header.version_ != VERSION
+        || indexMapped_.size() != sizeof(header) + header.count_ * sizeof(index_entry_t)
+        || header.packSize_ < sizeof(pack_header_t) || header.packSize_ > packSize_) {
+        spdlog::warn("Invalid log index [file={}][magic={:x}][version={}][count={}][packSize={}]",
+                     indexFile_.string(), header.magic_, header.version_, header.count_, header.packSize_);
+        return false;
+    }
+    // The mapping is page aligned and the header a multiple of 8 bytes
+    entries_ = reinterpret_cast<const index_entry_t *>(indexMapped_.data() + sizeof(header));
+    count_ = header.count_;
+    indexedSize_ = header.packSize_;
+    return true;
+}
+
+void LogPack::scan() {
+    const uint8_t *data = packMapped_.data();
+    uint64_t offset = indexedSize_;
+    frame_t frame{};
+    while (packSize_ - offset >= sizeof(frame)) {
+        std::memcpy(&frame, data + offset, sizeof(frame));
+        if (frame.length_ > packSize_ - offset - sizeof(frame)) break;
+        Digest::result digest{.md_ = {}, .len_ = DigestLength::SHA1};
+        std::memcpy(digest.md_, frame.digest_, DigestLength::SHA1);
+        tail_.emplace(digest, location_t{.offset_ = offset + sizeof(frame), .length_ = frame.length_});
+        offset += sizeof(frame) + frame.length_;
+    }
+    if (offset != packSize_) {
+        // Left in the file until the next append(), see writable()
+        spdlog::warn("Ignoring partial log record [file={}][offset={}][size={}]",
+                     packFile_.string(), offset, packSize_);
+        packSize_ = offset;
+    }
+}
+
+void LogPack::writable() {
+    if (pack_ != -1) return;
+    pack_ = open(packFile_.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (pack_ == -1) {
+        THROW_ERRNO("Failed to open '" + packFile_.string() + "'");
+    }
+    struct stat st{};
+    if (fstat(pack_, &st)) {
+        THROW_ERRNO("Failed to stat '" + packFile_.string() + "'");
+    }
+    if (static_cast<uint64_t>(st.st_size) != packSize_) {
+        spdlog::warn("Truncating partial log record [file={}][offset={}][size={}]",
+                     packFile_.string(), packSize_, st.st_size);
+        if (ftruncate(pack_, static_cast<off_t>(packSize_))) {
+            THROW_ERRNO("Failed to truncate '" + packFile_.string() + "'");
+        }
+        packMapped_ = MappedFile{packFile_};
+    }
+    if (packSize_ == 0) {
+        constexpr pack_header_t header{.magic_ = PACK_MAGIC, .version_ = VERSION};
+        if (::write(pack_, &header, sizeof(header)) != sizeof(header)) {
+            THROW_ERRNO("Failed to write '" + packFile_.string() + "'");
+        }
+        packSize_ = indexedSize_ = sizeof(header);
+    }
+}
+
+const LogPack::index_entry_t *LogPack::indexed(const Digest::result &digest) const {
+    size_t lo = 0, hi = count_;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        const int cmp = std::memcmp(entries_[mid].digest_, digest.md_, DigestLength::SHA1);
+        if (cmp == 0) return &entries_[mid];
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return nullptr;
+}
+
+void LogPack::save() {
+    std::vector<index_entry_t> entries{entries_, entries_ + count_};
+    const auto indexed = static_cast<std::ptrdiff_t>(entries.size());
+    for (const auto &[digest, location]: tail_) {
+        auto &entry = entries.emplace_back(index_entry_t{
+            .digest_ = {}, .length_ = location.length_, .offset_ = location.offset_
+        });
+        std::memcpy(entry.digest_, digest.md_, DigestLength::SHA1);
+    }
+    const auto less = [](const index_entry_t &lhs, const index_entry_t &rhs) {
+        return std::memcmp(lhs.digest_, rhs.digest_, DigestLength::SHA1) < 0;
+    };
+    std::sort(entries.begin() + indexed, entries.end(), less);
+    std::inplace_merge(entries.begin(), entries.begin() + indexed, entries.end(), less);
+
+    const TemporaryFile tmpFile{indexFile_.parent_path(), indexFile_.filename().string()};
+    do {
+        std::ofstream out{tmpFile.file(), std::ios::binary | std::ios::trunc};
+        const index_header_t header{
+            .magic_ = INDEX_MAGIC, .version_ = VERSION, .count_ = entries.size(), .packSize_ = packSize_
+        };
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(entries.data()),
+                  static_cast<std::streamsize>(entries.size() * sizeof(index_entry_t)));
+        out.close();
+        if (!out) {
+            THROW_EXCEPTION("Failed to write '" + tmpFile.file().string() + "'");
+        }
+    } while (false);
+    RENAME_FILE(tmpFile.file(), indexFile_);
+    tail_.clear();
+    if (!map()) {
+        THROW_EXCEPTION("Failed to map '" + indexFile_.string() + "'");
+    }
+    spdlog::debug("Saved log index [file={}][records={}]", indexFile_.string(), count_);
+}
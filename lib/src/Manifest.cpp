@@ -0,0 +1,334 @@
+#include "krico/backup/Manifest.h"
+#include "krico/backup/exception.h"
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <cstring>
+
+using namespace krico::backup;
+namespace fs = std::filesystem;
+
+namespace {
+    void put_varint(std::string &out, uint64_t v) {
+        while (v >= 0x80) {
+            out.push_back(static_cast<char>((v & 0x7f) | 0x80));
+            v >>= 7;
+        }
+        out.push_back(static_cast<char>(v));
+    }
+
+    template<typename T>
+    void put_fixed(std::string &out, const T &v) {
+        out.append(reinterpret_cast<const char *>(&v), sizeof(v));
+    }
+
+    //!
+    //! @return false if `p` does not point to a complete varint before `end`
+    //!
+    bool get_varint(const uint8_t *&p, const uint8_t *end, uint64_t &v) {
+        v = 0;
+        for (unsigned shift = 0; shift < 64 && p != end; shift += 7) {
+            const uint8_t b = *p++;
+            v |= static_cast<uint64_t>(b & 0x7f) << shift;
+            if (!(b & 0x80)) return true;
+        }
+        return false;
+    }
+}
+
+int krico::backup::compare_paths(std::string_view lhs, std::string_view rhs) {
+    if (lhs == ".") lhs = {};
+    if (rhs == ".") rhs = {};
+    const size_t n = std::min(lhs.size(), rhs.size());
+    for (size_t i = 0; i < n; ++i) {
+        if (lhs[i] == rhs[i]) continue;
+        // A separator ends a component, so it sorts before any other character
+        const unsigned l = lhs[i] == '/' ? 0 : static_cast<unsigned char>(lhs[i]) + 1;
+        const unsigned r = rhs[i] == '/' ? 0 : static_cast<unsigned char>(rhs[i]) + 1;
+        return l < r ? -1 : 1;
+    }
+    return lhs.size() < rhs.size() ? -1 : lhs.size() > rhs.size() ? 1 : 0;
+}
+
+ManifestWriter::ManifestWriter(const fs::path &file)
+    : file_(file),
+      out_(file, std::ios::binary | std::ios::trunc) {
+    if (!out_) {
+        THROW_EXCEPTION("Failed to create '" + file_.string() + "'");
+    }
+    buffer_.reserve(BUFFER_SIZE + 4096);
+    put_fixed(buffer_, header_t{.magic_ = MAGIC, .version_ = VERSION});
+}
+
+void ManifestWriter::add(const manifest_entry &entry) {
+    if (entries_ > 0 && compare_paths(previous_, entry.path_) >= 0) {
+        THROW_EXCEPTION("Manifest entry '" + std::string{entry.path_} + "' out of order (after '" + previous_ + "')");
+    }
+    size_t shared = 0;
+    if (entries_ % BLOCK_ENTRIES == 0) {
+        blocks_.push_back(offset_ + buffer_.size());
+    } else {
+        const size_t max = std::min(previous_.size(), entry.path_.size());
+        while (shared < max && previous_[shared] == entry.path_[shared]) ++shared;
+    }
+    buffer_.push_back(static_cast<char>(entry.kind_));
+    put_varint(buffer_, shared);
+    put_varint(buffer_, entry.path_.size() - shared);
+    buffer_.append(entry.path_.substr(shared));
+    switch (entry.kind_) {
+        case manifest_entry::kind::copied:
+        case manifest_entry::kind::hard_linked:
+            if (digestLength_ == 0) {
+                digestLength_ = entry.digest_.len_;
+            } else if (entry.digest_.len_ != digestLength_) {
+                THROW_EXCEPTION("Digest of '" + std::string{entry.path_} + "' has length " +
+                    std::to_string(entry.digest_.len_) + " (expected " + std::to_string(digestLength_) + ")");
+            }
+            buffer_.append(reinterpret_cast<const char *>(entry.digest_.md_), digestLength_);
+            put_varint(buffer_, entry.size_);
+            put_fixed(buffer_, entry.mtimeNs_);
+            break;
+        case manifest_entry::kind::symlink:
+            put_varint(buffer_, entry.target_.size());
+            buffer_.append(entry.target_);
+            break;
+        case manifest_entry::kind::directory:
+            break;
+    }
+    previous_.assign(entry.path_);
+    ++entries_;
+    if (buffer_.size() >= BUFFER_SIZE) {
+        flush();
+    }
+}
+
+void ManifestWriter::finish(const Digest::result &checksum) {
+    trailer_t trailer{
+        .indexOffset_ = offset_ + buffer_.size(),
+        .blocks_ = blocks_.size(),
+        .entries_ = entries_,
+        .digestLength_ = digestLength_,
+        .checksumLength_ = checksum.len_,
+        .checksum_ = {},
+        .reserved_ = 0,
+        .magic_ = MAGIC
+    };
+    std::memcpy(trailer.checksum_, checksum.md_, checksum.len_);
+    for (const uint64_t block: blocks_) {
+        put_fixed(buffer_, block);
+    }
+    put_fixed(buffer_, trailer);
+    flush();
+    out_.close();
+    if (!out_) {
+        THROW_EXCEPTION("Failed to write '" + file_.string() + "'");
+    }
+}
+
+void ManifestWriter::flush() {
+    if (!out_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()))) {
+        THROW_EXCEPTION("Failed to write '" + file_.string() + "'");
+    }
+    offset_ += buffer_.size();
+    buffer_.clear();
+}
+
+ManifestReader::ManifestReader(const fs::path &file)
+    : file_(file),
+      mapped_(file) {
+    const uint8_t *data = mapped_.data();
+    const size_t size = mapped_.size();
+    ManifestWriter::header_t header{};
+    ManifestWriter::trailer_t trailer{};
+    if (size < sizeof(header) + sizeof(trailer)) {
+        THROW_EXCEPTION("Not a manifest '" + file_.string() + "' (size=" + std::to_string(size) + ")");
+    }
+    std::memcpy(&header, data, sizeof(header));
+    std::memcpy(&trailer, data + size - sizeof(trailer), sizeof(trailer));
+    if (header.magic_ != ManifestWriter::MAGIC || trailer.magic_ != ManifestWriter::MAGIC) {
+        THROW_EXCEPTION("Not a manifest '" + file_.string() + "'");
+    }
+    if (header.version_ != ManifestWriter::VERSION) {
+        THROW_EXCEPTION("Unsupported manifest version " + std::to_string(header.version_) + " '" + file_.string() + "'");
+    }
+    if (trailer.indexOffset_ < sizeof(header) || trailer.checksumLength_ > EVP_MAX_MD_SIZE
+        || trailer.digestLength_ > EVP_MAX_MD_SIZE
+        || trailer.blocks_ != (trailer.entries_ + ManifestWriter::BLOCK_ENTRIES - 1) / ManifestWriter::BLOCK_ENTRIES
+        || trailer.indexOffset_ + trailer.blocks_ * sizeof(uint64_t) + sizeof(trailer) != size) {
+        THROW_EXCEPTION("Corrupt manifest '" + file_.string() + "'");
+    }
+    entriesEnd_ = data + trailer.indexOffset_;
+    index_ = entriesEnd_;
+    blocks_ = trailer.blocks_;
+    entries_ = trailer.entries_;
+    digestLength_ = trailer.digestLength_;
+    checksum_.len_ = trailer.checksumLength_;
+    std::memcpy(checksum_.md_, trailer.checksum_, trailer.checksumLength_);
+}
+
+bool ManifestReader::is_manifest(const fs::path &file) {
+    std::ifstream in{file, std::ios::binary};
+    ManifestWriter::header_t header{};
+    return in.read(reinterpret_cast<char *>(&header), sizeof(header)) && header.magic_ == ManifestWriter::MAGIC;
+}
+
+ManifestReader::iterator ManifestReader::begin() const {
+    return iterator{this, 0, blocks_ ? block(0) : entriesEnd_};
+}
+
+ManifestReader::iterator ManifestReader::end() const {
+    return iterator{this, entries_, entriesEnd_};
+}
+
+ManifestReader::iterator ManifestReader::lower_bound(const std::string_view path) const {
+    // Number of blocks starting at or before `path`, the one before them is where `path` would be
+    uint64_t lo = 0;
+    uint64_t hi = blocks_;
+    while (lo < hi) {
+        const uint64_t mid = lo + (hi - lo) / 2;
+        if (compare_paths(first_path(mid), path) <= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) return begin();
+    iterator it{this, (lo - 1) * ManifestWriter::BLOCK_ENTRIES, block(lo - 1)};
+    while (it.index_ < entries_ && compare_paths(it.path_, path) < 0) ++it;
+    return it;
+}
+
+ManifestReader::iterator ManifestReader::find(const std::string_view path) const {
+    auto it = lower_bound(path);
+    if (it.index_ < entries_ && compare_paths(it.path_, path) == 0) return it;
+    return end();
+}
+
+ManifestReader::range ManifestReader::subtree(const std::string_view dir) const {
+    if (dir == ".") return {.begin_ = begin(), .end_ = end()};
+    // Paths never contain '\0', which sorts right after the separator: dir + '\0' is past everything below dir
+    std::string after{dir};
+    after.push_back('\0');
+    return {.begin_ = lower_bound(dir), .end_ = lower_bound(after)};
+}
+
+const uint8_t *ManifestReader::block(const uint64_t block) const {
+    uint64_t offset;
+    std::memcpy(&offset, index_ + block * sizeof(offset), sizeof(offset));
+    if (offset >= static_cast<uint64_t>(entriesEnd_ - mapped_.data())) {
+        THROW_EXCEPTION("Corrupt manifest '" + file_.string() + "' (block " + std::to_string(block) + ")");
+    }
+    return mapped_.data() + offset;
+}
+
+std::string_view ManifestReader::first_path(const uint64_t block) const {
+    const uint8_t *p = this->block(block) + 1;
+    uint64_t shared, suffix;
+    if (!get_varint(p, entriesEnd_, shared) || !get_varint(p, entriesEnd_, suffix) || shared != 0
+        || suffix > static_cast<uint64_t>(entriesEnd_ - p)) {
+        THROW_EXCEPTION("Corrupt manifest '" + file_.string() + "' (block " + std::to_string(block) + ")");
+    }
+    return {reinterpret_cast<const char *>(p), suffix};
+}
+
+ManifestReader::iterator::iterator(const ManifestReader *reader, const uint64_t index, const uint8_t *next)
+    : reader_(reader),
+      index_(index),
+      next_(next) {
+    if (index_ < reader_->entries_) {
+        decode();
+    }
+}
+
+manifest_entry ManifestReader::iterator::operator*() const {
+    manifest_entry entry{entry_};
+    entry.path_ = path_;
+    return entry;
+}
+
+ManifestReader::iterator &ManifestReader::iterator::operator++() {
+    if (++index_ < reader_->entries_) {
+        decode();
+    }
+    return *this;
+}
+
+void ManifestReader::iterator::decode() {
+    const uint8_t *p = next_;
+    const uint8_t *end = reader_->entriesEnd_;
+    auto corrupt = [this] {
+        THROW_EXCEPTION("Corrupt manifest '" + reader_->file_.string() + "' (entry " + std::to_string(index_) + ")");
+    };
+    auto varint = [&] {
+        uint64_t v;
+        if (!get_varint(p, end, v)) corrupt();
+        return v;
+    };
+    auto bytes = [&](const uint64_t n) {
+        if (n > static_cast<uint64_t>(end - p)) corrupt();
+        const auto *ret = p;
+        p += n;
+        return ret;
+    };
+    entry_.kind_ = static_cast<manifest_entry::kind>(*bytes(1));
+    const uint64_t shared = varint();
+    const uint64_t suffix = varint();
+    if (shared > path_.size() || (shared > 0 && index_ % ManifestWriter::BLOCK_ENTRIES == 0)) corrupt();
+    path_.resize(shared);
+    path_.append(reinterpret_cast<const char *>(bytes(suffix)), suffix);
+    switch (entry_.kind_) {
+        case manifest_entry::kind::copied:
+        case manifest_entry::kind::hard_linked:
+            entry_.digest_.len_ = reader_->digestLength_;
+            std::memcpy(entry_.digest_.md_, bytes(reader_->digestLength_), reader_->digestLength_);
+            entry_.size_ = varint();
+            std::memcpy(&entry_.mtimeNs_, bytes(sizeof(entry_.mtimeNs_)), sizeof(entry_.mtimeNs_));
+            entry_.target_ = {};
+            break;
+        case manifest_entry::kind::symlink: {
+            const uint64_t len = varint();
+            entry_.target_ = {reinterpret_cast<const char *>(bytes(len)), len};
+            entry_.digest_ = {};
+            entry_.size_ = 0;
+            entry_.mtimeNs_ = 0;
+            break;
+        }
+        case manifest_entry::kind::directory:
+            entry_.digest_ = {};
+            entry_.size_ = 0;
+            entry_.mtimeNs_ = 0;
+            entry_.target_ = {};
+            break;
+        default:
+            corrupt();
+    }
+    next_ = p;
+}
+
+std::ostream &krico::backup::operator<<(std::ostream &out, const manifest_entry &entry) {
+    switch (entry.kind_) {
+        case manifest_entry::kind::directory:
+            return out << "D " << entry.path_;
+        case manifest_entry::kind::copied:
+        case manifest_entry::kind::hard_linked:
+            return out << static_cast<char>(entry.kind_) << ' ' << entry.digest_.str() << ' ' << entry.path_;
+        case manifest_entry::kind::symlink:
+            return out << "L " << entry.path_ << '\t' << entry.target_;
+    }
+    return out;
+}
+
+void krico::backup::print_manifest(const fs::path &file, std::ostream &out) {
+    if (!ManifestReader::is_manifest(file)) {
+        // Text summary of a backup that predates the manifest
+        if (std::ifstream in{file}; in) {
+            out << in.rdbuf();
+            return;
+        }
+        THROW_EXCEPTION("Failed to open '" + file.string() + "'");
+    }
+    const ManifestReader reader{file};
+    for (const auto &entry: reader) {
+        out << entry << '\n';
+    }
+    out << "S " << reader.checksum().str() << std::endl;
+}
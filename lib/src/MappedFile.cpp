@@ -0,0 +1,57 @@
+#include "krico/backup/MappedFile.h"
+#include "krico/backup/exception.h"
+#include <spdlog/spdlog.h>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace krico::backup;
+namespace fs = std::filesystem;
+
+MappedFile::MappedFile(const fs::path &file) {
+    const int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        THROW_ERRNO("Failed to open '" + file.string() + "'");
+    }
+    struct stat st{};
+    if (fstat(fd, &st)) {
+        const auto ec = std::make_error_code(static_cast<std::errc>(errno));
+        close(fd);
+        THROW_ERROR_CODE("Failed to stat '" + file.string() + "'", ec);
+    }
+    if (st.st_size > 0) {
+        void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (ptr == MAP_FAILED) {
+            const auto ec = std::make_error_code(static_cast<std::errc>(errno));
+            close(fd);
+            THROW_ERROR_CODE("Failed to mmap '" + file.string() + "'", ec);
+        }
+        data_ = static_cast<const uint8_t *>(ptr);
+        size_ = st.st_size;
+    }
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (data_ && munmap(const_cast<uint8_t *>(data_), size_)) {
+        auto ec = std::make_error_code(static_cast<std::errc>(errno));
+        spdlog::error("Failed to munmap [size={}][ec={}]: {}", size_, ec.value(), ec.message());
+    }
+}
+
+MappedFile::MappedFile(MappedFile &&rhs) noexcept
+    : data_(std::exchange(rhs.data_, nullptr)),
+      size_(std::exchange(rhs.size_, 0)) {
+}
+
+MappedFile &MappedFile::operator=(MappedFile &&rhs) noexcept {
+    if (this != &rhs) {
+        MappedFile old{std::move(*this)};
+        data_ = std::exchange(rhs.data_, nullptr);
+        size_ = std::exchange(rhs.size_, 0);
+    }
+    return *this;
+}
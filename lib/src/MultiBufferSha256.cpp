@@ -0,0 +1,211 @@
+#include "krico/backup/MultiBufferSha256.h"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <numeric>
+#include <vector>
+
+using namespace krico::backup;
+
+namespace {
+    constexpr size_t BLOCK_LEN = 64;
+    constexpr size_t MAX_LANES = 16;
+
+    constexpr uint32_t H0[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    constexpr uint32_t K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+
+    inline uint32_t load_be32(const uint8_t *p) {
+        uint32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        if constexpr (std::endian::native == std::endian::little) v = __builtin_bswap32(v);
+        return v;
+    }
+
+    inline void store_be32(uint8_t *p, uint32_t v) {
+        if constexpr (std::endian::native == std::endian::little) v = __builtin_bswap32(v);
+        std::memcpy(p, &v, sizeof(v));
+    }
+
+    // Vectors are only passed by reference: passing or returning them by value from a function that is not compiled
+    // for their instruction set changes the ABI (-Wpsabi)
+    template<typename V>
+    [[gnu::always_inline]] inline void sigma(const V &x, const int r1, const int r2, const int r3, V &out) {
+        out = ((x >> r1) | (x << (32 - r1))) ^ ((x >> r2) | (x << (32 - r2))) ^ ((x >> r3) | (x << (32 - r3)));
+    }
+
+    //!
+    //! Message schedule sigma: the last term is a shift
+    //!
+    template<typename V>
+    [[gnu::always_inline]] inline void schedule_sigma(const V &x, const int r1, const int r2, const int s, V &out) {
+        out = ((x >> r1) | (x << (32 - r1))) ^ ((x >> r2) | (x << (32 - r2))) ^ (x >> s);
+    }
+
+    template<size_t L>
+    struct vec {
+        typedef uint32_t type __attribute__((vector_size(4 * L)));
+    };
+
+    //!
+    //! A message with its padding: whole blocks straight from the buffer, then 1 or 2 blocks of `tail_`
+    //!
+    struct message_t {
+        const uint8_t *data_{nullptr};
+        size_t fullBlocks_{0};
+        size_t blocks_{0};
+        uint8_t tail_[2 * BLOCK_LEN]{};
+
+        void init(const MultiBufferSha256::buffer_t &buffer) {
+            data_ = static_cast<const uint8_t *>(buffer.data_);
+            fullBlocks_ = buffer.len_ / BLOCK_LEN;
+            const size_t rest = buffer.len_ % BLOCK_LEN;
+            const size_t tailBlocks = rest + 1 + 8 <= BLOCK_LEN ? 1 : 2;
+            blocks_ = fullBlocks_ + tailBlocks;
+            std::memset(tail_, 0, sizeof(tail_));
+            if (rest > 0) std::memcpy(tail_, data_ + fullBlocks_ * BLOCK_LEN, rest);
+            tail_[rest] = 0x80;
+            const uint64_t bits = static_cast<uint64_t>(buffer.len_) * 8;
+            for (size_t i = 0; i < 8; ++i) {
+                tail_[tailBlocks * BLOCK_LEN - 1 - i] = static_cast<uint8_t>(bits >> (8 * i));
+            }
+        }
+
+        [[nodiscard]] const uint8_t *block(const size_t b) const {
+            return b < fullBlocks_ ? data_ + b * BLOCK_LEN : tail_ + (b - fullBlocks_) * BLOCK_LEN;
+        }
+    };
+
+    using sha256_fn = void (*)(const message_t *messages, size_t n, Digest::result *out);
+
+    //!
+    //! Hash `n` (<= L) messages, one per vector lane.  Lanes whose message has no more blocks keep their state.
+    //!
+    template<size_t L>
+    [[gnu::always_inline]] inline void sha256(const message_t *messages, const size_t n, Digest::result *out) {
+        using V = typename vec<L>::type;
+        V state[8];
+        for (size_t i = 0; i < 8; ++i) state[i] = V{} + H0[i];
+        size_t maxBlocks = 0;
+        for (size_t j = 0; j < n; ++j) maxBlocks = std::max(maxBlocks, messages[j].blocks_);
+        for (size_t b = 0; b < maxBlocks; ++b) {
+            alignas(64) uint32_t words[16][L]{};
+            V active{};
+            for (size_t j = 0; j < n; ++j) {
+                if (b >= messages[j].blocks_) continue;
+                active[j] = ~0u;
+                const uint8_t *block = messages[j].block(b);
+                for (size_t w = 0; w < 16; ++w) words[w][j] = load_be32(block + 4 * w);
+            }
+            V w[64];
+            std::memcpy(w, words, sizeof(words));
+            for (size_t t = 16; t < 64; ++t) {
+                V s0, s1;
+                schedule_sigma(w[t - 15], 7, 18, 3, s0);
+                schedule_sigma(w[t - 2], 17, 19, 10, s1);
+                w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+            }
+            V a = state[0], b_ = state[1], c = state[2], d = state[3];
+            V e = state[4], f = state[5], g = state[6], h = state[7];
+            for (size_t t = 0; t < 64; ++t) {
+                V S0, S1;
+                sigma(e, 6, 11, 25, S1);
+                const V ch = (e & f) ^ (~e & g);
+                const V t1 = h + S1 + ch + K[t] + w[t];
+                sigma(a, 2, 13, 22, S0);
+                const V maj = (a & b_) ^ (a & c) ^ (b_ & c);
+                const V t2 = S0 + maj;
+                h = g;
+                g = f;
+                f = e;
+                e = d + t1;
+                d = c;
+                c = b_;
+                b_ = a;
+                a = t1 + t2;
+            }
+            const V next[8] = {a, b_, c, d, e, f, g, h};
+            for (size_t i = 0; i < 8; ++i) {
+                state[i] = ((state[i] + next[i]) & active) | (state[i] & ~active);
+            }
+        }
+        for (size_t j = 0; j < n; ++j) {
+            out[j].len_ = DigestLength::SHA256;
+            for (size_t i = 0; i < 8; ++i) store_be32(out[j].md_ + 4 * i, state[i][j]);
+        }
+    }
+
+    void sha256_128(const message_t *messages, const size_t n, Digest::result *out) {
+        sha256<4>(messages, n, out);
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    __attribute__((target("avx2")))
+    void sha256_avx2(const message_t *messages, const size_t n, Digest::result *out) {
+        sha256<8>(messages, n, out);
+    }
+
+    __attribute__((target("avx512f")))
+    void sha256_avx512(const message_t *messages, const size_t n, Digest::result *out) {
+        sha256<16>(messages, n, out);
+    }
+#endif
+
+    struct simd_t {
+        const char *name_;
+        size_t lanes_;
+        sha256_fn sha256_;
+    };
+
+    const simd_t &simd() {
+        static const simd_t detected = [] {
+#if defined(__x86_64__) || defined(__i386__)
+            if (__builtin_cpu_supports("avx512f")) return simd_t{"avx512", 16, sha256_avx512};
+            if (__builtin_cpu_supports("avx2")) return simd_t{"avx2", 8, sha256_avx2};
+            return simd_t{"sse2", 4, sha256_128};
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+            return simd_t{"neon", 4, sha256_128};
+#else
+            return simd_t{"simd128", 4, sha256_128};
+#endif
+        }();
+        return detected;
+    }
+}
+
+void MultiBufferSha256::digest(const buffer_t *buffers, const size_t n, Digest::result *results) {
+    const auto &[_, lanes, sha256] = simd();
+    // Hash buffers of similar length together, so few lanes sit idle
+    std::vector<size_t> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::ranges::sort(order, [buffers](const size_t lhs, const size_t rhs) {
+        return buffers[lhs].len_ < buffers[rhs].len_;
+    });
+    message_t messages[MAX_LANES];
+    Digest::result out[MAX_LANES];
+    for (size_t first = 0; first < n; first += lanes) {
+        const size_t count = std::min(lanes, n - first);
+        for (size_t j = 0; j < count; ++j) messages[j].init(buffers[order[first + j]]);
+        sha256(messages, count, out);
+        for (size_t j = 0; j < count; ++j) results[order[first + j]] = out[j];
+    }
+}
+
+size_t MultiBufferSha256::lanes() {
+    return simd().lanes_;
+}
+
+const char *MultiBufferSha256::implementation() {
+    return simd().name_;
+}
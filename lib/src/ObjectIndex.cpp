@@ -0,0 +1,233 @@
+#include "krico/backup/ObjectIndex.h"
+#include "krico/backup/TemporaryFile.h"
+#include "krico/backup/exception.h"
+#include "krico/backup/io.h"
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <cstring>
+#include <optional>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace krico::backup;
+namespace fs = std::filesystem;
+
+ObjectIndex::ObjectIndex(const fs::path &metaDir, fs::path hardLinksDir, const uint32_t digestLength)
+    : indexFile_(metaDir / INDEX_FILE),
+      journalFile_(metaDir / JOURNAL_FILE),
+      hardLinksDir_(std::move(hardLinksDir)),
+      digestLength_(digestLength) {
+    if (digestLength_ == 0 || digestLength_ > EVP_MAX_MD_SIZE) {
+        THROW_EXCEPTION("Invalid object index digest length " + std::to_string(digestLength_));
+    }
+    journal_ = open(journalFile_.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if (journal_ == -1) {
+        THROW_ERRNO("Failed to open '" + journalFile_.string() + "'");
+    }
+    if (!exists(indexFile_) || !map()) {
+        rebuild();
+        return;
+    }
+    // Replay inserts that were not saved (whole records only, a crash can leave a partial one)
+    std::ifstream in{journalFile_, std::ios::binary};
+    Digest::result digest{.md_ = {}, .len_ = digestLength_};
+    while (in.read(reinterpret_cast<char *>(digest.md_), digestLength_)) {
+        if (!indexed(digest.md_)) added_.insert(digest);
+    }
+    spdlog::debug("Opened object index [file={}][objects={}][journaled={}]",
+                  indexFile_.string(), count_, added_.size());
+}
+
+ObjectIndex::~ObjectIndex() {
+    if (journal_ != -1 && close(journal_)) {
+        auto ec = std::make_error_code(static_cast<std::errc>(errno));
+        spdlog::error("Failed to close [fd={}][ec={}]: {}", journal_, ec.value(), ec.message());
+    }
+}
+
+bool ObjectIndex::contains(const Digest::result &digest) const {
+    if (digest.len_ != digestLength_) return false;
+    std::shared_lock lock{mutex_};
+    return indexed(digest.md_) || added_.contains(digest);
+}
+
+void ObjectIndex::insert(const Digest::result &digest) {
+    if (digest.len_ != digestLength_) {
+        THROW_EXCEPTION("Cannot index digest '" + digest.str() + "' (length "
+            + std::to_string(digest.len_) + " != " + std::to_string(digestLength_) + ")");
+    }
+    std::unique_lock lock{mutex_};
+    if (indexed(digest.md_) || !added_.insert(digest).second) return;
+    // O_APPEND writes this small are atomic, losing one (crash) only costs a redundant copy later
+    if (::write(journal_, digest.md_, digestLength_) != digestLength_) {
+        THROW_ERRNO("Failed to append to '" + journalFile_.string() + "'");
+    }
+}
+
+void ObjectIndex::save() {
+    std::unique_lock lock{mutex_};
+    if (added_.empty()) return;
+    std::vector<Digest::result> added{added_.begin(), added_.end()};
+    std::ranges::sort(added, [this](const auto &lhs, const auto &rhs) { return less(lhs, rhs); });
+    // Merge the sorted inserts into the mapped entries as they are written
+    write([this, &added](const auto &emit) {
+        Digest::result digest{.md_ = {}, .len_ = digestLength_};
+        auto it = added.cbegin();
+        for (size_t i = 0; i < count_; ++i) {
+            std::memcpy(digest.md_, entries_ + i * digestLength_, digestLength_);
+            for (; it != added.cend() && less(*it, digest); ++it) emit(*it);
+            emit(digest);
+        }
+        for (; it != added.cend(); ++it) emit(*it);
+        return true;
+    });
+    spdlog::debug("Saved object index [file={}][objects={}]", indexFile_.string(), count_);
+}
+
+size_t ObjectIndex::rebuild() {
+    std::unique_lock lock{mutex_};
+    added_.clear();
+    const bool ordered = write([this](const auto &emit) {
+        if (!is_directory(hardLinksDir_)) return true;
+        std::optional<Digest::result> last{};
+        return scan(hardLinksDir_, [this, &emit, &last](const Digest::result &digest) {
+            if (last && !less(*last, digest)) return false;
+            emit(digest);
+            last = digest;
+            return true;
+        });
+    });
+    if (!ordered) {
+        spdlog::warn("Objects are not laid out in order, sorting all of them [dir={}]", hardLinksDir_.string());
+        std::vector<Digest::result> digests{};
+        scan(hardLinksDir_, [&digests](const Digest::result &digest) {
+            digests.push_back(digest);
+            return true;
+        });
+        std::ranges::sort(digests, [this](const auto &lhs, const auto &rhs) { return less(lhs, rhs); });
+        const auto [first, last] = std::ranges::unique(digests);
+        digests.erase(first, last);
+        write([&digests](const auto &emit) {
+            for (const auto &digest: digests) emit(digest);
+            return true;
+        });
+    }
+    spdlog::info("Rebuilt object index [file={}][objects={}]", indexFile_.string(), count_);
+    return count_;
+}
+
+size_t ObjectIndex::size() const {
+    std::shared_lock lock{mutex_};
+    return count_ + added_.size();
+}
+
+bool ObjectIndex::map() {
+    entries_ = nullptr;
+    count_ = 0;
+    mapped_ = MappedFile{indexFile_};
+    header_t header{};
+    if (mapped_.size() < sizeof(header)) {
+        spdlog::warn("Invalid object index [file={}][size={}]", indexFile_.string(), mapped_.size());
+        return false;
+    }
+    std::memcpy(&header, mapped_.data(), sizeof(header));
+    if (header.magic_ != MAGIC || header.version_ != VERSION || header.digestLength_ != digestLength_
+        || mapped_.size() != sizeof(header) + header.count_ * digestLength_) {
+        spdlog::warn("Invalid object index [file={}][magic={:x}][version={}][digestLength={}][count={}]",
+                     indexFile_.string(), header.magic_, header.version_, header.digestLength_, header.count_);
+        return false;
+    }
+    entries_ = mapped_.data() + sizeof(header);
+    count_ = header.count_;
+    return true;
+}
+
+bool ObjectIndex::indexed(const uint8_t *md) const {
+    size_t lo = 0, hi = count_;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        const int cmp = std::memcmp(entries_ + mid * digestLength_, md, digestLength_);
+        if (cmp == 0) return true;
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return false;
+}
+
+bool ObjectIndex::less(const Digest::result &lhs, const Digest::result &rhs) const {
+    return std::memcmp(lhs.md_, rhs.md_, digestLength_) < 0;
+}
+
+bool ObjectIndex::parse(const fs::path &file, Digest::result &digest) const {
+    // The object path is the hex digest with directory separators in it
+    std::string hex{};
+    for (const auto &part: file.lexically_relative(hardLinksDir_)) {
+        hex += part.string();
+    }
+    if (hex.size() != 2 * digestLength_
+        || !std::ranges::all_of(hex, [](const unsigned char c) { return std::isxdigit(c); })) {
+        // Temp files or something that is not ours
+        spdlog::debug("Not indexing '{}'", file.string());
+        return false;
+    }
+    Digest::result::parse(digest, hex);
+    return true;
+}
+
+bool ObjectIndex::scan(const fs::path &dir, const std::function<bool(const Digest::result &)> &add) const {
+    std::vector<Digest::result> files{};
+    std::vector<fs::path> dirs{};
+    for (const auto &entry: fs::directory_iterator{dir}) {
+        if (entry.is_symlink()) continue;
+        if (entry.is_directory()) {
+            dirs.push_back(entry.path());
+        } else if (Digest::result digest{}; entry.is_regular_file() && parse(entry.path(), digest)) {
+            files.push_back(digest);
+        }
+    }
+    // Within a layout the names of a directory all have the same length, so name order is digest order
+    std::ranges::sort(files, [this](const auto &lhs, const auto &rhs) { return less(lhs, rhs); });
+    for (const auto &digest: files) {
+        if (!add(digest)) return false;
+    }
+    files = {};
+    std::ranges::sort(dirs);
+    for (const auto &sub: dirs) {
+        if (!scan(sub, add)) return false;
+    }
+    return true;
+}
+
+bool ObjectIndex::write(const std::function<bool(const std::function<void(const Digest::result &)> &)> &produce) {
+    const TemporaryFile tmpFile{indexFile_.parent_path(), indexFile_.filename().string()};
+    do {
+        std::ofstream out{tmpFile.file(), std::ios::binary | std::ios::trunc};
+        header_t header{
+            .magic_ = MAGIC, .version_ = VERSION, .digestLength_ = digestLength_, .reserved_ = 0, .count_ = 0
+        };
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        const bool produced = produce([this, &out, &header](const Digest::result &digest) {
+            out.write(reinterpret_cast<const char *>(digest.md_), digestLength_);
+            ++header.count_;
+        });
+        if (!produced) return false;
+        // The count is only known once all the digests are written
+        out.seekp(0);
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.close();
+        if (!out) {
+            THROW_EXCEPTION("Failed to write '" + tmpFile.file().string() + "'");
+        }
+    } while (false);
+    RENAME_FILE(tmpFile.file(), indexFile_);
+    added_.clear();
+    if (ftruncate(journal_, 0)) {
+        THROW_ERRNO("Failed to truncate '" + journalFile_.string() + "'");
+    }
+    if (!map()) {
+        THROW_EXCEPTION("Failed to map '" + indexFile_.string() + "'");
+    }
+    return true;
+}
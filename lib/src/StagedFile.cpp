@@ -0,0 +1,150 @@
+#include "krico/backup/StagedFile.h"
+#include "krico/backup/exception.h"
+#include <spdlog/spdlog.h>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+using namespace krico::backup;
+using namespace krico;
+namespace fs = std::filesystem;
+
+namespace {
+    constexpr auto PROBE_FILE = "probe.tmp";
+    constexpr mode_t MODE = S_IRUSR | S_IWUSR;
+
+#ifdef O_TMPFILE
+    int open_anonymous(const int dirFd) {
+        return openat(dirFd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, MODE);
+    }
+
+    int link_proc_fd(const int fd, const int dirFd, const char *name) {
+        const std::string proc = "/proc/self/fd/" + std::to_string(fd);
+        return linkat(AT_FDCWD, proc.c_str(), dirFd, name, AT_SYMLINK_FOLLOW);
+    }
+#endif
+}
+
+StagedFile::method StagedFile::probe(const int dirFd, const fs::path &dir) {
+#ifdef O_TMPFILE
+    // Left over by a crash between the link and the unlink below
+    if (unlinkat(dirFd, PROBE_FILE, 0) && errno != ENOENT) {
+        THROW_ERRNO("Failed to remove '" + (dir / PROBE_FILE).string() + "'");
+    }
+    const int fd = open_anonymous(dirFd);
+    if (fd == -1) {
+        // EOPNOTSUPP from file systems without O_TMPFILE, EISDIR from kernels before 3.11
+        spdlog::debug("No O_TMPFILE [dir={}][errno={}]", dir.string(), errno);
+        return method::rename;
+    }
+    auto m = method::rename;
+    // AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH (ENOENT otherwise), the /proc link does not
+    if (linkat(fd, "", dirFd, PROBE_FILE, AT_EMPTY_PATH) == 0) {
+        m = method::empty_path;
+    } else if (link_proc_fd(fd, dirFd, PROBE_FILE) == 0) {
+        m = method::proc_fd;
+    }
+    close(fd);
+    if (m != method::rename && unlinkat(dirFd, PROBE_FILE, 0)) {
+        THROW_ERRNO("Failed to remove '" + (dir / PROBE_FILE).string() + "'");
+    }
+    return m;
+#else
+    return method::rename;
+#endif
+}
+
+StagedFile::StagedFile(const int dirFd, const method m, const fs::path &tmpFile)
+    : dirFd_(dirFd),
+      method_(m),
+      path_(m == method::rename ? tmpFile : tmpFile.parent_path()),
+      tmpName_(tmpFile.filename().string()) {
+#ifdef O_TMPFILE
+    if (method_ != method::rename) {
+        fd_ = open_anonymous(dirFd_);
+    } else {
+        fd_ = openat(dirFd_, tmpName_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, MODE);
+    }
+#else
+    if (method_ != method::rename) {
+        THROW_EXCEPTION(std::string{"Staging method not supported: "} + to_string(method_));
+    }
+    fd_ = openat(dirFd_, tmpName_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, MODE);
+#endif
+    if (fd_ == -1) {
+        THROW_ERRNO("Failed to create '" + path_.string() + "'");
+    }
+}
+
+StagedFile::~StagedFile() {
+    if (close(fd_)) {
+        auto ec = std::make_error_code(static_cast<std::errc>(errno));
+        spdlog::error("Failed to close '{}' [ec={}]: {}", path_.string(), ec.value(), ec.message());
+    }
+    if (method_ == method::rename && !published_ && unlinkat(dirFd_, tmpName_.c_str(), 0)) {
+        auto ec = std::make_error_code(static_cast<std::errc>(errno));
+        spdlog::error("Failed to remove '{}' [ec={}]: {}", path_.string(), ec.value(), ec.message());
+    }
+}
+
+void StagedFile::write(const void *data, size_t len) const {
+    const auto *p = static_cast<const char *>(data);
+    while (len > 0) {
+        const auto n = ::write(fd_, p, len);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            THROW_ERRNO("Failed to write '" + path_.string() + "'");
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+StagedFile::outcome StagedFile::publish(const char *name, const fs::path &target) {
+    int result = -1;
+    switch (method_) {
+#ifdef O_TMPFILE
+        case method::empty_path:
+            result = linkat(fd_, "", dirFd_, name, AT_EMPTY_PATH);
+            break;
+        case method::proc_fd:
+            result = link_proc_fd(fd_, dirFd_, name);
+            break;
+#endif
+        case method::rename: {
+            // rename() would silently replace it
+            struct stat st{};
+            if (fstatat(dirFd_, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+                return outcome::exists;
+            }
+            result = renameat(dirFd_, tmpName_.c_str(), dirFd_, name);
+            break;
+        }
+        default:
+            THROW_EXCEPTION(std::string{"Staging method not supported: "} + to_string(method_));
+    }
+    if (result == 0) {
+        published_ = true;
+        return outcome::published;
+    }
+    if (errno == EEXIST) {
+        return outcome::exists;
+    }
+    if (errno == ENOENT) {
+        return outcome::no_directory;
+    }
+    THROW_ERRNO("Failed to publish '" + path_.string() + "' as '" + target.string() + "'");
+}
+
+const char *backup::to_string(const StagedFile::method method) {
+    switch (method) {
+        case StagedFile::method::empty_path:
+            return "empty_path";
+        case StagedFile::method::proc_fd:
+            return "proc_fd";
+        case StagedFile::method::rename:
+            return "rename";
+    }
+    return "unknown";
+}
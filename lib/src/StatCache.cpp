@@ -0,0 +1,121 @@
+#include "krico/backup/StatCache.h"
+#include "krico/backup/TemporaryFile.h"
+#include "krico/backup/exception.h"
+#include "krico/backup/io.h"
+#include <spdlog/spdlog.h>
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+#include <sys/stat.h>
+
+using namespace krico::backup;
+using namespace std::chrono;
+namespace fs = std::filesystem;
+
+static_assert(sizeof(StatCache::key_t) == 40);
+
+namespace {
+    constexpr int64_t to_ns(const timespec &ts) {
+        return static_cast<int64_t>(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+    }
+
+    constexpr bool less(const StatCache::key_t &lhs, const StatCache::key_t &rhs) {
+        return lhs.dev_ != rhs.dev_ ? lhs.dev_ < rhs.dev_ : lhs.ino_ < rhs.ino_;
+    }
+}
+
+StatCache::StatCache(const fs::path &metaDir)
+    : file_(metaDir / CACHE_FILE),
+      openTime_ns_(duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count()) {
+    if (!exists(file_)) {
+        spdlog::debug("No stat cache [file={}]", file_.string());
+        return;
+    }
+    mapped_ = MappedFile{file_};
+    header_t header{};
+    if (mapped_.size() < sizeof(header)) {
+        spdlog::warn("Ignoring truncated stat cache [file={}][size={}]", file_.string(), mapped_.size());
+        return;
+    }
+    std::memcpy(&header, mapped_.data(), sizeof(header));
+    if (header.magic_ != MAGIC || header.version_ != VERSION
+        || mapped_.size() != sizeof(header) + header.count_ * sizeof(entry_t)) {
+        spdlog::warn("Ignoring invalid stat cache [file={}][magic={:x}][version={}][count={}]",
+                     file_.string(), header.magic_, header.version_, header.count_);
+        return;
+    }
+    entries_ = reinterpret_cast<const entry_t *>(mapped_.data() + sizeof(header));
+    count_ = header.count_;
+    spdlog::debug("Mapped stat cache [file={}][entries={}]", file_.string(), count_);
+}
+
+void StatCache::stat(const fs::path &file, key_t &key) {
+    struct stat st{};
+    if (lstat(file.c_str(), &st)) {
+        THROW_ERRNO("Failed to stat '" + file.string() + "'");
+    }
+    key.dev_ = st.st_dev;
+    key.ino_ = st.st_ino;
+    key.size_ = st.st_size;
+#ifdef __APPLE__
+    key.mtime_ns_ = to_ns(st.st_mtimespec);
+    key.ctime_ns_ = to_ns(st.st_ctimespec);
+#else
+    key.mtime_ns_ = to_ns(st.st_mtim);
+    key.ctime_ns_ = to_ns(st.st_ctim);
+#endif
+}
+
+bool StatCache::find(const key_t &key, Digest::result &digest) {
+    const entry_t *end = entries_ + count_;
+    const entry_t *it = std::lower_bound(entries_, end, key, [](const entry_t &e, const key_t &k) {
+        return less(e.key_, k);
+    });
+    if (it == end || it->key_ != key) {
+        ++misses_;
+        return false;
+    }
+    digest.len_ = it->len_;
+    std::memcpy(digest.md_, it->md_, it->len_);
+    ++hits_;
+    std::lock_guard lock{mutex_};
+    // Files written before reserved_ carry whatever was in the padding
+    next_.emplace_back(*it).reserved_ = 0;
+    return true;
+}
+
+void StatCache::put(const key_t &key, const Digest::result &digest) {
+    if (digest.len_ > MAX_DIGEST_LENGTH) return;
+    // Same "racy" problem as git's index: a change within the same clock tick would go unnoticed
+    if (key.mtime_ns_ >= openTime_ns_ || key.ctime_ns_ >= openTime_ns_) return;
+    entry_t entry{.key_ = key, .len_ = digest.len_, .md_ = {}, .reserved_ = 0};
+    std::memcpy(entry.md_, digest.md_, digest.len_);
+    std::lock_guard lock{mutex_};
+    next_.push_back(entry);
+}
+
+void StatCache::save() {
+    std::lock_guard lock{mutex_};
+    std::ranges::sort(next_, [](const entry_t &lhs, const entry_t &rhs) { return less(lhs.key_, rhs.key_); });
+    // Hard links of the same file (same dev/ino) are found more than once
+    const auto [first, last] = std::ranges::unique(next_, [](const entry_t &lhs, const entry_t &rhs) {
+        return lhs.key_.dev_ == rhs.key_.dev_ && lhs.key_.ino_ == rhs.key_.ino_;
+    });
+    next_.erase(first, last);
+
+    const TemporaryFile tmpFile{file_.parent_path(), file_.filename().string()};
+    do {
+        std::ofstream out{tmpFile.file(), std::ios::binary | std::ios::trunc};
+        const header_t header{.magic_ = MAGIC, .version_ = VERSION, .count_ = next_.size()};
+        out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char *>(next_.data()),
+                  static_cast<std::streamsize>(next_.size() * sizeof(entry_t)));
+        out.close();
+        if (!out) {
+            THROW_EXCEPTION("Failed to write '" + tmpFile.file().string() + "'");
+        }
+    } while (false);
+    RENAME_FILE(tmpFile.file(), file_);
+    spdlog::debug("Saved stat cache [file={}][entries={}][hits={}][misses={}]",
+                  file_.string(), next_.size(), hits_.load(), misses_.load());
+}
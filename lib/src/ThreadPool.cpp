@@ -0,0 +1,123 @@
+#include "krico/backup/ThreadPool.h"
+#include <spdlog/spdlog.h>
+
+using namespace krico::backup;
+
+namespace {
+    // Pool the calling thread is a worker of (nullptr for any other thread) and its index there
+    thread_local const ThreadPool *workerPool{nullptr};
+    thread_local unsigned workerIndex{0};
+}
+
+ThreadPool::ThreadPool(const unsigned threads) {
+    const unsigned n = threads == 0 ? 1 : threads;
+    queues_.reserve(n);
+    for (unsigned i = 0; i < n; ++i) {
+        queues_.emplace_back(std::make_unique<worker_queue>());
+    }
+    threads_.reserve(n);
+    for (unsigned i = 0; i < n; ++i) {
+        threads_.emplace_back([this, i] { run(i); });
+    }
+    spdlog::debug("Started ThreadPool [threads={}]", n);
+}
+
+ThreadPool::~ThreadPool() {
+    do {
+        std::lock_guard lock{mutex_};
+        stop_ = true;
+    } while (false);
+    workAvailable_.notify_all();
+    for (auto &t: threads_) {
+        if (t.joinable()) t.join();
+    }
+}
+
+void ThreadPool::submit(task t) {
+    ++pending_;
+    // Workers push to their own queue, everybody else (including workers of other pools) spreads round-robin
+    const unsigned index = workerPool == this ? workerIndex : nextQueue_++ % size();
+    do {
+        auto &queue = *queues_[index];
+        std::lock_guard lock{queue.mutex_};
+        queue.tasks_.emplace_back(std::move(t));
+    } while (false);
+    ++queued_;
+    do {
+        // Synchronize with workers about to wait (avoid lost wake-ups)
+        std::lock_guard lock{mutex_};
+    } while (false);
+    workAvailable_.notify_one();
+}
+
+void ThreadPool::wait() {
+    std::unique_lock lock{mutex_};
+    allDone_.wait(lock, [this] { return pending_ == 0; });
+    if (error_) {
+        auto error = std::exchange(error_, nullptr);
+        failed_ = false;
+        std::rethrow_exception(error);
+    }
+}
+
+unsigned ThreadPool::worker() {
+    return workerIndex;
+}
+
+void ThreadPool::run(const unsigned index) {
+    workerPool = this;
+    workerIndex = index;
+    task t;
+    while (true) {
+        if (pop(index, t)) {
+            execute(t);
+            continue;
+        }
+        std::unique_lock lock{mutex_};
+        workAvailable_.wait(lock, [this] { return stop_ || queued_ > 0; });
+        if (stop_ && queued_ == 0) return;
+    }
+}
+
+bool ThreadPool::pop(const unsigned index, task &t) {
+    do {
+        // Own queue, newest first
+        auto &queue = *queues_[index];
+        std::lock_guard lock{queue.mutex_};
+        if (!queue.tasks_.empty()) {
+            t = std::move(queue.tasks_.back());
+            queue.tasks_.pop_back();
+            --queued_;
+            return true;
+        }
+    } while (false);
+    for (unsigned i = 1; i < size(); ++i) {
+        // Steal from the others, oldest first
+        auto &queue = *queues_[(index + i) % size()];
+        std::lock_guard lock{queue.mutex_};
+        if (!queue.tasks_.empty()) {
+            t = std::move(queue.tasks_.front());
+            queue.tasks_.pop_front();
+            --queued_;
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::execute(task &t) {
+    if (!failed_) {
+        try {
+            t();
+        } catch (...) {
+            std::lock_guard lock{mutex_};
+            if (!error_) error_ = std::current_exception();
+            failed_ = true;
+        }
+    }
+    t = nullptr;
+    if (--pending_ == 0) {
+        std::lock_guard lock{mutex_};
+        allDone_.notify_all();
+    }
+}
@@ -1,4 +1,15 @@
 #include "krico/backup/io.h"
+#include "krico/backup/exception.h"
+#include <spdlog/spdlog.h>
+#include <memory>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#endif
 
 using namespace krico::backup;
 using namespace krico;
@@ -6,6 +17,131 @@ namespace fs = std::filesystem;
 
 namespace {
     fs::path dotDot{".."};
+
+    //!
+    //! Closes the file descriptor when going out of scope
+    //!
+    struct fd_guard {
+        int fd_;
+
+        explicit fd_guard(const int fd): fd_(fd) {
+        }
+
+        fd_guard(const fd_guard &) = delete;
+
+        fd_guard &operator=(const fd_guard &) = delete;
+
+        ~fd_guard() {
+            if (fd_ != -1 && close(fd_)) {
+                auto ec = std::make_error_code(static_cast<std::errc>(errno));
+                spdlog::error("Failed to close [fd={}][ec={}]: {}", fd_, ec.value(), ec.message());
+            }
+        }
+    };
+
+#ifdef __linux__
+    //!
+    //! @return true if errno (after copy_file_range/sendfile failed on the first call) means "try the next method"
+    //!
+    bool is_unsupported(const int error) {
+        return error == ENOSYS || error == EXDEV || error == EINVAL || error == EOPNOTSUPP || error == ENOTSUP;
+    }
+#endif
+
+    void write_fully(const int fd, const char *data, size_t len, const fs::path &to) {
+        while (len > 0) {
+            const auto n = write(fd, data, len);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                THROW_ERRNO("Failed to write '" + to.string() + "'");
+            }
+            data += n;
+            len -= n;
+        }
+    }
+}
+
+const char *backup::to_string(const copy_method method) {
+    switch (method) {
+        case copy_method::clone:
+            return "clone";
+        case copy_method::copy_file_range:
+            return "copy_file_range";
+        case copy_method::sendfile:
+            return "sendfile";
+        case copy_method::read_write:
+            return "read_write";
+    }
+    return "unknown";
+}
+
+backup::copy_method backup::copy_file_data(const fs::path &from, const fs::path &to) {
+    const fd_guard out{open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR)};
+    if (out.fd_ == -1) {
+        THROW_ERRNO("Failed to create '" + to.string() + "'");
+    }
+    return copy_file_data(from, out.fd_, to);
+}
+
+backup::copy_method backup::copy_file_data(const fs::path &from, const int toFd, const fs::path &to) {
+    const fd_guard in{open(from.c_str(), O_RDONLY | O_CLOEXEC)};
+    if (in.fd_ == -1) {
+        THROW_ERRNO("Failed to open '" + from.string() + "'");
+    }
+    struct stat st{};
+    if (fstat(in.fd_, &st)) {
+        THROW_ERRNO("Failed to stat '" + from.string() + "'");
+    }
+    // Same as std::filesystem::copy_file, the copy gets the permissions of the source
+    if (fchmod(toFd, st.st_mode & 07777)) {
+        THROW_ERRNO("Failed to set permissions of '" + to.string() + "'");
+    }
+#ifdef __linux__
+    const auto size = static_cast<size_t>(st.st_size);
+    if (ioctl(toFd, FICLONE, in.fd_) == 0) {
+        return copy_method::clone;
+    }
+    // Each method is given up on only if its very first call fails (nothing has been written yet)
+    size_t copied = 0;
+    while (copied < size) {
+        const auto n = copy_file_range(in.fd_, nullptr, toFd, nullptr, size - copied, 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (copied == 0 && is_unsupported(errno)) break;
+            THROW_ERRNO("Failed to copy_file_range '" + from.string() + "' -> '" + to.string() + "'");
+        }
+        if (n == 0) break; // Source shrunk
+        copied += n;
+    }
+    if (copied > 0) {
+        return copy_method::copy_file_range;
+    }
+    while (copied < size) {
+        const auto n = sendfile(toFd, in.fd_, nullptr, size - copied);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (copied == 0 && is_unsupported(errno)) break;
+            THROW_ERRNO("Failed to sendfile '" + from.string() + "' -> '" + to.string() + "'");
+        }
+        if (n == 0) break;
+        copied += n;
+    }
+    if (copied > 0) {
+        return copy_method::sendfile;
+    }
+#endif
+    constexpr size_t buffer_size = 128 * 1024;
+    const auto buffer = std::make_unique<char[]>(buffer_size);
+    while (true) {
+        const auto n = read(in.fd_, buffer.get(), buffer_size);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            THROW_ERRNO("Failed to read '" + from.string() + "'");
+        }
+        if (n == 0) break;
+        write_fully(toFd, buffer.get(), n, to);
+    }
+    return copy_method::read_write;
 }
 
 bool backup::is_lexical_sub_path(const std::filesystem::path &path, const std::filesystem::path &base) {
@@ -1,46 +1,29 @@
 #include "krico/backup/log_records.h"
 #include "krico/backup/exception.h"
 #include <spdlog/spdlog.h>
+#include <cstring>
+#include <ranges>
 
 using namespace krico::backup::records;
 using namespace krico::backup;
 using namespace std::chrono;
 
-LogHeader::LogHeader()
-    : buffer_(DEFAULT_BUFFER_SIZE), type_(buffer_), prev_(buffer_), ts_(buffer_), author_(buffer_) {
-    fields_.reserve(4);
-    fields_.push_back(&type_);
-    fields_.push_back(&prev_);
-    fields_.push_back(&ts_);
-    fields_.push_back(&author_);
-}
+LogHeader::LogHeader() = default;
 
 LogHeader::LogHeader(const LogEntryType type,
                      const Digest::result &prev,
-                     const std::string_view &author) : LogHeader() {
-    type_.offset(0);
-    type_.set(type);
-
-    prev_.offset(type_.end_offset());
-    prev_.set(prev);
-
-    ts_.offset(prev_.end_offset());
-    ts_.set(system_clock::now());
-
-    // Just in case someone has a VERY LONG author name ;)
-    assert(ts_.end_offset() + 4 + author.length() < DEFAULT_BUFFER_SIZE);
+                     const std::string_view &author) {
+    write<log_header_schema>(type, prev, system_clock::now(), author);
+}
 
-    author_.offset(ts_.end_offset());
-    author_.set(author);
+void LogHeader::assign(const std::string_view record) {
+    reserve(record.size());
+    std::memcpy(buffer_.ptr(), record.data(), record.size());
+    length_ = record.size();
 }
 
-void LogHeader::parse_offsets() const {
-    const field_offset *prev = nullptr;
-    for (auto *curr: fields_) {
-        if (prev) curr->offset(prev->end_offset());
-        else curr->offset(0);
-        prev = curr;
-    }
+void LogHeader::reserve(const size_t length) {
+    if (length > buffer_.capacity()) buffer_.resize(length);
 }
 
 InitRecord::InitRecord() = default;
@@ -49,122 +32,130 @@ InitRecord::InitRecord(const Digest::result &prev, const std::string_view &autho
     : LogHeader(log_entry_type, prev, author) {
 }
 
-AddDirectoryRecord::AddDirectoryRecord(): directoryId_(buffer_), sourceDir_(buffer_) {
-    add_fields();
-}
+AddDirectoryRecord::AddDirectoryRecord() = default;
 
 AddDirectoryRecord::AddDirectoryRecord(const Digest::result &prev,
                                        const std::string_view &author,
                                        const std::string_view &directoryId,
-                                       const std::filesystem::path &sourceDir)
-    : LogHeader(log_entry_type, prev, author),
-      directoryId_(buffer_), sourceDir_(buffer_) {
-    add_fields();
-
-    // directoryId length
-    assert(author_.end_offset() + 4 + directoryId.length() < DEFAULT_BUFFER_SIZE);
-
-    directoryId_.offset(author_.end_offset());
-    directoryId_.set(directoryId);
-
-    // sourceDir length
-    assert(directoryId_.end_offset() + 4 + sourceDir.string().length() < DEFAULT_BUFFER_SIZE);
-
-    sourceDir_.offset(directoryId_.end_offset());
-    sourceDir_.set(sourceDir);
-}
-
-void AddDirectoryRecord::add_fields() {
-    fields_.reserve(4 + 2);
-    fields_.push_back(&directoryId_);
-    fields_.push_back(&sourceDir_);
+                                       const std::filesystem::path &sourceDir) {
+    write<AddDirectoryRecordView::schema>(log_entry_type, prev, system_clock::now(), author, directoryId, sourceDir);
 }
 
-RunBackupRecord::RunBackupRecord()
-    : directoryId_(buffer_), date_(buffer_), backupId_(buffer_), startTime_(buffer_), endTime_(buffer_),
-      numDirectories_(buffer_), numCopiedFiles_(buffer_), numHardLinkedFiles_(buffer_), numSymlinks_(buffer_),
-      previousTarget_(buffer_), currentTarget_(buffer_),
-      checksum_(buffer_) {
-    add_fields();
-}
+RunBackupRecord::RunBackupRecord() = default;
 
 RunBackupRecord::RunBackupRecord(const Digest::result &prev,
                                  const std::string_view &author,
-                                 const BackupSummary &summary)
-    : LogHeader(log_entry_type, prev, author),
-      directoryId_(buffer_), date_(buffer_), backupId_(buffer_), startTime_(buffer_), endTime_(buffer_),
-      numDirectories_(buffer_), numCopiedFiles_(buffer_), numHardLinkedFiles_(buffer_), numSymlinks_(buffer_),
-      previousTarget_(buffer_), currentTarget_(buffer_),
-      checksum_(buffer_) {
-    add_fields();
-
-    // Link fields
-    directoryId_.offset(author_.end_offset());
-    directoryId_.set(summary.directoryId());
-
-    date_.offset(directoryId_.end_offset());
-    date_.set(summary.date());
-
-    backupId_.offset(date_.end_offset());
-    backupId_.set(summary.backupId());
-
-    startTime_.offset(backupId_.end_offset());
-    startTime_.set(summary.startTime());
-
-    endTime_.offset(startTime_.end_offset());
-    endTime_.set(summary.endTime());
-
-    numDirectories_.offset(endTime_.end_offset());
-    numDirectories_.set(summary.numDirectories());
+                                 const BackupSummary &summary) {
+    // The latest version: the fields of version 0 followed by what version 1 appends
+    using schema = RunBackupRecordView::version_schema::after<RunBackupRecordView::schema>;
+    write<schema>(log_entry_type, prev, system_clock::now(), author,
+                  summary.directoryId(),
+                  summary.date(),
+                  summary.backupId(),
+                  summary.startTime(),
+                  summary.endTime(),
+                  summary.numDirectories(),
+                  summary.numCopiedFiles(),
+                  summary.numHardLinkedFiles(),
+                  summary.numSymlinks(),
+                  summary.previousTarget(),
+                  summary.currentTarget(),
+                  summary.checksum(),
+                  VERSION,
+                  summary.metrics());
+}
 
-    numCopiedFiles_.offset(numDirectories_.end_offset());
-    numCopiedFiles_.set(summary.numCopiedFiles());
+CheckpointRecord::CheckpointRecord() = default;
+
+CheckpointRecord::CheckpointRecord(const Digest::result &prev,
+                                   const std::string_view &author,
+                                   const Digest::result &previousCheckpoint,
+                                   const uint32_t numRecords,
+                                   const log_counters &counters) {
+    // One entry per directory (twice with the byte counters), can be more than MAX_LOOSE_LENGTH
+    using schema = CheckpointRecordView::version_schema::after<CheckpointRecordView::schema>;
+    write<schema>(log_entry_type, prev, system_clock::now(), author,
+                  previousCheckpoint, numRecords, counters, VERSION, byte_counters(counters));
+}
 
-    numHardLinkedFiles_.offset(numCopiedFiles_.end_offset());
-    numHardLinkedFiles_.set(summary.numHardLinkedFiles());
+BackupSummary RunBackupRecordView::summary() const {
+    return BackupSummary{
+        BackupDirectoryId{directoryId()},
+        date(),
+        backupId(),
+        startTime(),
+        endTime(),
+        numDirectories(),
+        numCopiedFiles(),
+        numHardLinkedFiles(),
+        numSymlinks(),
+        previousTarget(),
+        currentTarget(),
+        checksum(),
+        metrics()
+    };
+}
 
-    numSymlinks_.offset(numHardLinkedFiles_.end_offset());
-    numSymlinks_.set(summary.numSymlinks());
+void krico::backup::throw_corrupt_record(const LogEntryType type, const size_t length) {
+    THROW_EXCEPTION("Corrupt log record (type=" + std::to_string(static_cast<int>(type))
+        + ", length=" + std::to_string(length) + ")");
+}
 
-    previousTarget_.offset(numSymlinks_.end_offset());
-    previousTarget_.set(summary.previousTarget());
+directory_counters &directory_counters::operator+=(const RunBackupRecordView &run) {
+    ++runs_;
+    directories_ += run.numDirectories();
+    copiedFiles_ += run.numCopiedFiles();
+    hardLinkedFiles_ += run.numHardLinkedFiles();
+    symlinks_ += run.numSymlinks();
+    lastRun_ = std::max(lastRun_, run.endTime());
+    const auto metrics = run.metrics();
+    bytesCopied_ += metrics.bytesCopied_;
+    bytesDeduplicated_ += metrics.bytesDeduplicated_;
+    bytesHashed_ += metrics.bytesHashed_;
+    return *this;
+}
 
-    currentTarget_.offset(previousTarget_.end_offset());
-    currentTarget_.set(summary.currentTarget());
+directory_counters &directory_counters::operator+=(const directory_counters &rhs) {
+    runs_ += rhs.runs_;
+    directories_ += rhs.directories_;
+    copiedFiles_ += rhs.copiedFiles_;
+    hardLinkedFiles_ += rhs.hardLinkedFiles_;
+    symlinks_ += rhs.symlinks_;
+    lastRun_ = std::max(lastRun_, rhs.lastRun_);
+    bytesCopied_ += rhs.bytesCopied_;
+    bytesDeduplicated_ += rhs.bytesDeduplicated_;
+    bytesHashed_ += rhs.bytesHashed_;
+    return *this;
+}
 
-    checksum_.offset(currentTarget_.end_offset());
-    checksum_.set(summary.checksum());
+directory_counters &directory_counters::operator-=(const directory_counters &rhs) {
+    runs_ -= rhs.runs_;
+    directories_ -= rhs.directories_;
+    copiedFiles_ -= rhs.copiedFiles_;
+    hardLinkedFiles_ -= rhs.hardLinkedFiles_;
+    symlinks_ -= rhs.symlinks_;
+    bytesCopied_ -= rhs.bytesCopied_;
+    bytesDeduplicated_ -= rhs.bytesDeduplicated_;
+    bytesHashed_ -= rhs.bytesHashed_;
+    return *this;
 }
 
-void RunBackupRecord::add_fields() {
-    fields_.reserve(4 + 12);
-    fields_.push_back(&directoryId_);
-    fields_.push_back(&date_);
-    fields_.push_back(&backupId_);
-    fields_.push_back(&startTime_);
-    fields_.push_back(&endTime_);
-    fields_.push_back(&numDirectories_);
-    fields_.push_back(&numCopiedFiles_);
-    fields_.push_back(&numHardLinkedFiles_);
-    fields_.push_back(&numSymlinks_);
-    fields_.push_back(&previousTarget_);
-    fields_.push_back(&currentTarget_);
-    fields_.push_back(&checksum_);
+log_byte_counters krico::backup::byte_counters(const log_counters &counters) {
+    log_byte_counters ret;
+    ret.reserve(counters.size());
+    for (const auto &c: counters | std::views::values) {
+        ret.push_back({c.bytesCopied_, c.bytesDeduplicated_, c.bytesHashed_});
+    }
+    return ret;
 }
 
-BackupSummary RunBackupRecord::summary() const {
-    return BackupSummary{
-        directoryId_.get(),
-        date_.get(),
-        backupId_.get(),
-        startTime_.get(),
-        endTime_.get(),
-        numDirectories_.get(),
-        numCopiedFiles_.get(),
-        numHardLinkedFiles_.get(),
-        numSymlinks_.get(),
-        previousTarget_.get(),
-        currentTarget_.get(),
-        checksum_.get()
-    };
+void krico::backup::set_byte_counters(log_counters &counters, const log_byte_counters &bytes) {
+    if (bytes.size() != counters.size()) return;
+    auto it = bytes.begin();
+    for (auto &c: counters | std::views::values) {
+        c.bytesCopied_ = (*it)[0];
+        c.bytesDeduplicated_ = (*it)[1];
+        c.bytesHashed_ = (*it)[2];
+        ++it;
+    }
 }
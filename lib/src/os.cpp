@@ -1,6 +1,7 @@
 #include "krico/backup/os.h"
 #include <unistd.h>
 #include <pwd.h>
+#include <ctime>
 
 using namespace krico::backup;
 
@@ -10,3 +11,11 @@ std::string krico::backup::get_username() {
     pwd = getpwuid(userid);
     return pwd->pw_name;
 }
+
+std::chrono::nanoseconds krico::backup::thread_cpu_time() {
+    timespec ts{};
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts)) {
+        return std::chrono::nanoseconds{0};
+    }
+    return std::chrono::seconds{ts.tv_sec} + std::chrono::nanoseconds{ts.tv_nsec};
+}
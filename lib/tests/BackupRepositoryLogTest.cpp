@@ -1,9 +1,13 @@
 #include "krico/backup/BackupRepositoryLog.h"
 #include "krico/backup/BackupRepository.h"
+#include "krico/backup/exception.h"
 #include "krico/backup/TemporaryDirectory.h"
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <ranges>
 #include <fstream>
 #include <chrono>
+#include <unistd.h>
 
 using namespace std::chrono;
 namespace fs = std::filesystem;
@@ -53,6 +57,287 @@ namespace krico::backup {
         ASSERT_EQ(e1.ts(), r1.ts());
     }
 
+    TEST(BackupRepositoryLogTest, batch) {
+        const TemporaryDirectory tmp{};
+        BackupRepositoryLog log{tmp.dir()};
+        log.putInitRecord("John Doe");
+        const auto init = log.head();
+        do {
+            BackupRepositoryLog::batch batch{log};
+            log.putAddDirectoryRecord("John Doe", "a", "/src/a");
+            log.putAddDirectoryRecord("John Doe", "b", "/src/b");
+            ASSERT_TRUE(log.headPending_);
+            // Chained, but HEAD is not published yet
+            ASSERT_EQ("b", log_record_cast<AddDirectoryRecordView>(log.getRecordView(log.head())).directoryId());
+            ASSERT_EQ(init, BackupRepositoryLog{tmp.dir()}.head());
+            batch.commit();
+            ASSERT_FALSE(log.headPending_);
+            ASSERT_EQ(log.head(), BackupRepositoryLog{tmp.dir()}.head());
+
+            log.putAddDirectoryRecord("John Doe", "c", "/src/c");
+            ASSERT_NE(log.head(), BackupRepositoryLog{tmp.dir()}.head());
+        } while (false);
+        // Published when the batch is destroyed
+        BackupRepositoryLog reopened{tmp.dir()};
+        ASSERT_EQ(log.head(), reopened.head());
+        std::vector<std::string> ids{};
+        for (auto prev = reopened.head(); prev != init;) {
+            const auto add = log_record_cast<AddDirectoryRecordView>(reopened.getRecordView(prev));
+            ids.emplace_back(add.directoryId());
+            prev = add.prev();
+        }
+        ASSERT_EQ((std::vector<std::string>{"c", "b", "a"}), ids);
+
+        // Outside a batch, every record publishes HEAD
+        log.putInitRecord("Bob Marley");
+        ASSERT_FALSE(log.headPending_);
+        ASSERT_EQ(log.head(), BackupRepositoryLog{tmp.dir()}.head());
+
+        // A nested batch (e.g. putRunBackupRecords() in a batch) leaves HEAD to the outer one
+        const auto published = log.head();
+        do {
+            BackupRepositoryLog::batch outer{log};
+            log.putAddDirectoryRecord("John Doe", "d", "/src/d");
+            do {
+                BackupRepositoryLog::batch inner{log};
+                log.putAddDirectoryRecord("John Doe", "e", "/src/e");
+                inner.commit();
+                ASSERT_TRUE(log.headPending_);
+            } while (false);
+            ASSERT_TRUE(log.headPending_);
+            ASSERT_EQ(published, BackupRepositoryLog{tmp.dir()}.head());
+        } while (false);
+        ASSERT_FALSE(log.headPending_);
+        ASSERT_EQ(log.head(), BackupRepositoryLog{tmp.dir()}.head());
+    }
+
+    TEST(BackupRepositoryLogTest, putRunBackupRecords) {
+        const TemporaryDirectory tmp{};
+        BackupRepositoryLog log{tmp.dir()};
+        fs::path directoryMetaDir{tmp.dir() / "dirMeta"};
+        fs::create_directory(directoryMetaDir);
+        std::vector<BackupSummary> summaries{};
+        for (const auto *id: {"a", "b", "c"}) {
+            fs::create_directory(directoryMetaDir / id);
+            BackupSummaryBuilder builder{
+                directoryMetaDir / id, BackupDirectoryId{id}, year_month_day{1976y, July, 15d}, fs::path{"1"}
+            };
+            summaries.push_back(builder.build());
+        }
+        log.putRunBackupRecords("John Doe", summaries);
+        BackupRepositoryLog reopened{tmp.dir()};
+        auto prev = reopened.head();
+        for (const auto &summary: std::ranges::reverse_view(summaries)) {
+            const auto run = log_record_cast<RunBackupRecordView>(reopened.getRecordView(prev));
+            ASSERT_EQ(summary, run.summary());
+            prev = run.prev();
+        }
+        ASSERT_EQ(Digest::SHA1_ZERO, prev);
+    }
+
+    TEST(BackupRepositoryLogTest, checkpoint) {
+        const TemporaryDirectory tmp{};
+        constexpr uint32_t RUNS = 2 * BackupRepositoryLog::CHECKPOINT_INTERVAL + 5;
+        do {
+            BackupRepositoryLog log{tmp.dir()};
+            log.putInitRecord("John Doe");
+            for (uint32_t i = 1; i < RUNS; ++i) {
+                const auto now = system_clock::now();
+                const BackupSummary summary{
+                    BackupDirectoryId{std::format("dir{}", i % 3)}, year_month_day{1976y, July, 15d}, fs::path{"1"},
+                    now, now + seconds{i}, i, 2 * i, 3 * i, 1, "", "", Digest::SHA1_ZERO,
+                    backup_metrics{.bytesHashed_ = 5 * i, .bytesCopied_ = 4 * i, .bytesDeduplicated_ = i}
+                };
+                log.putRunBackupRecord("John Doe", summary);
+            }
+        } while (false);
+
+        BackupRepositoryLog log{tmp.dir()};
+        // Every record, the slow way
+        std::vector<std::pair<system_clock::time_point, log_counters> > expected{};
+        log_counters total{};
+        std::vector<Digest::result> checkpoints{};
+        uint32_t records = 0;
+        for (auto prev = log.head(); !prev.is_zero();) {
+            const auto header = log.getRecordView(prev);
+            if (header.type() == LogEntryType::Checkpoint) {
+                checkpoints.push_back(prev);
+            } else {
+                ++records;
+            }
+            if (header.type() == LogEntryType::RunBackup) {
+                const auto run = log_record_cast<RunBackupRecordView>(header);
+                total[std::string{run.directoryId()}] += run;
+                expected.emplace_back(header.ts(), total);
+            }
+            prev = header.prev();
+        }
+        ASSERT_EQ(RUNS, records);
+        ASSERT_EQ(RUNS / BackupRepositoryLog::CHECKPOINT_INTERVAL, checkpoints.size());
+        const auto latest = log_record_cast<CheckpointRecordView>(log.getRecordView(checkpoints.front()));
+        ASSERT_EQ(checkpoints.back(), latest.previousCheckpoint());
+        ASSERT_EQ(2 * BackupRepositoryLog::CHECKPOINT_INTERVAL, latest.numRecords());
+
+        ASSERT_EQ(3, total.size());
+        ASSERT_LT(0, total.begin()->second.bytesHashed_);
+        ASSERT_EQ(total, log.counters());
+        ASSERT_EQ(total, log.counters(system_clock::time_point::min()));
+        ASSERT_TRUE(log.counters(system_clock::time_point::max()).empty());
+        // `expected` is newest first, with the counters of the runs since each of them
+        for (size_t i = 0; i < expected.size(); i += 7) {
+            const auto &[ts, since] = expected[i];
+            ASSERT_EQ(since, log.counters(ts)) << i;
+        }
+
+        // Checkpoints are picked up by a reopened log
+        log.putInitRecord("Bob Marley");
+        ASSERT_EQ(RUNS + 1 - checkpoints.size() * BackupRepositoryLog::CHECKPOINT_INTERVAL, log.checkpoint_.since_);
+        ASSERT_EQ(checkpoints.front(), log.checkpoint_.last_);
+    }
+
+    TEST(BackupRepositoryLogTest, query) {
+        const TemporaryDirectory tmp{};
+        const auto put = [&](BackupRepositoryLog &log, const uint32_t from, const uint32_t to) {
+            for (uint32_t i = from; i < to; ++i) {
+                const auto id = std::format("dir{}", i % 4);
+                if (i < 4) {
+                    log.putAddDirectoryRecord("John Doe", id, "/src/" + id);
+                    continue;
+                }
+                const auto now = system_clock::now();
+                log.putRunBackupRecord("John Doe", BackupSummary{
+                                           BackupDirectoryId{id}, year_month_day{1976y, July, 15d}, fs::path{"1"},
+                                           now, now, i, i, i, i, "", "", Digest::SHA1_ZERO
+                                       });
+            }
+        };
+        constexpr uint32_t RECORDS = 150;
+        do {
+            BackupRepositoryLog log{tmp.dir()};
+            log.putInitRecord("John Doe");
+            put(log, 0, RECORDS);
+        } while (false);
+
+        BackupRepositoryLog log{tmp.dir()};
+        // The slow way: walk every record
+        std::vector<std::pair<Digest::result, system_clock::time_point> > dir1Runs{};
+        std::vector<Digest::result> all{};
+        for (auto prev = log.head(); !prev.is_zero();) {
+            const auto header = log.getRecordView(prev);
+            all.push_back(prev);
+            if (header.type() == LogEntryType::RunBackup
+                && log_record_cast<RunBackupRecordView>(header).directoryId() == "dir1") {
+                dir1Runs.emplace_back(prev, header.ts());
+            }
+            prev = header.prev();
+        }
+        ASSERT_EQ(all, log.query({}));
+        ASSERT_EQ(log.head(), log.index_.last());
+        ASSERT_EQ(duration_cast<nanoseconds>(log.getRecordView(log.head()).ts().time_since_epoch()).count(),
+                  log.index_.entries().back().ts_);
+
+        std::vector<Digest::result> expected{};
+        for (const auto &digest: dir1Runs | std::views::keys) expected.push_back(digest);
+        ASSERT_EQ(expected, log.query({.directoryId_ = "dir1", .type_ = LogEntryType::RunBackup}));
+        // "When did dir1 last run"
+        ASSERT_EQ(std::vector{expected.front()}, log.query({.directoryId_ = "dir1", .limit_ = 1}));
+        ASSERT_EQ(1, log.query({.directoryId_ = "dir1", .type_ = LogEntryType::AddDirectory}).size());
+        ASSERT_EQ(1, log.query({.type_ = LogEntryType::Initialized}).size());
+        ASSERT_EQ(1, log.query({.type_ = LogEntryType::Checkpoint}).size());
+        ASSERT_TRUE(log.query({.directoryId_ = "dir"}).empty());
+
+        const auto &[middle, ts] = dir1Runs[dir1Runs.size() / 2];
+        const auto since = log.query({.directoryId_ = "dir1", .since_ = ts, .type_ = LogEntryType::RunBackup});
+        ASSERT_EQ(dir1Runs.size() / 2 + 1, since.size());
+        ASSERT_EQ(middle, since.back());
+        const auto until = log.query({.directoryId_ = "dir1", .until_ = ts, .type_ = LogEntryType::RunBackup});
+        ASSERT_EQ(dir1Runs.size() - since.size(), until.size());
+        ASSERT_TRUE(log.query({.since_ = ts, .until_ = ts}).empty());
+
+        // Kept up to date by putRecord, rebuilt when it is not
+        put(log, RECORDS, RECORDS + 4);
+        ASSERT_EQ(log.head(), log.index_.last());
+        fs::remove(tmp.dir() / LogIndex::INDEX_FILE);
+        do {
+            BackupRepositoryLog reopened{tmp.dir()};
+            put(reopened, RECORDS + 4, RECORDS + 8);
+            ASSERT_EQ(Digest::SHA1_ZERO, reopened.index_.last());
+            // The AddDirectoryRecord and two more runs
+            ASSERT_EQ(1 + expected.size() + 2, reopened.query({.directoryId_ = "dir1"}).size());
+            ASSERT_EQ(reopened.head(), reopened.index_.last());
+        } while (false);
+    }
+
+    TEST(BackupRepositoryLogTest, readOnly) {
+        const TemporaryDirectory tmp{};
+        do {
+            BackupRepositoryLog log{tmp.dir()};
+            log.putInitRecord("John Doe");
+            log.putAddDirectoryRecord("John Doe", "dir", "/src/dir");
+            for (uint32_t i = 0; i < BackupRepositoryLog::CHECKPOINT_INTERVAL + 3; ++i) {
+                const auto now = system_clock::now();
+                log.putRunBackupRecord("John Doe", BackupSummary{
+                                           BackupDirectoryId{"dir"}, year_month_day{1976y, July, 15d}, fs::path{"1"},
+                                           now, now, i, i, i, i, "", "", Digest::SHA1_ZERO
+                                       });
+            }
+        } while (false);
+        // A stale query index has to be rebuilt to answer a query
+        fs::remove(tmp.dir() / LogIndex::INDEX_FILE);
+        std::vector<std::pair<fs::path, fs::file_time_type> > files{};
+        for (const auto &entry: fs::recursive_directory_iterator{tmp.dir()}) {
+            files.emplace_back(entry.path(), entry.last_write_time());
+        }
+        const auto writable = fs::status(tmp.dir()).permissions();
+        fs::permissions(tmp.dir(), fs::perms::owner_read | fs::perms::owner_exec);
+        // Always writable by root
+        const bool readOnly = access(tmp.dir().c_str(), W_OK) != 0;
+        do {
+            BackupRepositoryLog log{tmp.dir()};
+            const auto all = log.query({});
+            ASSERT_EQ(1 + 1 + BackupRepositoryLog::CHECKPOINT_INTERVAL + 3 + 1, all.size());
+            ASSERT_EQ(log.head(), all.front());
+            ASSERT_EQ(BackupRepositoryLog::CHECKPOINT_INTERVAL + 3, log.query({.directoryId_ = "dir",
+                          .type_ = LogEntryType::RunBackup}).size());
+            ASSERT_EQ(BackupRepositoryLog::CHECKPOINT_INTERVAL + 3, log.counters().at("dir").runs_);
+            ASSERT_EQ(readOnly, log.index_.inMemory());
+        } while (false);
+        fs::permissions(tmp.dir(), writable);
+        if (readOnly) {
+            // Nothing was written
+            ASSERT_FALSE(exists(tmp.dir() / LogIndex::INDEX_FILE));
+            for (const auto &[path, time]: files) {
+                ASSERT_EQ(time, fs::last_write_time(path)) << path;
+            }
+        }
+    }
+
+    TEST(BackupRepositoryLogTest, looseRecord) {
+        const TemporaryDirectory tmp{};
+        // A record as written before the pack existed
+        LogHeader loose{LogEntryType::Initialized, Digest::SHA1_ZERO, "John Doe"};
+        const auto md = Digest::sha1();
+        md.update(loose.buffer().const_cptr(), loose.end_offset());
+        const auto digest = md.digest();
+        const fs::path looseFile{tmp.dir() / digest.path(BackupRepositoryLog::DIGEST_DIRS)};
+        fs::create_directories(looseFile.parent_path());
+        std::ofstream{looseFile}.write(loose.buffer().const_cptr(), static_cast<std::streamsize>(loose.end_offset()));
+        std::ofstream{tmp.dir() / BackupRepositoryLog::HEAD_FILE} << digest.str();
+
+        BackupRepositoryLog log{tmp.dir()};
+        ASSERT_EQ(digest, log.head());
+        ASSERT_EQ(std::vector{digest}, log.findHash(digest.str().substr(0, 6)));
+        log.putInitRecord("Bob Marley");
+        ASSERT_EQ(digest, log.getHeadRecord().prev());
+        ASSERT_EQ("John Doe", log.getRecord(digest).author());
+        ASSERT_FALSE(fs::exists(looseFile)) << "loose record not moved to the pack";
+        ASSERT_EQ("John Doe", log.getRecord(digest).author());
+
+        BackupRepositoryLog reopened{tmp.dir()};
+        ASSERT_EQ("John Doe", reopened.getPrev(reopened.getHeadRecord()).author());
+        ASSERT_EQ(std::vector{digest}, reopened.findHash(digest.str().substr(0, 6)));
+    }
+
     TEST(BackupRepositoryLogTest, findHash) {
         const TemporaryDirectory tmp{};
         BackupRepositoryLog log{tmp.dir()};
@@ -88,6 +373,41 @@ namespace krico::backup {
         }
     }
 
+    TEST(BackupRepositoryLogTest, resolveHash) {
+        const TemporaryDirectory tmp{};
+        BackupRepositoryLog log{tmp.dir()};
+        ASSERT_THROW((void) log.resolveHash("ab"), exception);
+        std::vector<Digest::result> hashes{};
+        // Enough records for both the index and the records appended after it
+        for (size_t i = 0; i < 2 * LogPack::INDEX_INTERVAL + 10; ++i) {
+            log.putInitRecord("Author " + std::to_string(i));
+        }
+        // Including checkpoints
+        for (auto prev = log.head(); !prev.is_zero(); prev = log.getRecordView(prev).prev()) {
+            hashes.push_back(prev);
+        }
+        for (const auto &hash: hashes) {
+            const auto hex = hash.str();
+            ASSERT_EQ(std::vector{hash}, log.findHash(hex));
+            ASSERT_EQ(hash, log.resolveHash(hex));
+            std::string upper{hex};
+            std::ranges::transform(upper, upper.begin(), [](const unsigned char c) { return std::toupper(c); });
+            ASSERT_EQ(hash, log.resolveHash(upper.substr(0, 12)));
+            // The first digit is shared by several of them
+            const auto sharing = std::ranges::count_if(hashes, [&](const Digest::result &h) {
+                return h.str().front() == hex.front();
+            });
+            ASSERT_EQ(sharing, log.findHash(hex.substr(0, 1)).size());
+            if (sharing > 1) {
+                ASSERT_THROW((void) log.resolveHash(hex.substr(0, 1)), exception);
+            }
+        }
+        ASSERT_EQ(hashes.size(), log.findHash("").size());
+        ASSERT_TRUE(log.findHash("xyz").empty());
+        ASSERT_TRUE(log.findHash("../").empty());
+        ASSERT_TRUE(log.findHash(hashes.front().str() + "0").empty());
+    }
+
     TEST(BackupRepositoryLogTest, putInitRecord) {
         const TemporaryDirectory tmp{};
         BackupRepositoryLog log{tmp.dir()};
@@ -121,6 +441,75 @@ namespace krico::backup {
         ASSERT_EQ(Digest::SHA1_ZERO, ir1.prev());
     }
 
+    TEST(BackupRepositoryLogTest, looseRecordSynced) {
+        const TemporaryDirectory tmp{};
+        // A chain of records as written before the pack existed, one more batch than is migrated at once
+        constexpr size_t count = BackupRepositoryLog::MIGRATE_BATCH + 2;
+        std::vector<fs::path> files{};
+        Digest::result prev{Digest::SHA1_ZERO};
+        for (size_t i = 0; i < count; ++i) {
+            const LogHeader loose{LogEntryType::Initialized, prev, "John Doe " + std::to_string(i)};
+            const auto md = Digest::sha1();
+            md.update(loose.buffer().const_cptr(), loose.end_offset());
+            prev = md.digest();
+            files.push_back(tmp.dir() / prev.path(BackupRepositoryLog::DIGEST_DIRS));
+            fs::create_directories(files.back().parent_path());
+            std::ofstream{files.back()}.write(loose.buffer().const_cptr(),
+                                              static_cast<std::streamsize>(loose.end_offset()));
+        }
+        std::ofstream{tmp.dir() / BackupRepositoryLog::HEAD_FILE} << prev.str();
+
+        do {
+            BackupRepositoryLog log{tmp.dir()};
+            for (auto digest = log.head(); !digest.is_zero(); digest = log.getRecord(digest).prev()) {
+            }
+            ASSERT_TRUE(log.pack_.contains(prev));
+            // The first batch was synced then removed, the rest waits for the next sync
+            ASSERT_EQ(count - BackupRepositoryLog::MIGRATE_BATCH, log.migrated_.size());
+            ASSERT_FALSE(log.pack_.synced());
+            for (size_t i = 0; i < count; ++i) {
+                ASSERT_EQ(i < count - BackupRepositoryLog::MIGRATE_BATCH, fs::exists(files[i])) << i;
+            }
+        } while (false);
+        // Synced and removed by the destructor
+        for (const auto &file: files) {
+            ASSERT_FALSE(fs::exists(file)) << file;
+        }
+        BackupRepositoryLog reopened{tmp.dir()};
+        const auto first = reopened.query({.type_ = LogEntryType::Initialized}).back();
+        ASSERT_EQ("John Doe 0", reopened.getRecord(first).author());
+    }
+
+    TEST(BackupRepositoryLogTest, getRecordView) {
+        const TemporaryDirectory tmp{};
+        // A record as written before the pack existed
+        LogHeader loose{LogEntryType::Initialized, Digest::SHA1_ZERO, "John Doe"};
+        const auto md = Digest::sha1();
+        md.update(loose.buffer().const_cptr(), loose.end_offset());
+        const auto digest = md.digest();
+        const fs::path looseFile{tmp.dir() / digest.path(BackupRepositoryLog::DIGEST_DIRS)};
+        fs::create_directories(looseFile.parent_path());
+        std::ofstream{looseFile}.write(loose.buffer().const_cptr(), static_cast<std::streamsize>(loose.end_offset()));
+        std::ofstream{tmp.dir() / BackupRepositoryLog::HEAD_FILE} << digest.str();
+
+        BackupRepositoryLog log{tmp.dir()};
+        log.putAddDirectoryRecord("John Senna", "TheBackup", "/tmp/MyTheBackup");
+        const auto head = log.getRecordView(log.head());
+        ASSERT_EQ(LogEntryType::AddDirectory, head.type());
+        const auto add = log_record_cast<AddDirectoryRecordView>(head);
+        ASSERT_EQ("John Senna", add.author());
+        ASSERT_EQ("TheBackup", add.directoryId());
+        ASSERT_EQ("/tmp/MyTheBackup", add.sourceDir());
+        ASSERT_EQ(digest, add.prev());
+
+        const auto init = log.getRecordView(digest);
+        ASSERT_EQ(LogEntryType::Initialized, init.type());
+        ASSERT_EQ("John Doe", init.author());
+        ASSERT_EQ(loose.ts(), init.ts());
+        ASSERT_FALSE(fs::exists(looseFile)) << "loose record not moved to the pack";
+        ASSERT_THROW((void) log.getRecordView(Digest::SHA1_ZERO), exception);
+    }
+
     TEST(BackupRepositoryLogTest, putAddDirectoryRecord) {
         const TemporaryDirectory tmp{};
         BackupRepositoryLog log{tmp.dir()};
@@ -3,7 +3,11 @@
 
 #include "krico/backup/BackupDirectory.h"
 #include "krico/backup/exception.h"
+#include "krico/backup/LogPack.h"
 #include "krico/backup/TemporaryDirectory.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
 
 using namespace krico::backup;
 namespace fs = std::filesystem;
@@ -17,6 +21,24 @@ TEST(BackupRepositoryTest, initialize) {
     ASSERT_THROW(BackupRepository{tmp.dir()}, exception) << "Not locked";
 }
 
+TEST(BackupRepositoryTest, digestAlgorithm) {
+    const TemporaryDirectory tmp(TemporaryDirectory::args_t{.prefix = "Backup"});
+    do {
+        BackupRepository repo{BackupRepository::initialize(tmp.dir(), Digest::BLAKE3_ALGORITHM)};
+        ASSERT_EQ(Digest::BLAKE3_ALGORITHM, repo.digestAlgorithm());
+    } while (false);
+    BackupRepository repo{tmp.dir()};
+    ASSERT_EQ(Digest::BLAKE3_ALGORITHM, repo.digestAlgorithm());
+
+    const TemporaryDirectory tmpDefault(TemporaryDirectory::args_t{.prefix = "Backup"});
+    BackupRepository defaultRepo{BackupRepository::initialize(tmpDefault.dir())};
+    ASSERT_EQ(Digest::SHA256_ALGORITHM, defaultRepo.digestAlgorithm());
+
+    const TemporaryDirectory tmpInvalid(TemporaryDirectory::args_t{.prefix = "Backup"});
+    ASSERT_THROW(BackupRepository::initialize(tmpInvalid.dir(), "NO-SUCH-DIGEST"), exception);
+    ASSERT_FALSE(exists(tmpInvalid.dir() / BackupRepository::METADATA_DIR));
+}
+
 TEST(BackupRepositoryTest, unlock) {
     const TemporaryDirectory tmp(TemporaryDirectory::args_t{.prefix = "Backup"});
     BackupRepository repo1{BackupRepository::initialize(tmp.dir())};
@@ -59,3 +81,135 @@ TEST(BackupRepositoryTest, list_directories) {
     ASSERT_EQ(dir1.id(), repo1.list_directories().at(0)->id());
     ASSERT_EQ(dir2.id(), repo1.list_directories().at(1)->id());
 }
+
+TEST(BackupRepositoryTest, relayout) {
+    const TemporaryDirectory tmp(TemporaryDirectory::args_t{.prefix = "Backup"});
+    const TemporaryDirectory src(TemporaryDirectory::args_t{.prefix = "Source"});
+    for (int i = 0; i < 50; ++i) {
+        std::ofstream{src.dir() / ("file" + std::to_string(i))} << "content " << i;
+    }
+    BackupRepository repo{BackupRepository::initialize(tmp.dir(), Digest::SHA256_ALGORITHM, Fanout::legacy())};
+    ASSERT_EQ(Fanout::legacy(), repo.fanout());
+    ASSERT_TRUE(is_directory(repo.hardLinksDir() / "ff" / "ff"));
+    const auto &dir = repo.add_directory("Target", src.dir());
+    ASSERT_EQ(50, repo.run_backup(dir).numCopiedFiles());
+
+    constexpr Fanout wide{.depth_ = 1, .width_ = 3};
+    ASSERT_EQ(50, repo.relayout(wide, 4));
+    ASSERT_EQ(wide, repo.fanout());
+    ASSERT_EQ(0, repo.relayout(wide, 4)) << "Already laid out";
+    size_t objects = 0;
+    for (const auto &entry: fs::recursive_directory_iterator{repo.hardLinksDir()}) {
+        const auto relative = entry.path().lexically_relative(repo.hardLinksDir());
+        if (entry.is_directory()) {
+            ASSERT_TRUE(wide.is_directory(relative)) << relative;
+        } else {
+            ASSERT_EQ(2, std::distance(relative.begin(), relative.end())) << relative;
+            ASSERT_EQ(2, hard_link_count(entry.path())) << "Still linked from the backup";
+            ++objects;
+        }
+    }
+    ASSERT_EQ(50, objects);
+    ASSERT_EQ(wide.directories(), std::distance(fs::directory_iterator{repo.hardLinksDir()}, fs::directory_iterator{}));
+
+    // New objects go to the new layout, existing ones are found there
+    std::ofstream{src.dir() / "new"} << "new content";
+    const auto summary = repo.run_backup(dir);
+    ASSERT_EQ(1, summary.numCopiedFiles());
+    ASSERT_EQ(50, summary.numHardLinkedFiles());
+    ASSERT_TRUE(exists(repo.hardLinksDir() / sha256_sum("new content").insert(3, "/")));
+    ASSERT_THROW(repo.relayout(Fanout{.depth_ = 3, .width_ = 2}, 1), exception) << "Too many directories";
+}
+
+TEST(BackupRepositoryTest, verify_log) {
+    const TemporaryDirectory tmp(TemporaryDirectory::args_t{.prefix = "Backup"});
+    const TemporaryDirectory src(TemporaryDirectory::args_t{.prefix = "Source"});
+    for (int i = 0; i < 5; ++i) {
+        std::ofstream{src.dir() / ("file" + std::to_string(i))} << "content " << i;
+    }
+    fs::path summaryFile{};
+    // Of the last byte of the checksum of the last run, from the end of the pack (where its record is)
+    std::streamoff checksumFromEnd = 0;
+    do {
+        BackupRepository repo{BackupRepository::initialize(tmp.dir())};
+        const auto &dir = repo.add_directory("Target", src.dir());
+        summaryFile = repo.run_backup(dir).summaryFile(dir.metaDir());
+        std::ofstream{src.dir() / "new"} << "new content";
+        ASSERT_NO_THROW(repo.run_backup(dir));
+
+        const auto result = repo.verify_log(4);
+        ASSERT_TRUE(result.problems_.empty()) << result.problems_.at(0);
+        ASSERT_EQ(4, result.numRecords_) << "init, add and two runs";
+        ASSERT_EQ(4, result.numLinks_);
+        ASSERT_EQ(2, result.numSummaries_);
+
+        const auto record = repo.repositoryLog().getRecordView(repo.repositoryLog().head()).record();
+        const auto *data = reinterpret_cast<const uint8_t *>(record.data());
+        // Followed by the version and the metrics
+        const auto checksumEnd = RunBackupRecordView::schema::offset<16>(data);
+        ASSERT_EQ(record.size(), checksumEnd + 1 + records::codec<backup_metrics>::width);
+        ASSERT_EQ(checksumEnd - DigestLength::SHA1, RunBackupRecordView::schema::offset<15>(data));
+        checksumFromEnd = static_cast<std::streamoff>(record.size() - checksumEnd + 1);
+    } while (false);
+
+    // A summary file that is gone and a record that was altered (its checksum)
+    fs::remove(summaryFile);
+    do {
+        std::fstream file{tmp.dir() / BackupRepository::METADATA_DIR / BackupRepository::LOG_DIR / LogPack::PACK_FILE,
+                          std::ios::binary | std::ios::in | std::ios::out};
+        file.seekg(-checksumFromEnd, std::ios::end);
+        const auto last = static_cast<char>(file.get() ^ 0x5a);
+        file.seekp(-checksumFromEnd, std::ios::end);
+        file.put(last);
+    } while (false);
+    BackupRepository repo{tmp.dir()};
+    const auto result = repo.verify_log(2);
+    ASSERT_EQ(3, result.problems_.size());
+    const auto head = repo.repositoryLog().head().str();
+    ASSERT_TRUE(std::ranges::any_of(result.problems_, [&](const std::string &p) {
+        return p.starts_with("Record " + head) && p.find("does not hash") != std::string::npos;
+    }));
+    ASSERT_TRUE(std::ranges::any_of(result.problems_, [&](const std::string &p) {
+        return p.starts_with("Record " + head) && p.find("checksum") != std::string::npos;
+    }));
+    ASSERT_TRUE(std::ranges::any_of(result.problems_, [&](const std::string &p) {
+        return p.find("not found") != std::string::npos;
+    }));
+}
+
+TEST(BackupRepositoryTest, verify_logReadOnly) {
+    const TemporaryDirectory tmp(TemporaryDirectory::args_t{.prefix = "Backup"});
+    const fs::path logDir{tmp.dir() / BackupRepository::METADATA_DIR / BackupRepository::LOG_DIR};
+    Digest::result head{};
+    do {
+        BackupRepository repo{BackupRepository::initialize(tmp.dir())};
+        head = repo.repositoryLog().head();
+    } while (false);
+    // A loose record (as written before the pack existed) at HEAD that does not hash to its name
+    const LogHeader loose{LogEntryType::Initialized, head, "John Doe"};
+    const auto md = Digest::sha1();
+    md.update(loose.buffer().const_cptr(), loose.end_offset());
+    const auto digest = md.digest();
+    const fs::path looseFile{logDir / digest.path(BackupRepositoryLog::DIGEST_DIRS)};
+    fs::create_directories(looseFile.parent_path());
+    std::string bytes{loose.record()};
+    bytes.back() ^= 0x5a;
+    std::ofstream{looseFile} << bytes;
+    std::ofstream{logDir / BackupRepositoryLog::HEAD_FILE} << digest.str();
+    const auto packSize = fs::file_size(logDir / LogPack::PACK_FILE);
+
+    do {
+        BackupRepository repo{tmp.dir()};
+        const auto result = repo.verify_log(2);
+        ASSERT_EQ(2, result.numLinks_);
+        ASSERT_TRUE(std::ranges::any_of(result.problems_, [&](const std::string &p) {
+            return p.starts_with("Record " + digest.str()) && p.find("does not hash") != std::string::npos;
+        }));
+    } while (false);
+    // Still loose, with the same bytes, and the pack did not change
+    ASSERT_TRUE(fs::exists(looseFile));
+    std::stringstream read{};
+    read << std::ifstream{looseFile}.rdbuf();
+    ASSERT_EQ(bytes, read.str());
+    ASSERT_EQ(packSize, fs::file_size(logDir / LogPack::PACK_FILE));
+}
@@ -3,6 +3,12 @@
 #include "krico/backup/TemporaryDirectory.h"
 #include <gtest/gtest.h>
 #include <fstream>
+#include <sstream>
+#include <format>
+#include <optional>
+#include <thread>
+#include <unistd.h>
+#include <sys/resource.h>
 
 using namespace krico::backup;
 using namespace std::chrono;
@@ -54,7 +60,7 @@ TEST_F(BackupRunnerTest, run) {
     const fs::path backupFile = runner.backupDir() / "file1.txt";
     const fs::path backupFileLink = runner.backupDir() / "fileLink.txt";
     const fs::path backupDigest = repository->hardLinksDir() /
-                                  "12/94/ae29913c994993ea89efd7ddae0a73fcedda0b03c17a40c4d9c64bbd36f7";
+                                  "12/94ae29913c994993ea89efd7ddae0a73fcedda0b03c17a40c4d9c64bbd36f7";
     ASSERT_TRUE(exists(backupFile));
     ASSERT_TRUE(exists(backupDigest));
     ASSERT_TRUE(exists(backupFileLink));
@@ -73,3 +79,363 @@ TEST_F(BackupRunnerTest, run) {
     ASSERT_TRUE(exists(bd.dir()/BackupRunner::CURRENT_LINK));
     ASSERT_EQ(canonical(runner.backupDir()), canonical(bd.dir()/BackupRunner::CURRENT_LINK));
 }
+
+TEST_F(BackupRunnerTest, runParallel) {
+    const TemporaryDirectory tmpSource{};
+    const fs::path &source = tmpSource.dir();
+    for (int d = 0; d < 8; ++d) {
+        const fs::path dir{source / ("dir" + std::to_string(d))};
+        create_directories(dir / "sub");
+        for (int f = 0; f < 10; ++f) {
+            std::ofstream out{dir / ("file" + std::to_string(f) + ".txt")};
+            // Same content across directories so some files are copied and others hard-linked
+            out << "Content " << f;
+            std::ofstream out2{dir / "sub" / ("file" + std::to_string(f) + ".txt")};
+            out2 << "Sub content " << d << " " << f;
+        }
+        create_symlink(dir / "file0.txt", dir / "link.txt");
+    }
+
+    const TemporaryDirectory tmpSerial{TemporaryDirectory::args_t{.prefix = "Serial"}};
+    BackupRepository serialRepository{BackupRepository::initialize(tmpSerial.dir())};
+    const auto &serialDir = serialRepository.add_directory("TheTarget", source);
+    const auto serial = serialRepository.run_backup(serialDir, BackupRunner::options_t{});
+
+    const auto &parallelDir = repository->add_directory("TheTarget", source);
+    const auto parallel = repository->run_backup(parallelDir, BackupRunner::options_t{
+        .scanners = 2, .hashers = 4, .copiers = 3, .linkers = 2, .queueSize = 4
+    });
+
+    ASSERT_EQ(serial.checksum(), parallel.checksum());
+    ASSERT_EQ(serial.numDirectories(), parallel.numDirectories());
+    ASSERT_EQ(serial.numCopiedFiles(), parallel.numCopiedFiles());
+    ASSERT_EQ(serial.numHardLinkedFiles(), parallel.numHardLinkedFiles());
+    ASSERT_EQ(serial.numSymlinks(), parallel.numSymlinks());
+    ASSERT_EQ(8 * 10 + 10, parallel.numCopiedFiles());
+    uint32_t numCopies = 0;
+    for (size_t i = 0; i < COPY_METHOD_COUNT; ++i) numCopies += parallel.numCopies(static_cast<copy_method>(i));
+    ASSERT_EQ(parallel.numCopiedFiles(), numCopies);
+
+    auto read = [](const fs::path &file) {
+        std::ifstream in{file};
+        return std::string{std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+    };
+    ASSERT_EQ(read(serial.summaryFile(serialDir.metaDir())), read(parallel.summaryFile(parallelDir.metaDir())));
+
+    const auto manifest = parallel.manifest(parallelDir.metaDir());
+    ASSERT_EQ(parallel.checksum(), manifest.checksum());
+    const auto file = manifest.find("dir3/sub/file7.txt");
+    ASSERT_FALSE(file == manifest.end());
+    ASSERT_EQ(std::string{"Sub content 3 7"}.size(), (*file).size_);
+    // dir3, its files, link.txt, sub and its files
+    ASSERT_EQ(1 + 10 + 1 + 1 + 10, std::distance(manifest.subtree("dir3").begin(), manifest.subtree("dir3").end()));
+}
+
+TEST_F(BackupRunnerTest, runHashWhileCopy) {
+    const TemporaryDirectory tmpSource{};
+    const fs::path &source = tmpSource.dir();
+    create_directories(source / "dir");
+    std::string large(300 * 1024, 'x');
+    for (size_t i = 0; i < large.size(); i += 4096) large[i] = static_cast<char>('a' + i % 26);
+    std::ofstream{source / "large.bin"} << large;
+    std::ofstream{source / "empty.txt"};
+    std::ofstream{source / "dir" / "a.txt"} << "Same content";
+    std::ofstream{source / "dir" / "b.txt"} << "Same content";
+    std::ofstream{source / "dir" / "c.txt"} << "Other content";
+
+    const TemporaryDirectory tmpTwoPass{TemporaryDirectory::args_t{.prefix = "TwoPass"}};
+    BackupRepository twoPassRepository{BackupRepository::initialize(tmpTwoPass.dir())};
+    const auto &twoPassDir = twoPassRepository.add_directory("TheTarget", source);
+    const auto twoPass = twoPassRepository.run_backup(twoPassDir, BackupRunner::options_t{});
+
+    const auto &singlePassDir = repository->add_directory("TheTarget", source);
+    const auto singlePass = repository->run_backup(singlePassDir, BackupRunner::options_t{
+        .hashers = 2, .hashWhileCopy = true
+    });
+
+    ASSERT_EQ(twoPass.checksum(), singlePass.checksum());
+    ASSERT_EQ(4, singlePass.numCopiedFiles());
+    ASSERT_EQ(1, singlePass.numHardLinkedFiles());
+    ASSERT_EQ(4, singlePass.numCopies(copy_method::read_write));
+
+    auto read = [](const fs::path &file) {
+        std::ifstream in{file, std::ios::binary};
+        return std::string{std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+    };
+    const auto &hardLinksDir = repository->hardLinksDir();
+    ASSERT_EQ(large, read(hardLinksDir / sha256_sum(large).insert(2, "/")));
+    for (const auto &entry: fs::recursive_directory_iterator{hardLinksDir}) {
+        ASSERT_NE(".tmp", entry.path().extension()) << entry.path();
+    }
+
+    // Second run finds every digest and only discards the copies
+    const auto again = repository->run_backup(singlePassDir, BackupRunner::options_t{.hashWhileCopy = true});
+    ASSERT_EQ(0, again.numCopiedFiles());
+    ASSERT_EQ(5, again.numHardLinkedFiles());
+}
+
+TEST_F(BackupRunnerTest, runStatCache) {
+    const TemporaryDirectory tmpSource{};
+    const fs::path &source = tmpSource.dir();
+    std::ofstream{source / "a.txt"} << "A";
+    std::ofstream{source / "b.txt"} << "B";
+    std::this_thread::sleep_for(10ms);
+    const auto &dir = repository->add_directory("TheTarget", source);
+
+    const auto first = repository->run_backup(dir);
+    ASSERT_EQ(0, first.numStatCacheHits());
+    ASSERT_EQ(2, first.numStatCacheMisses());
+    ASSERT_TRUE(exists(dir.metaDir() / StatCache::CACHE_FILE));
+
+    const auto second = repository->run_backup(dir);
+    ASSERT_EQ(2, second.numStatCacheHits());
+    ASSERT_EQ(0, second.numStatCacheMisses());
+    ASSERT_EQ(first.checksum(), second.checksum());
+
+    std::ofstream{source / "b.txt"} << "Changed";
+    std::this_thread::sleep_for(10ms);
+    const auto third = repository->run_backup(dir);
+    ASSERT_EQ(1, third.numStatCacheHits());
+    ASSERT_EQ(1, third.numStatCacheMisses());
+    ASSERT_EQ(1, third.numCopiedFiles());
+
+    const auto rehash = repository->run_backup(dir, BackupRunner::options_t{.rehash = true});
+    ASSERT_EQ(0, rehash.numStatCacheHits());
+    ASSERT_EQ(2, rehash.numStatCacheMisses());
+    ASSERT_EQ(third.checksum(), rehash.checksum());
+
+    // Only the run knows the stat cache counters, the summary in the log does not print them
+    std::stringstream printed{};
+    printed << rehash;
+    ASSERT_TRUE(rehash.inProcess());
+    ASSERT_NE(std::string::npos, printed.str().find("hits=0 misses=2"));
+    const auto logged = log_record_cast<RunBackupRecord>(repository->repositoryLog().getHeadRecord()).summary();
+    ASSERT_EQ(rehash, logged);
+    ASSERT_FALSE(logged.inProcess());
+    printed = std::stringstream{};
+    printed << logged;
+    ASSERT_EQ(std::string::npos, printed.str().find("Stat cache"));
+}
+
+TEST_F(BackupRunnerTest, runMetrics) {
+    const TemporaryDirectory tmpSource{};
+    const fs::path &source = tmpSource.dir();
+    const std::string big(256 * 1024, 'x');
+    std::ofstream{source / "big.bin"} << big;
+    std::ofstream{source / "a.txt"} << "Same";
+    std::ofstream{source / "b.txt"} << "Same";
+    std::ofstream{source / "c.txt"} << "Other";
+    std::this_thread::sleep_for(10ms);
+    const auto &dir = repository->add_directory("TheTarget", source);
+    constexpr uint64_t small = 4 + 4 + 5;
+
+    const auto first = repository->run_backup(dir).metrics();
+    ASSERT_EQ(big.size() + small, first.bytesHashed_);
+    ASSERT_EQ(big.size() + 4 + 5, first.bytesCopied_);
+    ASSERT_EQ(4, first.bytesDeduplicated_);
+    ASSERT_EQ(big.size(), first.largestFileSize_);
+    ASSERT_LT(0ns, first.largestFileTime_);
+    for (const auto phase: {backup_phase::scan, backup_phase::hash, backup_phase::copy, backup_phase::link}) {
+        ASSERT_LT(0ns, first.phase(phase).wall_) << to_string(phase);
+    }
+    ASSERT_LT(0ns, first.phase(backup_phase::hash).cpu_);
+
+    // Found in the StatCache, nothing to read or copy
+    const auto second = repository->run_backup(dir).metrics();
+    ASSERT_EQ(0, second.bytesHashed_);
+    ASSERT_EQ(0, second.bytesCopied_);
+    ASSERT_EQ(big.size() + small, second.bytesDeduplicated_);
+    ASSERT_EQ(0ns, second.phase(backup_phase::copy).wall_);
+}
+
+TEST_F(BackupRunnerTest, runBufferedDirs) {
+    const TemporaryDirectory tmpSource{};
+    const fs::path &source = tmpSource.dir();
+    // The root cannot be merged before its big file is hashed and copied, everything else is scanned meanwhile
+    std::ofstream{source / "big.bin"} << std::string(32 * 1024 * 1024, 'x');
+    constexpr size_t numDirs = 400;
+    for (size_t i = 0; i < numDirs; ++i) {
+        const fs::path dir{source / std::format("dir-{:03d}", i)};
+        create_directories(dir / "sub");
+        std::ofstream{dir / "sub" / "file.txt"} << i;
+    }
+    const auto &dir = repository->add_directory("TheTarget", source);
+    constexpr size_t maxBufferedDirs = 16;
+    BackupRunner runner{dir, {}, BackupRunner::options_t{.scanners = 4, .hashers = 1, .maxBufferedDirs = maxBufferedDirs}};
+    const auto summary = runner.run();
+    ASSERT_EQ(1 + 2 * numDirs, summary.numDirectories());
+    ASSERT_EQ(1 + numDirs, summary.numCopiedFiles());
+    // The directories the merge waits for are scanned regardless, one per level of the tree
+    ASSERT_GE(maxBufferedDirs + 2, runner.peakBufferedDirs());
+    ASSERT_LE(1, runner.peakBufferedDirs());
+}
+
+TEST_F(BackupRunnerTest, runOpenFilesLimit) {
+    const TemporaryDirectory tmpSource{};
+    const fs::path &source = tmpSource.dir();
+    // Stalls the merge, every directory buffered meanwhile keeps its descriptors open
+    std::ofstream{source / "big.bin"} << std::string(32 * 1024 * 1024, 'x');
+    constexpr size_t numDirs = 1000;
+    for (size_t i = 0; i < numDirs; ++i) {
+        const fs::path dir{source / std::format("dir-{:04d}", i)};
+        create_directories(dir / "sub");
+        std::ofstream{dir / "sub" / "file.txt"} << i;
+    }
+    const auto &dir = repository->add_directory("TheTarget", source);
+
+    rlimit original{};
+    ASSERT_EQ(0, getrlimit(RLIMIT_NOFILE, &original));
+    rlimit lowered{original};
+    lowered.rlim_cur = std::min<rlim_t>(original.rlim_cur, 256);
+    ASSERT_EQ(0, setrlimit(RLIMIT_NOFILE, &lowered));
+    std::optional<BackupSummary> summary{};
+    size_t peakBufferedDirs{0};
+    try {
+        // Default cap, far more directories than descriptors
+        BackupRunner runner{dir, {}, BackupRunner::options_t{.scanners = 8}};
+        summary = runner.run();
+        peakBufferedDirs = runner.peakBufferedDirs();
+    } catch (...) {
+        setrlimit(RLIMIT_NOFILE, &original);
+        throw;
+    }
+    ASSERT_EQ(0, setrlimit(RLIMIT_NOFILE, &original));
+    ASSERT_EQ(1 + 2 * numDirs, summary->numDirectories());
+    ASSERT_EQ(1 + numDirs, summary->numCopiedFiles());
+    ASSERT_GT(lowered.rlim_cur / 2, peakBufferedDirs);
+}
+
+TEST_F(BackupRunnerTest, runBlake3) {
+    const TemporaryDirectory tmpSource{};
+    const fs::path &source = tmpSource.dir();
+    constexpr auto content = "Hello OpenSSL krico-backup world";
+    std::ofstream{source / "a.txt"} << content;
+    std::ofstream{source / "b.txt"} << content;
+
+    const TemporaryDirectory tmpBlake3{TemporaryDirectory::args_t{.prefix = "Blake3"}};
+    BackupRepository blake3Repository{BackupRepository::initialize(tmpBlake3.dir(), Digest::BLAKE3_ALGORITHM)};
+    const auto &dir = blake3Repository.add_directory("TheTarget", source);
+    const auto summary = blake3Repository.run_backup(dir);
+    ASSERT_EQ(1, summary.numCopiedFiles());
+    ASSERT_EQ(1, summary.numHardLinkedFiles());
+    ASSERT_TRUE(exists(blake3Repository.hardLinksDir() /
+        "9c/0fa231f6e38a92d8ee47eb1d1bb5cc651cb9af78fb1caff8eb850f207efc56"));
+}
+
+TEST_F(BackupRunnerTest, runAllocations) {
+    const TemporaryDirectory tmpSource{};
+    const fs::path &source = tmpSource.dir();
+    constexpr size_t numFiles = 200;
+    create_directory(source / "sub");
+    for (size_t i = 0; i < numFiles; ++i) {
+        std::ofstream{source / "sub" / std::format("file-{:03d}.txt", i)} << i;
+    }
+    const auto &dir = repository->add_directory("TheTarget", source);
+    const auto summary = repository->run_backup(dir);
+    ASSERT_EQ(numFiles, summary.numCopiedFiles());
+    // Entries and paths of a directory come from its arena, a handful of blocks rather than one per file
+    ASSERT_LT(0, summary.numAllocations());
+    ASSERT_GT(20, summary.numAllocations());
+    ASSERT_LT(numFiles * sizeof(void *), summary.numAllocatedBytes());
+}
+
+TEST_F(BackupRunnerTest, runReplicas) {
+    const TemporaryDirectory tmpSource{};
+    const fs::path &source = tmpSource.dir();
+    for (int i = 0; i < 7; ++i) {
+        std::ofstream{source / std::format("license-{}", i)} << "Same license";
+        std::ofstream{source / std::format("empty-{}", i)};
+    }
+    const auto &dir = repository->add_directory("TheTarget", source);
+    // Each object and replica carries itself plus 3 links
+    const BackupRunner::options_t options{.linkers = 2, .maxLinks = 4};
+    const auto summary = repository->run_backup(dir, options);
+    ASSERT_EQ(2, summary.numCopiedFiles());
+    ASSERT_EQ(12, summary.numHardLinkedFiles());
+    ASSERT_EQ(4, summary.numReplicas()) << "2 per object";
+
+    const auto &hardLinksDir = repository->hardLinksDir();
+    const auto license = hardLinksDir / sha256_sum("Same license").insert(2, "/");
+    const auto empty = hardLinksDir / sha256_sum("").insert(2, "/");
+    for (const auto &object: {license, empty}) {
+        ASSERT_EQ(4, hard_link_count(object));
+        ASSERT_EQ(4, fs::hard_link_count(object.string() + ".1"));
+        ASSERT_EQ(2, fs::hard_link_count(object.string() + ".2"));
+        ASSERT_FALSE(fs::exists(object.string() + ".3"));
+    }
+    ASSERT_EQ(0, fs::file_size(empty.string() + ".2"));
+
+    // The next run continues with the replica that has room
+    const auto again = repository->run_backup(dir, options);
+    ASSERT_EQ(0, again.numCopiedFiles());
+    ASSERT_EQ(4, again.numReplicas());
+    for (const auto &object: {license, empty}) {
+        ASSERT_EQ(4, fs::hard_link_count(object.string() + ".2"));
+        ASSERT_EQ(4, fs::hard_link_count(object.string() + ".3"));
+        ASSERT_EQ(3, fs::hard_link_count(object.string() + ".4"));
+    }
+    for (const auto &entry: fs::recursive_directory_iterator{dir.dir() / BackupRunner::CURRENT_LINK}) {
+        if (!entry.is_regular_file()) continue;
+        std::ifstream in{entry.path()};
+        const std::string content{std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+        ASSERT_EQ(entry.path().filename().string().starts_with("empty") ? "" : "Same license", content);
+    }
+}
+
+TEST_F(BackupRunnerTest, runReplicasLinkLimit) {
+    // The limit of the file system (EMLINK) rather than options_t::maxLinks
+    const auto linkMax = pathconf(repository->hardLinksDir().c_str(), _PC_LINK_MAX);
+    if (linkMax <= 0 || linkMax > 100000) {
+        GTEST_SKIP() << "Link limit of the file system is " << linkMax;
+    }
+    const TemporaryDirectory tmpSource{};
+    const fs::path &source = tmpSource.dir();
+    std::ofstream{source / "license-0"} << "Same license";
+    std::ofstream{source / "empty-0"};
+    const auto &dir = repository->add_directory("TheTarget", source);
+    ASSERT_EQ(2, repository->run_backup(dir).numCopiedFiles());
+
+    const auto &hardLinksDir = repository->hardLinksDir();
+    const auto license = hardLinksDir / sha256_sum("Same license").insert(2, "/");
+    const auto empty = hardLinksDir / sha256_sum("").insert(2, "/");
+    // Fill the objects up to 3 links short of the limit
+    const fs::path fill{tmp.dir() / "fill"};
+    create_directory(fill);
+    for (const auto &object: {license, empty}) {
+        for (auto i = fs::hard_link_count(object); i < static_cast<uintmax_t>(linkMax) - 3; ++i) {
+            fs::create_hard_link(object, fill / std::format("{}-{}", object.filename().string().substr(0, 8), i));
+        }
+    }
+    for (int i = 1; i < 8; ++i) {
+        std::ofstream{source / std::format("license-{}", i)} << "Same license";
+        std::ofstream{source / std::format("empty-{}", i)};
+    }
+    const auto summary = repository->run_backup(dir);
+    ASSERT_EQ(0, summary.numCopiedFiles());
+    ASSERT_EQ(16, summary.numHardLinkedFiles());
+    ASSERT_EQ(2, summary.numReplicas());
+    for (const auto &object: {license, empty}) {
+        ASSERT_EQ(linkMax, fs::hard_link_count(object));
+        // Itself plus the 5 links that did not fit
+        ASSERT_EQ(6, fs::hard_link_count(object.string() + ".1"));
+        ASSERT_FALSE(fs::exists(object.string() + ".2"));
+    }
+    for (const auto &entry: fs::directory_iterator{dir.dir() / BackupRunner::CURRENT_LINK}) {
+        std::ifstream in{entry.path()};
+        const std::string content{std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+        ASSERT_EQ(entry.path().filename().string().starts_with("empty") ? "" : "Same license", content);
+    }
+}
+
+TEST_F(BackupRunnerTest, emptyObjectPermissions) {
+    const TemporaryDirectory tmpSource{};
+    const fs::path &source = tmpSource.dir();
+    const fs::path empty{source / "empty"};
+    std::ofstream{empty};
+    fs::permissions(empty, fs::perms::owner_read | fs::perms::owner_write | fs::perms::group_read);
+    const auto &dir = repository->add_directory("TheTarget", source);
+    repository->run_backup(dir);
+    // Same as the objects of other files, the object carries the permissions of the first source
+    const auto object = repository->hardLinksDir() / sha256_sum("").insert(2, "/");
+    ASSERT_EQ(fs::status(empty).permissions(), fs::status(object).permissions());
+}
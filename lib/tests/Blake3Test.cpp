@@ -0,0 +1,120 @@
+#include "krico/backup/Blake3.h"
+#include "krico/backup/Digest.h"
+#include <gtest/gtest.h>
+#include <vector>
+
+using namespace krico::backup;
+
+namespace {
+    //! Input of the official BLAKE3 test vectors: bytes cycling through 0..250
+    std::vector<uint8_t> input(const size_t len) {
+        std::vector<uint8_t> v(len);
+        for (size_t i = 0; i < len; ++i) v[i] = static_cast<uint8_t>(i % 251);
+        return v;
+    }
+
+    std::string hex(const uint8_t out[Blake3::OUT_LEN]) {
+        Digest::result r{.md_ = {}, .len_ = Blake3::OUT_LEN};
+        std::memcpy(r.md_, out, Blake3::OUT_LEN);
+        return r.str();
+    }
+
+    const std::vector<std::pair<size_t, std::string> > VECTORS{
+        {0, "af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262"},
+        {3, "e1be4d7a8ab5560aa4199eea339849ba8e293d55ca0a81006726d184519e647f"},
+        {1023, "10108970eeda3eb932baac1428c7a2163b0e924c9a9e25b35bba72b28f70bd11"},
+        {1024, "42214739f095a406f3fc83deb889744ac00df831c10daa55189b5d121c855af7"},
+        {1025, "d00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444"},
+        {2048, "e776b6028c7cd22a4d0ba182a8bf62205d2ef576467e838ed6f2529b85fba24a"},
+        {2049, "5f4d72f40d7a5f82b15ca2b2e44b1de3c2ef86c426c95c1af0b6879522563030"},
+        {4097, "9b4052b38f1c5fc8b1f9ff7ac7b27cd242487b3d890d15c96a1c25b8aa0fb995"},
+        {8193, "bab6c09cb8ce8cf459261398d2e7aef35700bf488116ceb94a36d0f5f1b7bc3b"},
+        {16384, "f875d6646de28985646f34ee13be9a576fd515f76b5b0a26bb324735041ddde4"},
+        {31744, "62b6960e1a44bcc1eb1a611a8d6235b6b4b78f32e7abc4fb4c6cdcce94895c47"},
+        {102400, "bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085"},
+        {1048577, "2f053cd7472cf0cd2f9adaf45c1180255b91b9a865404a63671a0ee5f792ed33"},
+    };
+}
+
+TEST(Blake3Test, vectors) {
+    for (const auto &[len, expected]: VECTORS) {
+        const auto data = input(len);
+        Blake3 hasher{};
+        hasher.update(data.data(), data.size());
+        uint8_t out[Blake3::OUT_LEN];
+        hasher.finalize(out);
+        ASSERT_EQ(expected, hex(out)) << "len=" << len << " impl=" << Blake3::implementation();
+    }
+}
+
+TEST(Blake3Test, implementations) {
+    const std::string detected = Blake3::implementation();
+    const auto implementations = Blake3::implementations();
+    ASSERT_EQ(detected, implementations.front());
+    ASSERT_STREQ("portable", implementations.back());
+    ASSERT_THROW(Blake3::implementation("mmx"), std::exception);
+    struct restore_t {
+        std::string name_;
+
+        ~restore_t() { Blake3::implementation(name_); }
+    } restore{detected};
+    for (const auto *impl: implementations) {
+        Blake3::implementation(impl);
+        ASSERT_STREQ(impl, Blake3::implementation());
+        for (const auto &[len, expected]: VECTORS) {
+            const auto data = input(len);
+            Blake3 hasher{};
+            hasher.update(data.data(), data.size());
+            uint8_t out[Blake3::OUT_LEN];
+            hasher.finalize(out);
+            ASSERT_EQ(expected, hex(out)) << "len=" << len << " impl=" << impl;
+            Blake3::hash(data.data(), data.size(), out, 3);
+            ASSERT_EQ(expected, hex(out)) << "len=" << len << " impl=" << impl << " threads=3";
+        }
+    }
+}
+
+TEST(Blake3Test, incremental) {
+    // Feeding odd sized pieces must not change the result (exercises block, chunk and SIMD batch boundaries)
+    for (const auto &[len, expected]: VECTORS) {
+        const auto data = input(len);
+        for (const size_t piece: {1ul, 63ul, 64ul, 1000ul, 3 * Blake3::CHUNK_LEN + 7}) {
+            Blake3 hasher{};
+            for (size_t i = 0; i < len; i += piece) {
+                hasher.update(data.data() + i, std::min(piece, len - i));
+            }
+            uint8_t out[Blake3::OUT_LEN];
+            hasher.finalize(out);
+            ASSERT_EQ(expected, hex(out)) << "len=" << len << " piece=" << piece;
+        }
+    }
+}
+
+TEST(Blake3Test, threads) {
+    for (const auto &[len, expected]: VECTORS) {
+        const auto data = input(len);
+        for (const unsigned threads: {2u, 3u, 8u}) {
+            uint8_t out[Blake3::OUT_LEN];
+            Blake3::hash(data.data(), data.size(), out, threads);
+            ASSERT_EQ(expected, hex(out)) << "len=" << len << " threads=" << threads;
+        }
+    }
+    const auto large = input(40 * 1024 * 1024 + 123);
+    uint8_t out[Blake3::OUT_LEN];
+    Blake3::hash(large.data(), large.size(), out, 4);
+    ASSERT_EQ("f90d6c94ca3c54e34b469a422adcd2c8e218715e6a233622e8fd9a3b811685fb", hex(out));
+}
+
+TEST(Blake3Test, digest) {
+    const Digest d = Digest::blake3();
+    constexpr auto data = "Hello OpenSSL krico-backup world";
+    d.update(data, strlen(data));
+    const auto r = d.digest();
+    ASSERT_EQ(DigestLength::BLAKE3, r.len_);
+    ASSERT_EQ("9c0fa231f6e38a92d8ee47eb1d1bb5cc651cb9af78fb1caff8eb850f207efc56", r.str());
+    ASSERT_EQ(r, d.digest(data, strlen(data), 2));
+    d.reset();
+    ASSERT_EQ("af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262", d.digest().str());
+    ASSERT_EQ(DigestLength::BLAKE3, d.zero().len_);
+    ASSERT_TRUE(d.zero().is_zero());
+}
@@ -0,0 +1,56 @@
+#include "krico/backup/BoundedQueue.h"
+#include <gtest/gtest.h>
+#include <thread>
+#include <atomic>
+
+using namespace krico::backup;
+
+TEST(BoundedQueueTest, fifo) {
+    BoundedQueue<int> queue{3};
+    ASSERT_EQ(3, queue.capacity());
+    ASSERT_TRUE(queue.push(1));
+    ASSERT_TRUE(queue.push(2));
+    ASSERT_TRUE(queue.push(3));
+    ASSERT_EQ(1, queue.pop());
+    ASSERT_EQ(2, queue.try_pop());
+    ASSERT_EQ(3, queue.pop());
+    ASSERT_FALSE(queue.try_pop());
+}
+
+TEST(BoundedQueueTest, close) {
+    BoundedQueue<int> queue{3};
+    ASSERT_TRUE(queue.push(1));
+    queue.close();
+    ASSERT_FALSE(queue.push(2));
+    ASSERT_EQ(1, queue.pop());
+    ASSERT_FALSE(queue.pop());
+}
+
+TEST(BoundedQueueTest, abort) {
+    BoundedQueue<int> queue{3};
+    ASSERT_TRUE(queue.push(1));
+    queue.abort();
+    ASSERT_FALSE(queue.push(2));
+    ASSERT_FALSE(queue.pop());
+}
+
+TEST(BoundedQueueTest, backpressure) {
+    BoundedQueue<int> queue{2};
+    std::atomic<int> pushed{0};
+    std::thread producer{
+        [&] {
+            for (int i = 0; i < 100; ++i) {
+                queue.push(i);
+                ++pushed;
+            }
+            queue.close();
+        }
+    };
+    int expected = 0;
+    while (auto v = queue.pop()) {
+        ASSERT_LE(pushed - expected, 3) << "Producer ran ahead of the capacity";
+        ASSERT_EQ(expected++, *v);
+    }
+    producer.join();
+    ASSERT_EQ(100, expected);
+}
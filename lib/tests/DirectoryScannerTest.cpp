@@ -0,0 +1,66 @@
+#include "krico/backup/DirectoryScanner.h"
+#include "krico/backup/TemporaryDirectory.h"
+#include <gtest/gtest.h>
+#include <fstream>
+#include <format>
+
+using namespace krico::backup;
+namespace fs = std::filesystem;
+
+namespace {
+    void touch(const fs::path &file) {
+        std::ofstream out{file, std::ios_base::app};
+    }
+}
+
+TEST(DirectoryScannerTest, entries) {
+    const TemporaryDirectory tmp{};
+    const fs::path &base = tmp.dir();
+    touch(base / "b");
+    touch(base / "B");
+    touch(base / "a.txt");
+    create_directory(base / "a");
+    touch(base / "a" / "file");
+    create_symlink("a", base / "link");
+    create_symlink("missing", base / "dangling");
+
+    const DirectoryScanner dir{base};
+    ASSERT_EQ(6, dir.size());
+    // Raw byte order: upper case before lower case, "a" before "a.txt"
+    std::vector<std::string> names{};
+    for (const auto entry: dir) names.emplace_back(entry.name_);
+    ASSERT_EQ((std::vector<std::string>{"B", "a", "a.txt", "b", "dangling", "link"}), names);
+
+    ASSERT_TRUE(dir[0].is_file());
+    ASSERT_TRUE(dir[1].is_directory());
+    ASSERT_TRUE(dir[4].is_symlink());
+    ASSERT_TRUE(dir[5].is_symlink());
+    ASSERT_EQ("a", dir.read_symlink("link"));
+    ASSERT_TRUE(dir.is_directory("link"));
+    ASSERT_FALSE(dir.is_directory("dangling"));
+    ASSERT_FALSE(dir.is_directory("b"));
+
+    const DirectoryScanner sub{dir, dir[1].name_};
+    ASSERT_EQ(base / "a", sub.path());
+    ASSERT_EQ(1, sub.size());
+    ASSERT_EQ("file", sub[0].name_);
+}
+
+TEST(DirectoryScannerTest, manyEntries) {
+    // More than fit in a single getdents64 buffer
+    const TemporaryDirectory tmp{};
+    constexpr size_t count = 5000;
+    for (size_t i = 0; i < count; ++i) {
+        touch(tmp.dir() / std::format("file-{:05d}-with-a-longer-name", count - i));
+    }
+    const DirectoryScanner dir{tmp.dir()};
+    ASSERT_EQ(count, dir.size());
+    for (size_t i = 1; i < count; ++i) {
+        ASSERT_LT(dir[i - 1].name_, dir[i].name_);
+    }
+}
+
+TEST(DirectoryScannerTest, missing) {
+    const TemporaryDirectory tmp{};
+    ASSERT_THROW(DirectoryScanner{tmp.dir() / "missing"}, std::exception);
+}
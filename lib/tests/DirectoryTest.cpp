@@ -129,3 +129,35 @@ TEST_F(DirectoryTest, iterator) {
 
 TEST_F(DirectoryTest, Symlink) {
 }
+
+TEST_F(DirectoryTest, arena) {
+    const Directory dir{base};
+    const auto pass = [&dir] {
+        const auto before = Directory::allocations().allocations();
+        size_t count = 0;
+        for (const auto &e: dir) {
+            EXPECT_FALSE(e.relative_path().empty());
+            ++count;
+        }
+        EXPECT_EQ(dir.size(), count);
+        return Directory::allocations().allocations() - before;
+    };
+    ASSERT_LT(0, pass());
+    // Entries are recycled through the pool, later passes only pay for the arena of the nested Directory (dir1)
+    const auto second = pass();
+    ASSERT_GE(1, second);
+    ASSERT_EQ(second, pass());
+}
+
+TEST_F(DirectoryTest, iteratorLifetime) {
+    const Directory other{dir1};
+    auto it = other.begin();
+    ASSERT_EQ(file2.filename(), (*it).absolute_path().filename());
+    do {
+        const Directory dir{base};
+        // Releases the entry of `other` into its own arena
+        it = dir.begin();
+        ASSERT_FALSE((*it).relative_path().empty());
+    } while (false);
+    // `it` outlives `dir`, its entry is released into the arena it shares
+}
@@ -0,0 +1,65 @@
+#include "krico/backup/Fanout.h"
+#include "krico/backup/exception.h"
+#include "krico/backup/TemporaryDirectory.h"
+#include <gtest/gtest.h>
+
+using namespace krico::backup;
+namespace fs = std::filesystem;
+
+namespace {
+    Digest::result parse(const std::string &hex) {
+        Digest::result r{};
+        Digest::result::parse(r, hex);
+        return r;
+    }
+}
+
+TEST(FanoutTest, path) {
+    const auto digest = parse("1294ae29913c994993ea89efd7ddae0a73fcedda0b03c17a40c4d9c64bbd36f7");
+    ASSERT_EQ(digest.path(2).string(), Fanout::legacy().path(digest));
+    ASSERT_EQ("12/94ae29913c994993ea89efd7ddae0a73fcedda0b03c17a40c4d9c64bbd36f7", Fanout::standard().path(digest));
+    ASSERT_EQ("129/4ae29913c994993ea89efd7ddae0a73fcedda0b03c17a40c4d9c64bbd36f7",
+              (Fanout{.depth_ = 1, .width_ = 3}.path(digest)));
+    ASSERT_EQ("1/2/9/4/ae29913c994993ea89efd7ddae0a73fcedda0b03c17a40c4d9c64bbd36f7",
+              (Fanout{.depth_ = 4, .width_ = 1}.path(digest)));
+    ASSERT_EQ(digest.str(), (Fanout{.depth_ = 0, .width_ = 2}.path(digest)));
+}
+
+TEST(FanoutTest, validate) {
+    Fanout::standard().validate();
+    Fanout::legacy().validate();
+    Fanout{.depth_ = 0, .width_ = 1}.validate();
+    ASSERT_THROW((Fanout{.depth_ = 1, .width_ = 0}.validate()), exception);
+    ASSERT_THROW((Fanout{.depth_ = 1, .width_ = 5}.validate()), exception);
+    ASSERT_THROW((Fanout{.depth_ = 5, .width_ = 1}.validate()), exception);
+    ASSERT_THROW((Fanout{.depth_ = 3, .width_ = 2}.validate()), exception);
+}
+
+TEST(FanoutTest, isDirectory) {
+    const Fanout fanout{.depth_ = 2, .width_ = 2};
+    ASSERT_TRUE(fanout.is_directory("00"));
+    ASSERT_TRUE(fanout.is_directory("ab/ff"));
+    ASSERT_FALSE(fanout.is_directory(""));
+    ASSERT_FALSE(fanout.is_directory("abc"));
+    ASSERT_FALSE(fanout.is_directory("AB"));
+    ASSERT_FALSE(fanout.is_directory("xy"));
+    ASSERT_FALSE(fanout.is_directory("ab/cd/ef"));
+}
+
+TEST(FanoutTest, create) {
+    const TemporaryDirectory tmp{};
+    const Fanout fanout{.depth_ = 2, .width_ = 1};
+    fanout.create(tmp.dir(), 7);
+    size_t leaves = 0, dirs = 0;
+    for (const auto &entry: fs::recursive_directory_iterator{tmp.dir()}) {
+        ASSERT_TRUE(entry.is_directory());
+        ASSERT_TRUE(fanout.is_directory(entry.path().lexically_relative(tmp.dir())));
+        ++dirs;
+        if (std::distance(fs::directory_iterator{entry.path()}, fs::directory_iterator{}) == 0) ++leaves;
+    }
+    ASSERT_EQ(256, fanout.directories());
+    ASSERT_EQ(fanout.directories(), leaves);
+    ASSERT_EQ(16 + 256, dirs);
+    // Existing directories are fine
+    fanout.create(tmp.dir());
+}
@@ -0,0 +1,80 @@
+#include "krico/backup/IoBatch.h"
+#include "krico/backup/TemporaryDirectory.h"
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <fstream>
+
+using namespace krico::backup;
+namespace fs = std::filesystem;
+
+namespace {
+    class IoBatchTest : public testing::TestWithParam<bool> {
+    protected:
+        const TemporaryDirectory tmp{};
+        const fs::path &dir{tmp.dir()};
+        IoBatch io{8, GetParam()};
+    };
+}
+
+TEST_P(IoBatchTest, backend) {
+    if (GetParam() && IoBatch::uring_available()) {
+        ASSERT_EQ(IoBatch::backend::io_uring, io.get_backend());
+    } else {
+        ASSERT_EQ(IoBatch::backend::blocking, io.get_backend());
+    }
+    ASSERT_STREQ("blocking", to_string(IoBatch{1, false}.get_backend()));
+}
+
+TEST_P(IoBatchTest, operations) {
+    std::ofstream{dir / "file"} << "Hello io";
+    // More operations than the depth of the ring
+    for (int i = 0; i < 20; ++i) {
+        io.mkdir(dir / std::to_string(i));
+    }
+    ASSERT_EQ(20, io.size());
+    for (const int result: io.submit()) {
+        ASSERT_EQ(0, result);
+    }
+    ASSERT_EQ(0, io.size());
+    for (int i = 0; i < 20; ++i) {
+        ASSERT_TRUE(is_directory(dir / std::to_string(i)));
+        io.link(dir / "file", dir / std::to_string(i) / "link");
+    }
+    io.rename(dir / "0", dir / "renamed");
+    for (const int result: io.submit()) {
+        ASSERT_EQ(0, result);
+    }
+    ASSERT_EQ(20, hard_link_count(dir / "file") - 1);
+    ASSERT_TRUE(exists(dir / "renamed" / "link"));
+
+    struct stat st{};
+    io.stat(dir / "file", st);
+    const auto opened = io.open(dir / "file", O_RDONLY | O_CLOEXEC);
+    const auto results = io.submit();
+    ASSERT_EQ(0, results[0]);
+    ASSERT_EQ(8, st.st_size);
+    ASSERT_TRUE(S_ISREG(st.st_mode));
+    ASSERT_EQ(21, st.st_nlink);
+    const int fd = results[opened];
+    ASSERT_LE(0, fd);
+
+    char buffer[16]{};
+    io.read(fd, buffer, sizeof(buffer), 6);
+    ASSERT_EQ(2, io.submit()[0]);
+    ASSERT_EQ(std::string{"io"}, buffer);
+    io.close(fd);
+    ASSERT_EQ(0, io.submit()[0]);
+}
+
+TEST_P(IoBatchTest, errors) {
+    struct stat st{};
+    io.stat(dir / "missing", st);
+    io.mkdir(dir / "missing" / "dir");
+    io.link(dir / "missing", dir / "link");
+    io.open(dir / "missing", O_RDONLY);
+    for (const int result: io.submit()) {
+        ASSERT_EQ(-ENOENT, result);
+    }
+}
+
+INSTANTIATE_TEST_SUITE_P(Backends, IoBatchTest, testing::Values(true, false));
@@ -0,0 +1,152 @@
+#include "krico/backup/LogIndex.h"
+#include "krico/backup/TemporaryDirectory.h"
+#include <gtest/gtest.h>
+#include <cstring>
+#include <fstream>
+#include <unistd.h>
+
+using namespace krico::backup;
+namespace fs = std::filesystem;
+
+namespace {
+    LogIndex::entry_t entry(const size_t i) {
+        LogIndex::entry_t ret{
+            .ts_ = static_cast<int64_t>(i), .directory_ = LogIndex::directory_hash(std::to_string(i % 3)),
+            .digest_ = {}, .type_ = LogEntryType::RunBackup, .reserved_ = {}
+        };
+        const auto digest = Digest::sha1().digest(reinterpret_cast<const char *>(&i), sizeof(i));
+        std::memcpy(ret.digest_, digest.md_, DigestLength::SHA1);
+        return ret;
+    }
+
+    void expect_entries(LogIndex &index, const size_t count) {
+        const auto entries = index.entries();
+        ASSERT_EQ(count, entries.size());
+        for (size_t i = 0; i < count; ++i) {
+            const auto expected = entry(i);
+            ASSERT_EQ(0, std::memcmp(&entries[i], &expected, sizeof(LogIndex::entry_t))) << i;
+        }
+        ASSERT_EQ(count ? entry(count - 1).digest() : Digest::SHA1_ZERO, index.last());
+    }
+}
+
+TEST(LogIndexTest, append) {
+    const TemporaryDirectory tmp{};
+    do {
+        LogIndex index{tmp.dir()};
+        expect_entries(index, 0);
+        for (size_t i = 0; i < 10; ++i) {
+            index.append(entry(i));
+        }
+        expect_entries(index, 10);
+        std::vector<LogIndex::entry_t> more{};
+        for (size_t i = 10; i < 20; ++i) more.push_back(entry(i));
+        index.append(more);
+        expect_entries(index, 20);
+    } while (false);
+    LogIndex index{tmp.dir()};
+    expect_entries(index, 20);
+    index.clear();
+    expect_entries(index, 0);
+}
+
+TEST(LogIndexTest, partialEntry) {
+    const TemporaryDirectory tmp{};
+    const auto file = tmp.dir() / LogIndex::INDEX_FILE;
+    do {
+        LogIndex index{tmp.dir()};
+        for (size_t i = 0; i < 3; ++i) index.append(entry(i));
+    } while (false);
+    const auto size = fs::file_size(file);
+    // A crash in the middle of an append
+    std::ofstream{file, std::ios::binary | std::ios::app} << "garbage";
+    do {
+        // Ignored by readers, dropped by the next append
+        LogIndex index{tmp.dir()};
+        expect_entries(index, 3);
+        ASSERT_EQ(size + 7, fs::file_size(file));
+        index.append(entry(3));
+        expect_entries(index, 4);
+        ASSERT_EQ(size + sizeof(LogIndex::entry_t), fs::file_size(file));
+    } while (false);
+    // Not an index at all
+    std::ofstream{file, std::ios::binary | std::ios::trunc} << "garbage";
+    LogIndex index{tmp.dir()};
+    expect_entries(index, 0);
+    index.append(entry(0));
+    expect_entries(index, 1);
+}
+
+TEST(LogIndexTest, readOnly) {
+    const TemporaryDirectory tmp{};
+    const auto file = tmp.dir() / LogIndex::INDEX_FILE;
+    do {
+        // Nothing is created until something is appended
+        LogIndex index{tmp.dir()};
+        expect_entries(index, 0);
+        ASSERT_FALSE(exists(file));
+        for (size_t i = 0; i < 3; ++i) index.append(entry(i));
+    } while (false);
+    const auto size = fs::file_size(file);
+    const auto writable = fs::status(tmp.dir()).permissions();
+    fs::permissions(file, fs::perms::owner_read | fs::perms::group_read | fs::perms::others_read);
+    fs::permissions(tmp.dir(), fs::perms::owner_read | fs::perms::owner_exec);
+    // Always writable by root
+    const bool readOnly = access(file.c_str(), W_OK) != 0;
+    do {
+        LogIndex index{tmp.dir()};
+        expect_entries(index, 3);
+        index.append(entry(3));
+        expect_entries(index, 4);
+        ASSERT_EQ(readOnly, index.inMemory());
+        if (readOnly) {
+            ASSERT_EQ(size, fs::file_size(file));
+            index.clear();
+            expect_entries(index, 0);
+            index.append(entry(0));
+            expect_entries(index, 1);
+        }
+    } while (false);
+    fs::permissions(tmp.dir(), writable);
+    fs::permissions(file, fs::perms::owner_write, fs::perm_options::add);
+    LogIndex index{tmp.dir()};
+    expect_entries(index, readOnly ? 3 : 4);
+}
+
+TEST(LogIndexTest, directoryHash) {
+    ASSERT_EQ(LogIndex::directory_hash("some/dir"), LogIndex::directory_hash("some/dir"));
+    ASSERT_NE(LogIndex::directory_hash("some/dir"), LogIndex::directory_hash("some/dir2"));
+    // FNV-1a of the empty string
+    ASSERT_EQ(0xcbf29ce484222325ULL, LogIndex::directory_hash(""));
+}
+
+TEST(LogIndexTest, timestamp) {
+    using namespace std::chrono;
+    // Nanoseconds whatever the duration of system_clock
+    const system_clock::time_point ts{duration_cast<system_clock::duration>(seconds{1'700'000'000} + microseconds{5})};
+    ASSERT_EQ(1'700'000'000'000'005'000LL, LogIndex::timestamp(ts));
+    ASSERT_EQ(0, LogIndex::timestamp(system_clock::time_point{}));
+    // Query bounds that are not representable in nanoseconds
+    ASSERT_EQ(nanoseconds::max().count(), LogIndex::timestamp(system_clock::time_point::max()));
+    ASSERT_EQ(nanoseconds::min().count(), LogIndex::timestamp(system_clock::time_point::min()));
+}
+
+TEST(LogIndexTest, version1) {
+    const TemporaryDirectory tmp{};
+    const auto file = tmp.dir() / LogIndex::INDEX_FILE;
+    do {
+        LogIndex index{tmp.dir()};
+        for (size_t i = 0; i < 3; ++i) index.append(entry(i));
+    } while (false);
+    // Its timestamps were system_clock ticks, it is dropped and rebuilt
+    do {
+        std::fstream out{file, std::ios::binary | std::ios::in | std::ios::out};
+        constexpr uint32_t version = 1;
+        out.seekp(sizeof(uint32_t));
+        out.write(reinterpret_cast<const char *>(&version), sizeof(version));
+    } while (false);
+    LogIndex index{tmp.dir()};
+    expect_entries(index, 0);
+    index.append(entry(0));
+    expect_entries(index, 1);
+}
@@ -0,0 +1,269 @@
+#include "krico/backup/LogPack.h"
+#include "krico/backup/TemporaryDirectory.h"
+#include "krico/backup/ThreadPool.h"
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <fstream>
+
+using namespace krico::backup;
+namespace fs = std::filesystem;
+
+namespace {
+    std::string record(const size_t i) {
+        return "Record number " + std::to_string(i);
+    }
+
+    Digest::result digest_of(const std::string &data) {
+        return Digest::sha1().digest(data.data(), data.size());
+    }
+
+    void append(LogPack &pack, const size_t from, const size_t to) {
+        for (size_t i = from; i < to; ++i) {
+            const auto data = record(i);
+            pack.append(digest_of(data), data.data(), data.size());
+        }
+    }
+
+    void expect_records(LogPack &pack, const size_t count) {
+        ASSERT_EQ(count, pack.size());
+        for (size_t i = 0; i < count; ++i) {
+            ASSERT_EQ(record(i), pack.find(digest_of(record(i)))) << i;
+        }
+        ASSERT_TRUE(pack.find(digest_of(record(count))).empty());
+    }
+}
+
+TEST(LogPackTest, append) {
+    const TemporaryDirectory tmp{};
+    LogPack pack{tmp.dir()};
+    ASSERT_EQ(0, pack.size());
+    append(pack, 0, 10);
+    expect_records(pack, 10);
+    // Appending the same record again is a no-op
+    append(pack, 0, 10);
+    expect_records(pack, 10);
+    ASSERT_FALSE(exists(tmp.dir() / LogPack::INDEX_FILE)) << "index written before INDEX_INTERVAL records";
+}
+
+TEST(LogPackTest, reopen) {
+    const TemporaryDirectory tmp{};
+    constexpr size_t COUNT = 3 * LogPack::INDEX_INTERVAL + 5;
+    do {
+        LogPack pack{tmp.dir()};
+        append(pack, 0, COUNT);
+        ASSERT_TRUE(exists(tmp.dir() / LogPack::INDEX_FILE));
+        expect_records(pack, COUNT);
+    } while (false);
+    do {
+        LogPack pack{tmp.dir()};
+        expect_records(pack, COUNT);
+        append(pack, COUNT, COUNT + 1);
+    } while (false);
+    // The index is a cache of the pack, rebuilt by the next append
+    fs::remove(tmp.dir() / LogPack::INDEX_FILE);
+    do {
+        LogPack pack{tmp.dir()};
+        expect_records(pack, COUNT + 1);
+        ASSERT_FALSE(exists(tmp.dir() / LogPack::INDEX_FILE));
+        const auto digests = pack.digests();
+        ASSERT_EQ(COUNT + 1, digests.size());
+        append(pack, COUNT + 1, COUNT + 2);
+        ASSERT_TRUE(exists(tmp.dir() / LogPack::INDEX_FILE));
+    } while (false);
+    LogPack pack{tmp.dir()};
+    expect_records(pack, COUNT + 2);
+}
+
+TEST(LogPackTest, partialRecord) {
+    const TemporaryDirectory tmp{};
+    const auto packFile = tmp.dir() / LogPack::PACK_FILE;
+    do {
+        LogPack pack{tmp.dir()};
+        append(pack, 0, 3);
+    } while (false);
+    const auto size = fs::file_size(packFile);
+    // A crash in the middle of an append
+    std::ofstream{packFile, std::ios::binary | std::ios::app} << "garbage";
+    do {
+        LogPack pack{tmp.dir()};
+        expect_records(pack, 3);
+        // Only truncated by the next append, frames are the length and digest of the record
+        ASSERT_EQ(size + 7, fs::file_size(packFile));
+        append(pack, 3, 4);
+        ASSERT_EQ(size + 24 + record(3).size(), fs::file_size(packFile));
+    } while (false);
+    LogPack pack{tmp.dir()};
+    expect_records(pack, 4);
+}
+
+TEST(LogPackTest, readOnly) {
+    const TemporaryDirectory tmp{};
+    const auto packFile = tmp.dir() / LogPack::PACK_FILE;
+    const auto indexFile = tmp.dir() / LogPack::INDEX_FILE;
+    do {
+        // Nothing is created until something is appended
+        const LogPack pack{tmp.dir()};
+        ASSERT_EQ(0, pack.size());
+        ASSERT_FALSE(exists(packFile));
+    } while (false);
+    constexpr size_t COUNT = 2 * LogPack::INDEX_INTERVAL + 5;
+    do {
+        LogPack pack{tmp.dir()};
+        append(pack, 0, COUNT);
+    } while (false);
+    // Stale index and a partial record, both fixed by the next append (not by reading)
+    fs::remove(indexFile);
+    std::ofstream{packFile, std::ios::binary | std::ios::app} << "garbage";
+    const auto size = fs::file_size(packFile);
+    const auto writable = fs::status(tmp.dir()).permissions();
+    fs::permissions(packFile, fs::perms::owner_read | fs::perms::group_read | fs::perms::others_read);
+    fs::permissions(tmp.dir(), fs::perms::owner_read | fs::perms::owner_exec);
+    do {
+        LogPack pack{tmp.dir()};
+        expect_records(pack, COUNT);
+        ASSERT_EQ(COUNT, pack.digests().size());
+        ASSERT_EQ(1, pack.find_prefix(digest_of(record(0)).str()).size());
+        ThreadPool pool{2};
+        ASSERT_EQ(COUNT, pack.verify(pool, [](const Digest::result &digest, const std::string &what) {
+            FAIL() << digest.str() << ": " << what;
+        }));
+        pack.sync();
+    } while (false);
+    fs::permissions(tmp.dir(), writable);
+    fs::permissions(packFile, fs::perms::owner_write, fs::perm_options::add);
+    ASSERT_EQ(size, fs::file_size(packFile));
+    ASSERT_FALSE(exists(indexFile));
+
+    LogPack pack{tmp.dir()};
+    append(pack, COUNT, COUNT + 1);
+    ASSERT_TRUE(exists(indexFile));
+    // The partial record is gone, frames are the length and digest of the record
+    ASSERT_EQ(size - 7 + 24 + record(COUNT).size(), fs::file_size(packFile));
+    expect_records(pack, COUNT + 1);
+}
+
+TEST(LogPackTest, findPrefix) {
+    const TemporaryDirectory tmp{};
+    LogPack pack{tmp.dir()};
+    constexpr size_t COUNT = LogPack::INDEX_INTERVAL + 20;
+    append(pack, 0, COUNT);
+    for (size_t i = 0; i < COUNT; ++i) {
+        const auto digest = digest_of(record(i));
+        const auto hex = digest.str();
+        for (size_t len = 0; len <= hex.size(); len += 3) {
+            const auto prefix = hex.substr(0, len);
+            const auto found = pack.find_prefix(prefix);
+            ASSERT_TRUE(std::ranges::find(found, digest) != found.end()) << prefix;
+            for (const auto &f: found) {
+                ASSERT_TRUE(f.str().starts_with(prefix)) << prefix;
+            }
+            size_t expected = 0;
+            for (size_t j = 0; j < COUNT; ++j) {
+                if (digest_of(record(j)).str().starts_with(prefix)) ++expected;
+            }
+            ASSERT_EQ(expected, found.size()) << prefix;
+        }
+        ASSERT_EQ(1, pack.find_prefix(hex).size());
+    }
+    ASSERT_TRUE(pack.find_prefix("g").empty());
+    ASSERT_TRUE(pack.find_prefix(std::string(41, '0')).empty());
+}
+
+TEST(LogPackTest, verify) {
+    const TemporaryDirectory tmp{};
+    constexpr size_t COUNT = LogPack::INDEX_INTERVAL + 20;
+    const auto packFile = tmp.dir() / LogPack::PACK_FILE;
+    do {
+        LogPack pack{tmp.dir()};
+        append(pack, 0, COUNT);
+        ThreadPool pool{4};
+        std::vector<Digest::result> corrupt{};
+        ASSERT_EQ(COUNT, pack.verify(pool, [&](const Digest::result &digest, const std::string &) { corrupt.push_back(digest); }));
+        ASSERT_TRUE(corrupt.empty());
+    } while (false);
+    // Flip the last character of the last record
+    do {
+        std::fstream file{packFile, std::ios::binary | std::ios::in | std::ios::out};
+        file.seekp(-1, std::ios::end);
+        file.put('X');
+    } while (false);
+    LogPack pack{tmp.dir()};
+    ThreadPool pool{4};
+    std::vector<Digest::result> corrupt{};
+    ASSERT_EQ(COUNT, pack.verify(pool, [&](const Digest::result &digest, const std::string &) { corrupt.push_back(digest); }));
+    ASSERT_EQ(1, corrupt.size());
+    ASSERT_EQ(digest_of(record(COUNT - 1)), corrupt.at(0));
+    // Split into tasks of a few records (and one per record), every record is still checked exactly once
+    for (const size_t chunk: {size_t{1}, size_t{100}, size_t{1000}}) {
+        corrupt.clear();
+        ASSERT_EQ(COUNT, pack.verify(pool, [&](const Digest::result &digest, const std::string &) { corrupt.push_back(digest); }, chunk));
+        ASSERT_EQ(1, corrupt.size()) << chunk;
+        ASSERT_EQ(digest_of(record(COUNT - 1)), corrupt.at(0)) << chunk;
+    }
+}
+
+TEST(LogPackTest, verifyCorruptFrame) {
+    const TemporaryDirectory tmp{};
+    constexpr size_t COUNT = LogPack::INDEX_INTERVAL + 20;
+    constexpr size_t DAMAGED = 3;
+    const auto packFile = tmp.dir() / LogPack::PACK_FILE;
+    do {
+        LogPack pack{tmp.dir()};
+        append(pack, 0, COUNT);
+    } while (false);
+    ASSERT_TRUE(exists(tmp.dir() / LogPack::INDEX_FILE));
+    const auto size = fs::file_size(packFile);
+    // Pack header, then a length and a digest before each record
+    size_t offset = 8;
+    for (size_t i = 0; i < DAMAGED; ++i) {
+        offset += 24 + record(i).size();
+    }
+    const auto set_length = [&](const uint32_t length) {
+        std::fstream file{packFile, std::ios::binary | std::ios::in | std::ios::out};
+        file.seekp(static_cast<std::streamoff>(offset));
+        file.write(reinterpret_cast<const char *>(&length), sizeof(length));
+    };
+    struct problem_t {
+        Digest::result digest_;
+        std::string what_;
+    };
+    const auto verify = [&](std::vector<problem_t> &problems) {
+        LogPack pack{tmp.dir()};
+        ThreadPool pool{4};
+        return pack.verify(pool, [&](const Digest::result &digest, const std::string &what) {
+            problems.push_back({digest, what});
+        }, 100);
+    };
+    const auto is_index_entry = [](const problem_t &problem) {
+        for (size_t i = DAMAGED; i < LogPack::INDEX_INTERVAL; ++i) {
+            if (problem.digest_ == digest_of(record(i))) return problem.what_.starts_with("index entry");
+        }
+        return false;
+    };
+
+    // A length far beyond the end of the pack, in the indexed part (not checked when the pack is opened)
+    set_length(0xfffffff0);
+    std::vector<problem_t> problems{};
+    ASSERT_EQ(DAMAGED, verify(problems));
+    ASSERT_EQ(1, std::ranges::count_if(problems, [&](const problem_t &problem) {
+        return problem.digest_ == digest_of(record(DAMAGED))
+               && problem.what_.starts_with("corrupt frame at offset " + std::to_string(offset));
+    }));
+    // The index entries of the records the walk did not reach do not locate a frame
+    ASSERT_EQ(LogPack::INDEX_INTERVAL - DAMAGED, std::ranges::count_if(problems, is_index_entry));
+    ASSERT_EQ(1 + LogPack::INDEX_INTERVAL - DAMAGED, problems.size());
+
+    // A length leaving less than a frame header at the end of the pack
+    set_length(static_cast<uint32_t>(size - offset - 24 - 1));
+    problems.clear();
+    ASSERT_EQ(DAMAGED + 1, verify(problems));
+    ASSERT_EQ(1, std::ranges::count_if(problems, [](const problem_t &problem) {
+        return problem.digest_ == Digest::SHA1_ZERO && problem.what_.starts_with("truncated frame");
+    }));
+    ASSERT_EQ(1, std::ranges::count_if(problems, [&](const problem_t &problem) {
+        return problem.digest_ == digest_of(record(DAMAGED)) && problem.what_.ends_with("does not hash to its digest");
+    }));
+    // The damaged record's own entry has the wrong length, the others locate nothing
+    ASSERT_EQ(LogPack::INDEX_INTERVAL - DAMAGED, std::ranges::count_if(problems, is_index_entry));
+    ASSERT_EQ(2 + LogPack::INDEX_INTERVAL - DAMAGED, problems.size());
+}
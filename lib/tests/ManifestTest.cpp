@@ -0,0 +1,181 @@
+#include "krico/backup/Manifest.h"
+#include "krico/backup/exception.h"
+#include "krico/backup/TemporaryDirectory.h"
+#include <gtest/gtest.h>
+#include <sstream>
+
+using namespace krico::backup;
+namespace fs = std::filesystem;
+
+namespace {
+    Digest::result digest_of(const std::string &text) {
+        return Digest::sha1().digest(text.data(), text.size());
+    }
+
+    std::string name(const size_t i) {
+        return std::format("dir{:02}", i / 10) + "/file" + std::to_string(i % 10);
+    }
+}
+
+TEST(ManifestTest, comparePaths) {
+    ASSERT_LT(compare_paths(".", "a"), 0);
+    ASSERT_EQ(0, compare_paths(".", "."));
+    ASSERT_LT(compare_paths("a", "a/b"), 0);
+    ASSERT_LT(compare_paths("a/b", "a.txt"), 0);
+    ASSERT_LT(compare_paths("a/z", "ab"), 0);
+    ASSERT_GT(compare_paths("b", "a/z"), 0);
+    ASSERT_EQ(0, compare_paths("a/b", "a/b"));
+    ASSERT_LT(compare_paths("a", "\xe9"), 0);
+}
+
+TEST(ManifestTest, roundTrip) {
+    const TemporaryDirectory tmp{};
+    const auto file = tmp.dir() / "manifest";
+    const auto checksum = digest_of("checksum");
+    constexpr size_t FILES = 300;
+    do {
+        ManifestWriter writer{file};
+        writer.add({.kind_ = manifest_entry::kind::directory, .path_ = "."});
+        for (size_t i = 0; i < FILES; ++i) {
+            const auto path = name(i);
+            if (i % 10 == 0) {
+                writer.add({.kind_ = manifest_entry::kind::directory, .path_ = path.substr(0, path.find('/'))});
+            }
+            if (i % 7 == 0) {
+                writer.add({.kind_ = manifest_entry::kind::symlink, .path_ = path, .target_ = "../" + path});
+            } else {
+                writer.add({
+                    .kind_ = i % 2 ? manifest_entry::kind::copied : manifest_entry::kind::hard_linked,
+                    .path_ = path, .digest_ = digest_of(path), .size_ = i * 1000, .mtimeNs_ = -static_cast<int64_t>(i)
+                });
+            }
+        }
+        ASSERT_EQ(1 + FILES + FILES / 10, writer.size());
+        ASSERT_THROW(writer.add({.kind_ = manifest_entry::kind::directory, .path_ = "dir00"}), exception);
+        writer.finish(checksum);
+    } while (false);
+
+    ASSERT_TRUE(ManifestReader::is_manifest(file));
+    const ManifestReader reader{file};
+    ASSERT_EQ(1 + FILES + FILES / 10, reader.size());
+    ASSERT_EQ(checksum, reader.checksum());
+    auto it = reader.begin();
+    ASSERT_EQ(manifest_entry::kind::directory, (*it).kind_);
+    ASSERT_EQ(".", (*it).path_);
+    for (size_t i = 0; i < FILES; ++i) {
+        const auto path = name(i);
+        if (i % 10 == 0) {
+            ++it;
+            ASSERT_EQ(manifest_entry::kind::directory, (*it).kind_);
+            ASSERT_EQ(path.substr(0, path.find('/')), (*it).path_);
+        }
+        ++it;
+        const auto entry = *it;
+        ASSERT_EQ(path, entry.path_);
+        if (i % 7 == 0) {
+            ASSERT_EQ(manifest_entry::kind::symlink, entry.kind_);
+            ASSERT_EQ("../" + path, entry.target_);
+        } else {
+            ASSERT_EQ(i % 2 ? manifest_entry::kind::copied : manifest_entry::kind::hard_linked, entry.kind_);
+            ASSERT_EQ(digest_of(path), entry.digest_);
+            ASSERT_EQ(i * 1000, entry.size_);
+            ASSERT_EQ(-static_cast<int64_t>(i), entry.mtimeNs_);
+        }
+    }
+    ASSERT_TRUE(++it == reader.end());
+}
+
+TEST(ManifestTest, empty) {
+    const TemporaryDirectory tmp{};
+    const auto file = tmp.dir() / "manifest";
+    ManifestWriter writer{file};
+    writer.finish(Digest::SHA1_ZERO);
+    const ManifestReader reader{file};
+    ASSERT_EQ(0, reader.size());
+    ASSERT_TRUE(reader.begin() == reader.end());
+}
+
+TEST(ManifestTest, print) {
+    const TemporaryDirectory tmp{};
+    const auto file = tmp.dir() / "manifest";
+    const auto digest = digest_of("a");
+    const auto checksum = digest_of("checksum");
+    const std::string expected = "D .\n"
+                                 "C " + digest.str() + " a\n"
+                                 "D b\n"
+                                 "H " + digest.str() + " b/a\n"
+                                 "L b/c\t../a\n"
+                                 "S " + checksum.str() + "\n";
+    do {
+        ManifestWriter writer{file};
+        writer.add({.kind_ = manifest_entry::kind::directory, .path_ = "."});
+        writer.add({.kind_ = manifest_entry::kind::copied, .path_ = "a", .digest_ = digest});
+        writer.add({.kind_ = manifest_entry::kind::directory, .path_ = "b"});
+        writer.add({.kind_ = manifest_entry::kind::hard_linked, .path_ = "b/a", .digest_ = digest});
+        writer.add({.kind_ = manifest_entry::kind::symlink, .path_ = "b/c", .target_ = "../a"});
+        writer.finish(checksum);
+    } while (false);
+    std::stringstream ss;
+    print_manifest(file, ss);
+    ASSERT_EQ(expected, ss.str());
+
+    // Summary files written before the manifest are that text
+    const auto legacy = tmp.dir() / "legacy";
+    std::ofstream{legacy} << expected;
+    ASSERT_FALSE(ManifestReader::is_manifest(legacy));
+    ASSERT_THROW(ManifestReader{legacy}, exception);
+    std::stringstream legacySs;
+    print_manifest(legacy, legacySs);
+    ASSERT_EQ(expected, legacySs.str());
+}
+
+TEST(ManifestTest, find) {
+    const TemporaryDirectory tmp{};
+    const auto file = tmp.dir() / "manifest";
+    constexpr size_t FILES = 1000;
+    do {
+        ManifestWriter writer{file};
+        writer.add({.kind_ = manifest_entry::kind::directory, .path_ = "."});
+        for (size_t i = 0; i < FILES; ++i) {
+            const auto path = name(i);
+            if (i % 10 == 0) {
+                writer.add({.kind_ = manifest_entry::kind::directory, .path_ = path.substr(0, path.find('/'))});
+            }
+            writer.add({.kind_ = manifest_entry::kind::copied, .path_ = path, .digest_ = digest_of(path), .size_ = i});
+        }
+        writer.finish(Digest::SHA1_ZERO);
+    } while (false);
+
+    const ManifestReader reader{file};
+    for (size_t i = 0; i < FILES; ++i) {
+        const auto path = name(i);
+        const auto it = reader.find(path);
+        ASSERT_FALSE(it == reader.end()) << path;
+        ASSERT_EQ(path, (*it).path_);
+        ASSERT_EQ(digest_of(path), (*it).digest_);
+        ASSERT_EQ(i, (*it).size_);
+    }
+    ASSERT_EQ(".", (*reader.find(".")).path_);
+    ASSERT_EQ("dir42", (*reader.find("dir42")).path_);
+    ASSERT_TRUE(reader.find("dir42/file") == reader.end());
+    ASSERT_TRUE(reader.find("dir") == reader.end());
+    ASSERT_TRUE(reader.find("zzz") == reader.end());
+    ASSERT_EQ("dir43", (*reader.lower_bound("dir42/z")).path_);
+    ASSERT_TRUE(reader.lower_bound("zzz") == reader.end());
+
+    std::vector<std::string> paths{};
+    for (const auto &entry: reader.subtree("dir42")) {
+        paths.emplace_back(entry.path_);
+    }
+    ASSERT_EQ(11, paths.size());
+    ASSERT_EQ("dir42", paths.front());
+    ASSERT_EQ("dir42/file9", paths.back());
+    const auto file3 = reader.subtree("dir42/file3");
+    ASSERT_EQ(1, std::distance(file3.begin(), file3.end()));
+    ASSERT_EQ("dir42/file3", (*file3.begin()).path_);
+    ASSERT_TRUE(reader.subtree("dir4").empty());
+    ASSERT_TRUE(reader.subtree("nothing").empty());
+    size_t all = 0;
+    for ([[maybe_unused]] const auto &entry: reader.subtree(".")) ++all;
+    ASSERT_EQ(reader.size(), all);
+}
@@ -0,0 +1,40 @@
+#include "krico/backup/MultiBufferSha256.h"
+#include <gtest/gtest.h>
+#include <vector>
+
+using namespace krico::backup;
+
+namespace {
+    std::vector<uint8_t> input(const size_t len, const size_t seed) {
+        std::vector<uint8_t> v(len);
+        for (size_t i = 0; i < len; ++i) v[i] = static_cast<uint8_t>((i + seed) * 31 % 251);
+        return v;
+    }
+}
+
+TEST(MultiBufferSha256Test, vectors) {
+    const std::string abc{"abc"};
+    const MultiBufferSha256::buffer_t buffers[]{{"", 0}, {abc.data(), abc.size()}};
+    Digest::result results[2];
+    MultiBufferSha256::digest(buffers, 2, results);
+    ASSERT_EQ("e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855", results[0].str());
+    ASSERT_EQ("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", results[1].str());
+}
+
+TEST(MultiBufferSha256Test, sameAsDigest) {
+    // Lengths around the padding boundaries (55/56 bytes) and multiple blocks, more buffers than lanes
+    const std::vector<size_t> lengths{0, 1, 55, 56, 57, 63, 64, 65, 119, 120, 127, 128, 1000, 4096, 65535, 3, 200};
+    const Digest md{Digest::SHA256_ALGORITHM};
+    for (size_t n = 1; n <= 2 * MultiBufferSha256::lanes() + 1; ++n) {
+        std::vector<std::vector<uint8_t> > data{};
+        std::vector<MultiBufferSha256::buffer_t> buffers{};
+        for (size_t i = 0; i < n; ++i) data.push_back(input(lengths[(i + n) % lengths.size()], i));
+        for (const auto &d: data) buffers.push_back({d.data(), d.size()});
+        std::vector<Digest::result> results(n);
+        MultiBufferSha256::digest(buffers.data(), n, results.data());
+        for (size_t i = 0; i < n; ++i) {
+            ASSERT_EQ(md.digest(data[i].data(), data[i].size()), results[i])
+                << "n=" << n << " len=" << data[i].size() << " impl=" << MultiBufferSha256::implementation();
+        }
+    }
+}
@@ -0,0 +1,156 @@
+#include "krico/backup/ObjectIndex.h"
+#include "krico/backup/TemporaryDirectory.h"
+#include <gtest/gtest.h>
+#include <fstream>
+#include <thread>
+
+using namespace krico::backup;
+namespace fs = std::filesystem;
+
+namespace {
+    class ObjectIndexTest : public testing::Test {
+    protected:
+        const TemporaryDirectory tmp{TemporaryDirectory::args_t{.prefix = "ObjectIndex"}};
+        const fs::path hardLinksDir{tmp.dir() / "hlinks"};
+
+        void SetUp() override {
+            create_directory(hardLinksDir);
+        }
+
+        static Digest::result digest(const std::string &content) {
+            Digest::result r{};
+            Digest::result::parse(r, sha256_sum(content));
+            return r;
+        }
+
+        static Digest::result sha1(const std::string &content) {
+            Digest::result r{};
+            Digest::result::parse(r, sha1_sum(content));
+            return r;
+        }
+
+        //! Store an object the way BackupRunner does
+        void store(const std::string &content, const uint8_t dirs = 2) const {
+            store(digest(content), dirs);
+        }
+
+        void store(const Digest::result &digest, const uint8_t dirs = 2) const {
+            const auto file = hardLinksDir / digest.path(dirs);
+            create_directories(file.parent_path());
+            std::ofstream{file} << digest.str();
+        }
+    };
+}
+
+TEST_F(ObjectIndexTest, insertAndSave) {
+    do {
+        ObjectIndex index{tmp.dir(), hardLinksDir};
+        ASSERT_EQ(0, index.size());
+        ASSERT_FALSE(index.contains(digest("A")));
+        index.insert(digest("A"));
+        index.insert(digest("A"));
+        ASSERT_TRUE(index.contains(digest("A")));
+        ASSERT_EQ(1, index.size());
+        index.insert(digest("B"));
+        // Not saved, kept by the journal
+    } while (false);
+
+    do {
+        ObjectIndex index{tmp.dir(), hardLinksDir};
+        ASSERT_EQ(2, index.size());
+        ASSERT_TRUE(index.contains(digest("A")));
+        ASSERT_TRUE(index.contains(digest("B")));
+        ASSERT_FALSE(index.contains(digest("C")));
+        index.insert(digest("C"));
+        index.save();
+        ASSERT_EQ(0, fs::file_size(tmp.dir() / ObjectIndex::JOURNAL_FILE));
+    } while (false);
+
+    ObjectIndex index{tmp.dir(), hardLinksDir};
+    ASSERT_EQ(3, index.size());
+    for (const auto *c: {"A", "B", "C"}) {
+        ASSERT_TRUE(index.contains(digest(c))) << c;
+    }
+    ASSERT_FALSE(index.contains(Digest::SHA256_ZERO));
+    ASSERT_FALSE(index.contains(Digest::SHA1_ZERO));
+}
+
+TEST_F(ObjectIndexTest, rebuild) {
+    store("A");
+    store("B");
+    std::ofstream{hardLinksDir / "store.0.tmp"} << "temp";
+    // Missing index file is rebuilt from hardLinksDir
+    ObjectIndex index{tmp.dir(), hardLinksDir};
+    ASSERT_EQ(2, index.size());
+    ASSERT_TRUE(index.contains(digest("A")));
+    ASSERT_TRUE(index.contains(digest("B")));
+
+    store("C");
+    ASSERT_FALSE(index.contains(digest("C")));
+    ASSERT_EQ(3, index.rebuild());
+    ASSERT_TRUE(index.contains(digest("C")));
+}
+
+TEST_F(ObjectIndexTest, rebuildLayouts) {
+    for (int i = 0; i < 500; ++i) {
+        store(std::to_string(i));
+    }
+    do {
+        ObjectIndex index{tmp.dir(), hardLinksDir};
+        ASSERT_EQ(500, index.size());
+    } while (false);
+
+    // Half moved to another depth (interrupted relayout), the directory order no longer is the digest order
+    for (int i = 500; i < 1000; ++i) {
+        store(std::to_string(i), 1);
+    }
+    ObjectIndex index{tmp.dir(), hardLinksDir};
+    ASSERT_EQ(1000, index.rebuild());
+    for (int i = 0; i < 1000; ++i) {
+        ASSERT_TRUE(index.contains(digest(std::to_string(i)))) << i;
+    }
+    ASSERT_FALSE(index.contains(digest("1000")));
+}
+
+TEST_F(ObjectIndexTest, digestLength) {
+    store(sha1("A"));
+    store(sha1("B"));
+    do {
+        ObjectIndex index{tmp.dir(), hardLinksDir, DigestLength::SHA1};
+        ASSERT_EQ(DigestLength::SHA1, index.digestLength());
+        ASSERT_EQ(2, index.size());
+        ASSERT_TRUE(index.contains(sha1("A")));
+        ASSERT_FALSE(index.contains(digest("A")));
+        index.insert(sha1("C"));
+        index.save();
+        ASSERT_THROW(index.insert(digest("D")), std::exception);
+    } while (false);
+    do {
+        ObjectIndex index{tmp.dir(), hardLinksDir, DigestLength::SHA1};
+        ASSERT_EQ(3, index.size());
+        ASSERT_TRUE(index.contains(sha1("C")));
+    } while (false);
+
+    // An index written for another digest length is rebuilt
+    ObjectIndex index{tmp.dir(), hardLinksDir, DigestLength::SHA256};
+    ASSERT_EQ(0, index.size());
+    ASSERT_FALSE(index.contains(sha1("A")));
+}
+
+TEST_F(ObjectIndexTest, concurrentInsert) {
+    ObjectIndex index{tmp.dir(), hardLinksDir};
+    std::vector<std::thread> threads{};
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&index, t] {
+            for (int i = 0; i < 100; ++i) {
+                index.insert(digest(std::to_string(i * (t % 2 + 1))));
+                ASSERT_TRUE(index.contains(digest(std::to_string(i))) || t % 2 == 1);
+            }
+        });
+    }
+    for (auto &t: threads) t.join();
+    index.save();
+    ASSERT_EQ(150, index.size());
+    ObjectIndex reopened{tmp.dir(), hardLinksDir};
+    ASSERT_EQ(150, reopened.size());
+}
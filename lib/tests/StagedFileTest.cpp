@@ -0,0 +1,82 @@
+#include "krico/backup/StagedFile.h"
+#include "krico/backup/TemporaryDirectory.h"
+#include <gtest/gtest.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <fstream>
+
+using namespace krico::backup;
+namespace fs = std::filesystem;
+
+namespace {
+    class StagedFileTest : public testing::TestWithParam<StagedFile::method> {
+    protected:
+        const TemporaryDirectory tmp{};
+        const fs::path &dir{tmp.dir()};
+        const int dirFd{open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)};
+
+        void SetUp() override {
+            ASSERT_NE(-1, dirFd);
+            const auto probed = StagedFile::probe(dirFd, dir);
+            if (GetParam() == StagedFile::method::empty_path && probed != StagedFile::method::empty_path) {
+                GTEST_SKIP() << "linkat(AT_EMPTY_PATH) not permitted";
+            }
+            if (GetParam() == StagedFile::method::proc_fd && probed == StagedFile::method::rename) {
+                GTEST_SKIP() << "O_TMPFILE not supported";
+            }
+        }
+
+        void TearDown() override {
+            close(dirFd);
+        }
+
+        [[nodiscard]] size_t count() const {
+            return std::distance(fs::directory_iterator{dir}, fs::directory_iterator{});
+        }
+
+        static std::string read(const fs::path &file) {
+            std::ifstream in{file};
+            return std::string{std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+        }
+    };
+}
+
+TEST_P(StagedFileTest, publish) {
+    ASSERT_EQ(0, count()) << "probe left files behind";
+    do {
+        StagedFile staged{dirFd, GetParam(), dir / "staged.tmp"};
+        ASSERT_EQ(GetParam(), staged.get_method());
+        staged.write("Hello staged", 12);
+        ASSERT_EQ(GetParam() == StagedFile::method::rename ? 1 : 0, count());
+        ASSERT_EQ(StagedFile::outcome::published, staged.publish("file", dir / "file"));
+    } while (false);
+    ASSERT_EQ(1, count());
+    ASSERT_EQ("Hello staged", read(dir / "file"));
+}
+
+TEST_P(StagedFileTest, exists) {
+    std::ofstream{dir / "file"} << "first";
+    do {
+        StagedFile staged{dirFd, GetParam(), dir / "staged.tmp"};
+        staged.write("second", 6);
+        ASSERT_EQ(StagedFile::outcome::exists, staged.publish("file", dir / "file"));
+    } while (false);
+    ASSERT_EQ(1, count()) << "discarded file left behind";
+    ASSERT_EQ("first", read(dir / "file"));
+}
+
+TEST_P(StagedFileTest, noDirectory) {
+    StagedFile staged{dirFd, GetParam(), dir / "staged.tmp"};
+    staged.write("x", 1);
+    ASSERT_EQ(StagedFile::outcome::no_directory, staged.publish("sub/file", dir / "sub" / "file"));
+    create_directory(dir / "sub");
+    ASSERT_EQ(StagedFile::outcome::published, staged.publish("sub/file", dir / "sub" / "file"));
+    ASSERT_EQ("x", read(dir / "sub" / "file"));
+}
+
+INSTANTIATE_TEST_SUITE_P(methods, StagedFileTest,
+                         testing::Values(StagedFile::method::empty_path, StagedFile::method::proc_fd,
+                                         StagedFile::method::rename),
+                         [](const testing::TestParamInfo<StagedFile::method> &info) {
+                             return std::string{to_string(info.param)};
+                         });
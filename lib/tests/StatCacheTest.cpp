@@ -0,0 +1,111 @@
+#include "krico/backup/StatCache.h"
+#include "krico/backup/TemporaryDirectory.h"
+#include <gtest/gtest.h>
+#include <fstream>
+#include <thread>
+
+using namespace krico::backup;
+using namespace std::chrono_literals;
+namespace fs = std::filesystem;
+
+namespace {
+    class StatCacheTest : public testing::Test {
+    protected:
+        const TemporaryDirectory tmp{TemporaryDirectory::args_t{.prefix = "StatCache"}};
+
+        [[nodiscard]] fs::path write(const std::string &name, const std::string &content) const {
+            const fs::path file{tmp.dir() / name};
+            std::ofstream{file} << content;
+            return file;
+        }
+    };
+}
+
+TEST_F(StatCacheTest, findAndSave) {
+    const auto a = write("a.txt", "A");
+    const auto b = write("b.txt", "B");
+    StatCache::key_t keyA{}, keyB{};
+    StatCache::stat(a, keyA);
+    StatCache::stat(b, keyB);
+    ASSERT_EQ(1, keyA.size_);
+    ASSERT_NE(keyA, keyB);
+    const auto digestA = Digest::sha256();
+    digestA.update("A", 1);
+    const auto resultA = digestA.digest();
+    Digest::result found{};
+    std::this_thread::sleep_for(10ms);
+
+    do {
+        StatCache cache{tmp.dir()};
+        ASSERT_EQ(0, cache.size());
+        ASSERT_FALSE(cache.find(keyA, found));
+        cache.put(keyA, resultA);
+        cache.put(keyB, Digest::SHA256_ZERO);
+        cache.save();
+        ASSERT_EQ(0, cache.hits());
+        ASSERT_EQ(1, cache.misses());
+    } while (false);
+    ASSERT_TRUE(exists(tmp.dir() / StatCache::CACHE_FILE));
+
+    do {
+        StatCache cache{tmp.dir()};
+        ASSERT_EQ(2, cache.size());
+        ASSERT_TRUE(cache.find(keyA, found));
+        ASSERT_EQ(resultA, found);
+        // Any change of the key is a miss
+        auto changed = keyB;
+        ++changed.mtime_ns_;
+        ASSERT_FALSE(cache.find(changed, found));
+        ASSERT_EQ(1, cache.hits());
+        ASSERT_EQ(1, cache.misses());
+        // Only keyA was used, keyB is dropped
+        cache.save();
+    } while (false);
+
+    StatCache cache{tmp.dir()};
+    ASSERT_EQ(1, cache.size());
+    ASSERT_TRUE(cache.find(keyA, found));
+    ASSERT_FALSE(cache.find(keyB, found));
+}
+
+TEST_F(StatCacheTest, deterministicFile) {
+    const auto a = write("a.txt", "A");
+    StatCache::key_t key{};
+    StatCache::stat(a, key);
+    std::this_thread::sleep_for(10ms);
+    const auto read = [](const fs::path &file) {
+        std::ifstream in{file, std::ios::binary};
+        return std::string{std::istreambuf_iterator{in}, std::istreambuf_iterator<char>{}};
+    };
+    std::string first{};
+    for (const auto *name: {"first", "second"}) {
+        fs::create_directory(tmp.dir() / name);
+        StatCache cache{tmp.dir() / name};
+        cache.put(key, Digest::SHA1_ZERO);
+        cache.save();
+        const auto content = read(tmp.dir() / name / StatCache::CACHE_FILE);
+        if (first.empty()) first = content;
+        ASSERT_EQ(first, content) << "Same entries, same bytes";
+    }
+}
+
+TEST_F(StatCacheTest, ignoresRecentlyChanged) {
+    StatCache cache{tmp.dir()};
+    std::this_thread::sleep_for(10ms);
+    const auto a = write("a.txt", "A");
+    StatCache::key_t key{};
+    StatCache::stat(a, key);
+    cache.put(key, Digest::SHA256_ZERO);
+    cache.save();
+
+    StatCache reopened{tmp.dir()};
+    ASSERT_EQ(0, reopened.size());
+}
+
+TEST_F(StatCacheTest, invalidFile) {
+    ASSERT_TRUE(exists(write(StatCache::CACHE_FILE, "not a stat cache")));
+    StatCache cache{tmp.dir()};
+    ASSERT_EQ(0, cache.size());
+    Digest::result found{};
+    ASSERT_FALSE(cache.find(StatCache::key_t{}, found));
+}
@@ -0,0 +1,71 @@
+#include "krico/backup/ThreadPool.h"
+#include "krico/backup/exception.h"
+#include <gtest/gtest.h>
+#include <atomic>
+
+using namespace krico::backup;
+
+namespace {
+    void spawn(ThreadPool &pool, std::atomic<int> &count, const int depth) /* NOLINT(*-no-recursion) */ {
+        ++count;
+        if (depth == 0) return;
+        for (int i = 0; i < 3; ++i) {
+            pool.submit([&pool, &count, depth] { spawn(pool, count, depth - 1); });
+        }
+    }
+}
+
+TEST(ThreadPoolTest, size) {
+    ASSERT_EQ(1, ThreadPool{0}.size());
+    ASSERT_EQ(1, ThreadPool{1}.size());
+    ASSERT_EQ(4, ThreadPool{4}.size());
+}
+
+TEST(ThreadPoolTest, nestedSubmit) {
+    ThreadPool pool{4};
+    std::atomic<int> count{0};
+    pool.submit([&] { spawn(pool, count, 5); });
+    pool.wait();
+    // 1 + 3 + 9 + 27 + 81 + 243
+    ASSERT_EQ(364, count);
+
+    count = 0;
+    pool.submit([&] { spawn(pool, count, 2); });
+    pool.wait();
+    ASSERT_EQ(13, count);
+}
+
+TEST(ThreadPoolTest, worker) {
+    ThreadPool pool{3};
+    std::atomic<bool> valid{true};
+    for (int i = 0; i < 100; ++i) {
+        pool.submit([&] { if (ThreadPool::worker() >= pool.size()) valid = false; });
+    }
+    pool.wait();
+    ASSERT_TRUE(valid);
+}
+
+TEST(ThreadPoolTest, submitToOtherPool) {
+    // Workers of `outer` have indexes that do not exist in `inner`
+    ThreadPool outer{8};
+    ThreadPool inner{1};
+    std::atomic<int> count{0};
+    for (int i = 0; i < 64; ++i) {
+        outer.submit([&] { inner.submit([&] { ++count; }); });
+    }
+    outer.wait();
+    inner.wait();
+    ASSERT_EQ(64, count);
+}
+
+TEST(ThreadPoolTest, exception) {
+    ThreadPool pool{2};
+    pool.submit([] { throw exception("Boom"); });
+    ASSERT_THROW(pool.wait(), exception);
+
+    // Pool is still usable after a failure
+    std::atomic<int> count{0};
+    pool.submit([&] { ++count; });
+    pool.wait();
+    ASSERT_EQ(1, count);
+}
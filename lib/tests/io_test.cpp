@@ -1,5 +1,7 @@
 #include "krico/backup/io.h"
+#include "krico/backup/TemporaryDirectory.h"
 #include <gtest/gtest.h>
+#include <fstream>
 
 using namespace krico::backup;
 namespace fs = std::filesystem;
@@ -30,3 +32,35 @@ TEST(io_test, lexically_relative_symlink_target) {
                   fs::path("/a/../b/../a/bb/../cc/../bb////bbb"),
                   fs::path("/a")));
 }
+
+TEST(io_test, copy_file_data) {
+    const TemporaryDirectory tmp{};
+    auto read = [](const fs::path &file) {
+        std::ifstream in{file, std::ios::binary};
+        return std::string{std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{}};
+    };
+    std::string content(1024 * 1024 + 17, '\0');
+    for (size_t i = 0; i < content.size(); ++i) content[i] = static_cast<char>(i * 31 % 251);
+    const fs::path from{tmp.dir() / "from.bin"};
+    std::ofstream{from, std::ios::binary} << content;
+    fs::permissions(from, fs::perms::owner_read | fs::perms::owner_write | fs::perms::group_read);
+
+    const fs::path to{tmp.dir() / "to.bin"};
+    const auto method = copy_file_data(from, to);
+    ASSERT_STRNE("unknown", to_string(method));
+    ASSERT_EQ(content, read(to));
+    ASSERT_EQ(fs::status(from).permissions(), fs::status(to).permissions());
+
+    // Overwrites (truncates) an existing file
+    const fs::path small{tmp.dir() / "small.txt"};
+    std::ofstream{small} << "small";
+    copy_file_data(small, to);
+    ASSERT_EQ("small", read(to));
+
+    const fs::path empty{tmp.dir() / "empty.txt"};
+    std::ofstream{empty};
+    ASSERT_EQ(copy_method::read_write, copy_file_data(empty, to));
+    ASSERT_EQ(0, fs::file_size(to));
+
+    ASSERT_THROW(copy_file_data(tmp.dir() / "missing", to), std::exception);
+}
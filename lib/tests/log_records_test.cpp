@@ -2,6 +2,8 @@
 #include <gtest/gtest.h>
 
 #include "krico/backup/TemporaryDirectory.h"
+#include "krico/backup/exception.h"
+#include <ranges>
 
 using namespace krico::backup;
 using namespace std::chrono;
@@ -19,12 +21,9 @@ TEST(log_records_test, LogHeader) {
         ASSERT_TRUE(header.ts() <= end);
         ASSERT_EQ("John Doe", header.author());
         ASSERT_EQ(38, header.end_offset());
-
-        header.parse_offsets();
     }
-    const LogHeader read{};
-    std::memcpy(read.buffer().ptr(), header.buffer().ptr(), header.end_offset());
-    read.parse_offsets();
+    LogHeader read{};
+    read.assign(header.record());
     ASSERT_EQ(header.type(), read.type());
     ASSERT_EQ(header.prev(), read.prev());
     ASSERT_EQ(header.ts(), read.ts());
@@ -42,9 +41,8 @@ TEST(log_records_test, InitRecord) {
     ASSERT_TRUE(init.ts() <= end);
     ASSERT_EQ("John Doe", init.author());
 
-    const InitRecord read{};
-    std::memcpy(read.buffer().ptr(), init.buffer().ptr(), init.end_offset());
-    read.parse_offsets();
+    InitRecord read{};
+    read.assign(init.record());
     ASSERT_EQ(init.type(), read.type());
     ASSERT_EQ(init.prev(), read.prev());
     ASSERT_EQ(init.ts(), read.ts());
@@ -66,13 +64,10 @@ TEST(log_records_test, AddDirectoryRecord) {
         ASSERT_EQ("Dir", add.directoryId());
         ASSERT_EQ(fs::path{"/src/path"}, add.sourceDir());
         ASSERT_EQ(52, add.end_offset());
-
-        add.parse_offsets();
     }
 
-    const AddDirectoryRecord read{};
-    std::memcpy(read.buffer().ptr(), add.buffer().ptr(), add.end_offset());
-    read.parse_offsets();
+    AddDirectoryRecord read{};
+    read.assign(add.record());
     ASSERT_EQ(add.type(), read.type());
     ASSERT_EQ(add.prev(), read.prev());
     ASSERT_EQ(add.ts(), read.ts());
@@ -100,18 +95,189 @@ TEST(log_records_test, RunBackupRecord) {
         ASSERT_TRUE(run.ts() <= end);
         ASSERT_EQ("John Doe", run.author());
         ASSERT_EQ(summary, run.summary());
-        ASSERT_EQ(99, run.end_offset());
-
-        run.parse_offsets();
+        ASSERT_EQ(RunBackupRecord::VERSION, run.version());
+        // Version 0 fields, the version and the metrics
+        ASSERT_EQ(99 + 1 + records::codec<backup_metrics>::width, run.end_offset());
     }
 
-    const RunBackupRecord read{};
-    std::memcpy(read.buffer().ptr(), run.buffer().ptr(), run.end_offset());
-    read.parse_offsets();
+    RunBackupRecord read{};
+    read.assign(run.record());
     ASSERT_EQ(run.type(), read.type());
     ASSERT_EQ(run.prev(), read.prev());
     ASSERT_EQ(run.ts(), read.ts());
     ASSERT_EQ(run.author(), read.author());
     ASSERT_EQ(run.summary(), read.summary());
     ASSERT_EQ(run.end_offset(), read.end_offset());
+
+    // A version 0 record ends with the checksum
+    read.assign(run.record().substr(0, 99));
+    ASSERT_EQ(99, read.end_offset());
+    ASSERT_EQ(0, read.version());
+    ASSERT_EQ(backup_metrics{}, read.metrics());
+    ASSERT_EQ(summary.checksum(), read.summary().checksum());
+    const RunBackupRecordView v0{run.record().substr(0, 99)};
+    ASSERT_TRUE(v0.valid());
+    ASSERT_EQ(0, v0.version());
+    ASSERT_EQ(backup_metrics{}, v0.metrics());
+    ASSERT_EQ(read.summary(), v0.summary());
+}
+
+TEST(log_records_test, schema) {
+    using run_schema = RunBackupRecordView::schema;
+    static_assert(log_header_schema::size == 4);
+    static_assert(log_header_schema::fixed_prefix == 3);
+    static_assert(run_schema::size == 4 + 12);
+    static_assert(std::is_same_v<run_schema::type<4>, BackupDirectoryId>);
+    // type + prev + ts
+    ASSERT_EQ(1 + 20 + 8, log_header_schema::offset<3>(nullptr));
+
+    const AddDirectoryRecord add{Digest::SHA1_ZERO, "John Doe", "Dir", "/src/path"};
+    const auto *data = add.buffer().const_ptr();
+    ASSERT_EQ(add.end_offset(), AddDirectoryRecordView::schema::length(data));
+    ASSERT_TRUE(AddDirectoryRecordView::schema::fits(data, add.end_offset()));
+    for (size_t len = 0; len < add.end_offset(); ++len) {
+        ASSERT_FALSE(AddDirectoryRecordView::schema::fits(data, len)) << len;
+    }
+}
+
+TEST(log_records_test, views) {
+    const InitRecord init{Digest::SHA1_ZERO, "John Doe"};
+    const LogHeaderView header{init.record()};
+    ASSERT_TRUE(header.valid());
+    ASSERT_EQ(LogEntryType::Initialized, header.type());
+    ASSERT_EQ(init.prev(), header.prev());
+    ASSERT_EQ(init.ts(), header.ts());
+    ASSERT_EQ("John Doe", header.author());
+    ASSERT_EQ("John Doe", log_record_cast<InitRecordView>(header).author());
+
+    const AddDirectoryRecord add{Digest::SHA1_ZERO, "John Doe", "Dir", "/src/path"};
+    const AddDirectoryRecordView addView{add.record()};
+    ASSERT_TRUE(addView.valid());
+    ASSERT_EQ(add.ts(), addView.ts());
+    ASSERT_EQ("Dir", addView.directoryId());
+    ASSERT_EQ("/src/path", addView.sourceDir());
+    // Valid as a header, not as an AddDirectoryRecord
+    const LogHeaderView truncated{add.record().substr(0, add.end_offset() - 1)};
+    ASSERT_TRUE(truncated.valid());
+    ASSERT_THROW(log_record_cast<AddDirectoryRecordView>(truncated), exception);
+
+    const TemporaryDirectory tmp{};
+    fs::path directoryMetaDir{tmp.dir() / "dirMeta"};
+    fs::create_directory(directoryMetaDir);
+    BackupSummaryBuilder builder{
+        directoryMetaDir, BackupDirectoryId{"some/dir"}, year_month_day{1976y, July, 15d}, fs::path{"1"}
+    };
+    builder.addDir(".");
+    builder.addCopiedFile("a", Digest::SHA1_ZERO, 1234);
+    builder.addHardLinkedFile("b", Digest::SHA1_ZERO, 1234);
+    builder.addPhase(backup_phase::hash, milliseconds{20}, milliseconds{15});
+    builder.addPhase(backup_phase::link, milliseconds{3}, milliseconds{2});
+    builder.addHashedBytes(2468);
+    builder.addFileTime(1234, milliseconds{7});
+    const auto summary = builder.build();
+    const RunBackupRecord run{Digest::SHA1_ZERO, "John Doe", summary};
+    const auto runView = log_record_cast<RunBackupRecordView>(LogHeaderView{run.record()});
+    ASSERT_EQ("some/dir", runView.directoryId());
+    ASSERT_EQ(summary.date(), runView.date());
+    ASSERT_EQ(summary.startTime(), runView.startTime());
+    ASSERT_EQ(summary.endTime(), runView.endTime());
+    ASSERT_EQ(1, runView.numDirectories());
+    ASSERT_EQ(1, runView.numCopiedFiles());
+    ASSERT_EQ(summary.checksum(), runView.checksum());
+    ASSERT_EQ(summary, runView.summary());
+    ASSERT_EQ(run.end_offset(), RunBackupRecordView::schema::length(run.buffer().const_ptr()) + 1
+              + records::codec<backup_metrics>::width);
+    ASSERT_EQ(RunBackupRecord::VERSION, runView.version());
+    const auto metrics = runView.metrics();
+    ASSERT_EQ(summary.metrics(), metrics);
+    ASSERT_EQ(milliseconds{20}, metrics.phase(backup_phase::hash).wall_);
+    ASSERT_EQ(milliseconds{15}, metrics.phase(backup_phase::hash).cpu_);
+    ASSERT_EQ(milliseconds{2}, metrics.phase(backup_phase::link).cpu_);
+    ASSERT_EQ(2468, metrics.bytesHashed_);
+    ASSERT_EQ(1234, metrics.bytesCopied_);
+    ASSERT_EQ(1234, metrics.bytesDeduplicated_);
+    ASSERT_EQ(1234, metrics.largestFileSize_);
+    ASSERT_EQ(milliseconds{7}, metrics.largestFileTime_);
+    // Truncated metrics are ignored, the record is still valid
+    const RunBackupRecordView truncatedRun{run.record().substr(0, run.end_offset() - 1)};
+    ASSERT_TRUE(truncatedRun.valid());
+    ASSERT_EQ(backup_metrics{}, truncatedRun.metrics());
+}
+
+namespace {
+    //!
+    //! `record` (written through `Schema`) is a valid `View` whose fields end where `Schema` says, and the buffer
+    //! reserved for it was enough
+    //!
+    template<typename View, typename Schema = typename View::schema>
+    void expect_layout(const LogHeader &record) {
+        const auto *data = record.buffer().const_ptr();
+        ASSERT_EQ(record.end_offset(), Schema::length(data));
+        ASSERT_TRUE(Schema::fits(data, record.end_offset()));
+        ASSERT_LE(record.end_offset(), record.buffer().capacity());
+        ASSERT_TRUE(View{record.record()}.valid());
+    }
+}
+
+TEST(log_records_test, layouts) {
+    expect_layout<InitRecordView>(InitRecord{Digest::SHA1_ZERO, "John Doe"});
+    expect_layout<AddDirectoryRecordView>(AddDirectoryRecord{Digest::SHA1_ZERO, "John Doe", "Dir", "/src/path"});
+
+    const TemporaryDirectory tmp{};
+    BackupSummaryBuilder builder{tmp.dir(), BackupDirectoryId{"some/dir"}, year_month_day{1976y, July, 15d}, "1"};
+    builder.addDir(".");
+    builder.addCopiedFile("a", Digest::SHA1_ZERO, 1234);
+    // Then the version and what it appends
+    using run_v1 = RunBackupRecordView::version_schema::after<RunBackupRecordView::schema>;
+    static_assert(run_v1::size == RunBackupRecordView::schema::size + 2);
+    expect_layout<RunBackupRecordView, run_v1>(RunBackupRecord{Digest::SHA1_ZERO, "John Doe", builder.build()});
+
+    const log_counters counters{{"some/dir", directory_counters{.runs_ = 1, .directories_ = 2}}};
+    using checkpoint_v1 = CheckpointRecordView::version_schema::after<CheckpointRecordView::schema>;
+    expect_layout<CheckpointRecordView, checkpoint_v1>(
+        CheckpointRecord{Digest::SHA1_ZERO, "John Doe", Digest::SHA1_ZERO, 3, counters});
+}
+
+TEST(log_records_test, CheckpointRecord) {
+    log_counters counters{};
+    // More than MAX_LOOSE_LENGTH
+    for (size_t i = 0; i < 200; ++i) {
+        counters[std::format("some/directory/{:03}", i)] = directory_counters{
+            .runs_ = static_cast<uint32_t>(i), .directories_ = i * 10, .copiedFiles_ = i * 100,
+            .hardLinkedFiles_ = i * 1000, .symlinks_ = i, .lastRun_ = system_clock::time_point{seconds{i}},
+            .bytesCopied_ = i * 4096, .bytesDeduplicated_ = i * 512, .bytesHashed_ = i * 4608
+        };
+    }
+    const auto previous = Digest::sha1().digest("previous", 8);
+    const CheckpointRecord checkpoint{Digest::SHA1_ZERO, "John Doe", previous, 1234, counters};
+    ASSERT_GT(checkpoint.end_offset(), LogHeader::MAX_LOOSE_LENGTH);
+    ASSERT_EQ(LogEntryType::Checkpoint, checkpoint.type());
+    ASSERT_EQ(previous, checkpoint.previousCheckpoint());
+    ASSERT_EQ(1234, checkpoint.numRecords());
+    ASSERT_EQ(CheckpointRecord::VERSION, checkpoint.version());
+    ASSERT_EQ(counters, checkpoint.counters());
+
+    const auto data = checkpoint.record();
+    const auto view = log_record_cast<CheckpointRecordView>(LogHeaderView{data});
+    ASSERT_EQ(previous, view.previousCheckpoint());
+    ASSERT_EQ(1234, view.numRecords());
+    ASSERT_EQ(CheckpointRecord::VERSION, view.version());
+    ASSERT_EQ(counters, view.counters());
+
+    // A version 0 record ends with the counters, which then have no byte counters
+    const auto countersEnd = CheckpointRecordView::schema::length(checkpoint.buffer().const_ptr());
+    auto withoutBytes = counters;
+    for (auto &c: withoutBytes | std::views::values) c.bytesCopied_ = c.bytesDeduplicated_ = c.bytesHashed_ = 0;
+    const auto v0 = log_record_cast<CheckpointRecordView>(LogHeaderView{data.substr(0, countersEnd)});
+    ASSERT_EQ(0, v0.version());
+    ASSERT_EQ(withoutBytes, v0.counters());
+    // Truncated byte counters are ignored, truncated counters are not
+    const auto truncated = log_record_cast<CheckpointRecordView>(LogHeaderView{data.substr(0, data.size() - 1)});
+    ASSERT_EQ(withoutBytes, truncated.counters());
+    ASSERT_THROW(log_record_cast<CheckpointRecordView>(LogHeaderView{data.substr(0, countersEnd - 1)}), exception);
+
+    CheckpointRecord read{};
+    read.assign(data);
+    ASSERT_EQ(counters, read.counters());
+    ASSERT_EQ(checkpoint.end_offset(), read.end_offset());
 }
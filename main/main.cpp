@@ -5,10 +5,13 @@
 #include "krico/backup/BackupDirectoryId.h"
 #include "krico/backup/BackupRepository.h"
 #include "krico/backup/BackupRunner.h"
+#include "krico/backup/Manifest.h"
 #include <spdlog/spdlog.h>
 #include <CLI/CLI.hpp>
 #include <chrono>
+#include <map>
 #include <iostream>
+#include <sstream>
 
 using namespace krico::backup;
 using namespace std::chrono;
@@ -45,8 +48,27 @@ struct help_subcommand : subcommand {
 };
 
 struct init_subcommand : subcommand {
+    std::string digest_{Digest::SHA256_ALGORITHM};
+    unsigned fanoutDepth_{Fanout::standard().depth_};
+    unsigned fanoutWidth_{Fanout::standard().width_};
+
     init_subcommand(CLI::App &app, const base_options &baseOptions)
         : subcommand(app, baseOptions, "init", "Initialize a backup repository") {
+        const std::map<std::string, std::string> digests{
+            {"sha256", Digest::SHA256_ALGORITHM}, {"blake3", Digest::BLAKE3_ALGORITHM}
+        };
+        subCommand_->add_option("--digest", digest_, "Digest used to identify (and de-duplicate) files")
+                ->type_name("<algorithm>")
+                ->transform(CLI::CheckedTransformer(digests, CLI::ignore_case))
+                ->capture_default_str();
+        subCommand_->add_option("--fanout-depth", fanoutDepth_, "Levels of directories the objects are spread across")
+                ->type_name("<levels>")
+                ->check(CLI::Range(0u, static_cast<unsigned>(Fanout::MAX_DEPTH)))
+                ->capture_default_str();
+        subCommand_->add_option("--fanout-width", fanoutWidth_, "Hex digits of the digest naming each directory level")
+                ->type_name("<digits>")
+                ->check(CLI::Range(1u, static_cast<unsigned>(Fanout::MAX_WIDTH)))
+                ->capture_default_str();
         subCommand_->callback([&] { this->initialize(); });
     }
 
@@ -55,7 +77,11 @@ struct init_subcommand : subcommand {
             MKDIRS(baseOptions_.repoPath_);
             std::cout << "Created backup repository '" << baseOptions_.repoPath_.string() << "'" << std::endl;
         }
-        const auto backup = BackupRepository::initialize(baseOptions_.repoPath_);
+        const Fanout fanout{
+            .depth_ = static_cast<uint8_t>(fanoutDepth_),
+            .width_ = static_cast<uint8_t>(fanoutWidth_)
+        };
+        const auto backup = BackupRepository::initialize(baseOptions_.repoPath_, digest_, fanout);
         std::cout << "Initialized backup repository '" << baseOptions_.repoPath_.string() << "'" << std::endl;
     }
 };
@@ -141,18 +167,68 @@ struct list_subcommand : subcommand {
 };
 
 struct run_subcommand : subcommand {
+    unsigned jobs_{1};
+    BackupRunner::options_t options_{};
+    CLI::Option *optionScanners_{nullptr};
+    CLI::Option *optionHashers_{nullptr};
+    CLI::Option *optionCopiers_{nullptr};
+
     run_subcommand(CLI::App &app, const base_options &baseOptions)
         : subcommand(app, baseOptions, "run", "Run the backup for this repository") {
+        subCommand_->add_option("-j,--jobs", jobs_, "Number of threads for the scan, hash and copy stages")
+                ->type_name("<number>")->check(CLI::PositiveNumber);
+        optionScanners_ = subCommand_->add_option("--scanners", options_.scanners,
+                                                  "Threads traversing the source directories (default: --jobs)")
+                ->type_name("<number>")->check(CLI::PositiveNumber)->group("Pipeline");
+        optionHashers_ = subCommand_->add_option("--hashers", options_.hashers,
+                                                 "Threads computing digests (default: --jobs)")
+                ->type_name("<number>")->check(CLI::PositiveNumber)->group("Pipeline");
+        optionCopiers_ = subCommand_->add_option("--copiers", options_.copiers,
+                                                 "Threads copying new files (default: --jobs)")
+                ->type_name("<number>")->check(CLI::PositiveNumber)->group("Pipeline");
+        subCommand_->add_option("--linkers", options_.linkers, "Threads creating hard links")
+                ->type_name("<number>")->check(CLI::PositiveNumber)->group("Pipeline")->capture_default_str();
+        subCommand_->add_option("--queue-size", options_.queueSize, "Capacity of the queues between stages")
+                ->type_name("<number>")->check(CLI::PositiveNumber)->group("Pipeline")->capture_default_str();
+        subCommand_->add_flag("--single-pass", options_.hashWhileCopy,
+                              "Hash files while copying them (reads each file once, best for first backups)")
+                ->group("Pipeline");
+        subCommand_->add_option("--batch-digest-size", options_.batchDigestSize,
+                                "Hash SHA2-256 files smaller than this several at a time (0 disables)")
+                ->type_name("<bytes>")->check(CLI::NonNegativeNumber)->group("Pipeline")->capture_default_str();
+        subCommand_->add_option("--io-depth", options_.ioDepth,
+                                "Hard links and small file reads submitted to the file system at once")
+                ->type_name("<number>")->check(CLI::PositiveNumber)->group("Pipeline")->capture_default_str();
+        subCommand_->add_flag("--io-uring,!--no-io-uring", options_.ioUring,
+                              "Submit I/O batches through io_uring when available (default: on)")
+                ->group("Pipeline");
+        subCommand_->add_option("--max-links", options_.maxLinks,
+                                "Hard links per object before an overflow replica is used (0: file system limit)")
+                ->type_name("<number>")->check(CLI::NonNegativeNumber)->capture_default_str();
+        subCommand_->add_flag("--rehash", options_.rehash,
+                              "Hash every file, even the ones the stat cache says are unchanged");
         subCommand_->callback([&] { this->run_backup(); });
     }
 
+    [[nodiscard]] BackupRunner::options_t options() const {
+        BackupRunner::options_t options{options_};
+        if (!*optionScanners_) options.scanners = jobs_;
+        if (!*optionHashers_) options.hashers = jobs_;
+        if (!*optionCopiers_) options.copiers = jobs_;
+        return options;
+    }
+
     void run_backup() const {
-        for (BackupRepository repo{baseOptions_.repoPath_}; const auto *backupDirectory: repo.list_directories()) {
+        BackupRepository repo{baseOptions_.repoPath_};
+        // One HEAD update for the records of all the directories
+        BackupRepositoryLog::batch batch{repo.repositoryLog()};
+        for (const auto *backupDirectory: repo.list_directories()) {
             std::cout << "Running backup of '" << backupDirectory->id().relative_path().string() << "'"
                     << " from '" << backupDirectory->sourceDir().string() << "'" << std::endl;
-            auto summary = repo.run_backup(*backupDirectory);
+            auto summary = repo.run_backup(*backupDirectory, options());
             std::cout << summary << std::endl;
         }
+        batch.commit();
     }
 };
 
@@ -166,6 +242,15 @@ struct log_subcommand : subcommand {
     CLI::Option *optionHash_{nullptr};
     CLI::Option *optionOne_{nullptr};
     CLI::Option *optionFileList_{nullptr};
+    CLI::Option *optionStats_{nullptr};
+    std::string since_{};
+    CLI::Option *optionSince_{nullptr};
+    std::string until_{};
+    CLI::Option *optionUntil_{nullptr};
+    std::string dir_{};
+    CLI::Option *optionDir_{nullptr};
+    std::string type_{};
+    CLI::Option *optionType_{nullptr};
 
     log_subcommand(CLI::App &app, const base_options &baseOptions)
         : subcommand(app, baseOptions, "log", "Print the log of what happened in the backup repository") {
@@ -177,6 +262,17 @@ struct log_subcommand : subcommand {
         optionOne_ = subCommand_->add_flag("-1", "Print a single result (equivalent to '-n 1')");
         optionFileList_ = subCommand_->add_flag("--file-list", "Print the list of files of every 'run' log record\n"
                                                 "Best if used in combination with `-n` or `-1` since could be a lot of output");
+        optionStats_ = subCommand_->add_flag("--stats", "Print the number of runs and entries backed up of each "
+                                             "directory (from the latest checkpoint instead of the whole log)");
+        optionSince_ = subCommand_->add_option("--since", since_, "Only the records (or with --stats, the runs) "
+                                               "since <date> (YYYY-MM-DD, UTC)")
+                ->type_name("<date>");
+        optionUntil_ = subCommand_->add_option("--until", until_, "Only the records until <date> (inclusive)")
+                ->type_name("<date>");
+        optionDir_ = subCommand_->add_option("--dir", dir_, "Only the records of backup directory <dir>")
+                ->type_name("<dir>");
+        optionType_ = subCommand_->add_option("--type", type_, "Only the records of <type> (init, add, run or ckpt)")
+                ->type_name("<type>");
         optionHash_ = subCommand_->add_option("hash", hash_, "Start printing logs from this log <hash>.\n"
                                               "A full hash such as 00223f175b5efa40724916ac50176e5fd5204fd2\n"
                                               "A partial hash like 00223f17 (must be unique)");
@@ -185,24 +281,79 @@ struct log_subcommand : subcommand {
 
     Digest::result start_hash(BackupRepositoryLog &log) const {
         if (*optionHash_) {
-            if (const auto found = log.findHash(hash_); found.empty()) {
-                throw exception("No hash found matching '" + hash_ + "'");
-            } else {
-                if (found.size() != 1) {
-                    std::stringstream ss;
-                    for (const auto &h: found) {
-                        ss << std::endl << h.str();
-                    }
-                    throw exception("More than one hash found matching '" + hash_ + "'" + ss.str());
-                }
-                return found.at(0);
-            }
+            return log.resolveHash(hash_);
         }
         return log.head();
     }
 
+    static system_clock::time_point parse_date(const std::string &date) {
+        int y{0};
+        unsigned m{0}, d{0};
+        char sep1{0}, sep2{0};
+        std::istringstream in{date};
+        if (in >> y >> sep1 >> m >> sep2 >> d && sep1 == '-' && sep2 == '-' && in.peek() == EOF) {
+            if (const year_month_day ymd{year{y}, month{m}, day{d}}; ymd.ok()) {
+                return sys_days{ymd};
+            }
+        }
+        throw exception("Invalid date '" + date + "' (expected YYYY-MM-DD)");
+    }
+
+    static LogEntryType parse_type(const std::string &type) {
+        for (const auto t: {
+                 LogEntryType::Initialized, LogEntryType::AddDirectory, LogEntryType::RunBackup,
+                 LogEntryType::Checkpoint
+             }) {
+            std::ostringstream name{};
+            name << t;
+            if (name.str() == type) return t;
+        }
+        throw exception("Invalid log record type '" + type + "' (expected init, add, run or ckpt)");
+    }
+
+    [[nodiscard]] bool is_query() const {
+        return *optionDir_ || *optionSince_ || *optionUntil_ || *optionType_;
+    }
+
+    //!
+    //! Print the records matching --dir, --since, --until and --type (found with the log index)
+    //!
+    void query(BackupRepository &repo, BackupRepositoryLog &log, const uint32_t first, const uint32_t last) const {
+        BackupRepositoryLog::query_t query{.limit_ = last};
+        if (*optionDir_) query.directoryId_ = BackupDirectoryId{dir_}.str();
+        if (*optionSince_) query.since_ = parse_date(since_);
+        if (*optionUntil_) query.until_ = parse_date(until_) + days{1};
+        if (*optionType_) query.type_ = parse_type(type_);
+        const auto found = log.query(query);
+        if (found.size() <= first) {
+            std::cout << "No matching log records" << std::endl;
+            return;
+        }
+        for (size_t i = first; i < found.size(); ++i) {
+            if (i != first) std::cout << std::endl;
+            print_record(repo, found[i], log.getRecordView(found[i]));
+        }
+    }
+
+    void stats(BackupRepositoryLog &log) const {
+        const auto counters = *optionSince_ ? log.counters(parse_date(since_)) : log.counters();
+        if (counters.empty()) {
+            std::cout << "No backup runs" << std::endl;
+            return;
+        }
+        // Runs only counted by checkpoints written before the byte counters existed add no bytes
+        std::cout << std::format("{:<30} {:>6} {:>12} {:>12} {:>12} {:>12} {:>16} {:>16} {:>16}  {}", "Directory",
+                                 "Runs", "Directories", "Copied", "Linked", "Symlinks", "Copied bytes",
+                                 "Dedup bytes", "Hashed bytes", "Last run") << std::endl;
+        for (const auto &[id, c]: counters) {
+            std::cout << std::format("{:<30} {:>6} {:>12} {:>12} {:>12} {:>12} {:>16} {:>16} {:>16}  {:%F %T}",
+                                     BackupDirectoryId{id}.relative_path().string(), c.runs_, c.directories_,
+                                     c.copiedFiles_, c.hardLinkedFiles_, c.symlinks_, c.bytesCopied_,
+                                     c.bytesDeduplicated_, c.bytesHashed_, floor<seconds>(c.lastRun_)) << std::endl;
+        }
+    }
+
     void log() const {
-        static constexpr auto WIDTH = 10;
         BackupRepository repo{baseOptions_.repoPath_};
         auto &log = repo.repositoryLog();
         if (log.head().is_zero()) {
@@ -210,6 +361,10 @@ struct log_subcommand : subcommand {
             std::cout << "No log entries in this repository" << std::endl;
             return;
         }
+        if (*optionStats_) {
+            stats(log);
+            return;
+        }
         uint32_t first{0};
         if (*optionSkip_) first = skip_;
         uint32_t last{std::numeric_limits<uint32_t>::max()};
@@ -219,86 +374,219 @@ struct log_subcommand : subcommand {
         if (*optionOne_) {
             last = 1 + first;
         }
+        if (is_query()) {
+            query(repo, log, first, last);
+            return;
+        }
         uint32_t count = 0;
         auto prev = start_hash(log);
         do {
             if (count++ == last) break;
-            const LogHeader &headerEntry = log.getRecord(prev);
-
+            const auto headerEntry = log.getRecordView(prev);
             if (count > first) {
-                const auto type = headerEntry.type();
-                std::cout << std::left << std::setw(5) << std::setfill(' ') << type << prev.str() << std::endl;
-                system_clock::time_point ts{headerEntry.ts()};
-                const auto tt = system_clock::to_time_t(ts);
-
-                std::cout << std::left << std::setw(WIDTH) << "Date:" << std::ctime(&tt);
-                switch (type) {
-                    case InitRecord::log_entry_type: {
-                        const auto &entry = log_record_cast<InitRecord>(headerEntry);
-                        std::cout << std::left << std::setw(WIDTH) << "Author:" << entry.author() << std::endl;
-                    }
-                    break;
-                    case AddDirectoryRecord::log_entry_type: {
-                        const auto &entry = log_record_cast<AddDirectoryRecord>(headerEntry);
-                        std::cout << std::left << std::setw(WIDTH) << "Author:" << entry.author() << std::endl;
-                        std::cout << std::endl;
-                        std::cout << "  Added \"" << entry.directoryId() << "\""
-                                << " as backup of " << entry.sourceDir() << "" << std::endl;
-
-                        if (*optionFull_) {
-                            constexpr auto W = 12;
-                            std::cout << std::endl;
-                            std::cout << std::setw(W) << "Directory:" << entry.directoryId() << std::endl;
-                            std::cout << std::setw(W) << "SourceDir:" << entry.sourceDir().string() << std::endl;
-                        }
-                    }
-                    break;
-                    case RunBackupRecord::log_entry_type: {
-                        const auto &entry = log_record_cast<RunBackupRecord>(headerEntry);
-                        std::cout << std::left << std::setw(WIDTH) << "Author:" << entry.author() << std::endl;
-                        const auto &summary = entry.summary();
-                        std::cout << std::left << std::setw(WIDTH) << "Checksum:" << summary.checksum().str() <<
-                                std::endl;
-                        std::cout << std::endl;
-                        const auto total = summary.numCopiedFiles()
-                                           + summary.numHardLinkedFiles()
-                                           + summary.numSymlinks();
-                        const auto elapsed = duration_cast<nanoseconds>(summary.endTime() - summary.startTime());
-                        std::cout << "  Backed up " << summary.directoryId().relative_path()
-                                << " (" << total << " entries)"
-                                << " in " << std::format("{0:%T}", elapsed) << std::endl;
-
-                        if (*optionFull_) {
-                            constexpr auto W = 12;
-                            std::cout << std::endl;
-                            std::cout << summary << std::endl;
-                        }
-                        if (*optionFileList_) {
-                            //TODO: file-list should be structured (not just plain text)
-                            std::cout << std::endl;
-                            if (const auto *backupDirectory = repo.get_directory(summary.directoryId())) {
-                                auto summaryFile = summary.summaryFile(backupDirectory->metaDir());
-                                if (std::ifstream in{summaryFile}; in) {
-                                    std::cout << in.rdbuf();
-                                } else {
-                                    throw exception("Failed to open '" + summaryFile.string() + "'");
-                                }
-                            } else {
-                                std::cerr << "ERROR: \"" << summary.directoryId().str() << "\" NOT FOUND" << std::endl;
-                                std::cout << "N/A" << std::endl;
-                            }
-                        }
-                    }
-                    break;
-                    default:
-                        std::cout << "UNKNOWN LOG ENTRY TYPE" << std::endl;
-                        break;
-                }
+                print_record(repo, prev, headerEntry);
             }
             prev = headerEntry.prev();
             if (!prev.is_zero() && count != last) std::cout << std::endl;
         } while (!prev.is_zero());
     }
+
+    void print_record(BackupRepository &repo, const Digest::result &digest, const LogHeaderView &headerEntry) const {
+        static constexpr auto WIDTH = 10;
+        const auto type = headerEntry.type();
+        std::cout << std::left << std::setw(5) << std::setfill(' ') << type << digest.str() << std::endl;
+        system_clock::time_point ts{headerEntry.ts()};
+        const auto tt = system_clock::to_time_t(ts);
+
+        std::cout << std::left << std::setw(WIDTH) << "Date:" << std::ctime(&tt);
+        switch (type) {
+            case InitRecord::log_entry_type: {
+                const auto entry = log_record_cast<InitRecordView>(headerEntry);
+                std::cout << std::left << std::setw(WIDTH) << "Author:" << entry.author() << std::endl;
+            }
+            break;
+            case AddDirectoryRecord::log_entry_type: {
+                const auto entry = log_record_cast<AddDirectoryRecordView>(headerEntry);
+                std::cout << std::left << std::setw(WIDTH) << "Author:" << entry.author() << std::endl;
+                std::cout << std::endl;
+                std::cout << "  Added \"" << entry.directoryId() << "\""
+                        << " as backup of " << fs::path{entry.sourceDir()} << "" << std::endl;
+
+                if (*optionFull_) {
+                    constexpr auto W = 12;
+                    std::cout << std::endl;
+                    std::cout << std::setw(W) << "Directory:" << entry.directoryId() << std::endl;
+                    std::cout << std::setw(W) << "SourceDir:" << entry.sourceDir() << std::endl;
+                }
+            }
+            break;
+            case RunBackupRecord::log_entry_type: {
+                const auto entry = log_record_cast<RunBackupRecordView>(headerEntry);
+                std::cout << std::left << std::setw(WIDTH) << "Author:" << entry.author() << std::endl;
+                std::cout << std::left << std::setw(WIDTH) << "Checksum:" << entry.checksum().str() <<
+                        std::endl;
+                std::cout << std::endl;
+                const auto total = entry.numCopiedFiles()
+                                   + entry.numHardLinkedFiles()
+                                   + entry.numSymlinks();
+                const auto elapsed = duration_cast<nanoseconds>(entry.endTime() - entry.startTime());
+                std::cout << "  Backed up " << BackupDirectoryId{entry.directoryId()}.relative_path()
+                        << " (" << total << " entries)"
+                        << " in " << std::format("{0:%T}", elapsed) << std::endl;
+
+                if (*optionFull_) {
+                    constexpr auto W = 12;
+                    std::cout << std::endl;
+                    std::cout << entry.summary() << std::endl;
+                }
+                if (*optionFileList_) {
+                    const auto summary = entry.summary();
+                    std::cout << std::endl;
+                    if (const auto *backupDirectory = repo.get_directory(summary.directoryId())) {
+                        print_manifest(summary.summaryFile(backupDirectory->metaDir()), std::cout);
+                    } else {
+                        std::cerr << "ERROR: \"" << summary.directoryId().str() << "\" NOT FOUND" << std::endl;
+                        std::cout << "N/A" << std::endl;
+                    }
+                }
+            }
+            break;
+            case CheckpointRecordView::log_entry_type: {
+                const auto entry = log_record_cast<CheckpointRecordView>(headerEntry);
+                std::cout << std::left << std::setw(WIDTH) << "Author:" << entry.author() << std::endl;
+                std::cout << std::endl;
+                std::cout << "  Checkpoint of " << entry.numRecords() << " records" << std::endl;
+
+                if (*optionFull_) {
+                    constexpr auto W = 12;
+                    std::cout << std::endl;
+                    std::cout << std::setw(W) << "Previous:" << entry.previousCheckpoint().str() << std::endl;
+                    for (const auto &[id, c]: entry.counters()) {
+                        std::cout << std::setw(W) << "Directory:" << id << " (" << c.runs_ << " runs)"
+                                << std::endl;
+                    }
+                }
+            }
+            break;
+            default:
+                std::cout << "UNKNOWN LOG ENTRY TYPE" << std::endl;
+                break;
+        }
+    }
+};
+
+struct show_subcommand : subcommand {
+    std::string hash_{};
+    std::string path_{"."};
+
+    show_subcommand(CLI::App &app, const base_options &baseOptions)
+        : subcommand(app, baseOptions, "show", "Print a file (or directory and everything below it) of a backup") {
+        subCommand_->add_option("hash", hash_, "Hash of the 'run' log record of the backup (full or partial)")
+                ->required();
+        subCommand_->add_option("path", path_, "Relative to the backed-up directory (default: all of it)")
+                ->capture_default_str();
+        subCommand_->callback([&] { this->show(); });
+    }
+
+    void show() const {
+        BackupRepository repo{baseOptions_.repoPath_};
+        auto &log = repo.repositoryLog();
+        const auto header = log.getRecordView(log.resolveHash(hash_));
+        if (header.type() != RunBackupRecordView::log_entry_type) {
+            throw exception("Log record '" + hash_ + "' is not a backup run");
+        }
+        const auto summary = log_record_cast<RunBackupRecordView>(header).summary();
+        const auto *backupDirectory = repo.get_directory(summary.directoryId());
+        if (!backupDirectory) {
+            throw exception("Backup directory \"" + summary.directoryId().str() + "\" not found");
+        }
+        if (!ManifestReader::is_manifest(summary.summaryFile(backupDirectory->metaDir()))) {
+            throw exception("Backup '" + summary.backupId().string() + "' predates the manifest (try 'log --file-list')");
+        }
+        std::string_view path{path_};
+        while (path.starts_with('/')) path.remove_prefix(1);
+        while (path.ends_with('/')) path.remove_suffix(1);
+        if (path.empty()) path = ".";
+        const auto manifest = summary.manifest(backupDirectory->metaDir());
+        const auto entries = manifest.subtree(path);
+        if (entries.empty()) {
+            throw exception("No '" + std::string{path} + "' in backup '" + summary.backupId().string() + "'");
+        }
+        for (const auto &entry: entries) {
+            std::cout << entry << std::endl;
+        }
+    }
+};
+
+struct verify_log_subcommand : subcommand {
+    unsigned threads_{std::max(1u, std::thread::hardware_concurrency())};
+
+    verify_log_subcommand(CLI::App &app, const base_options &baseOptions)
+        : subcommand(app, baseOptions, "verify-log", "Check the log records, their chain and the backup summaries") {
+        subCommand_->add_option("--threads", threads_, "Threads hashing the records and summaries")
+                ->type_name("<number>")
+                ->check(CLI::PositiveNumber)
+                ->capture_default_str();
+        subCommand_->callback([&] { this->verify(); });
+    }
+
+    void verify() const {
+        BackupRepository repo{baseOptions_.repoPath_};
+        const auto result = repo.verify_log(threads_);
+        for (const auto &problem: result.problems_) {
+            std::cout << problem << std::endl;
+        }
+        std::cout << "Verified " << result.numRecords_ << " records, " << result.numLinks_ << " links and "
+                << result.numSummaries_ << " summaries" << std::endl;
+        if (!result.problems_.empty()) {
+            throw exception("Log verification found " + std::to_string(result.problems_.size()) + " problem(s)");
+        }
+    }
+};
+
+struct admin_subcommand : subcommand {
+    CLI::App *reindex_{nullptr};
+    CLI::App *relayout_{nullptr};
+    unsigned fanoutDepth_{Fanout::standard().depth_};
+    unsigned fanoutWidth_{Fanout::standard().width_};
+    unsigned threads_{std::max(1u, std::thread::hardware_concurrency())};
+
+    admin_subcommand(CLI::App &app, const base_options &baseOptions)
+        : subcommand(app, baseOptions, "admin", "Maintenance of the backup repository") {
+        subCommand_->require_subcommand(1, 1);
+        reindex_ = subCommand_->add_subcommand("reindex", "Rebuild the object index from a scan of the hard links");
+        reindex_->callback([&] { this->reindex(); });
+        relayout_ = subCommand_->add_subcommand("relayout", "Move the objects to a different fanout (renames only)");
+        relayout_->add_option("--fanout-depth", fanoutDepth_, "Levels of directories the objects are spread across")
+                ->type_name("<levels>")
+                ->check(CLI::Range(0u, static_cast<unsigned>(Fanout::MAX_DEPTH)))
+                ->capture_default_str();
+        relayout_->add_option("--fanout-width", fanoutWidth_, "Hex digits of the digest naming each directory level")
+                ->type_name("<digits>")
+                ->check(CLI::Range(1u, static_cast<unsigned>(Fanout::MAX_WIDTH)))
+                ->capture_default_str();
+        relayout_->add_option("--threads", threads_, "Threads moving the objects")
+                ->type_name("<number>")
+                ->check(CLI::PositiveNumber)
+                ->capture_default_str();
+        relayout_->callback([&] { this->relayout(); });
+    }
+
+    void reindex() const {
+        BackupRepository repo{baseOptions_.repoPath_};
+        const auto count = repo.objectIndex().rebuild();
+        std::cout << "Indexed " << count << " objects" << std::endl;
+    }
+
+    void relayout() const {
+        BackupRepository repo{baseOptions_.repoPath_};
+        const Fanout fanout{
+            .depth_ = static_cast<uint8_t>(fanoutDepth_),
+            .width_ = static_cast<uint8_t>(fanoutWidth_)
+        };
+        const auto moved = repo.relayout(fanout, threads_);
+        std::cout << "Moved " << moved << " objects to " << fanout.str() << std::endl;
+    }
 };
 
 class krico_backup {
@@ -337,6 +625,9 @@ private:
     list_subcommand list_{app_, baseOptions_};
     run_subcommand run_{app_, baseOptions_};
     log_subcommand log_{app_, baseOptions_};
+    show_subcommand show_{app_, baseOptions_};
+    verify_log_subcommand verifyLog_{app_, baseOptions_};
+    admin_subcommand admin_{app_, baseOptions_};
     help_subcommand help_{app_, baseOptions_};
 };
 